@@ -0,0 +1,156 @@
+// -*- Mode: C++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+//     * Neither the name of Google Inc. nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// Compares interior pointer lookups heap checker does (FindInside)
+// through AddressMap and through AddressIndex built from it.
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+
+#include <random>
+#include <vector>
+
+#include "address_index-inl.h"
+#include "addressmap-inl.h"
+#include "base/logging.h"
+
+#include "run_benchmark.h"
+
+static size_t SizeFunc(const size_t& size) { return size; }
+
+// How far into objects we look, same as heap checker's default
+// max_heap_object_size.
+static const size_t kMaxOffset = 1 << 20;
+static const int kProbes = 1 << 16;
+
+struct Fixture {
+  AddressMap<size_t>* map;
+  AddressIndex<size_t>* index;
+  std::vector<const void*> probes;
+};
+
+// Lays out 'n' heap-like objects (mostly small with some big ones,
+// separated by small gaps) and random probes into and around them.
+static Fixture* GetFixture(size_t n) {
+  static Fixture* cached;
+  static size_t cached_n;
+  if (cached != NULL && cached_n == n) {
+    return cached;
+  }
+  if (cached != NULL) {
+    cached->index->~AddressIndex<size_t>();
+    free(cached->index);
+    cached->map->~AddressMap<size_t>();
+    free(cached->map);
+    delete cached;
+  }
+
+  std::mt19937 rng(n);
+  Fixture* f = new Fixture;
+  f->map = new (malloc(sizeof(AddressMap<size_t>)))
+    AddressMap<size_t>(malloc, free);
+  std::vector<uintptr_t> starts;
+  uintptr_t addr = uintptr_t{1} << 32;
+  for (size_t i = 0; i < n; i++) {
+    size_t size = 16 << (rng() % 7);
+    if (rng() % 256 == 0) size = 64 << 10;
+    f->map->Insert(reinterpret_cast<const void*>(addr), size);
+    starts.push_back(addr);
+    addr += size + 16 * (rng() % 4);
+  }
+  f->index = new (malloc(sizeof(AddressIndex<size_t>)))
+    AddressIndex<size_t>(malloc, free);
+  f->index->Build(*f->map, &SizeFunc);
+
+  for (int i = 0; i < kProbes; i++) {
+    uintptr_t start = starts[rng() % n];
+    size_t size = *f->map->Find(reinterpret_cast<const void*>(start));
+    // Mostly hits, with some misses past the object's end.
+    f->probes.push_back(
+      reinterpret_cast<const void*>(start + rng() % (size + size / 8 + 1)));
+  }
+
+  // Both must give the same answers.
+  for (const void* p : f->probes) {
+    const void* map_key = NULL;
+    const void* index_key = NULL;
+    const size_t* map_v = f->map->FindInside(&SizeFunc, kMaxOffset, p,
+                                             &map_key);
+    const size_t* index_v = f->index->FindInside(kMaxOffset, p, &index_key);
+    CHECK_EQ(map_v, index_v);
+    CHECK_EQ(map_key, index_key);
+  }
+
+  cached = f;
+  cached_n = n;
+  return f;
+}
+
+static void bench_addressmap_find_inside(long iterations, uintptr_t param) {
+  Fixture* f = GetFixture(param);
+  uintptr_t found = 0;
+  for (long i = 0; i < iterations; i++) {
+    const void* key;
+    found += reinterpret_cast<uintptr_t>(
+      f->map->FindInside(&SizeFunc, kMaxOffset,
+                         f->probes[i & (kProbes - 1)], &key));
+  }
+  CHECK_NE(found, 0);
+}
+
+static void bench_address_index_find_inside(long iterations, uintptr_t param) {
+  Fixture* f = GetFixture(param);
+  uintptr_t found = 0;
+  for (long i = 0; i < iterations; i++) {
+    const void* key;
+    found += reinterpret_cast<uintptr_t>(
+      f->index->FindInside(kMaxOffset, f->probes[i & (kProbes - 1)], &key));
+  }
+  CHECK_NE(found, 0);
+}
+
+static void bench_address_index_build(long iterations, uintptr_t param) {
+  Fixture* f = GetFixture(param);
+  for (long i = 0; i < iterations; i++) {
+    f->index->Build(*f->map, &SizeFunc);
+  }
+}
+
+int main(void) {
+  static const uintptr_t kSizes[] = {1 << 10, 1 << 14, 1 << 18, 1 << 20};
+  for (uintptr_t n : kSizes) {
+    report_benchmark("addressmap_find_inside", bench_addressmap_find_inside, n);
+    report_benchmark("address_index_find_inside", bench_address_index_find_inside, n);
+  }
+  for (uintptr_t n : kSizes) {
+    report_benchmark("address_index_build", bench_address_index_build, n);
+  }
+  return 0;
+}
@@ -0,0 +1,489 @@
+// -*- Mode: C++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+// Copyright (c) 2024, gperftools Contributors
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+//     * Neither the name of Google Inc. nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// Replays a malloc trace recorded with MALLOCTRACE=<file> (see
+// src/malloc_trace.h) and reports throughput, RSS and fragmentation.
+//
+// Usage: malloc_trace_replay [-t] [-n <runs>] <trace file>
+//
+// By default all events are replayed by one thread in timestamp
+// order. With -t every recorded thread is replayed by a thread of its
+// own, and a thread that frees an object allocated by another waits
+// until it's allocated.
+//
+// Fragmentation is RSS divided by bytes requested by live objects,
+// taken when live bytes peak and at the end of the trace. RSS
+// includes the allocator's own metadata and caches, and is measured
+// relative to RSS before the replay (the tool keeps its own data out
+// of malloc). Only serial replays measure it.
+//
+// Only malloc and free are called, so the tool works with any malloc:
+// this build uses tcmalloc, but it can be built without it (it only
+// needs the header above) and run with another malloc preloaded.
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+
+#include <atomic>
+#include <functional>
+#include <queue>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "malloc_trace.h"
+
+using tcmalloc::MallocTraceChunk;
+using tcmalloc::MallocTraceHeader;
+using tcmalloc::MallocTraceRecord;
+
+// Everything the tool itself needs is kept in mmap-ed memory, so that
+// the malloc under test only sees replayed objects, and RSS growth
+// during a replay is all its doing. Only used by the main thread.
+class ToolMemory {
+ public:
+  static void* Alloc(size_t size) {
+    if (size > kMaxSmall) {
+      return MmapOrDie(size);
+    }
+    const size_t cls = (size + kAlign - 1) / kAlign;
+    if (free_lists_[cls] == NULL) {
+      // Carve a fresh batch of blocks.
+      const size_t block = cls * kAlign;
+      char* p = static_cast<char*>(MmapOrDie(kBatch));
+      for (size_t off = 0; off + block <= kBatch; off += block) {
+        *reinterpret_cast<void**>(p + off) = free_lists_[cls];
+        free_lists_[cls] = p + off;
+      }
+    }
+    void* result = free_lists_[cls];
+    free_lists_[cls] = *static_cast<void**>(result);
+    return result;
+  }
+
+  static void Free(void* p, size_t size) {
+    if (size > kMaxSmall) {
+      munmap(p, size);
+      return;
+    }
+    const size_t cls = (size + kAlign - 1) / kAlign;
+    *static_cast<void**>(p) = free_lists_[cls];
+    free_lists_[cls] = p;
+  }
+
+ private:
+  static const size_t kAlign = 16;
+  static const size_t kMaxSmall = 4096;
+  static const size_t kBatch = 1 << 20;
+
+  static void* MmapOrDie(size_t size) {
+    void* p = mmap(NULL, size, PROT_READ|PROT_WRITE,
+                   MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+      fprintf(stderr, "mmap failed: %s\n", strerror(errno));
+      exit(1);
+    }
+    return p;
+  }
+
+  static void* free_lists_[kMaxSmall / kAlign + 1];
+};
+
+void* ToolMemory::free_lists_[kMaxSmall / kAlign + 1];
+
+template <typename T>
+struct ToolAllocator {
+  typedef T value_type;
+  ToolAllocator() {}
+  template <typename U> ToolAllocator(const ToolAllocator<U>&) {}
+  T* allocate(size_t n) {
+    return static_cast<T*>(ToolMemory::Alloc(n * sizeof(T)));
+  }
+  void deallocate(T* p, size_t n) { ToolMemory::Free(p, n * sizeof(T)); }
+};
+
+template <typename T, typename U>
+bool operator==(const ToolAllocator<T>&, const ToolAllocator<U>&) { return true; }
+template <typename T, typename U>
+bool operator!=(const ToolAllocator<T>&, const ToolAllocator<U>&) { return false; }
+
+template <typename T>
+using Vector = std::vector<T, ToolAllocator<T>>;
+template <typename K, typename V>
+using HashMap = std::unordered_map<K, V, std::hash<K>, std::equal_to<K>,
+                                   ToolAllocator<std::pair<const K, V>>>;
+
+// An op is an object number, with kFreeBit set for frees.
+typedef uint32_t Op;
+static const Op kFreeBit = 1u << 31;
+
+// Trace with addresses replaced by dense object numbers.
+struct Trace {
+  Vector<Op> ops;                 // in timestamp order
+  Vector<Vector<Op>> threads;     // ops of each recorded thread (-t only)
+  Vector<uint64_t> sizes;         // by object
+  size_t num_threads = 0;
+  uint64_t unknown_frees = 0;     // of objects allocated before tracing
+  uint64_t reused_addresses = 0;  // allocations of a live address
+};
+
+static double Now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static long CurrentRSS() {
+  long pages = 0;
+  FILE* f = fopen("/proc/self/statm", "r");
+  if (f != NULL) {
+    if (fscanf(f, "%*s %ld", &pages) != 1) {
+      pages = 0;
+    }
+    fclose(f);
+  }
+  return pages * getpagesize();
+}
+
+static long MaxRSS() {
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  return ru.ru_maxrss * 1024L;
+}
+
+// Records of one recorded thread, read a chunk at a time.
+struct ThreadReader {
+  Vector<off_t> chunk_offsets;
+  Vector<uint32_t> chunk_counts;
+  size_t next_chunk = 0;
+  Vector<MallocTraceRecord> records;
+  size_t pos = 0;
+
+  // Makes sure records[pos] is the next record. Returns false when
+  // there are no more.
+  bool Fill(FILE* f) {
+    while (pos == records.size()) {
+      if (next_chunk == chunk_offsets.size()) {
+        return false;
+      }
+      records.resize(chunk_counts[next_chunk]);
+      if (fseeko(f, chunk_offsets[next_chunk], SEEK_SET) != 0 ||
+          fread(records.data(), sizeof(MallocTraceRecord), records.size(),
+                f) != records.size()) {
+        fprintf(stderr, "read error\n");
+        exit(1);
+      }
+      next_chunk++;
+      pos = 0;
+    }
+    return true;
+  }
+};
+
+// Adds record 'r' of recorded thread 'thread' to the trace.
+static void AddRecord(const MallocTraceRecord& r, size_t thread,
+                      bool per_thread,
+                      HashMap<uint64_t, uint32_t>* live,
+                      Trace* trace) {
+  auto add = [trace, thread, per_thread] (Op op) {
+    trace->ops.push_back(op);
+    if (per_thread) {
+      trace->threads[thread].push_back(op);
+    }
+  };
+  auto it = live->find(r.ptr);
+  if (r.op() == tcmalloc::kMallocTraceFree) {
+    if (it == live->end()) {
+      trace->unknown_frees++;
+      return;
+    }
+    add(it->second | kFreeBit);
+    live->erase(it);
+    return;
+  }
+  if (it != live->end()) {
+    // We missed a free (or it got the same timestamp and sorted
+    // after us). Free the old object right here.
+    trace->reused_addresses++;
+    add(it->second | kFreeBit);
+    live->erase(it);
+  }
+  const Op object = trace->sizes.size();
+  if (object & kFreeBit) {
+    fprintf(stderr, "too many objects\n");
+    exit(1);
+  }
+  trace->sizes.push_back(r.size());
+  add(object);
+  (*live)[r.ptr] = object;
+}
+
+// Reads trace from 'path', merging records of all threads in
+// timestamp order. Fills trace->threads only if 'per_thread'.
+static bool ReadTrace(const char* path, bool per_thread, Trace* trace) {
+  FILE* f = fopen(path, "rb");
+  if (f == NULL) {
+    fprintf(stderr, "can't open %s: %s\n", path, strerror(errno));
+    return false;
+  }
+  MallocTraceHeader header;
+  if (fread(&header, sizeof(header), 1, f) != 1 ||
+      memcmp(header.magic, tcmalloc::kMallocTraceMagic,
+             sizeof(header.magic)) != 0) {
+    fprintf(stderr, "%s is not a malloc trace\n", path);
+    fclose(f);
+    return false;
+  }
+  if (header.version != tcmalloc::kMallocTraceVersion ||
+      header.record_size != sizeof(MallocTraceRecord)) {
+    fprintf(stderr, "%s: unsupported trace version %u\n",
+            path, header.version);
+    fclose(f);
+    return false;
+  }
+  struct stat st;
+  if (fstat(fileno(f), &st) != 0) {
+    fprintf(stderr, "can't stat %s: %s\n", path, strerror(errno));
+    fclose(f);
+    return false;
+  }
+
+  // First find chunks of every thread, so that we only need to keep
+  // one chunk per thread in memory while merging.
+  Vector<ThreadReader> readers;
+  HashMap<uint32_t, size_t> reader_index;
+  MallocTraceChunk chunk;
+  while (fread(&chunk, sizeof(chunk), 1, f) == 1) {
+    const off_t offset = ftello(f);
+    const off_t end = offset + static_cast<off_t>(chunk.count) *
+                               sizeof(MallocTraceRecord);
+    if (end > st.st_size) {
+      fprintf(stderr, "%s: trace is truncated\n", path);
+      break;
+    }
+    auto it = reader_index.emplace(chunk.thread, readers.size()).first;
+    if (it->second == readers.size()) {
+      readers.emplace_back();
+    }
+    readers[it->second].chunk_offsets.push_back(offset);
+    readers[it->second].chunk_counts.push_back(chunk.count);
+    if (fseeko(f, end, SEEK_SET) != 0) {
+      break;
+    }
+  }
+  trace->num_threads = readers.size();
+  if (per_thread) {
+    trace->threads.resize(readers.size());
+  }
+
+  // Merge, oldest record first.
+  typedef std::pair<uint64_t, size_t> HeapEntry;  // timestamp, reader
+  std::priority_queue<HeapEntry, Vector<HeapEntry>,
+                      std::greater<HeapEntry>> heap;
+  for (size_t i = 0; i < readers.size(); i++) {
+    if (readers[i].Fill(f)) {
+      heap.push(HeapEntry(readers[i].records[0].timestamp, i));
+    }
+  }
+  HashMap<uint64_t, uint32_t> live;
+  while (!heap.empty()) {
+    const size_t i = heap.top().second;
+    heap.pop();
+    ThreadReader* reader = &readers[i];
+    AddRecord(reader->records[reader->pos++], i, per_thread, &live, trace);
+    if (reader->Fill(f)) {
+      heap.push(HeapEntry(reader->records[reader->pos].timestamp, i));
+    }
+  }
+  fclose(f);
+  return true;
+}
+
+// Programs write to what they allocate, so do we, a byte a page.
+static void Touch(void* p, uint64_t size) {
+  char* c = static_cast<char*>(p);
+  for (uint64_t i = 0; i < size; i += 4096) {
+    c[i] = 1;
+  }
+}
+
+static void PrintFragmentation(const char* when, uint64_t live, long rss) {
+  printf("  %-8s live %10.2f MiB, rss %10.2f MiB", when, live / 1048576.0,
+         rss / 1048576.0);
+  if (live > 0) {
+    printf(", fragmentation %.3f", static_cast<double>(rss) / live);
+  }
+  printf("\n");
+}
+
+static void ReplaySerial(const Trace& trace) {
+  Vector<void*> objects(trace.sizes.size());
+  const long base_rss = CurrentRSS();
+  uint64_t live = 0, peak_live = 0, sampled_peak = 0;
+  long peak_rss = 0;
+
+  const double start = Now();
+  for (const Op op : trace.ops) {
+    const uint32_t object = op & ~kFreeBit;
+    const uint64_t size = trace.sizes[object];
+    if (op & kFreeBit) {
+      free(objects[object]);
+      objects[object] = NULL;
+      live -= size;
+      continue;
+    }
+    void* p = malloc(size);
+    Touch(p, size);
+    objects[object] = p;
+    live += size;
+    if (live > peak_live) {
+      peak_live = live;
+      // Reading RSS is slow, so only do it once per MiB of growth.
+      if (sampled_peak == 0 || peak_live >= sampled_peak + (1 << 20)) {
+        sampled_peak = peak_live;
+        peak_rss = CurrentRSS() - base_rss;
+      }
+    }
+  }
+  const double elapsed = Now() - start;
+  const long end_rss = CurrentRSS() - base_rss;
+
+  printf("  %zu ops in %.3f s, %.2f Mops/s\n", trace.ops.size(), elapsed,
+         trace.ops.size() / elapsed / 1e6);
+  PrintFragmentation("peak:", sampled_peak, peak_rss);
+  PrintFragmentation("end:", live, end_rss);
+
+  for (size_t i = 0; i < objects.size(); i++) {
+    free(objects[i]);
+  }
+}
+
+static void ReplayThreaded(const Trace& trace) {
+  Vector<std::atomic<void*>> objects(trace.sizes.size());
+  for (auto& o : objects) {
+    o.store(NULL, std::memory_order_relaxed);
+  }
+  std::atomic<bool> go{false};
+
+  Vector<std::thread> threads;
+  for (const Vector<Op>& ops : trace.threads) {
+    threads.emplace_back([&trace, &objects, &go, &ops] () {
+      while (!go.load(std::memory_order_acquire)) {
+        std::this_thread::yield();
+      }
+      for (const Op op : ops) {
+        const uint32_t object = op & ~kFreeBit;
+        if (!(op & kFreeBit)) {
+          const uint64_t size = trace.sizes[object];
+          void* p = malloc(size);
+          Touch(p, size);
+          objects[object].store(p, std::memory_order_release);
+          continue;
+        }
+        void* p;
+        while ((p = objects[object].exchange(
+                  NULL, std::memory_order_acquire)) == NULL) {
+          std::this_thread::yield();
+        }
+        free(p);
+      }
+    });
+  }
+
+  const double start = Now();
+  go.store(true, std::memory_order_release);
+  for (auto& t : threads) {
+    t.join();
+  }
+  const double elapsed = Now() - start;
+
+  printf("  %zu ops on %zu threads in %.3f s, %.2f Mops/s, max rss %.2f MiB\n",
+         trace.ops.size(), threads.size(), elapsed,
+         trace.ops.size() / elapsed / 1e6, MaxRSS() / 1048576.0);
+
+  for (auto& o : objects) {
+    free(o.load(std::memory_order_relaxed));
+  }
+}
+
+static void Usage(const char* argv0) {
+  fprintf(stderr, "Usage: %s [-t] [-n <runs>] <trace file>\n", argv0);
+  exit(1);
+}
+
+int main(int argc, char** argv) {
+  bool threaded = false;
+  int runs = 1;
+  int opt;
+  while ((opt = getopt(argc, argv, "tn:")) != -1) {
+    switch (opt) {
+    case 't':
+      threaded = true;
+      break;
+    case 'n':
+      runs = atoi(optarg);
+      break;
+    default:
+      Usage(argv[0]);
+    }
+  }
+  if (optind != argc - 1 || runs < 1) {
+    Usage(argv[0]);
+  }
+
+  Trace trace;
+  if (!ReadTrace(argv[optind], threaded, &trace)) {
+    return 1;
+  }
+  printf("%zu ops, %zu objects, %zu threads "
+         "(%llu frees of unknown objects, %llu reused addresses)\n",
+         trace.ops.size(), trace.sizes.size(), trace.num_threads,
+         static_cast<unsigned long long>(trace.unknown_frees),
+         static_cast<unsigned long long>(trace.reused_addresses));
+
+  for (int i = 0; i < runs; i++) {
+    printf("run %d:\n", i);
+    if (threaded) {
+      ReplayThreaded(trace);
+    } else {
+      ReplaySerial(trace);
+    }
+  }
+  return 0;
+}
@@ -7,6 +7,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <string.h>
 #if HAVE_LIBUNWIND_H
 #include <libunwind.h>
 #endif
@@ -58,12 +59,54 @@ void getcontext_light(ucontext_t *ctx) {
 #define MAX_FRAMES 2048
 static void *frames[MAX_FRAMES];
 
+// Stack depths we measure. Every unwind captures exactly that many
+// frames, and bench bodies count iterations in frames, so results
+// are nsec per frame and include per-call setup cost amortized over
+// depth.
+static const int kDepths[] = {4, 16, 64, 250};
+
+// Number of frames captured by the last unwind. Benchmark bodies abort
+// on short backtraces, so we first probe each implementation.
+static int captured_frames;
+static bool probing;
+
 enum measure_mode {
   MODE_NOOP,
   MODE_WITH_CONTEXT,
-  MODE_WITHOUT_CONTEXT
+  MODE_WITHOUT_CONTEXT,
+  MODE_SIGNAL,
+  MODE_SIGNAL_NOOP
 };
 
+#ifndef _WIN32
+#define BENCHMARK_SIGNAL_STUFF 1
+
+#include <signal.h>
+
+static int signal_maxlevel;
+static bool signal_unwind;
+
+// Unwinds from signal handler using kernel-provided context, like
+// cpu profiler does.
+static void unwind_signal_handler(int sig, siginfo_t* info, void* uc) {
+  if (signal_unwind) {
+    captured_frames = GetStackTraceWithContext(frames, signal_maxlevel, 0, uc);
+  }
+}
+
+static void install_signal_handler() {
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_sigaction = unwind_signal_handler;
+  sa.sa_flags = SA_SIGINFO | SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  if (sigaction(SIGPROF, &sa, nullptr) != 0) {
+    perror("sigaction");
+    abort();
+  }
+}
+#endif
+
 static int ATTRIBUTE_NOINLINE measure_unwind(int maxlevel, int mode) {
   int n;
 
@@ -74,14 +117,27 @@ static int ATTRIBUTE_NOINLINE measure_unwind(int maxlevel, int mode) {
 #if BENCHMARK_UCONTEXT_STUFF
     ucontext_t uc;
     getcontext_light(&uc);
-    n = GetStackTraceWithContext(frames, MAX_FRAMES, 0, &uc);
+    n = GetStackTraceWithContext(frames, maxlevel, 0, &uc);
+#else
+    abort();
+#endif
+  } else if (mode == MODE_SIGNAL || mode == MODE_SIGNAL_NOOP) {
+#if BENCHMARK_SIGNAL_STUFF
+    signal_maxlevel = maxlevel;
+    signal_unwind = (mode == MODE_SIGNAL);
+    captured_frames = 0;
+    raise(SIGPROF);
+    if (mode == MODE_SIGNAL_NOOP)
+      return 0;
+    n = captured_frames;
 #else
     abort();
 #endif
   } else {
-    n = GetStackTrace(frames, MAX_FRAMES, 0);
+    n = GetStackTrace(frames, maxlevel, 0);
   }
-  if (n < maxlevel) {
+  captured_frames = n;
+  if (n < maxlevel && !probing) {
     fprintf(stderr, "Expected at least %d frames, got %d\n", maxlevel, n);
     abort();
   }
@@ -127,12 +183,115 @@ static void bench_unwind_no_context(long iterations, uintptr_t param) {
   } while (iterations > 0);
 }
 
-int main(void) {
+#if BENCHMARK_SIGNAL_STUFF
+static void bench_unwind_signal(long iterations, uintptr_t param) {
+  do {
+    f1(0, param, MODE_SIGNAL);
+    iterations -= param;
+  } while (iterations > 0);
+}
+
+static void bench_unwind_signal_no_op(long iterations, uintptr_t param) {
+  do {
+    f1(0, param, MODE_SIGNAL_NOOP);
+    iterations -= param;
+  } while (iterations > 0);
+}
+#endif
+
+// Returns true if the current stacktrace implementation captures all
+// 'depth' frames in 'mode'.
+static bool probe_unwind(int depth, int mode) {
+  probing = true;
+  f1(0, depth, mode);
+  probing = false;
+  return captured_frames >= depth;
+}
+
+static void report_unwind(const char* impl, const char* what,
+                          bench_body body, int mode, int depth) {
+  char name[256];
+  snprintf(name, sizeof(name), "%s/%s(%d)", impl, what, depth);
+  bool noop = (mode == MODE_NOOP || mode == MODE_SIGNAL_NOOP);
+  if (!noop && !probe_unwind(depth, mode)) {
+    printf("Benchmark: %s: skipped, captured only %d frames\n",
+           name, captured_frames);
+    return;
+  }
+  report_benchmark(name, body, depth);
+}
+
+extern "C" {
+const char* TEST_bump_stacktrace_implementation(const char*);
+bool TEST_stacktrace_step_cache_stats(uint64_t* hits, uint64_t* misses);
+}
+
+// For *_cached implementations, prints how many frames were unwound
+// by cached steps since the last call.
+static void report_step_cache(const char* impl) {
+  static uint64_t last_hits, last_misses;
+  uint64_t hits, misses;
+  if (!TEST_stacktrace_step_cache_stats(&hits, &misses)) {
+    return;
+  }
+  uint64_t new_hits = hits - last_hits;
+  uint64_t new_misses = misses - last_misses;
+  last_hits = hits;
+  last_misses = misses;
+  if (strstr(impl, "_cached") == nullptr) {
+    return;
+  }
+  printf("Benchmark: %s: step cache: %llu frames hit, %llu backtraces missed\n",
+         impl, (unsigned long long)new_hits, (unsigned long long)new_misses);
+}
+
+int main(int argc, char** argv) {
+  // first arg if given is the only stacktrace implementation we
+  // want to benchmark, second is the only depth
+  const char* only = (argc > 1) ? argv[1] : nullptr;
+  int only_depth = (argc > 2) ? atoi(argv[2]) : 0;
+
+#if BENCHMARK_SIGNAL_STUFF
+  install_signal_handler();
+#endif
+
+  printf("Unwind results are nsec per captured frame.\n");
+
+  for (;;) {
+    const char* impl = TEST_bump_stacktrace_implementation(only);
+    if (!impl) {
+      break;
+    }
+    for (int depth : kDepths) {
+      if (only_depth && depth != only_depth) {
+        continue;
+      }
 #if BENCHMARK_UCONTEXT_STUFF
-  report_benchmark("unwind_context", bench_unwind_context, 1024);
+      report_unwind(impl, "unwind_context", bench_unwind_context,
+                    MODE_WITH_CONTEXT, depth);
 #endif
-  report_benchmark("unwind_no_context", bench_unwind_no_context, 1024);
-  report_benchmark("unwind_no_op", bench_unwind_no_op, 1024);
+      report_unwind(impl, "unwind_no_context", bench_unwind_no_context,
+                    MODE_WITHOUT_CONTEXT, depth);
+#if BENCHMARK_SIGNAL_STUFF
+      report_unwind(impl, "unwind_signal", bench_unwind_signal,
+                    MODE_SIGNAL, depth);
+#endif
+    }
+    report_step_cache(impl);
+  }
+
+  // Baselines: cost of recursion itself and, for unwind_signal, of
+  // signal delivery. Subtract them to get pure unwinding cost.
+  for (int depth : kDepths) {
+    if (only_depth && depth != only_depth) {
+      continue;
+    }
+    report_unwind("baseline", "no_op", bench_unwind_no_op, MODE_NOOP, depth);
+#if BENCHMARK_SIGNAL_STUFF
+    report_unwind("baseline", "signal_no_op", bench_unwind_signal_no_op,
+                  MODE_SIGNAL_NOOP, depth);
+#endif
+  }
 
 //// TODO: somehow this fails at linking step. Figure out why this is missing
 // #if HAVE_LIBUNWIND_H
@@ -0,0 +1,268 @@
+// -*- Mode: C++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+// Copyright (c) 2024, gperftools Contributors
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+//     * Neither the name of Google Inc. nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// AddressIndex is a read-only snapshot of an AddressMap of
+// non-overlapping address ranges, built for many FindInside lookups
+// while the map doesn't change (e.g. during a heap leak check).
+//
+// Range starts and sizes are kept in flat sorted arrays. Ranges that
+// are close to each other are grouped into runs, and every run has a
+// page table that gives, for each kPageSize-sized page of the run,
+// the index of the first range starting at or after it. So a lookup
+// finds its run (there are usually few of them), reads one page table
+// slot and then binary searches over ranges starting in one page.
+
+#ifndef BASE_ADDRESS_INDEX_INL_H_
+#define BASE_ADDRESS_INDEX_INL_H_
+
+#include "config.h"
+#include <stddef.h>
+#include <stdint.h>
+
+#include <algorithm>
+
+#include "addressmap-inl.h"
+#include "base/logging.h"
+
+template <class Value>
+class AddressIndex {
+ public:
+  typedef typename AddressMap<Value>::Allocator Allocator;
+  typedef typename AddressMap<Value>::DeAllocator DeAllocator;
+  typedef typename AddressMap<Value>::Key Key;
+  typedef typename AddressMap<Value>::ValueSizeFunc ValueSizeFunc;
+
+  AddressIndex(Allocator alloc, DeAllocator dealloc)
+    : alloc_(alloc), dealloc_(dealloc), built_(false),
+      keys_(NULL), sizes_(NULL), values_(NULL), num_entries_(0),
+      runs_(NULL), num_runs_(0), pages_(NULL) {
+  }
+  ~AddressIndex() { Clear(); }
+
+  // Indexes all ranges in 'map'. The index refers to the values in
+  // 'map', so 'map' must not change until Clear() is called.
+  void Build(const AddressMap<Value>& map, ValueSizeFunc size_func);
+
+  // Forgets everything and frees memory.
+  void Clear();
+
+  bool built() const { return built_; }
+
+  // Same as AddressMap's FindMutable.
+  Value* FindMutable(Key key) const;
+
+  // Same as AddressMap's FindInside, except that max_size limits the
+  // offset of 'key' into its range exactly (AddressMap rounds it to
+  // its blocks).
+  Value* FindInside(size_t max_size, Key key, Key* res_key) const;
+
+ private:
+  typedef uintptr_t Number;
+
+  static const int kPageBits = 10;
+  static const Number kPageSize = Number(1) << kPageBits;
+
+  // Ranges that are at most this far apart share a run. Page table
+  // slots of the gap cost us 4 bytes per kPageSize.
+  static const Number kMaxRunGap = Number(1) << 20;
+
+  // Ranges of a run lie in [start, end), and start is page aligned.
+  // Its page table is pages_[table, table+num_pages], where the last
+  // slot is the index of the first range after the run.
+  struct Run {
+    Number start;
+    Number end;
+    size_t table;
+  };
+
+  // Returns the entry which might contain 'num' or -1.
+  ptrdiff_t FindCandidate(Number num) const {
+    // Find the last run starting at or before num.
+    size_t lo = 0, n = num_runs_;
+    if (n == 0 || num < runs_[0].start) return -1;
+    while (n > 1) {
+      const size_t half = n / 2;
+      if (runs_[lo + half].start <= num) lo += half;
+      n -= half;
+    }
+    const Run& run = runs_[lo];
+    if (num >= run.end) return -1;
+
+    // Ranges starting in num's page are [first, last). The one we
+    // want is the last one starting at or before num, which can also
+    // be the one before 'first'.
+    const uint32_t* table = pages_ + run.table;
+    const size_t page = (num - run.start) >> kPageBits;
+    size_t first = table[page];
+    n = table[page + 1] - first;
+    if (n == 0 || keys_[first] > num) {
+      return static_cast<ptrdiff_t>(first) - 1;
+    }
+    while (n > 1) {
+      const size_t half = n / 2;
+      if (keys_[first + half] <= num) first += half;
+      n -= half;
+    }
+    return first;
+  }
+
+  Allocator   alloc_;
+  DeAllocator dealloc_;
+  bool        built_;
+
+  // Sorted by key.
+  Number*     keys_;
+  size_t*     sizes_;
+  Value**     values_;
+  size_t      num_entries_;
+
+  Run*        runs_;
+  size_t      num_runs_;
+  uint32_t*   pages_;
+};
+
+template <class Value>
+void AddressIndex<Value>::Build(const AddressMap<Value>& map,
+                                ValueSizeFunc size_func) {
+  Clear();
+  built_ = true;
+
+  size_t n = 0;
+  map.Iterate([&n] (Key, Value*) { n++; });
+  if (n == 0) return;
+  RAW_CHECK(n < (size_t(1) << 31), "too many ranges to index");
+
+  // Sort (key, value) pairs and then split them into arrays.
+  struct Entry {
+    Number key;
+    Value* value;
+    bool operator<(const Entry& other) const { return key < other.key; }
+  };
+  Entry* entries = static_cast<Entry*>((*alloc_)(sizeof(Entry) * n));
+  map.Iterate([this, entries] (Key key, Value* value) {
+    entries[num_entries_].key = reinterpret_cast<Number>(key);
+    entries[num_entries_].value = value;
+    num_entries_++;
+  });
+  std::sort(entries, entries + num_entries_);
+  keys_ = static_cast<Number*>((*alloc_)(sizeof(Number) * n));
+  sizes_ = static_cast<size_t*>((*alloc_)(sizeof(size_t) * n));
+  values_ = static_cast<Value**>((*alloc_)(sizeof(Value*) * n));
+  for (size_t i = 0; i < n; i++) {
+    keys_[i] = entries[i].key;
+    values_[i] = entries[i].value;
+    sizes_[i] = (*size_func)(*entries[i].value);
+  }
+  (*dealloc_)(entries);
+
+  // Split ranges into runs. First pass counts runs and page table
+  // slots, second one fills them. 0-sized ranges still occupy a byte,
+  // so that their start can be found.
+  for (int pass = 0; pass < 2; pass++) {
+    size_t runs = 0;
+    size_t slots = 0;
+    size_t i = 0;
+    while (i < n) {
+      const uint32_t first = static_cast<uint32_t>(i);
+      const Number start = keys_[i] & ~(kPageSize - 1);
+      Number end = keys_[i] + std::max<size_t>(sizes_[i], 1);
+      for (i++; i < n && keys_[i] <= end + kMaxRunGap; i++) {
+        end = std::max<Number>(end, keys_[i] + std::max<size_t>(sizes_[i], 1));
+      }
+      const size_t num_pages = ((end - 1 - start) >> kPageBits) + 1;
+      if (pass == 1) {
+        Run* run = &runs_[runs];
+        run->start = start;
+        run->end = end;
+        run->table = slots;
+        uint32_t* table = pages_ + slots;
+        size_t k = first;
+        for (size_t page = 0; page < num_pages; page++) {
+          const Number page_start = start + (page << kPageBits);
+          while (k < i && keys_[k] < page_start) k++;
+          table[page] = static_cast<uint32_t>(k);
+        }
+        table[num_pages] = static_cast<uint32_t>(i);
+      }
+      runs++;
+      slots += num_pages + 1;
+    }
+    if (pass == 0) {
+      num_runs_ = runs;
+      runs_ = static_cast<Run*>((*alloc_)(sizeof(Run) * runs));
+      pages_ = static_cast<uint32_t*>((*alloc_)(sizeof(uint32_t) * slots));
+    }
+  }
+}
+
+template <class Value>
+void AddressIndex<Value>::Clear() {
+  if (keys_ != NULL) (*dealloc_)(keys_);
+  if (sizes_ != NULL) (*dealloc_)(sizes_);
+  if (values_ != NULL) (*dealloc_)(values_);
+  if (runs_ != NULL) (*dealloc_)(runs_);
+  if (pages_ != NULL) (*dealloc_)(pages_);
+  keys_ = NULL;
+  sizes_ = NULL;
+  values_ = NULL;
+  runs_ = NULL;
+  pages_ = NULL;
+  num_entries_ = 0;
+  num_runs_ = 0;
+  built_ = false;
+}
+
+template <class Value>
+Value* AddressIndex<Value>::FindMutable(Key key) const {
+  const Number num = reinterpret_cast<Number>(key);
+  const ptrdiff_t i = FindCandidate(num);
+  if (i < 0 || keys_[i] != num) return NULL;
+  return values_[i];
+}
+
+template <class Value>
+Value* AddressIndex<Value>::FindInside(size_t max_size,
+                                       Key key, Key* res_key) const {
+  const Number num = reinterpret_cast<Number>(key);
+  // Ranges don't overlap, so only the last one starting at or before
+  // 'key' can contain it.
+  const ptrdiff_t i = FindCandidate(num);
+  if (i < 0) return NULL;
+  const Number offset = num - keys_[i];
+  if (offset > max_size) return NULL;
+  if (offset != 0 &&  // to handle 0-sized ranges
+      offset >= sizes_[i]) {
+    return NULL;
+  }
+  *res_key = reinterpret_cast<Key>(keys_[i]);
+  return values_[i];
+}
+
+#endif  // BASE_ADDRESS_INDEX_INL_H_
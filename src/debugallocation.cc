@@ -60,6 +60,10 @@
 #include <unistd.h>
 #endif
 
+#include <atomic>
+#include <functional>
+#include <thread>
+
 #include <gperftools/malloc_extension.h>
 #include <gperftools/malloc_hook.h>
 
@@ -97,6 +101,16 @@
 #ifndef MAP_ANONYMOUS
 # define MAP_ANONYMOUS MAP_ANON
 #endif
+#ifndef MAP_NORESERVE
+# define MAP_NORESERVE 0
+#endif
+
+// Lightweight guard pages (Linux 6.13+). Older headers don't have
+// them, and older kernels fail them with EINVAL, which we handle.
+#if defined(__linux__) && !defined(MADV_GUARD_INSTALL)
+# define MADV_GUARD_INSTALL 102
+# define MADV_GUARD_REMOVE 103
+#endif
 
 // ========================================================================= //
 
@@ -116,6 +130,10 @@ DEFINE_bool(malloc_page_fence_never_reclaim,
 DEFINE_bool(malloc_page_fence_readable,
             EnvToBool("TCMALLOC_PAGE_FENCE_READABLE", false),
             "Permits reads to the page fence.");
+DEFINE_bool(malloc_page_fence_guard_markers,
+            EnvToBool("TCMALLOC_PAGE_FENCE_GUARD_MARKERS", true),
+            "If set to false, page fences are always made with mprotect, "
+            "even where the kernel supports MADV_GUARD_INSTALL.");
 #else
 DEFINE_bool(malloc_page_fence, false, "Not usable (requires mmap)");
 DEFINE_bool(malloc_page_fence_never_reclaim, false, "Not usable (required mmap)");
@@ -225,6 +243,209 @@ struct MallocBlockQueueEntry {
   std::thread::id deleter_threadid;
 };
 
+#ifdef HAVE_MMAP
+// Slots for malloc_page_fence blocks. Mmap-ing every block separately
+// (and mprotect-ing the page after it) costs several syscalls per
+// allocation, all serialized on the kernel's mmap lock, and leaves a
+// mapping or two per live block, so large programs run into
+// vm.max_map_count.
+//
+// Instead, slots are carved from large regions. A slot is some data
+// pages followed by a guard page, and is only reused for blocks with
+// the same number of data pages, so its guard page never moves. Freed
+// slots are made inaccessible and are quarantined, oldest first, until
+// more than FLAGS_max_free_queue_size bytes of slots are quarantined,
+// so that dangling accesses keep faulting for a while. With
+// malloc_page_fence_never_reclaim (or !malloc_reclaim_memory) freed
+// slots are never reused, same as before.
+//
+// Pages are made inaccessible with guard markers where the kernel
+// supports MADV_GUARD_INSTALL (Linux 6.13+). Those don't split the
+// region's mapping, so the whole pool stays one mapping per region.
+// Otherwise (and for readable page fences, which guard markers can't
+// do) we use mprotect: that still costs an mprotect per allocation and
+// an mprotect plus madvise per free, and every live block splits off
+// mappings of its own, so only the mmap and munmap calls are saved.
+class PageFencePool {
+ public:
+  // Blocks with more data pages are mmap-ed separately.
+  static const int kMaxPooledPages = 32;
+
+  // Returns start of an accessible range of 'data_pages' pages which
+  // is followed by a guard page.
+  static char* Allocate(int data_pages) {
+    const size_t pagesize = getpagesize();
+    const size_t slot_size = (data_pages + 1) * pagesize;
+    Slot* reused;
+    char* p;
+    bool fresh = false;
+    {
+      SpinLockHolder h(&lock_);
+      reused = reusable_[data_pages];
+      if (reused != NULL) {
+        reusable_[data_pages] = reused->next;
+        p = reused->start;
+      } else {
+        // Mmap-ing under the lock, same as system allocations do
+        // under pageheap_lock. It happens once per kRegionSize.
+        if (static_cast<size_t>(region_end_ - region_next_) < slot_size) {
+          NewRegionLocked();
+        }
+        p = region_next_;
+        region_next_ += slot_size;
+        fresh = true;
+      }
+    }
+    if (reused != NULL) {
+      do_free(reused);
+    }
+
+    bool ok;
+    if (use_guard_markers_) {
+      ok = GuardMarkers(p, data_pages * pagesize, false);
+    } else {
+      ok = mprotect(p, data_pages * pagesize, PROT_READ|PROT_WRITE) == 0;
+      if (ok && fresh && FLAGS_malloc_page_fence_readable) {
+        ok = mprotect(p + data_pages * pagesize, pagesize, PROT_READ) == 0;
+      }
+    }
+    if (!ok) {
+      RAW_LOG(FATAL, "Page fence slot setup failed: %s",
+              tcmalloc::SafeStrError(errno).c_str());
+    }
+    return p;
+  }
+
+  // Makes the data pages of slot 'p' inaccessible and releases their
+  // memory. Unless 'reuse' is false the slot is quarantined for
+  // reuse.
+  static void Deallocate(char* p, int data_pages, bool reuse) {
+    const size_t pagesize = getpagesize();
+    const size_t data_size = data_pages * pagesize;
+    bool ok;
+    if (use_guard_markers_) {
+      // Installing guard markers also drops the pages.
+      ok = GuardMarkers(p, data_size, true);
+    } else {
+      ok = (mprotect(p, data_size, PROT_NONE) == 0 &&
+            madvise(p, data_size, MADV_DONTNEED) == 0);
+    }
+    if (!ok) {
+      RAW_LOG(FATAL, "Page fence slot release failed: %s",
+              tcmalloc::SafeStrError(errno).c_str());
+    }
+    if (!reuse) {
+      return;
+    }
+
+    Slot* slot = static_cast<Slot*>(do_malloc(sizeof(Slot)));
+    RAW_CHECK(slot != NULL, "out of memory");
+    slot->start = p;
+    slot->data_pages = data_pages;
+    slot->next = NULL;
+
+    const size_t max_size = FLAGS_max_free_queue_size;
+    SpinLockHolder h(&lock_);
+    if (quarantine_tail_ != NULL) {
+      quarantine_tail_->next = slot;
+    } else {
+      quarantine_head_ = slot;
+    }
+    quarantine_tail_ = slot;
+    quarantine_size_ += (data_pages + 1) * pagesize;
+    while (quarantine_size_ > max_size) {
+      Slot* oldest = quarantine_head_;
+      quarantine_head_ = oldest->next;
+      if (quarantine_head_ == NULL) {
+        quarantine_tail_ = NULL;
+      }
+      quarantine_size_ -= (oldest->data_pages + 1) * pagesize;
+      oldest->next = reusable_[oldest->data_pages];
+      reusable_[oldest->data_pages] = oldest;
+    }
+  }
+
+ private:
+  // Address space reserved at a time. Data pages only use memory
+  // while allocated.
+  static const size_t kRegionSize = 64 << 20;
+
+  // Free slot, kept outside of the slot itself since that's
+  // inaccessible.
+  struct Slot {
+    char* start;
+    int data_pages;
+    Slot* next;
+  };
+
+  // Installs or removes guard markers on [p, p + size).
+  static bool GuardMarkers(char* p, size_t size, bool install) {
+#ifdef MADV_GUARD_INSTALL
+    return madvise(p, size,
+                   install ? MADV_GUARD_INSTALL : MADV_GUARD_REMOVE) == 0;
+#else
+    return false;
+#endif
+  }
+
+  static void NewRegionLocked() {
+    const bool readable = FLAGS_malloc_page_fence_readable;
+    // Guard markers need an accessible mapping to be placed on.
+    char* region = static_cast<char*>(
+      mmap(NULL, kRegionSize,
+           readable ? PROT_NONE : PROT_READ|PROT_WRITE,
+           MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0));
+    if (region == MAP_FAILED) {
+      // If the allocation fails, abort rather than returning NULL to
+      // malloc. This is because in most cases, the program will run out
+      // of memory in this mode due to tremendous amount of wastage. There
+      // is no point in propagating the error elsewhere.
+      RAW_LOG(FATAL, "Out of memory: possibly due to page fence overhead: %s",
+              tcmalloc::SafeStrError(errno).c_str());
+    }
+    if (!readable) {
+      // The first region decides for all others: slots are set up and
+      // released the same way in all regions, so a later region can't
+      // go without guard markers.
+      bool ok;
+      if (region_end_ == NULL) {
+        use_guard_markers_ = (FLAGS_malloc_page_fence_guard_markers &&
+                              GuardMarkers(region, kRegionSize, true));
+        ok = use_guard_markers_ ||
+             mprotect(region, kRegionSize, PROT_NONE) == 0;
+      } else if (use_guard_markers_) {
+        ok = GuardMarkers(region, kRegionSize, true);
+      } else {
+        ok = mprotect(region, kRegionSize, PROT_NONE) == 0;
+      }
+      if (!ok) {
+        RAW_LOG(FATAL, "Guard page setup failed: %s",
+                tcmalloc::SafeStrError(errno).c_str());
+      }
+    }
+    // Rest of the previous region is left unused.
+    region_next_ = region;
+    region_end_ = region + kRegionSize;
+  }
+
+  // Protects everything below.
+  static inline SpinLock lock_;
+  // Where the next new slot is carved from.
+  static inline char* region_next_;
+  static inline char* region_end_;
+  // Whether pages are made inaccessible with MADV_GUARD_INSTALL
+  // rather than mprotect. Set up with the first region and only read
+  // after that.
+  static inline bool use_guard_markers_;
+  // Freed slots waiting to be reused, oldest first.
+  static inline Slot* quarantine_head_;
+  static inline Slot* quarantine_tail_;
+  static inline size_t quarantine_size_;
+  // Slots that can be reused, by number of data pages.
+  static inline Slot* reusable_[kMaxPooledPages + 1];
+};
+#endif  // HAVE_MMAP
+
 class MallocBlock {
  public:  // allocation type constants
 
@@ -312,11 +533,25 @@ class MallocBlock {
   // immediately, we put them in a queue, freeing them only when necessary
   // to keep the total size of all the freed blocks below the limit set by
   // FLAGS_max_free_queue_size.
-  static inline FreeQueue<MallocBlockQueueEntry>* free_queue_;
-
-  static inline size_t free_queue_size_;  // total size of blocks in free_queue_
-  // protects free_queue_ and free_queue_size_
-  static inline SpinLock free_queue_lock_;
+  //
+  // The queue is split into shards picked by freeing thread, so that
+  // threads freeing concurrently rarely contend on the same lock. The
+  // size limit is still for all shards together.
+  struct FreeQueueShard {
+    SpinLock lock;  // protects queue and size updates
+    FreeQueue<MallocBlockQueueEntry>* queue;
+    // Total size of blocks in queue. Read without the lock by other
+    // threads, which sum up all shards.
+    std::atomic<size_t> size;
+  };
+  static const int kFreeQueueShardBits = 3;
+  static const int kFreeQueueShards = 1 << kFreeQueueShardBits;
+  static inline FreeQueueShard free_queue_shards_[kFreeQueueShards];
+
+  // Number of blocks we release from a shard per lock acquisition.
+  // MallocBlockQueueEntry are about 144 in size, so we can only
+  // use a small array of them on the stack.
+  static const int kFreeQueueBatch = 4;
 
   // Names of allocation types (kMallocType, kNewType, kArrayNewType)
   static const char* const kAllocName[];
@@ -525,21 +760,26 @@ class MallocBlock {
       size_t sz = real_mmapped_size(size);
       int pagesize = getpagesize();
       int num_pages = (sz + pagesize - 1) / pagesize + 1;
-      char* p = (char*) mmap(NULL, num_pages * pagesize, PROT_READ|PROT_WRITE,
-                             MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
-      if (p == MAP_FAILED) {
-        // If the allocation fails, abort rather than returning NULL to
-        // malloc. This is because in most cases, the program will run out
-        // of memory in this mode due to tremendous amount of wastage. There
-        // is no point in propagating the error elsewhere.
-        RAW_LOG(FATAL, "Out of memory: possibly due to page fence overhead: %s",
-                tcmalloc::SafeStrError(errno).c_str());
-      }
-      // Mark the page after the block inaccessible
-      if (mprotect(p + (num_pages - 1) * pagesize, pagesize,
-                   PROT_NONE|(malloc_page_fence_readable ? PROT_READ : 0))) {
-        RAW_LOG(FATAL, "Guard page setup failed: %s",
-                tcmalloc::SafeStrError(errno).c_str());
+      char* p;
+      if (num_pages - 1 <= PageFencePool::kMaxPooledPages) {
+        p = PageFencePool::Allocate(num_pages - 1);
+      } else {
+        p = (char*) mmap(NULL, num_pages * pagesize, PROT_READ|PROT_WRITE,
+                         MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) {
+          // If the allocation fails, abort rather than returning NULL to
+          // malloc. This is because in most cases, the program will run out
+          // of memory in this mode due to tremendous amount of wastage. There
+          // is no point in propagating the error elsewhere.
+          RAW_LOG(FATAL, "Out of memory: possibly due to page fence overhead: %s",
+                  tcmalloc::SafeStrError(errno).c_str());
+        }
+        // Mark the page after the block inaccessible
+        if (mprotect(p + (num_pages - 1) * pagesize, pagesize,
+                     PROT_NONE|(malloc_page_fence_readable ? PROT_READ : 0))) {
+          RAW_LOG(FATAL, "Guard page setup failed: %s",
+                  tcmalloc::SafeStrError(errno).c_str());
+        }
       }
       b = (MallocBlock*) (p + (num_pages - 1) * pagesize - sz);
     } else {
@@ -566,13 +806,15 @@ class MallocBlock {
       int size = CheckAndClear(type, given_size);
       int pagesize = getpagesize();
       int num_pages = (size + pagesize - 1) / pagesize + 1;
-      char* p = (char*) this;
-      if (FLAGS_malloc_page_fence_never_reclaim  ||
-          !FLAGS_malloc_reclaim_memory) {
-        mprotect(p - (num_pages - 1) * pagesize + size,
-                 num_pages * pagesize, PROT_NONE);
+      char* p = (char*) this - (num_pages - 1) * pagesize + size;
+      const bool reclaim = (!FLAGS_malloc_page_fence_never_reclaim &&
+                            FLAGS_malloc_reclaim_memory);
+      if (num_pages - 1 <= PageFencePool::kMaxPooledPages) {
+        PageFencePool::Deallocate(p, num_pages - 1, reclaim);
+      } else if (!reclaim) {
+        mprotect(p, num_pages * pagesize, PROT_NONE);
       } else {
-        munmap(p - (num_pages - 1) * pagesize + size, num_pages * pagesize);
+        munmap(p, num_pages * pagesize);
       }
 #endif
     } else {
@@ -589,56 +831,130 @@ class MallocBlock {
   }
 
   static size_t FreeQueueSize() {
-    SpinLockHolder l(&free_queue_lock_);
-    return free_queue_size_;
+    size_t total = 0;
+    for (int i = 0; i < kFreeQueueShards; i++) {
+      total += free_queue_shards_[i].size.load(std::memory_order_relaxed);
+    }
+    return total;
   }
 
   static void ProcessFreeQueue(MallocBlock* b, size_t size,
                                int max_free_queue_size) {
-    // MallocBlockQueueEntry are about 144 in size, so we can only
-    // use a small array of them on the stack.
-    MallocBlockQueueEntry entries[4];
-    int num_entries = 0;
     MallocBlockQueueEntry new_entry(b, size);
-    free_queue_lock_.Lock();
-    if (free_queue_ == NULL)
-      free_queue_ = new FreeQueue<MallocBlockQueueEntry>;
-    RAW_CHECK(!free_queue_->Full(), "Free queue mustn't be full!");
+    const size_t max_size = max_free_queue_size;
+    if (b == NULL) {
+      for (int i = 0; i < kFreeQueueShards; i++) {
+        ReleaseFromShard(&free_queue_shards_[i], max_size);
+      }
+      return;
+    }
 
-    if (b != NULL) {
-      free_queue_size_ += size + sizeof(MallocBlockQueueEntry);
-      free_queue_->Push(new_entry);
+    FreeQueueShard* shard = CurrentShard();
+    {
+      MallocBlockQueueEntry entries[kFreeQueueBatch];
+      int num_entries = 0;
+      shard->lock.Lock();
+      if (shard->queue == NULL)
+        shard->queue = new FreeQueue<MallocBlockQueueEntry>;
+      RAW_CHECK(!shard->queue->Full(), "Free queue mustn't be full!");
+      shard->queue->Push(new_entry);
+      AddToSize(shard, new_entry, 1);
+      // Our shard must have at least one free space in it.
+      if (shard->queue->Full()) {
+        entries[num_entries] = shard->queue->Pop();
+        AddToSize(shard, entries[num_entries], -1);
+        num_entries++;
+      }
+      if (PickShardToRelease(shard, max_size) == shard) {
+        num_entries = PopExcessLocked(shard, max_size, entries, num_entries);
+      }
+      shard->lock.Unlock();
+      FreeEntries(entries, num_entries);
     }
 
-    // Free blocks until the total size of unfreed blocks no longer exceeds
-    // max_free_queue_size, and the free queue has at least one free
-    // space in it.
-    while (free_queue_size_ > max_free_queue_size || free_queue_->Full()) {
-      RAW_CHECK(num_entries < arraysize(entries), "entries array overflow");
-      entries[num_entries] = free_queue_->Pop();
-      free_queue_size_ -=
-          entries[num_entries].size + sizeof(MallocBlockQueueEntry);
-      num_entries++;
-      if (num_entries == arraysize(entries)) {
-        // The queue will not be full at this point, so it is ok to
-        // release the lock.  The queue may still contain more than
-        // max_free_queue_size, but this is not a strict invariant.
-        free_queue_lock_.Unlock();
-        for (int i = 0; i < num_entries; i++) {
-          CheckForDanglingWrites(entries[i]);
-          do_free(entries[i].block);
-        }
-        num_entries = 0;
-        free_queue_lock_.Lock();
+    // Free blocks until the total size of unfreed blocks no longer
+    // exceeds max_free_queue_size.
+    if (FreeQueueSize() > max_size) {
+      ReleaseFromShard(PickShardToRelease(shard, max_size), max_size);
+    }
+  }
+
+  static FreeQueueShard* CurrentShard() {
+    uint64_t h = std::hash<std::thread::id>()(std::this_thread::get_id());
+    h *= uint64_t{0x9E3779B97F4A7C15};
+    return &free_queue_shards_[h >> (64 - kFreeQueueShardBits)];
+  }
+
+  static void AddToSize(FreeQueueShard* shard,
+                        const MallocBlockQueueEntry& entry, int sign) {
+    const size_t entry_size = entry.size + sizeof(MallocBlockQueueEntry);
+    shard->size.store(
+        shard->size.load(std::memory_order_relaxed) + sign * entry_size,
+        std::memory_order_relaxed);
+  }
+
+  // We release our own oldest blocks first, which in a single-threaded
+  // program is exactly FIFO order. But if other threads' shards hold
+  // most of the queue, our blocks would be released right after being
+  // freed, so then we release from the largest shard instead.
+  static FreeQueueShard* PickShardToRelease(FreeQueueShard* own,
+                                            size_t max_size) {
+    if (own->size.load(std::memory_order_relaxed) >=
+        max_size / kFreeQueueShards) {
+      return own;
+    }
+    FreeQueueShard* largest = own;
+    size_t largest_size = 0;
+    for (int i = 0; i < kFreeQueueShards; i++) {
+      size_t s = free_queue_shards_[i].size.load(std::memory_order_relaxed);
+      if (s > largest_size) {
+        largest = &free_queue_shards_[i];
+        largest_size = s;
       }
     }
-    free_queue_lock_.Unlock();
+    return largest;
+  }
+
+  // Pops oldest blocks of 'shard' into entries[num_entries,
+  // kFreeQueueBatch) while all shards together hold more than
+  // max_size bytes. Returns new num_entries.
+  static int PopExcessLocked(FreeQueueShard* shard, size_t max_size,
+                             MallocBlockQueueEntry* entries,
+                             int num_entries) {
+    while (num_entries < kFreeQueueBatch && shard->queue != NULL &&
+           shard->queue->size() > 0 &&
+           FreeQueueSize() > max_size) {
+      entries[num_entries] = shard->queue->Pop();
+      AddToSize(shard, entries[num_entries], -1);
+      num_entries++;
+    }
+    return num_entries;
+  }
+
+  // Blocks are checked and freed without holding shard's lock. The
+  // queue may meanwhile contain more than max_free_queue_size, but
+  // this is not a strict invariant.
+  static void FreeEntries(const MallocBlockQueueEntry* entries,
+                          int num_entries) {
     for (int i = 0; i < num_entries; i++) {
       CheckForDanglingWrites(entries[i]);
       do_free(entries[i].block);
     }
   }
 
+  // Releases oldest blocks of 'shard' while all shards together hold
+  // more than max_size bytes.
+  static void ReleaseFromShard(FreeQueueShard* shard, size_t max_size) {
+    MallocBlockQueueEntry entries[kFreeQueueBatch];
+    int num_entries;
+    do {
+      shard->lock.Lock();
+      num_entries = PopExcessLocked(shard, max_size, entries, 0);
+      shard->lock.Unlock();
+      FreeEntries(entries, num_entries);
+    } while (num_entries == kFreeQueueBatch);
+  }
+
   static void InitDeletedBuffer() {
     memset(kMagicDeletedBuffer, kMagicDeletedByte, sizeof(kMagicDeletedBuffer));
   }
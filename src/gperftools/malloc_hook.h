@@ -119,6 +119,20 @@ class PERFTOOLS_DLL_DECL MallocHook {
   }
   inline static void InvokeDeleteHook(const void* p);
 
+  // The BatchHook is invoked with arrays of new and delete events that
+  // were buffered per thread.  See malloc_hook_c.h for details.
+  typedef MallocHook_Event Event;
+  typedef MallocHook_BatchHook BatchHook;
+  inline static bool AddBatchHook(BatchHook hook) {
+    return MallocHook_AddBatchHook(hook);
+  }
+  inline static bool RemoveBatchHook(BatchHook hook) {
+    return MallocHook_RemoveBatchHook(hook);
+  }
+  inline static void FlushBatchHooks() {
+    MallocHook_FlushBatchHooks();
+  }
+
   // The PreMmapHook is invoked with mmap or mmap64 arguments just
   // before the call is actually made.  Such a hook may be useful
   // in memory limited contexts, to catch allocations that will exceed
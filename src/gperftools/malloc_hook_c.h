@@ -79,6 +79,47 @@ int MallocHook_AddDeleteHook(MallocHook_DeleteHook hook);
 PERFTOOLS_DLL_DECL
 int MallocHook_RemoveDeleteHook(MallocHook_DeleteHook hook);
 
+/* Batch hooks are a cheaper alternative to the NewHook and DeleteHook
+ * for consumers that don't need to see each event as it happens (e.g.
+ * allocation accounting).  Every thread appends its events to its own
+ * buffer, and batch hooks are handed arrays of events when the buffer
+ * fills up, when the thread exits, or when MallocHook_FlushBatchHooks
+ * is called.  Events of one thread are delivered in order, but no
+ * order is kept between threads.  E.g. a new event may be delivered
+ * before the delete event of the previous object at the same address,
+ * if that one was freed by another thread.  Events for NULL pointers
+ * are not recorded.
+ *
+ * A batch hook may be called from any thread, but never concurrently
+ * for the same buffer.  Allocations made by a batch hook itself are
+ * recorded too, but they are dropped if the buffer fills up while the
+ * hook is running on that thread.
+ */
+typedef enum {
+  MallocHook_NewEvent = 0,
+  MallocHook_DeleteEvent = 1
+} MallocHook_EventType;
+
+typedef struct {
+  const void* ptr;
+  size_t size;  /* allocated size for new events, 0 for delete events */
+  MallocHook_EventType type;
+} MallocHook_Event;
+
+typedef void (*MallocHook_BatchHook)(const MallocHook_Event* events,
+                                     int count);
+PERFTOOLS_DLL_DECL
+int MallocHook_AddBatchHook(MallocHook_BatchHook hook);
+/* Buffered events are flushed before the hook is removed. */
+PERFTOOLS_DLL_DECL
+int MallocHook_RemoveBatchHook(MallocHook_BatchHook hook);
+/* Delivers the buffered events of all threads.  Does nothing when
+ * called from inside a batch hook.  Must not be called while holding
+ * a lock that batch hooks take.
+ */
+PERFTOOLS_DLL_DECL
+void MallocHook_FlushBatchHooks(void);
+
 typedef void (*MallocHook_PreMmapHook)(const void *start,
                                        size_t size,
                                        int protection,
@@ -61,6 +61,7 @@
 #define BASE_PROFILER_H_
 
 #include <time.h>       /* For time_t */
+#include <stdint.h>     /* For uintptr_t */
 
 /* Annoying stuff for windows; makes sure clients can import these functions */
 #ifndef PERFTOOLS_DLL_DECL
@@ -162,6 +163,52 @@ struct ProfilerState {
 };
 PERFTOOLS_DLL_DECL void ProfilerGetCurrentState(struct ProfilerState* state);
 
+/* Maximum number of labels a thread can carry at once. */
+#define PROFILER_MAX_LABELS 4
+
+/* Sets label 'key' of the calling thread to 'value'.  Every sample
+ * subsequently taken on this thread carries the labels the thread had at
+ * the time, and samples are aggregated by stack trace and labels, so that
+ * e.g. a server can split its CPU profile by request type:
+ *
+ *   ProfilerSetLabel(0, kEndpointSearch);
+ *   HandleSearch(request);
+ *   ProfilerSetLabel(0, 0);
+ *
+ * 'key' must be in [0, PROFILER_MAX_LABELS).  Keys and values are
+ * application-defined integers (an index into a table of interned
+ * strings works well); a 'value' of 0 clears the label.  This is a plain
+ * thread-local store, cheap enough to call per request, and is
+ * async-signal-safe.  Use "pprof --label=<key>=<value>" to look at the
+ * samples taken with a given label.
+ */
+PERFTOOLS_DLL_DECL void ProfilerSetLabel(int key, uintptr_t value);
+
+/* Returns the value of label 'key' of the calling thread, or 0 if it is
+ * not set.
+ */
+PERFTOOLS_DLL_DECL uintptr_t ProfilerGetLabel(int key);
+
+/* Restricts profiling to selected threads.  By default every registered
+ * thread is sampled.  Once a thread is selected, by kernel thread id
+ * (gettid()) or by a tag set with ProfilerSetThreadTag, only the selected
+ * threads are; the others are not interrupted at all, which is cheaper
+ * than rejecting their samples with ProfilerOptions.filter_in_thread.
+ * Pass 'selected' as zero to remove a thread id or tag from the
+ * selection again, and call ProfilerSelectAllThreads to drop it.
+ *
+ * This needs per-thread timers (set CPUPROFILE_PER_THREAD_TIMERS,
+ * CPUPROFILE_WALLCLOCK or CPUPROFILE_PERF_EVENT) and is ignored otherwise.
+ */
+PERFTOOLS_DLL_DECL void ProfilerSelectThread(long tid, int selected);
+PERFTOOLS_DLL_DECL void ProfilerSelectThreadTag(int tag, int selected);
+PERFTOOLS_DLL_DECL void ProfilerSelectAllThreads(void);
+
+/* Sets the tag of the calling thread, e.g. to the same value for all the
+ * threads of a pool.  Threads start with tag 0.
+ */
+PERFTOOLS_DLL_DECL void ProfilerSetThreadTag(int tag);
+
 /* Returns the current stack trace, to be called from a SIGPROF handler. */
 PERFTOOLS_DLL_DECL int ProfilerGetStackTrace(
     void** result, int max_depth, int skip_count, const void *uc);
@@ -0,0 +1,395 @@
+// -*- Mode: C++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+// Copyright (c) 2024, gperftools Contributors
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+//     * Neither the name of Google Inc. nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include "config.h"
+
+#include "guarded_allocation.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>                     // for memset
+#ifdef HAVE_MMAP
+#include <signal.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+
+#include "base/basictypes.h"
+#include "base/commandlineflags.h"
+#include "base/logging.h"
+#include "base/spinlock.h"
+#include "internal_logging.h"
+#include "maybe_emergency_malloc.h"
+
+// Guarded allocations are taken from sampled allocations, so they
+// only happen when TCMALLOC_SAMPLE_PARAMETER is set too.
+DEFINE_int32(tcmalloc_guarded_slots,
+             EnvToInt("TCMALLOC_GUARDED_SLOTS", 0),
+             "Number of guarded slots for sampled allocations. Every slot "
+             "costs two tcmalloc pages of address space. 0 disables "
+             "guarded allocations.");
+
+namespace tcmalloc {
+
+ATTRIBUTE_HIDDEN uintptr_t guarded_pool_start;
+ATTRIBUTE_HIDDEN uintptr_t guarded_pool_end;
+
+#if defined(HAVE_MMAP) && !defined(_WIN32)
+
+namespace {
+
+// Keeps slot metadata and pool's address space at sane sizes.
+constexpr int kMaxGuardedSlots = 1 << 14;
+
+// Bytes after object's end up to the next system page are filled
+// with this and checked at free.
+constexpr unsigned char kSlackByte = 0xd7;
+
+enum SlotState {
+  kSlotUnused,
+  kSlotLive,
+  kSlotFreed,
+};
+
+struct Slot {
+  StackTrace alloc_stack;       // alloc_stack.size is object size
+  int free_depth;
+  void* free_stack[kMaxStackDepth];
+  SlotState state;
+};
+
+CACHELINE_ALIGNED SpinLock guarded_lock;
+bool pool_initialized;          // pool creation was attempted
+
+// Pool is a guard, then data of slot 0, then a guard, then data of
+// slot 1 and so on, ending with a guard. Data areas and guards are
+// slot_size bytes each.
+size_t slot_size;
+size_t sys_page_size;
+int num_slots;
+Slot* slots;
+
+// Free slots in FIFO order, so that freed slots stay inaccessible
+// for as long as possible.
+int* free_slots;
+int free_head;
+int free_count;
+
+struct sigaction previous_segv_action;
+struct sigaction previous_bus_action;
+
+char* SlotData(int idx) {
+  return reinterpret_cast<char*>(guarded_pool_start + slot_size +
+                                 size_t(idx) * 2 * slot_size);
+}
+
+size_t AccessibleSize(size_t size) {
+  return (size + sys_page_size - 1) & ~(sys_page_size - 1);
+}
+
+void PrintStack(const char* title, void* const* stack, int depth) {
+  RAW_LOG(ERROR, "%s", title);
+  for (int i = 0; i < depth; i++) {
+    RAW_LOG(ERROR, "    @ %p", stack[i]);
+  }
+}
+
+void PrintSlotStacks(const Slot& slot) {
+  PrintStack("Allocated at:", slot.alloc_stack.stack,
+             static_cast<int>(slot.alloc_stack.depth));
+  if (slot.state == kSlotFreed) {
+    PrintStack("Freed at:", slot.free_stack, slot.free_depth);
+  }
+}
+
+// Prints what we know about a fault at 'addr' in the pool. Runs in a
+// signal handler, so it doesn't take locks.
+void DescribeFault(uintptr_t addr) {
+  const uintptr_t offset = addr - guarded_pool_start;
+  const int unit = static_cast<int>(offset / (2 * slot_size));
+  const size_t pos = offset % (2 * slot_size);
+
+  // Unit k is a guard followed by data of slot k. Faults in a guard
+  // are blamed on the closer of the neighbouring slots.
+  int idx;
+  if (pos >= slot_size) {
+    idx = unit;
+  } else if (unit == num_slots || (unit > 0 && pos < slot_size / 2)) {
+    idx = unit - 1;
+  } else {
+    idx = unit;
+  }
+
+  const Slot& slot = slots[idx];
+  const uintptr_t data = reinterpret_cast<uintptr_t>(SlotData(idx));
+  const size_t size = slot.alloc_stack.size;
+  if (slot.state == kSlotUnused) {
+    RAW_LOG(ERROR, "tcmalloc: guarded allocation: invalid access at %p, "
+            "near a slot which was never used", reinterpret_cast<void*>(addr));
+    return;
+  }
+  if (addr < data) {
+    RAW_LOG(ERROR, "tcmalloc: guarded allocation: buffer underflow at %p, "
+            "%zu bytes before %zu-byte object at %p%s",
+            reinterpret_cast<void*>(addr), size_t(data - addr), size,
+            reinterpret_cast<void*>(data),
+            slot.state == kSlotFreed ? " (freed)" : "");
+  } else if (slot.state == kSlotFreed && addr - data < slot_size) {
+    RAW_LOG(ERROR, "tcmalloc: guarded allocation: use-after-free at %p, "
+            "%zu bytes into %zu-byte object at %p",
+            reinterpret_cast<void*>(addr), size_t(addr - data), size,
+            reinterpret_cast<void*>(data));
+  } else {
+    RAW_LOG(ERROR, "tcmalloc: guarded allocation: buffer overflow at %p, "
+            "%zu bytes past the end of %zu-byte object at %p%s",
+            reinterpret_cast<void*>(addr), size_t(addr - data - size), size,
+            reinterpret_cast<void*>(data),
+            slot.state == kSlotFreed ? " (freed)" : "");
+  }
+  PrintSlotStacks(slot);
+}
+
+void FaultHandler(int sig, siginfo_t* info, void* context) {
+  struct sigaction* previous =
+    sig == SIGSEGV ? &previous_segv_action : &previous_bus_action;
+  const uintptr_t addr = reinterpret_cast<uintptr_t>(info->si_addr);
+  if (IsGuardedPtr(info->si_addr)) {
+    DescribeFault(addr);
+  } else if (previous->sa_flags & SA_SIGINFO) {
+    previous->sa_sigaction(sig, info, context);
+    return;
+  } else if (previous->sa_handler != SIG_DFL &&
+             previous->sa_handler != SIG_IGN) {
+    previous->sa_handler(sig);
+    return;
+  }
+  // Let the faulting instruction run again with the previous
+  // disposition in place, which normally kills us with this signal.
+  sigaction(sig, previous, NULL);
+}
+
+void InstallFaultHandler() {
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_sigaction = FaultHandler;
+  sa.sa_flags = SA_SIGINFO | SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  RAW_CHECK(sigaction(SIGSEGV, &sa, &previous_segv_action) == 0,
+            "guarded allocation: sigaction(SIGSEGV)");
+  RAW_CHECK(sigaction(SIGBUS, &sa, &previous_bus_action) == 0,
+            "guarded allocation: sigaction(SIGBUS)");
+}
+
+void InitPool() {
+  const int n = std::min<int>(FLAGS_tcmalloc_guarded_slots, kMaxGuardedSlots);
+  if (n <= 0) {
+    return;
+  }
+
+  sys_page_size = getpagesize();
+  // Both are powers of two, so slots are aligned for both tcmalloc
+  // pages (what sampled allocations promise) and mprotect.
+  slot_size = std::max<size_t>(kPageSize, sys_page_size);
+  const size_t pool_size = (2 * size_t(n) + 1) * slot_size;
+
+  // Reserve with one extra slot, so that we can align the start.
+  const size_t reserve_size = pool_size + slot_size;
+  void* reserved = mmap(NULL, reserve_size, PROT_NONE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (reserved == MAP_FAILED) {
+    Log(kLog, __FILE__, __LINE__,
+        "tcmalloc: failed to reserve guarded allocations pool", reserve_size);
+    return;
+  }
+  const uintptr_t reserved_start = reinterpret_cast<uintptr_t>(reserved);
+  const uintptr_t start = (reserved_start + slot_size - 1) & ~(slot_size - 1);
+  if (start != reserved_start) {
+    munmap(reserved, start - reserved_start);
+  }
+  const size_t tail = reserved_start + reserve_size - (start + pool_size);
+  if (tail != 0) {
+    munmap(reinterpret_cast<void*>(start + pool_size), tail);
+  }
+
+  slots = static_cast<Slot*>(MetaDataAlloc(sizeof(Slot) * n));
+  free_slots = static_cast<int*>(MetaDataAlloc(sizeof(int) * n));
+  if (slots == NULL || free_slots == NULL) {
+    Log(kLog, __FILE__, __LINE__,
+        "tcmalloc: failed to allocate guarded allocations metadata", n);
+    munmap(reinterpret_cast<void*>(start), pool_size);
+    return;
+  }
+  memset(slots, 0, sizeof(Slot) * n);
+  for (int i = 0; i < n; i++) {
+    free_slots[i] = i;
+  }
+  num_slots = n;
+  free_head = 0;
+  free_count = n;
+
+  InstallFaultHandler();
+
+  guarded_pool_end = start + pool_size;
+  guarded_pool_start = start;
+}
+
+// Returns index of the slot whose object starts at 'ptr', or -1.
+int SlotIndex(const void* ptr) {
+  const uintptr_t offset = reinterpret_cast<uintptr_t>(ptr) - guarded_pool_start;
+  if (offset % (2 * slot_size) != slot_size) {
+    return -1;
+  }
+  return static_cast<int>(offset / (2 * slot_size));
+}
+
+}  // namespace
+
+ATTRIBUTE_HIDDEN void* GuardedAlloc(size_t size, const StackTrace& stack) {
+  if (FLAGS_tcmalloc_guarded_slots <= 0) {
+    return NULL;
+  }
+
+  SpinLockHolder h(&guarded_lock);
+  if (PREDICT_FALSE(!pool_initialized)) {
+    pool_initialized = true;
+    InitPool();
+  }
+  if (size > slot_size || free_count == 0) {
+    return NULL;
+  }
+
+  const int idx = free_slots[free_head];
+  char* data = SlotData(idx);
+  const size_t accessible = AccessibleSize(size);
+  if (accessible != 0 && mprotect(data, accessible, PROT_READ | PROT_WRITE) != 0) {
+    return NULL;
+  }
+  free_head = (free_head + 1) % num_slots;
+  free_count--;
+
+  memset(data + size, kSlackByte, accessible - size);
+
+  Slot* slot = &slots[idx];
+  slot->alloc_stack = stack;
+  slot->alloc_stack.size = size;
+  slot->state = kSlotLive;
+  return data;
+}
+
+ATTRIBUTE_HIDDEN void GuardedFree(void* ptr) {
+  void* free_stack[kMaxStackDepth];
+  const int free_depth = GrabBacktrace(free_stack, kMaxStackDepth, 1);
+
+  SpinLockHolder h(&guarded_lock);
+  const int idx = SlotIndex(ptr);
+  if (idx < 0 || slots[idx].state == kSlotUnused) {
+    PrintStack("Deallocated at:", free_stack, free_depth);
+    RAW_LOG(FATAL, "tcmalloc: guarded allocation: attempt to free "
+            "invalid pointer %p", ptr);
+  }
+
+  Slot* slot = &slots[idx];
+  const size_t size = slot->alloc_stack.size;
+  if (slot->state == kSlotFreed) {
+    PrintSlotStacks(*slot);
+    PrintStack("Deallocated again at:", free_stack, free_depth);
+    RAW_LOG(FATAL, "tcmalloc: guarded allocation: double free of "
+            "%zu-byte object at %p", size, ptr);
+  }
+
+  char* data = static_cast<char*>(ptr);
+  const size_t accessible = AccessibleSize(size);
+  for (size_t i = size; i < accessible; i++) {
+    if (static_cast<unsigned char>(data[i]) != kSlackByte) {
+      PrintSlotStacks(*slot);
+      PrintStack("Deallocated at:", free_stack, free_depth);
+      RAW_LOG(FATAL, "tcmalloc: guarded allocation: buffer overflow of "
+              "%zu-byte object at %p, byte %zu past the end was "
+              "overwritten (detected at free)", size, ptr, i - size);
+    }
+  }
+
+  if (accessible != 0) {
+    RAW_CHECK(mprotect(data, accessible, PROT_NONE) == 0,
+              "guarded allocation: mprotect");
+    madvise(data, accessible, MADV_DONTNEED);
+  }
+
+  slot->state = kSlotFreed;
+  slot->free_depth = free_depth;
+  memcpy(slot->free_stack, free_stack, sizeof(void*) * free_depth);
+  free_slots[(free_head + free_count) % num_slots] = idx;
+  free_count++;
+}
+
+ATTRIBUTE_HIDDEN size_t GuardedGetSize(const void* ptr) {
+  SpinLockHolder h(&guarded_lock);
+  const int idx = SlotIndex(ptr);
+  if (idx < 0 || slots[idx].state != kSlotLive) {
+    RAW_LOG(FATAL, "tcmalloc: guarded allocation: attempt to get the size "
+            "of invalid pointer %p", ptr);
+  }
+  return slots[idx].alloc_stack.size;
+}
+
+ATTRIBUTE_HIDDEN void GuardedIterateStackTraces(
+    void (*fn)(const StackTrace& stack, void* arg), void* arg) {
+  SpinLockHolder h(&guarded_lock);
+  for (int i = 0; i < num_slots; i++) {
+    if (slots[i].state == kSlotLive) {
+      fn(slots[i].alloc_stack, arg);
+    }
+  }
+}
+
+#else  // !HAVE_MMAP || _WIN32
+
+ATTRIBUTE_HIDDEN void* GuardedAlloc(size_t size, const StackTrace& stack) {
+  return NULL;
+}
+
+ATTRIBUTE_HIDDEN void GuardedFree(void* ptr) {
+  RAW_LOG(FATAL, "guarded allocations are not supported");
+}
+
+ATTRIBUTE_HIDDEN size_t GuardedGetSize(const void* ptr) {
+  RAW_LOG(FATAL, "guarded allocations are not supported");
+  return 0;
+}
+
+ATTRIBUTE_HIDDEN void GuardedIterateStackTraces(
+    void (*fn)(const StackTrace& stack, void* arg), void* arg) {
+}
+
+#endif  // !HAVE_MMAP || _WIN32
+
+}  // namespace tcmalloc
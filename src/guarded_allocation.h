@@ -0,0 +1,93 @@
+// -*- Mode: C++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+// Copyright (c) 2024, gperftools Contributors
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+//     * Neither the name of Google Inc. nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// Guarded allocations catch use-after-free and buffer overflows of a
+// small random subset of heap objects in production. When enabled
+// (TCMALLOC_GUARDED_SLOTS), sampled allocations that fit are placed
+// into a pool of slots, each separated from the next by an
+// inaccessible guard area. Freed slots are made inaccessible too and
+// are reused in FIFO order, so dangling accesses keep faulting for as
+// long as possible. Faults in the pool are reported along with
+// allocation and deallocation stacks.
+//
+// Objects are placed at the start of their slot, so guarded pointers
+// are kPageSize aligned just like other sampled allocations, and
+// sized delete and memalign keep working without any extra checks.
+// Accesses past the object's end that don't reach the next system
+// page are caught at free time instead, by checking a fill pattern.
+//
+// Guarded pointers aren't known to the page heap, so free, realloc
+// and friends see them on their "invalid pointer" slow paths, which
+// check IsGuardedPtr. The fast paths don't pay anything.
+
+#ifndef TCMALLOC_GUARDED_ALLOCATION_H_
+#define TCMALLOC_GUARDED_ALLOCATION_H_
+#include "config.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "base/basictypes.h"
+#include "common.h"
+
+namespace tcmalloc {
+
+// [guarded_pool_start, guarded_pool_end) covers all slots and guards.
+// Both are 0 until the pool is created.
+ATTRIBUTE_HIDDEN extern uintptr_t guarded_pool_start;
+ATTRIBUTE_HIDDEN extern uintptr_t guarded_pool_end;
+
+static inline bool IsGuardedPtr(const void* ptr) {
+  uintptr_t p = reinterpret_cast<uintptr_t>(ptr);
+  return PREDICT_FALSE(p - guarded_pool_start < guarded_pool_end - guarded_pool_start);
+}
+
+// Returns guarded memory for 'size' bytes allocated at 'stack', or
+// NULL if guarded allocations are disabled, 'size' doesn't fit into a
+// slot or all slots are in use.
+ATTRIBUTE_HIDDEN void* GuardedAlloc(size_t size, const StackTrace& stack);
+
+// Frees guarded memory. Crashes with a report on double free, on free
+// of a pointer that doesn't point to a slot start and on writes past
+// the object's end.
+ATTRIBUTE_HIDDEN void GuardedFree(void* ptr);
+
+// Returns requested size of guarded allocation 'ptr'. Crashes if
+// 'ptr' isn't a live guarded allocation.
+ATTRIBUTE_HIDDEN size_t GuardedGetSize(const void* ptr);
+
+// Calls 'fn' with allocation stack of every live guarded allocation.
+// 'fn' is called under guarded allocations lock and must not malloc.
+ATTRIBUTE_HIDDEN void GuardedIterateStackTraces(
+  void (*fn)(const StackTrace& stack, void* arg), void* arg);
+
+}  // namespace tcmalloc
+
+#endif  // TCMALLOC_GUARDED_ALLOCATION_H_
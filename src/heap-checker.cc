@@ -42,7 +42,10 @@
 
 #include <errno.h>
 #include <fcntl.h>    // for O_RDONLY (we use syscall to do actual reads)
+#include <limits.h>   // for INT_MAX
 #include <pthread.h>
+#include <sched.h>    // for sched_yield
+#include <signal.h>
 #include <stddef.h>
 #include <string.h>
 #include <sys/mman.h> // TODO: check if needed
@@ -50,6 +53,7 @@
 #include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/uio.h>
+#include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -57,8 +61,10 @@
 #include <sys/procfs.h>
 #include <sys/user.h>
 #include <elf.h> // NT_PRSTATUS
+#include <linux/futex.h>
 
 #include <algorithm>
+#include <atomic>
 #include <functional>
 #include <map>
 #include <set>
@@ -86,6 +92,7 @@
 #include "heap-profile-table.h"
 #include "malloc_hook-inl.h"
 #include "memory_region_map.h"
+#include "mmap_hook.h"
 #include "safe_strerror.h"
 
 // When dealing with ptrace-ed threads, we need to capture all thread
@@ -281,6 +288,23 @@ DEFINE_int64(heap_check_max_pointer_offset,
              "pointers going inside of heap allocated objects. "
              "Set to -1 to use the actual largest heap object size.");
 
+DEFINE_int32(heap_check_threads,
+             EnvToInt("HEAP_CHECK_THREADS", 1),
+             "Number of threads that look for pointers to live heap objects "
+             "during a leak check. Values above 1 start that many minus one "
+             "helper threads for the time of each check.");
+
+DEFINE_bool(heap_check_fork,
+            EnvToBool("HEAP_CHECK_FORK", false),
+            "If set to true, live objects are found by a forked copy of the "
+            "process, and other threads are stopped only while their "
+            "registers and stacks are captured");
+
+DEFINE_bool(heap_check_fork_test_failure,
+            EnvToBool("HEAP_CHECK_FORK_TEST_FAILURE", false),
+            "If set to true, the child of a forked check fails on purpose, "
+            "so that the check is redone in this process (for testing)");
+
 DEFINE_bool(heap_check_run_under_gdb,
             EnvToBool("HEAP_CHECK_RUN_UNDER_GDB", false),
             "If false, turns off heap-checking library when running under gdb "
@@ -457,6 +481,73 @@ typedef vector<AllocObject,
               > LiveObjectsStack;
 static LiveObjectsStack* live_objects = NULL;
 
+// Helper threads that mark live objects together with the thread doing
+// the leak check (see --heap_check_threads). They exist only during
+// DoNoLeaks; we need their thread ids to keep them running while
+// TCMalloc_ListAllProcessThreads has all other threads stopped.
+static const int kMaxMarkThreads = 64;
+static int num_mark_helpers = 0;
+static pid_t mark_helper_tids[kMaxMarkThreads];
+
+// Memory for parallel marking work lists. Its pages are mapped
+// bypassing mmap hooks, as MemoryRegionMap's lock is held by the
+// checking thread. Hence they are unknown to MemoryRegionMap and a check
+// may scan them as global data, which is harmless: any heap pointers
+// there are to objects that are already marked live. The arena is
+// deleted at the end of every check, so nothing stale is left for the
+// next one.
+class MarkAllocator {
+ public:
+  static void Init() {
+    static union {
+      char bytes[sizeof(PagesAllocator)];
+      void* align;
+    } pages_allocator_space;
+    static PagesAllocator* pages_allocator =
+      new(pages_allocator_space.bytes) PagesAllocator;
+    arena_ = LowLevelAlloc::NewArenaWithCustomAlloc(
+      0, LowLevelAlloc::DefaultArena(), pages_allocator);
+  }
+  static void Shutdown() {
+    RAW_CHECK(LowLevelAlloc::DeleteArena(arena_),
+              "marking memory is still in use");
+    arena_ = NULL;
+  }
+  static void* Allocate(size_t n) {
+    return LowLevelAlloc::AllocWithArena(n, arena_);
+  }
+  static void Free(void* p, size_t /* n */) {
+    LowLevelAlloc::Free(p);
+  }
+
+ private:
+  class PagesAllocator : public LowLevelAlloc::PagesAllocator {
+   public:
+    void* MapPages(int32_t flags, size_t size) override {
+      tcmalloc::DirectAnonMMapResult result =
+        tcmalloc::DirectAnonMMap(false, size);
+      RAW_CHECK(result.success, "mmap error");
+      return result.addr;
+    }
+    void UnMapPages(int32_t flags, void* addr, size_t size) override {
+      RAW_CHECK(tcmalloc::DirectMUnMap(false, addr, size) == 0,
+                "munmap error");
+    }
+  };
+
+  static LowLevelAlloc::Arena* arena_;
+};
+
+LowLevelAlloc::Arena* MarkAllocator::arena_ = NULL;
+
+typedef vector<AllocObject,
+               STL_Allocator<AllocObject, MarkAllocator>
+              > MarkStack;
+
+// Marking work not yet taken by any marking thread.
+static SpinLock mark_pool_lock;
+static MarkStack* mark_pool = NULL;  // GUARDED_BY(mark_pool_lock)
+
 // A special string type that uses my allocator
 typedef basic_string<char, char_traits<char>,
                      STL_Allocator<char, HeapLeakChecker::Allocator>
@@ -562,6 +653,49 @@ inline static uintptr_t AsInt(const void* ptr) {
 
 //----------------------------------------------------------------------
 
+// Coarse map of where heap objects are, used to drop most words that
+// fall within [min_heap_address, max_heap_address] but point between
+// heap objects (e.g. into mmap-ed areas, libraries or thread stacks)
+// without doing the much slower HaveOnHeap lookup. The bit for address
+// 'a' is set if some heap object overlaps the kHeapPageShift-sized page
+// of 'a'. Pages are hashed into the bitmap, so far apart pages may
+// share bits; that only costs extra lookups. The bitmap is rebuilt at
+// the start of every check, and heap_profile can't change until the
+// check is done.
+static const int kHeapPageShift = 16;
+static const size_t kHeapPageBits = 1 << 16;
+static const size_t kBitsPerWord = 8 * sizeof(uintptr_t);
+static uintptr_t heap_page_bitmap[kHeapPageBits / kBitsPerWord];
+
+static inline bool MaybeOnHeapPage(uintptr_t addr) {
+  const size_t bit = (addr >> kHeapPageShift) & (kHeapPageBits - 1);
+  return (heap_page_bitmap[bit / kBitsPerWord] >> (bit % kBitsPerWord)) & 1;
+}
+
+static void AddToHeapPageBitmapCallback(const void* ptr,
+                                        const HeapProfileTable::AllocInfo& info) {
+  const uintptr_t first = AsInt(ptr) >> kHeapPageShift;
+  // Inclusive, like max_heap_address: a pointer just past the end of
+  // an object can be into it (for 0-sized objects).
+  const uintptr_t last = (AsInt(ptr) + info.object_size) >> kHeapPageShift;
+  if (last - first >= kHeapPageBits) {
+    memset(heap_page_bitmap, 0xff, sizeof(heap_page_bitmap));
+    return;
+  }
+  for (uintptr_t page = first; page <= last; page++) {
+    const size_t bit = page & (kHeapPageBits - 1);
+    heap_page_bitmap[bit / kBitsPerWord] |= uintptr_t{1} << (bit % kBitsPerWord);
+  }
+}
+
+static void BuildHeapPageBitmapLocked() {
+  RAW_DCHECK(heap_checker_lock.IsHeld(), "");
+  memset(heap_page_bitmap, 0, sizeof(heap_page_bitmap));
+  heap_profile->IterateAllocs(AddToHeapPageBitmapCallback);
+}
+
+//----------------------------------------------------------------------
+
 // We've seen reports that strstr causes heap-checker crashes in some
 // libc's (?):
 //    https://github.com/gperftools/gperftools/issues/265
@@ -1004,6 +1138,229 @@ static enum {
   CALLBACK_COMPLETED,
 } thread_listing_status = CALLBACK_NOT_STARTED;
 
+//----------------------------------------------------------------------
+// Checking in a forked child
+//----------------------------------------------------------------------
+
+// With FLAGS_heap_check_fork IgnoreLiveThreadsLocked forks a child as
+// soon as registers and stacks of all threads are captured. The child
+// finds live objects in its copy-on-write image of the process and
+// sends back all objects that are not live, while in the parent
+// threads are resumed and can use the heap until the answer arrives.
+// Objects found to be not live can't be freed meanwhile, as nothing
+// could reach them to free them, so the answer stays good for the
+// parent's heap_profile.
+
+// The child sends this, followed by 'leaks' ForkedCheckLeak-s.
+struct ForkedCheckHeader {
+  int64_t live_objects;
+  int64_t live_bytes;
+  uint64_t leaks;
+};
+
+struct ForkedCheckLeak {
+  uintptr_t ptr;
+  size_t size;
+
+  bool operator<(const ForkedCheckLeak& other) const {
+    return ptr < other.ptr;
+  }
+};
+
+// Set when a forked check failed; all later checks are in-process.
+static bool fork_check_failed = false;
+// Set when the current check released heap_checker_lock to wait for
+// a forked child, so other threads could use the heap meanwhile.
+static bool fork_check_waited = false;
+// True in the child of a forked check.
+static bool in_fork_check_child = false;
+// Pipe for the next forked check. It's made before threads are listed,
+// as TCMalloc_ListAllProcessThreads may close descriptor numbers it
+// has used while its callback runs.
+static int fork_check_pipe[2] = { -1, -1 };
+// Child doing the current forked check (in the parent), and our end of
+// the pipe to it.
+static pid_t fork_check_pid = 0;
+static int fork_check_fd = -1;
+
+static bool ForkCheckReadFully(int fd, void* buf, size_t size) {
+  char* p = static_cast<char*>(buf);
+  while (size > 0) {
+    ssize_t rv = read(fd, p, size);
+    if (rv < 0 && errno == EINTR) {
+      continue;
+    }
+    if (rv <= 0) {
+      return false;
+    }
+    p += rv;
+    size -= rv;
+  }
+  return true;
+}
+
+static bool ForkCheckWriteFully(int fd, const void* buf, size_t size) {
+  const char* p = static_cast<const char*>(buf);
+  while (size > 0) {
+    ssize_t rv = write(fd, p, size);
+    if (rv < 0 && errno == EINTR) {
+      continue;
+    }
+    if (rv <= 0) {
+      return false;
+    }
+    p += rv;
+    size -= rv;
+  }
+  return true;
+}
+
+// Starts the child of a forked check. Returns true in the parent if the
+// child got started, and false in the child and if we failed to fork.
+static bool StartForkedCheckLocked() {
+  RAW_DCHECK(heap_checker_lock.IsHeld(), "");
+  const int fds[2] = { fork_check_pipe[0], fork_check_pipe[1] };
+  if (fds[0] < 0) {
+    return false;
+  }
+  fork_check_pipe[0] = fork_check_pipe[1] = -1;
+  // We normally run in TCMalloc_ListAllProcessThreads' helper, which
+  // isn't around when we wait for the child, so make the child ours
+  // instead. Exit signal is 0 not to disturb SIGCHLD handlers, and we
+  // fork with a raw syscall so that no atfork handlers run while
+  // threads are stopped.
+  const int flags = getpid() != self_thread_pid ? CLONE_PARENT : 0;
+#if defined(__s390__)
+  const pid_t pid = syscall(SYS_clone, 0, flags);
+#else
+  const pid_t pid = syscall(SYS_clone, flags, 0, 0, 0, 0);
+#endif
+  if (pid < 0) {
+    RAW_LOG(WARNING, "Could not fork for leak check: errno=%d", errno);
+    close(fds[0]);
+    close(fds[1]);
+    return false;
+  }
+  if (pid == 0) {
+    close(fds[0]);
+    in_fork_check_child = true;
+    fork_check_fd = fds[1];
+    return false;
+  }
+  close(fds[1]);
+  fork_check_pid = pid;
+  fork_check_fd = fds[0];
+  return true;
+}
+
+static uint64_t fork_check_leak_count;
+static ForkedCheckLeak fork_check_buffer[256];
+static size_t fork_check_buffered;
+static bool fork_check_write_ok;
+
+static void CountNonLiveCallback(const void* ptr,
+                                 const HeapProfileTable::AllocInfo& info) {
+  if (!info.live) fork_check_leak_count++;
+}
+
+static void SendNonLiveCallback(const void* ptr,
+                                const HeapProfileTable::AllocInfo& info) {
+  if (info.live) return;
+  fork_check_buffer[fork_check_buffered].ptr = AsInt(ptr);
+  fork_check_buffer[fork_check_buffered].size = info.object_size;
+  if (++fork_check_buffered == arraysize(fork_check_buffer)) {
+    fork_check_write_ok = fork_check_write_ok &&
+      ForkCheckWriteFully(fork_check_fd, fork_check_buffer,
+                          sizeof(fork_check_buffer));
+    fork_check_buffered = 0;
+  }
+}
+
+// Called in the child once live objects are known.
+[[noreturn]] static void FinishForkedCheckChildLocked() {
+  RAW_DCHECK(in_fork_check_child, "");
+  if (FLAGS_heap_check_fork_test_failure) {
+    _exit(1);
+  }
+  fork_check_leak_count = 0;
+  heap_profile->IterateAllocs(CountNonLiveCallback);
+  ForkedCheckHeader header;
+  header.live_objects = live_objects_total;
+  header.live_bytes = live_bytes_total;
+  header.leaks = fork_check_leak_count;
+  fork_check_buffered = 0;
+  fork_check_write_ok =
+    ForkCheckWriteFully(fork_check_fd, &header, sizeof(header));
+  heap_profile->IterateAllocs(SendNonLiveCallback);
+  fork_check_write_ok = fork_check_write_ok &&
+    ForkCheckWriteFully(fork_check_fd, fork_check_buffer,
+                        sizeof(fork_check_buffer[0]) * fork_check_buffered);
+  _exit(fork_check_write_ok ? 0 : 1);
+}
+
+static const ForkedCheckLeak* fork_check_leaks;
+static const ForkedCheckLeak* fork_check_leaks_end;
+
+static void MarkLiveUnlessLeakedCallback(
+    const void* ptr, const HeapProfileTable::AllocInfo& info) {
+  ForkedCheckLeak key;
+  key.ptr = AsInt(ptr);
+  const ForkedCheckLeak* leak =
+    std::lower_bound(fork_check_leaks, fork_check_leaks_end, key);
+  if (leak != fork_check_leaks_end  &&  leak->ptr == key.ptr  &&
+      leak->size == info.object_size) {
+    return;
+  }
+  heap_profile->MarkAsLive(ptr);
+}
+
+// Waits for the child of a forked check and marks as live all objects
+// it did not report. Returns false if the child failed.
+static bool FinishForkedCheckLocked() {
+  RAW_DCHECK(heap_checker_lock.IsHeld(), "");
+  const pid_t pid = fork_check_pid;
+  const int fd = fork_check_fd;
+  fork_check_pid = 0;
+  fork_check_fd = -1;
+  fork_check_waited = true;
+
+  // The child needs nothing from us, so let other threads use the heap
+  // while it works.
+  MemoryRegionMap::Unlock();
+  heap_checker_lock.Unlock();
+  ForkedCheckHeader header;
+  bool ok = ForkCheckReadFully(fd, &header, sizeof(header));
+  heap_checker_lock.Lock();
+  MemoryRegionMap::Lock();
+
+  ForkedCheckLeak* leaks = NULL;
+  if (ok  &&  header.leaks > 0) {
+    leaks = static_cast<ForkedCheckLeak*>(
+      HeapLeakChecker::Allocator::Allocate(sizeof(*leaks) * header.leaks));
+    ok = ForkCheckReadFully(fd, leaks, sizeof(*leaks) * header.leaks);
+  }
+  close(fd);
+  int status;
+  pid_t rv;
+  do {
+    rv = waitpid(pid, &status, __WALL);
+  } while (rv < 0  &&  errno == EINTR);
+  if (rv != pid  ||  !WIFEXITED(status)  ||  WEXITSTATUS(status) != 0) {
+    ok = false;
+  }
+
+  if (ok) {
+    std::sort(leaks, leaks + header.leaks);
+    fork_check_leaks = leaks;
+    fork_check_leaks_end = leaks + header.leaks;
+    heap_profile->IterateAllocs(MarkLiveUnlessLeakedCallback);
+    live_objects_total = header.live_objects;
+    live_bytes_total = header.live_bytes;
+  }
+  HeapLeakChecker::Allocator::Free(leaks);
+  return ok;
+}
+
 // Ideally to avoid deadlocks this function should not result in any libc
 // or other function calls that might need to lock a mutex:
 // It is called when all threads of a process are stopped
@@ -1048,6 +1405,12 @@ static enum {
     if (thread_pids[i] == self_thread_pid) {
       continue;
     }
+    // marking helpers only ever hold pointers to objects they've
+    // already marked live:
+    if (std::find(mark_helper_tids, mark_helper_tids + num_mark_helpers,
+                  thread_pids[i]) != mark_helper_tids + num_mark_helpers) {
+      continue;
+    }
     RAW_VLOG(11, "Handling thread with pid %d", thread_pids[i]);
     auto add_reg = [&thread_registers] (void *reg) {
       RAW_VLOG(12, "Thread register %p", reg);
@@ -1062,6 +1425,16 @@ static enum {
       failures += 1;
     }
   }
+  // Everything below happens in the child of a forked check, so
+  // threads can go on right away.
+  if (FLAGS_heap_check_fork  &&  !fork_check_failed  &&
+      StartForkedCheckLocked()) {
+    TCMalloc_ResumeAllProcessThreads(num_threads, thread_pids);
+    thread_listing_status = CALLBACK_COMPLETED;
+    return failures;
+  }
+  // Marking helpers have to run to do their share of the work below.
+  TCMalloc_ResumeAllProcessThreads(num_mark_helpers, mark_helper_tids);
   // Use all the collected thread (stack) liveness sources:
   IgnoreLiveObjectsLocked("threads stack data", "");
   if (thread_registers.size()) {
@@ -1076,6 +1449,9 @@ static enum {
   }
   // Do all other liveness walking while all threads are stopped:
   IgnoreNonThreadLiveObjectsLocked();
+  if (in_fork_check_child) {
+    FinishForkedCheckChildLocked();
+  }
   // Can now resume the threads:
   TCMalloc_ResumeAllProcessThreads(num_threads, thread_pids);
   thread_listing_status = CALLBACK_COMPLETED;
@@ -1236,17 +1612,18 @@ void HeapLeakChecker::IgnoreNonThreadLiveObjectsLocked() {
 }
 
 // Callback for TCMalloc_ListAllProcessThreads in IgnoreAllLiveObjectsLocked below
-// to test/verify that we have just the one main thread, in which case
-// we can do everything in that main thread,
+// to test/verify that we have just the one main thread (and our marking
+// helpers), in which case we can do everything in that main thread,
 // so that CPU profiler can collect all its samples.
-// Returns the number of threads in the process.
+// Returns the number of threads in the process other than marking helpers.
 static int IsOneThread(void* parameter, int num_threads,
                        pid_t* thread_pids, va_list ap) {
+  TCMalloc_ResumeAllProcessThreads(num_threads, thread_pids);
+  num_threads -= num_mark_helpers;
   if (num_threads != 1) {
     RAW_LOG(WARNING, "Have threads: Won't CPU-profile the bulk of leak "
                      "checking work happening in IgnoreLiveThreadsLocked!");
   }
-  TCMalloc_ResumeAllProcessThreads(num_threads, thread_pids);
   return num_threads;
 }
 
@@ -1261,6 +1638,11 @@ void HeapLeakChecker::IgnoreAllLiveObjectsLocked(const void* self_stack_top) {
   live_objects = new(Allocator::Allocate(sizeof(LiveObjectsStack)))
                    LiveObjectsStack;
   stack_tops = new(Allocator::Allocate(sizeof(StackTopSet))) StackTopSet;
+  if (num_mark_helpers > 0) {
+    MarkAllocator::Init();
+    mark_pool = new(MarkAllocator::Allocate(sizeof(MarkStack))) MarkStack;
+  }
+  BuildHeapPageBitmapLocked();
   // reset the counts
   live_objects_total = 0;
   live_bytes_total = 0;
@@ -1274,12 +1656,20 @@ void HeapLeakChecker::IgnoreAllLiveObjectsLocked(const void* self_stack_top) {
     FLAGS_heap_check_max_pointer_offset != -1
     ? min(size_t(FLAGS_heap_check_max_pointer_offset), max_heap_object_size)
     : max_heap_object_size);
+  // Heap can't change until we are done, so index it for lookups.
+  heap_profile->BuildIndex();
   // Record global data as live:
   if (FLAGS_heap_check_ignore_global_live) {
     library_live_objects =
       new(Allocator::Allocate(sizeof(LibraryLiveObjectsStacks)))
         LibraryLiveObjectsStacks;
   }
+  if (FLAGS_heap_check_fork  &&  !fork_check_failed  &&
+      pipe2(fork_check_pipe, O_CLOEXEC) != 0) {
+    RAW_LOG(WARNING, "Could not create pipe for forked leak check: errno=%d",
+            errno);
+    fork_check_pipe[0] = fork_check_pipe[1] = -1;
+  }
   // Ignore all thread stacks:
   thread_listing_status = CALLBACK_NOT_STARTED;
   bool need_to_ignore_non_thread_objects = true;
@@ -1341,14 +1731,33 @@ void HeapLeakChecker::IgnoreAllLiveObjectsLocked(const void* self_stack_top) {
     }
     IgnoreNonThreadLiveObjectsLocked();
   }
-  if (live_objects_total) {
-    RAW_VLOG(10, "Ignoring %" PRId64 " reachable objects of %" PRId64 " bytes",
-                live_objects_total, live_bytes_total);
-  }
   // Free these: we made them here and heap_profile never saw them
   Allocator::DeleteAndNull(&live_objects);
   Allocator::DeleteAndNull(&stack_tops);
+  if (mark_pool != NULL) {
+    mark_pool->~MarkStack();
+    MarkAllocator::Free(mark_pool, sizeof(MarkStack));
+    mark_pool = NULL;
+    MarkAllocator::Shutdown();
+  }
   max_heap_object_size = old_max_heap_object_size;  // reset this var
+  heap_profile->ReleaseIndex();
+  if (fork_check_pipe[0] >= 0) {  // no child got forked
+    close(fork_check_pipe[0]);
+    close(fork_check_pipe[1]);
+    fork_check_pipe[0] = fork_check_pipe[1] = -1;
+  }
+  if (fork_check_pid != 0  &&  !FinishForkedCheckLocked()) {
+    RAW_LOG(WARNING, "Forked leak check failed; "
+                     "checking in this process from now on");
+    fork_check_failed = true;
+    IgnoreAllLiveObjectsLocked(self_stack_top);
+    return;
+  }
+  if (live_objects_total) {
+    RAW_VLOG(10, "Ignoring %" PRId64 " reachable objects of %" PRId64 " bytes",
+                live_objects_total, live_bytes_total);
+  }
 }
 
 // Alignment at which we should consider pointer positions
@@ -1359,6 +1768,96 @@ static size_t pointer_source_alignment = kPointerSourceAlignment;
 // to protect pointer_source_alignment.
 static SpinLock alignment_checker_lock;
 
+// Same as HeapLeakChecker::HaveOnHeapLocked. Marking threads other than
+// the one holding heap_checker_lock use it too.
+static inline bool HaveOnHeap(const void** ptr, size_t* object_size) {
+  const uintptr_t addr = AsInt(*ptr);
+  if (heap_profile->FindInsideAlloc(
+        *ptr, max_heap_object_size, ptr, object_size)) {
+    RAW_VLOG(16, "Got pointer into %p at +%" PRIuPTR " offset",
+             *ptr, addr - AsInt(*ptr));
+    return true;
+  }
+  return false;
+}
+
+// Number and total size of objects found to be live.
+struct LiveCounts {
+  int64_t objects;
+  int64_t bytes;
+};
+
+// Large memory ranges are scanned in chunks of this size when marking
+// in parallel, so that several threads can work on one range.
+static const size_t kMarkChunkSize = 64 << 10;
+
+// Aligned words are range-checked a block (a cache line on 64-bit
+// systems) at a time, without branches. This avoids mispredictions
+// when candidates are dense, and compilers vectorize it where that
+// pays off. The scan is otherwise memory bound, so most of the win
+// comes from heap_page_bitmap cutting down HaveOnHeap lookups.
+static const int kScanBlockWords = 8;
+static const size_t kScanBlockBytes = kScanBlockWords * sizeof(uintptr_t);
+
+// Returns mask with bit i set iff i-th word of the block at 'p' is in
+// [lo, lo + span]. Unsigned wrap-around turns the range check into one
+// comparison.
+static inline unsigned CandidateMask(const char* p,
+                                     uintptr_t lo, uintptr_t span) {
+  unsigned mask = 0;
+  for (int i = 0; i < kScanBlockWords; i++) {
+    uintptr_t word;
+    memcpy(&word, p + i * sizeof(word), sizeof(word));
+    mask |= unsigned(word - lo <= span) << i;
+  }
+  return mask;
+}
+
+// Marks heap object 'addr' (read from 'at' inside of 'whole_object')
+// points to as live, unless it already is, and pushes it onto 'stack'.
+// 'addr' has to be within [min_heap_address, max_heap_address].
+template <class Stack>
+static inline void MarkIfHeapPointer(const char* at, uintptr_t addr,
+                                     const char* whole_object,
+                                     size_t whole_size,
+                                     Stack* stack, LiveCounts* counts) {
+  if (!MaybeOnHeapPage(addr)) return;
+  const void* ptr = reinterpret_cast<const void*>(addr);
+  // Too expensive (inner loop): manually uncomment when debugging:
+  // RAW_VLOG(17, "Trying pointer to %p at %p", ptr, at);
+  size_t object_size;
+  if (HaveOnHeap(&ptr, &object_size)  &&
+      heap_profile->MarkAsLive(ptr)) {
+    // We take the (hopefully low) risk here of encountering by accident
+    // a byte sequence in memory that matches an address of
+    // a heap object which is in fact leaked.
+    // I.e. in very rare and probably not repeatable/lasting cases
+    // we might miss some real heap memory leaks.
+    RAW_VLOG(14, "Found pointer to %p of %zu bytes at %p "
+                "inside %p of size %zu",
+                ptr, object_size, at, whole_object, whole_size);
+    if (VLOG_IS_ON(15)) {
+      // log call stacks to help debug how come something is not a leak
+      HeapProfileTable::AllocInfo alloc;
+      if (!heap_profile->FindAllocDetails(ptr, &alloc)) {
+        RAW_LOG(FATAL, "FindAllocDetails failed on ptr %p", ptr);
+      }
+      RAW_LOG(INFO, "New live %p object's alloc stack:", ptr);
+      for (int i = 0; i < alloc.stack_depth; ++i) {
+        RAW_LOG(INFO, "  @ %p", alloc.call_stack[i]);
+      }
+    }
+    counts->objects += 1;
+    counts->bytes += object_size;
+    stack->push_back(AllocObject(ptr, object_size, IGNORED_ON_HEAP));
+  }
+}
+
+// Scans 'obj' for pointers to heap objects that are not live yet,
+// marks them live and pushes them onto 'stack' to be scanned in turn.
+// With 'split' set, ranges larger than kMarkChunkSize are cut into
+// chunks that are pushed onto 'stack' too.
+//
 // This function changes the live bits in the heap_profile-table's state:
 // we only record the live objects to be skipped.
 //
@@ -1386,118 +1885,345 @@ static SpinLock alignment_checker_lock;
 // we slightly increase the chance to mistake random memory bytes
 // for a pointer and miss a leak in a particular run of a binary.
 //
-/*static*/ void HeapLeakChecker::IgnoreLiveObjectsLocked(const char* name,
-                                                         const char* name2) {
-  RAW_DCHECK(heap_checker_lock.IsHeld(), "");
-  int64_t live_object_count = 0;
-  int64_t live_byte_count = 0;
-  while (!live_objects->empty()) {
-    const char* object =
-      reinterpret_cast<const char*>(live_objects->back().ptr);
-    size_t size = live_objects->back().size;
-    const ObjectPlacement place = live_objects->back().place;
-    live_objects->pop_back();
-    if (place == MUST_BE_ON_HEAP  &&  heap_profile->MarkAsLive(object)) {
-      live_object_count += 1;
-      live_byte_count += size;
+template <class Stack>
+static void ScanLiveObject(const AllocObject& obj, const char* name2,
+                           bool split, Stack* stack, LiveCounts* counts) {
+  const char* object = reinterpret_cast<const char*>(obj.ptr);
+  size_t size = obj.size;
+  if (obj.place == MUST_BE_ON_HEAP  &&  heap_profile->MarkAsLive(object)) {
+    counts->objects += 1;
+    counts->bytes += size;
+  }
+  RAW_VLOG(13, "Looking for heap pointers in %p of %zu bytes",
+              object, size);
+  const char* const whole_object = object;
+  size_t const whole_size = size;
+  // Try interpretting any byte sequence in object,size as a heap pointer:
+  const size_t remainder = AsInt(object) % pointer_source_alignment;
+  if (remainder) {
+    object += pointer_source_alignment - remainder;
+    if (size >= pointer_source_alignment - remainder) {
+      size -= pointer_source_alignment - remainder;
+    } else {
+      size = 0;
     }
-    RAW_VLOG(13, "Looking for heap pointers in %p of %zu bytes",
-                object, size);
-    const char* const whole_object = object;
-    size_t const whole_size = size;
-    // Try interpretting any byte sequence in object,size as a heap pointer:
-    const size_t remainder = AsInt(object) % pointer_source_alignment;
-    if (remainder) {
-      object += pointer_source_alignment - remainder;
-      if (size >= pointer_source_alignment - remainder) {
-        size -= pointer_source_alignment - remainder;
-      } else {
-        size = 0;
+  }
+  if (size < sizeof(void*)) return;
+
+  // Frame pointer omission requires us to use libunwind, which uses direct
+  // mmap and munmap system calls, and that needs special handling.
+  if (name2 == kUnnamedProcSelfMapEntry) {
+    static const uintptr_t page_mask = ~(getpagesize() - 1);
+    const uintptr_t addr = reinterpret_cast<uintptr_t>(object);
+    if ((addr & page_mask) == 0 && (size & page_mask) == 0) {
+      // This is an object we slurped from /proc/self/maps.
+      // It may or may not be readable at this point.
+      //
+      // In case all the above conditions made a mistake, and the object is
+      // not related to libunwind, we also verify that it's not readable
+      // before ignoring it.
+      if (msync(const_cast<char*>(object), size, MS_ASYNC) != 0) {
+        // Skip unreadable object, so we don't crash trying to sweep it.
+        RAW_VLOG(0, "Ignoring inaccessible object [%p, %p) "
+                 "(msync error %d (%s))",
+                 object, object + size, errno, tcmalloc::SafeStrError(errno).c_str());
+        return;
       }
     }
-    if (size < sizeof(void*)) continue;
-
-    // Frame pointer omission requires us to use libunwind, which uses direct
-    // mmap and munmap system calls, and that needs special handling.
-    if (name2 == kUnnamedProcSelfMapEntry) {
-      static const uintptr_t page_mask = ~(getpagesize() - 1);
-      const uintptr_t addr = reinterpret_cast<uintptr_t>(object);
-      if ((addr & page_mask) == 0 && (size & page_mask) == 0) {
-        // This is an object we slurped from /proc/self/maps.
-        // It may or may not be readable at this point.
-        //
-        // In case all the above conditions made a mistake, and the object is
-        // not related to libunwind, we also verify that it's not readable
-        // before ignoring it.
-        if (msync(const_cast<char*>(object), size, MS_ASYNC) != 0) {
-          // Skip unreadable object, so we don't crash trying to sweep it.
-          RAW_VLOG(0, "Ignoring inaccessible object [%p, %p) "
-                   "(msync error %d (%s))",
-                   object, object + size, errno, tcmalloc::SafeStrError(errno).c_str());
-          continue;
-        }
+  }
+
+  if (split  &&  size > kMarkChunkSize + sizeof(void*)) {
+    // Chunks overlap by sizeof(void*) - 1 bytes, so that words
+    // crossing chunk boundaries are looked at too.
+    const ObjectPlacement place =
+      obj.place == MUST_BE_ON_HEAP ? IGNORED_ON_HEAP : obj.place;
+    for (size_t offset = kMarkChunkSize; offset < size;
+         offset += kMarkChunkSize) {
+      stack->push_back(AllocObject(object + offset,
+                                   min(size - offset,
+                                       kMarkChunkSize + sizeof(void*) - 1),
+                                   place));
+    }
+    size = kMarkChunkSize + sizeof(void*) - 1;
+  }
+
+  const char* const max_object = object + size - sizeof(void*);
+  if (pointer_source_alignment == sizeof(void*)) {
+    // Common case of aligned words: filter whole blocks of them at once.
+    const uintptr_t span = max_heap_address - min_heap_address;
+    while (object + kScanBlockBytes - sizeof(void*) <= max_object) {
+      unsigned mask = CandidateMask(object, min_heap_address, span);
+      while (mask != 0) {
+        const char* at = object + __builtin_ctz(mask) * sizeof(void*);
+        mask &= mask - 1;
+        MarkIfHeapPointer(at, *reinterpret_cast<const uintptr_t*>(at),
+                          whole_object, whole_size, stack, counts);
       }
+      object += kScanBlockBytes;
     }
-
-    const char* const max_object = object + size - sizeof(void*);
-    while (object <= max_object) {
-      // potentially unaligned load:
-      const uintptr_t addr = *reinterpret_cast<const uintptr_t*>(object);
-      // Do fast check before the more expensive HaveOnHeapLocked lookup:
-      // this code runs for all memory words that are potentially pointers:
-      const bool can_be_on_heap =
-        // Order tests by the likelyhood of the test failing in 64/32 bit modes.
-        // Yes, this matters: we either lose 5..6% speed in 32 bit mode
-        // (which is already slower) or by a factor of 1.5..1.91 in 64 bit mode.
-        // After the alignment test got dropped the above performance figures
-        // must have changed; might need to revisit this.
+  }
+  while (object <= max_object) {
+    // potentially unaligned load:
+    const uintptr_t addr = *reinterpret_cast<const uintptr_t*>(object);
+    // Do fast check before the more expensive HaveOnHeap lookup:
+    // this code runs for all memory words that are potentially pointers:
+    const bool can_be_on_heap =
+      // Order tests by the likelyhood of the test failing in 64/32 bit modes.
+      // Yes, this matters: we either lose 5..6% speed in 32 bit mode
+      // (which is already slower) or by a factor of 1.5..1.91 in 64 bit mode.
+      // After the alignment test got dropped the above performance figures
+      // must have changed; might need to revisit this.
 #if defined(__x86_64__)
-        addr <= max_heap_address  &&  // <= is for 0-sized object with max addr
-        min_heap_address <= addr;
+      addr <= max_heap_address  &&  // <= is for 0-sized object with max addr
+      min_heap_address <= addr;
 #else
-        min_heap_address <= addr  &&
-        addr <= max_heap_address;  // <= is for 0-sized object with max addr
+      min_heap_address <= addr  &&
+      addr <= max_heap_address;  // <= is for 0-sized object with max addr
 #endif
-      if (can_be_on_heap) {
-        const void* ptr = reinterpret_cast<const void*>(addr);
-        // Too expensive (inner loop): manually uncomment when debugging:
-        // RAW_VLOG(17, "Trying pointer to %p at %p", ptr, object);
-        size_t object_size;
-        if (HaveOnHeapLocked(&ptr, &object_size)  &&
-            heap_profile->MarkAsLive(ptr)) {
-          // We take the (hopefully low) risk here of encountering by accident
-          // a byte sequence in memory that matches an address of
-          // a heap object which is in fact leaked.
-          // I.e. in very rare and probably not repeatable/lasting cases
-          // we might miss some real heap memory leaks.
-          RAW_VLOG(14, "Found pointer to %p of %zu bytes at %p "
-                      "inside %p of size %zu",
-                      ptr, object_size, object, whole_object, whole_size);
-          if (VLOG_IS_ON(15)) {
-            // log call stacks to help debug how come something is not a leak
-            HeapProfileTable::AllocInfo alloc;
-            if (!heap_profile->FindAllocDetails(ptr, &alloc)) {
-              RAW_LOG(FATAL, "FindAllocDetails failed on ptr %p", ptr);
-            }
-            RAW_LOG(INFO, "New live %p object's alloc stack:", ptr);
-            for (int i = 0; i < alloc.stack_depth; ++i) {
-              RAW_LOG(INFO, "  @ %p", alloc.call_stack[i]);
-            }
-          }
-          live_object_count += 1;
-          live_byte_count += object_size;
-          live_objects->push_back(AllocObject(ptr, object_size,
-                                              IGNORED_ON_HEAP));
+    if (can_be_on_heap) {
+      MarkIfHeapPointer(object, addr, whole_object, whole_size, stack, counts);
+    }
+    object += pointer_source_alignment;
+  }
+}
+
+//----------------------------------------------------------------------
+// Parallel marking
+//----------------------------------------------------------------------
+
+// Every IgnoreLiveObjectsLocked call with helpers running is a marking
+// phase. Helpers sleep on mark_phase between phases; bumping it starts
+// a phase, and -1 tells them to exit. The checking thread waits for
+// mark_helpers_busy to drop to zero at the end of a phase.
+//
+// Note that when threads are stopped, the checking thread is the
+// TCMalloc_ListAllProcessThreads's lister, which isn't a real pthread,
+// so we use futexes directly rather than pthread primitives.
+static std::atomic<int> mark_phase;
+static std::atomic<int> mark_helpers_busy;
+static const char* mark_name2;  // name2 of the current phase
+
+// Termination of a phase: it is over when mark_pool is empty and every
+// participant is idle, i.e. waits for work.
+static int mark_participants;
+static std::atomic<int> mark_idle;
+static bool mark_done;  // GUARDED_BY(mark_pool_lock)
+
+// Marking work is taken from mark_pool (and given back to it) in
+// batches of this many objects.
+static const size_t kMarkBatch = 32;
+
+struct MarkHelper {
+  pthread_t thread;
+  std::atomic<pid_t> tid;
+  LiveCounts counts;  // of the latest phase
+};
+static MarkHelper mark_helpers[kMaxMarkThreads];
+
+static void MarkFutexWait(std::atomic<int>* w, int value) {
+  syscall(SYS_futex, reinterpret_cast<int*>(w), FUTEX_WAIT, value,
+          NULL, NULL, 0);
+}
+
+static void MarkFutexWakeAll(std::atomic<int>* w) {
+  syscall(SYS_futex, reinterpret_cast<int*>(w), FUTEX_WAKE, INT_MAX,
+          NULL, NULL, 0);
+}
+
+// Moves a batch of work from mark_pool to 'local'. Returns false when
+// the phase is over.
+static bool TakeMarkWork(MarkStack* local, bool* idle) {
+  for (;;) {
+    {
+      SpinLockHolder l(&mark_pool_lock);
+      if (!mark_pool->empty()) {
+        if (*idle) {
+          *idle = false;
+          mark_idle.fetch_sub(1, std::memory_order_relaxed);
+        }
+        const size_t n = min(mark_pool->size(), kMarkBatch);
+        local->insert(local->end(), mark_pool->end() - n, mark_pool->end());
+        mark_pool->erase(mark_pool->end() - n, mark_pool->end());
+        return true;
+      }
+      if (!*idle) {
+        *idle = true;
+        if (mark_idle.fetch_add(1, std::memory_order_relaxed) + 1
+            == mark_participants) {
+          mark_done = true;
         }
       }
-      object += pointer_source_alignment;
+      if (mark_done) {
+        return false;
+      }
+    }
+    sched_yield();
+  }
+}
+
+// Gives the older half of 'local' to idle marking threads.
+static void ShareMarkWork(MarkStack* local) {
+  SpinLockHolder l(&mark_pool_lock);
+  const size_t n = local->size() / 2;
+  mark_pool->insert(mark_pool->end(), local->begin(), local->begin() + n);
+  local->erase(local->begin(), local->begin() + n);
+}
+
+static void MarkLoop(LiveCounts* counts) {
+  MarkStack local;
+  bool idle = false;
+  while (TakeMarkWork(&local, &idle)) {
+    while (!local.empty()) {
+      const AllocObject object = local.back();
+      local.pop_back();
+      ScanLiveObject(object, mark_name2, true, &local, counts);
+      if (local.size() > kMarkBatch  &&
+          mark_idle.load(std::memory_order_relaxed) > 0) {
+        ShareMarkWork(&local);
+      }
+    }
+  }
+}
+
+// Thread stacks are scanned as live data (glibc caches them after
+// threads exit, and regions made by ld.so are global data to us), so a
+// helper must not leave pointers it came across in one check for later
+// checks to find. Marking takes much less stack than this.
+static void ATTRIBUTE_NOINLINE WipeMarkHelperStack() {
+  char buf[32 << 10];
+  memset(buf, 0, sizeof(buf));
+  // keep the compiler from dropping the memset
+  __asm__ __volatile__("" : : "r"(buf) : "memory");
+}
+
+static void* MarkHelperMain(void* arg) {
+  MarkHelper* self = static_cast<MarkHelper*>(arg);
+  // Signals are for the threads doing real work.
+  sigset_t all;
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, NULL);
+  self->tid.store(syscall(SYS_gettid), std::memory_order_release);
+
+  int seen = 0;
+  for (;;) {
+    const int phase = mark_phase.load(std::memory_order_acquire);
+    if (phase < 0) {
+      WipeMarkHelperStack();
+      return NULL;
+    }
+    if (phase == seen) {
+      MarkFutexWait(&mark_phase, phase);
+      continue;
+    }
+    seen = phase;
+    self->counts = LiveCounts{0, 0};
+    MarkLoop(&self->counts);
+    if (mark_helpers_busy.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      MarkFutexWakeAll(&mark_helpers_busy);
+    }
+  }
+}
+
+// Finds everything reachable from live_objects using the calling thread
+// and all marking helpers.
+static void MarkInParallel(const char* name2, LiveCounts* counts) {
+  {
+    SpinLockHolder l(&mark_pool_lock);
+    mark_pool->assign(live_objects->begin(), live_objects->end());
+    mark_done = false;
+  }
+  live_objects->clear();
+  mark_name2 = name2;
+  mark_participants = num_mark_helpers + 1;
+  mark_idle.store(0, std::memory_order_relaxed);
+  mark_helpers_busy.store(num_mark_helpers, std::memory_order_relaxed);
+  mark_phase.fetch_add(1, std::memory_order_release);
+  MarkFutexWakeAll(&mark_phase);
+
+  MarkLoop(counts);
+
+  int busy;
+  while ((busy = mark_helpers_busy.load(std::memory_order_acquire)) != 0) {
+    MarkFutexWait(&mark_helpers_busy, busy);
+  }
+  for (int i = 0; i < num_mark_helpers; i++) {
+    counts->objects += mark_helpers[i].counts.objects;
+    counts->bytes += mark_helpers[i].counts.bytes;
+  }
+}
+
+// Starts FLAGS_heap_check_threads - 1 marking helpers. Thread creation
+// allocates memory, so it has to happen before heap_checker_lock is
+// taken.
+static void StartMarkHelpers() {
+  RAW_DCHECK(num_mark_helpers == 0, "");
+  const int want = min<int>(FLAGS_heap_check_threads, kMaxMarkThreads) - 1;
+  // Forked checks mark in the child, which has no other threads.
+  if (want <= 0  ||  (FLAGS_heap_check_fork  &&  !fork_check_failed)) {
+    return;
+  }
+  // What thread creation allocates is not a leak.
+  HeapLeakChecker::Disabler disabler;
+  mark_phase.store(0, std::memory_order_relaxed);
+  int started = 0;
+  while (started < want) {
+    MarkHelper* h = &mark_helpers[started];
+    h->tid.store(0, std::memory_order_relaxed);
+    if (pthread_create(&h->thread, NULL, MarkHelperMain, h) != 0) {
+      RAW_LOG(WARNING, "Started only %d of %d leak checking helper threads",
+              started, want);
+      break;
+    }
+    started++;
+  }
+  for (int i = 0; i < started; i++) {
+    pid_t tid;
+    while ((tid = mark_helpers[i].tid.load(std::memory_order_acquire)) == 0) {
+      sched_yield();
     }
+    mark_helper_tids[i] = tid;
+  }
+  num_mark_helpers = started;
+}
+
+static void StopMarkHelpers() {
+  if (num_mark_helpers == 0) {
+    return;
   }
-  live_objects_total += live_object_count;
-  live_bytes_total += live_byte_count;
-  if (live_object_count) {
+  mark_phase.store(-1, std::memory_order_release);
+  MarkFutexWakeAll(&mark_phase);
+  for (int i = 0; i < num_mark_helpers; i++) {
+    pthread_join(mark_helpers[i].thread, NULL);
+  }
+  num_mark_helpers = 0;
+}
+
+// Keeps marking helpers running for its lifetime, unless stopped
+// earlier.
+class MarkHelpersHolder {
+ public:
+  MarkHelpersHolder() { StartMarkHelpers(); }
+  ~MarkHelpersHolder() { StopMarkHelpers(); }
+};
+
+/*static*/ void HeapLeakChecker::IgnoreLiveObjectsLocked(const char* name,
+                                                         const char* name2) {
+  RAW_DCHECK(heap_checker_lock.IsHeld(), "");
+  LiveCounts counts = {0, 0};
+  if (num_mark_helpers > 0) {
+    MarkInParallel(name2, &counts);
+  } else {
+    while (!live_objects->empty()) {
+      const AllocObject object = live_objects->back();
+      live_objects->pop_back();
+      ScanLiveObject(object, name2, false, live_objects, &counts);
+    }
+  }
+  live_objects_total += counts.objects;
+  live_bytes_total += counts.bytes;
+  if (counts.objects) {
     RAW_VLOG(10, "Removed %" PRId64 " live heap objects of %" PRId64 " bytes: %s%s",
-                live_object_count, live_byte_count, name, name2);
+                counts.objects, counts.bytes, name, name2);
   }
 }
 
@@ -1724,6 +2450,7 @@ bool HeapLeakChecker::DoNoLeaks(ShouldSymbolize should_symbolize) {
   HeapProfileTable::Snapshot* leaks = NULL;
   char* pprof_file = NULL;
 
+  MarkHelpersHolder mark_helpers_holder;
   {
     // Heap activity in other threads is paused during this function
     // (i.e. until we got all profile difference info).
@@ -1747,6 +2474,7 @@ bool HeapLeakChecker::DoNoLeaks(ShouldSymbolize should_symbolize) {
     // Keep track of number of internally allocated objects so we
     // can detect leaks in the heap-leak-checket itself
     const int initial_allocs = Allocator::alloc_count();
+    fork_check_waited = false;
 
     if (name_ == NULL) {
       RAW_LOG(FATAL, "Heap leak checker must not be turned on "
@@ -1773,8 +2501,9 @@ bool HeapLeakChecker::DoNoLeaks(ShouldSymbolize should_symbolize) {
       // We can only check for internal leaks along the no-user-leak
       // path since in the leak path we temporarily release
       // heap_checker_lock and another thread can come in and disturb
-      // allocation counts.
-      if (Allocator::alloc_count() != initial_allocs) {
+      // allocation counts. Waiting for a forked check releases it too.
+      if (!fork_check_waited  &&
+          Allocator::alloc_count() != initial_allocs) {
         RAW_LOG(FATAL, "Internal HeapChecker leak of %d objects ; %d -> %d",
                 Allocator::alloc_count() - initial_allocs,
                 initial_allocs, Allocator::alloc_count());
@@ -1808,6 +2537,7 @@ bool HeapLeakChecker::DoNoLeaks(ShouldSymbolize should_symbolize) {
       pprof_file = MakeProfileNameLocked();
     }
   }
+  StopMarkHelpers();
 
   has_checked_ = true;
   if (leaks == NULL) {
@@ -2363,14 +3093,7 @@ inline bool HeapLeakChecker::HaveOnHeapLocked(const void** ptr,
                                               size_t* object_size) {
   // Commented-out because HaveOnHeapLocked is very performance-critical:
   // RAW_DCHECK(heap_checker_lock.IsHeld(), "");
-  const uintptr_t addr = AsInt(*ptr);
-  if (heap_profile->FindInsideAlloc(
-        *ptr, max_heap_object_size, ptr, object_size)) {
-    RAW_VLOG(16, "Got pointer into %p at +%" PRIuPTR " offset",
-             *ptr, addr - AsInt(*ptr));
-    return true;
-  }
-  return false;
+  return HaveOnHeap(ptr, object_size);
 }
 
 // static
@@ -47,6 +47,10 @@
 // bucket_table[i] => HeapProfileBucket() => NULL
 // ...
 // bucket_table[n] => HeapProfileBucket() => NULL
+//
+// Stack traces themselves are kept in tcmalloc::StackInternTable, so
+// buckets of different tables with the same stack trace share it, and
+// buckets are found by comparing stack ids.
 
 #ifndef HEAP_PROFILE_STATS_H_
 #define HEAP_PROFILE_STATS_H_
@@ -70,8 +74,9 @@ struct HeapProfileBucket : public HeapProfileStats {
   static const int kMaxStackDepth = 32;
 
   uintptr_t hash;           // Hash value of the stack trace.
+  uint32_t stack_id;        // Id of the stack trace in StackInternTable.
   int depth;                // Depth of stack trace.
-  const void** stack;       // Stack trace.
+  const void* const* stack; // Stack trace (owned by StackInternTable).
   HeapProfileBucket* next;  // Next entry in hash-table.
 };
 
@@ -66,6 +66,7 @@
 #include "gperftools/malloc_hook.h"
 #include "gperftools/stacktrace.h"
 #include "memory_region_map.h"
+#include "stack_intern_table.h"
 #include "symbolize.h"
 
 using std::sort;
@@ -119,7 +120,8 @@ HeapProfileTable::HeapProfileTable(Allocator alloc,
       profile_mmap_(profile_mmap),
       bucket_table_(NULL),
       num_buckets_(0),
-      address_map_(NULL) {
+      address_map_(NULL),
+      address_index_(NULL) {
   // Make a hash table for buckets.
   const int table_bytes = kHashTableSize * sizeof(*bucket_table_);
   bucket_table_ = static_cast<Bucket**>(alloc_(table_bytes));
@@ -128,6 +130,8 @@ HeapProfileTable::HeapProfileTable(Allocator alloc,
   // Make an allocation map.
   address_map_ =
       new(alloc_(sizeof(AllocationMap))) AllocationMap(alloc_, dealloc_);
+  address_index_ =
+      new(alloc_(sizeof(AllocationIndex))) AllocationIndex(alloc_, dealloc_);
 
   // Initialize.
   memset(&total_, 0, sizeof(total_));
@@ -135,17 +139,20 @@ HeapProfileTable::HeapProfileTable(Allocator alloc,
 }
 
 HeapProfileTable::~HeapProfileTable() {
+  address_index_->~AllocationIndex();
+  dealloc_(address_index_);
+  address_index_ = NULL;
+
   // Free the allocation map.
   address_map_->~AllocationMap();
   dealloc_(address_map_);
   address_map_ = NULL;
 
-  // Free the hash table.
+  // Free the hash table. Stacks are owned by StackInternTable.
   for (int i = 0; i < kHashTableSize; i++) {
     for (Bucket* curr = bucket_table_[i]; curr != 0; /**/) {
       Bucket* bucket = curr;
       curr = curr->next;
-      dealloc_(bucket->stack);
       dealloc_(bucket);
     }
   }
@@ -155,35 +162,23 @@ HeapProfileTable::~HeapProfileTable() {
 
 HeapProfileTable::Bucket* HeapProfileTable::GetBucket(int depth,
                                                       const void* const key[]) {
-  // Make hash-value
-  uintptr_t h = 0;
-  for (int i = 0; i < depth; i++) {
-    h += reinterpret_cast<uintptr_t>(key[i]);
-    h += h << 10;
-    h ^= h >> 6;
-  }
-  h += h << 3;
-  h ^= h >> 11;
+  uintptr_t h = tcmalloc::StackInternTable::Hash(key, depth);
+  uint32_t id = tcmalloc::StackInternTable::Intern(key, depth, h);
 
   // Lookup stack trace in table
   unsigned int buck = ((unsigned int) h) % kHashTableSize;
   for (Bucket* b = bucket_table_[buck]; b != 0; b = b->next) {
-    if ((b->hash == h) &&
-        (b->depth == depth) &&
-        equal(key, key + depth, b->stack)) {
+    if (b->stack_id == id) {
       return b;
     }
   }
 
   // Create new bucket
-  const size_t key_size = sizeof(key[0]) * depth;
-  const void** kcopy = reinterpret_cast<const void**>(alloc_(key_size));
-  copy(key, key + depth, kcopy);
   Bucket* b = reinterpret_cast<Bucket*>(alloc_(sizeof(Bucket)));
   memset(b, 0, sizeof(*b));
   b->hash  = h;
-  b->depth = depth;
-  b->stack = kcopy;
+  b->stack_id = id;
+  b->stack = tcmalloc::StackInternTable::Get(id, &b->depth);
   b->next  = bucket_table_[buck];
   bucket_table_[buck] = b;
   num_buckets_++;
@@ -191,9 +186,9 @@ HeapProfileTable::Bucket* HeapProfileTable::GetBucket(int depth,
 }
 
 int HeapProfileTable::GetCallerStackTrace(
-    int skip_count, void* stack[kMaxStackDepth]) {
+    int skip_count, void* stack[], int max_depth) {
   return MallocHook::GetCallerStackTrace(
-      stack, kMaxStackDepth, kStripFrames + skip_count + 1);
+      stack, max_depth, kStripFrames + skip_count + 1);
 }
 
 void HeapProfileTable::RecordAlloc(
@@ -205,6 +200,7 @@ void HeapProfileTable::RecordAlloc(
   total_.allocs++;
   total_.alloc_size += bytes;
 
+  RAW_DCHECK(!address_index_->built(), "heap changed while indexed");
   AllocValue v;
   v.set_bucket(b);  // also did set_live(false); set_ignore(false)
   v.bytes = bytes;
@@ -212,6 +208,7 @@ void HeapProfileTable::RecordAlloc(
 }
 
 void HeapProfileTable::RecordFree(const void* ptr) {
+  RAW_DCHECK(!address_index_->built(), "heap changed while indexed");
   AllocValue v;
   if (address_map_->FindAndRemove(ptr, &v)) {
     Bucket* b = v.bucket();
@@ -243,19 +240,30 @@ bool HeapProfileTable::FindInsideAlloc(const void* ptr,
                                        size_t max_size,
                                        const void** object_ptr,
                                        size_t* object_size) const {
-  const AllocValue* alloc_value =
-    address_map_->FindInside(&AllocValueSize, max_size, ptr, object_ptr);
+  const AllocValue* alloc_value;
+  if (address_index_->built()) {
+    alloc_value = address_index_->FindInside(max_size, ptr, object_ptr);
+  } else {
+    alloc_value =
+      address_map_->FindInside(&AllocValueSize, max_size, ptr, object_ptr);
+  }
   if (alloc_value != NULL) *object_size = alloc_value->bytes;
   return alloc_value != NULL;
 }
 
+void HeapProfileTable::BuildIndex() {
+  address_index_->Build(*address_map_, &AllocValueSize);
+}
+
+void HeapProfileTable::ReleaseIndex() {
+  address_index_->Clear();
+}
+
 bool HeapProfileTable::MarkAsLive(const void* ptr) {
-  AllocValue* alloc = address_map_->FindMutable(ptr);
-  if (alloc && !alloc->live()) {
-    alloc->set_live(true);
-    return true;
-  }
-  return false;
+  AllocValue* alloc = address_index_->built()
+    ? address_index_->FindMutable(ptr)
+    : address_map_->FindMutable(ptr);
+  return alloc && alloc->try_set_live();
 }
 
 void HeapProfileTable::MarkAsIgnored(const void* ptr) {
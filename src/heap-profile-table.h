@@ -36,6 +36,7 @@
 #ifndef BASE_HEAP_PROFILE_TABLE_H_
 #define BASE_HEAP_PROFILE_TABLE_H_
 
+#include "address_index-inl.h"
 #include "addressmap-inl.h"
 #include "base/basictypes.h"
 #include "base/generic_writer.h"
@@ -87,8 +88,12 @@ class HeapProfileTable {
   // The stack trace is stored in 'stack'. The stack depth is returned.
   //
   // 'skip_count' gives the number of stack frames between this call
-  // and the memory allocation function.
-  static int GetCallerStackTrace(int skip_count, void* stack[kMaxStackDepth]);
+  // and the memory allocation function. Callers that post-process the
+  // stack (e.g. fold recursion) may ask for more than kMaxStackDepth
+  // frames, but must pass at most kMaxStackDepth of them to
+  // RecordAlloc.
+  static int GetCallerStackTrace(int skip_count, void* stack[],
+                                 int max_depth = kMaxStackDepth);
 
   // Record an allocation at 'ptr' of 'bytes' bytes.  'stack_depth'
   // and 'call_stack' identifying the function that requested the
@@ -112,9 +117,19 @@ class HeapProfileTable {
   bool FindInsideAlloc(const void* ptr, size_t max_size,
                        const void** object_ptr, size_t* object_size) const;
 
+  // Build a flat index of all current allocations that makes
+  // FindInsideAlloc and MarkAsLive calls faster. Nothing may be
+  // recorded until ReleaseIndex is called. Meant for heap leak checks,
+  // which do many lookups while the heap is frozen.
+  void BuildIndex();
+  void ReleaseIndex();
+
   // If "ptr" points to a recorded allocation and it's not marked as live
   // mark it as live and return true. Else return false.
   // All allocations start as non-live.
+  // Several threads may mark objects concurrently (as long as nothing
+  // else changes the table meanwhile); exactly one of them gets true
+  // for any given object.
   bool MarkAsLive(const void* ptr);
 
   // If "ptr" points to a recorded allocation, mark it as "ignored".
@@ -189,6 +204,16 @@ class HeapProfileTable {
     void set_live(bool l) {
       bucket_rep = (bucket_rep & ~uintptr_t(kLive)) | (l ? kLive : 0);
     }
+    // Atomic version of set_live(true). Returns false if the flag was
+    // already set. Plain load goes first, since most objects we are
+    // asked about are already live.
+    bool try_set_live() {
+      if (__atomic_load_n(&bucket_rep, __ATOMIC_RELAXED) & kLive) {
+        return false;
+      }
+      return (__atomic_fetch_or(&bucket_rep, uintptr_t(kLive),
+                                __ATOMIC_RELAXED) & kLive) == 0;
+    }
 
     // Should this allocation be ignored if it looks like a leak?
     bool ignore() const { return bucket_rep & kIgnore; }
@@ -210,6 +235,7 @@ class HeapProfileTable {
   static size_t AllocValueSize(const AllocValue& v) { return v.bytes; }
 
   typedef AddressMap<AllocValue> AllocationMap;
+  typedef AddressIndex<AllocValue> AllocationIndex;
 
   // helpers ----------------------------
 
@@ -270,6 +296,9 @@ class HeapProfileTable {
   // Map of all currently allocated objects and mapped regions we know about.
   AllocationMap* address_map_;
 
+  // Index of address_map_ while BuildIndex is in effect.
+  AllocationIndex* address_index_;
+
   DISALLOW_COPY_AND_ASSIGN(HeapProfileTable);
 };
 
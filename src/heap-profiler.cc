@@ -72,6 +72,7 @@
 #include "heap-profile-table.h"
 #include "memory_region_map.h"
 #include "mmap_hook.h"
+#include "stack_fold.h"
 
 #ifndef	PATH_MAX
 #ifdef MAXPATHLEN
@@ -121,6 +122,11 @@ DEFINE_bool(only_mmap_profile,
             EnvToBool("HEAP_PROFILE_ONLY_MMAP", false),
             "If heap-profiling is on, only profile mmap, mremap, and sbrk; "
             "do not profile malloc/new/etc");
+DEFINE_bool(heap_profile_fold_recursion,
+            EnvToBool("HEAP_PROFILE_FOLD_RECURSION", false),
+            "If heap-profiling is on, fold repeated frames of recursive "
+            "calls in recorded stacks, so that deep recursion takes fewer "
+            "stack slots and more of the outer frames are kept");
 
 
 //----------------------------------------------------------------------
@@ -288,11 +294,23 @@ static void MaybeDumpProfileLocked() {
   }
 }
 
+// With recursion folding we capture this many times more frames than
+// we record, in hope that after folding most of them fit.
+static const int kFoldCaptureFactor = 4;
+
 // Record an allocation in the profile.
 static void RecordAlloc(const void* ptr, size_t bytes, int skip_count) {
   // Take the stack trace outside the critical section.
-  void* stack[HeapProfileTable::kMaxStackDepth];
-  int depth = HeapProfileTable::GetCallerStackTrace(skip_count + 1, stack);
+  void* stack[HeapProfileTable::kMaxStackDepth * kFoldCaptureFactor];
+  int depth;
+  if (FLAGS_heap_profile_fold_recursion) {
+    depth = HeapProfileTable::GetCallerStackTrace(skip_count + 1, stack,
+                                                  arraysize(stack));
+    depth = std::min<int>(tcmalloc::FoldRecursion(stack, depth),
+                          HeapProfileTable::kMaxStackDepth);
+  } else {
+    depth = HeapProfileTable::GetCallerStackTrace(skip_count + 1, stack);
+  }
   SpinLockHolder l(&heap_lock);
   if (is_on) {
     heap_profile->RecordAlloc(ptr, bytes, depth, stack);
@@ -226,6 +226,8 @@ T HookList<T>::ExchangeSingular(T value) {
 // Explicit instantiation for malloc_hook_test.cc.  This ensures all the methods
 // are instantiated.
 template struct HookList<MallocHook::NewHook>;
+// And for malloc_hook_batch.cc.
+template struct HookList<MallocHook::BatchHook>;
 
 HookList<MallocHook::NewHook> new_hooks_{InitialNewHook};
 HookList<MallocHook::DeleteHook> delete_hooks_;
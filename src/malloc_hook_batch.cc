@@ -0,0 +1,256 @@
+// -*- Mode: C++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+// Copyright (c) 2024, gperftools Contributors
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+//     * Neither the name of Google Inc. nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// Batch hooks (see malloc_hook_c.h). We install a regular new and
+// delete hook that appends events to a per-thread ring buffer, and
+// hand the buffered events to the batch hooks in bulk. So the batch
+// hooks' own cost (locking, updating tables, etc) is paid once per
+// batch instead of once per malloc and free.
+//
+// Each buffer has a single producer, its owning thread, and any
+// number of consumers serialized by flush_lock. Consumers only
+// advance tail after the hooks return, so the producer never
+// overwrites events that are being delivered.
+
+#include "config.h"
+
+#include <gperftools/malloc_hook.h>
+#include "malloc_hook-inl.h"
+
+#include <stddef.h>
+
+#include <algorithm>
+#include <atomic>
+
+#include "base/basictypes.h"
+#include "base/logging.h"
+#include "base/spinlock.h"
+#include "thread_buffer_list.h"
+
+#ifndef _WIN32
+
+namespace tcmalloc {
+namespace {
+
+using base::internal::kHookListMaxValues;
+
+// Events per thread buffer, 24 KiB worth. Buffers are flushed when
+// half full, so that a batch hook that allocates has room for its own
+// events.
+const size_t kBatchEvents = 1024;
+const size_t kFlushEvents = kBatchEvents / 2;
+
+struct BatchBuffer {
+  // Only ever written by the owning thread.
+  std::atomic<size_t> head;
+  // Only ever written with flush_lock held.
+  std::atomic<size_t> tail;
+  SpinLock flush_lock;
+  // Owned by ThreadBufferList.
+  BatchBuffer* next;
+  BatchBuffer* next_free;
+  MallocHook::Event events[kBatchEvents];
+};
+
+base::internal::HookList<MallocHook::BatchHook> batch_hooks;
+
+// Protects num_batch_hooks and installation of our new and delete
+// hooks.
+SpinLock batch_lock;
+int num_batch_hooks;
+
+typedef ThreadBufferList<BatchBuffer> Buffers;
+
+// Set while this thread runs batch hooks. Such a thread never flushes
+// again, since hooks need not be reentrant.
+__thread bool in_batch_hook ATTR_INITIAL_EXEC;
+
+// Hands buffered events of 'buf' to the batch hooks. Must not be
+// called when in_batch_hook is set.
+void FlushBuffer(BatchBuffer* buf) {
+  in_batch_hook = true;
+  {
+    SpinLockHolder h(&buf->flush_lock);
+    MallocHook::BatchHook hooks[kHookListMaxValues];
+    int num_hooks = batch_hooks.Traverse(hooks, kHookListMaxValues);
+    size_t tail = buf->tail.load(std::memory_order_relaxed);
+    size_t head = buf->head.load(std::memory_order_acquire);
+    while (tail != head) {
+      // The ring may wrap, in which case it takes two batches.
+      size_t start = tail % kBatchEvents;
+      size_t count = std::min(head - tail, kBatchEvents - start);
+      for (int i = 0; i < num_hooks; ++i) {
+        (*hooks[i])(buf->events + start, static_cast<int>(count));
+      }
+      tail += count;
+      buf->tail.store(tail, std::memory_order_release);
+    }
+  }
+  in_batch_hook = false;
+}
+
+void FlushAllBuffers() {
+  if (in_batch_hook) {
+    return;
+  }
+  for (BatchBuffer* buf = Buffers::All(); buf != NULL; buf = buf->next) {
+    if (buf->head.load(std::memory_order_acquire) !=
+        buf->tail.load(std::memory_order_relaxed)) {
+      FlushBuffer(buf);
+    }
+  }
+}
+
+void FlushExitingThreadBuffer(BatchBuffer* buf) {
+  if (!in_batch_hook) {
+    FlushBuffer(buf);
+  }
+}
+
+void Record(const void* ptr, size_t size, MallocHook_EventType type) {
+  BatchBuffer* buf = Buffers::Current();
+  if (PREDICT_FALSE(buf == NULL)) {
+    buf = Buffers::NewForThread();
+    if (buf == NULL) {
+      return;
+    }
+  }
+  size_t head = buf->head.load(std::memory_order_relaxed);
+  size_t tail = buf->tail.load(std::memory_order_acquire);
+  if (PREDICT_FALSE(head - tail == kBatchEvents)) {
+    // Only happens when a batch hook allocates a lot, since we
+    // flush at half full otherwise.
+    return;
+  }
+  MallocHook::Event* e = &buf->events[head % kBatchEvents];
+  e->ptr = ptr;
+  e->size = size;
+  e->type = type;
+  buf->head.store(head + 1, std::memory_order_release);
+  if (PREDICT_FALSE(head + 1 - tail >= kFlushEvents) && !in_batch_hook) {
+    FlushBuffer(buf);
+  }
+}
+
+void BatchNewHook(const void* ptr, size_t size) {
+  if (ptr != NULL) {
+    Record(ptr, size, MallocHook_NewEvent);
+  }
+}
+
+void BatchDeleteHook(const void* ptr) {
+  if (ptr != NULL) {
+    Record(ptr, 0, MallocHook_DeleteEvent);
+  }
+}
+
+// Installs our new and delete hooks. Requires batch_lock.
+bool StartRecordingLocked() {
+  Buffers::Init(FlushExitingThreadBuffer);
+  if (!MallocHook::AddNewHook(&BatchNewHook)) {
+    return false;
+  }
+  if (!MallocHook::AddDeleteHook(&BatchDeleteHook)) {
+    RAW_CHECK(MallocHook::RemoveNewHook(&BatchNewHook), "");
+    return false;
+  }
+  return true;
+}
+
+// Removes our hooks and drops the events still buffered (e.g. those
+// of the last batch hook's own allocations), so that hooks added later
+// don't get deletes of objects they never saw allocated. Requires
+// batch_lock.
+void StopRecordingLocked() {
+  RAW_CHECK(MallocHook::RemoveNewHook(&BatchNewHook), "");
+  RAW_CHECK(MallocHook::RemoveDeleteHook(&BatchDeleteHook), "");
+  for (BatchBuffer* buf = Buffers::All(); buf != NULL; buf = buf->next) {
+    SpinLockHolder h(&buf->flush_lock);
+    buf->tail.store(buf->head.load(std::memory_order_acquire),
+                    std::memory_order_release);
+  }
+}
+
+}  // namespace
+}  // namespace tcmalloc
+
+extern "C"
+int MallocHook_AddBatchHook(MallocHook_BatchHook hook) {
+  RAW_VLOG(10, "AddBatchHook(%p)", hook);
+  SpinLockHolder h(&tcmalloc::batch_lock);
+  if (!tcmalloc::batch_hooks.Add(hook)) {
+    return 0;
+  }
+  if (tcmalloc::num_batch_hooks == 0 && !tcmalloc::StartRecordingLocked()) {
+    tcmalloc::batch_hooks.Remove(hook);
+    return 0;
+  }
+  tcmalloc::num_batch_hooks++;
+  return 1;
+}
+
+extern "C"
+int MallocHook_RemoveBatchHook(MallocHook_BatchHook hook) {
+  RAW_VLOG(10, "RemoveBatchHook(%p)", hook);
+  tcmalloc::FlushAllBuffers();
+  SpinLockHolder h(&tcmalloc::batch_lock);
+  if (!tcmalloc::batch_hooks.Remove(hook)) {
+    return 0;
+  }
+  if (--tcmalloc::num_batch_hooks == 0) {
+    tcmalloc::StopRecordingLocked();
+  }
+  return 1;
+}
+
+extern "C"
+void MallocHook_FlushBatchHooks() {
+  tcmalloc::FlushAllBuffers();
+}
+
+#else  // _WIN32
+
+// No thread-local buffers on windows yet.
+
+extern "C"
+int MallocHook_AddBatchHook(MallocHook_BatchHook hook) {
+  return 0;
+}
+
+extern "C"
+int MallocHook_RemoveBatchHook(MallocHook_BatchHook hook) {
+  return 0;
+}
+
+extern "C"
+void MallocHook_FlushBatchHooks() {
+}
+
+#endif  // _WIN32
@@ -0,0 +1,277 @@
+// -*- Mode: C++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+// Copyright (c) 2024, gperftools Contributors
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+//     * Neither the name of Google Inc. nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// Records every allocation and deallocation into a binary trace file
+// named by MALLOCTRACE. See malloc_trace.h for the format.
+//
+// Writing a line per event (like debugallocation's TCMALLOC_TRACE
+// does) is far too slow for real workloads. So every thread appends
+// fixed size records to its own buffer and writes the whole buffer
+// out with a single write() when it's full, when the thread exits and
+// at program exit.
+
+#include "config.h"
+
+#include "malloc_trace.h"
+
+#ifndef _WIN32
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <gperftools/malloc_hook.h>
+
+#include "base/basictypes.h"
+#include "base/googleinit.h"
+#include "base/logging.h"
+#include "base/spinlock.h"
+#include "base/sysinfo.h"      // for GetUniquePathFromEnv()
+#include "safe_strerror.h"
+#include "tcmalloc_guard.h"
+#include "thread_buffer_list.h"
+
+#ifndef PATH_MAX
+#define PATH_MAX 4096
+#endif
+
+namespace tcmalloc {
+namespace {
+
+// Records per thread buffer, about 96 KiB worth.
+const uint32_t kBufferRecords = 4096;
+
+struct TraceBuffer {
+  // Taken by the owning thread for every record, and by whoever
+  // flushes all buffers at exit, so it's practically never contended.
+  SpinLock lock;
+  // Owned by ThreadBufferList.
+  TraceBuffer* next;
+  TraceBuffer* next_free;
+  // Records follow the chunk header directly, so that the whole
+  // chunk is written out at once.
+  MallocTraceChunk chunk;
+  MallocTraceRecord records[kBufferRecords];
+};
+
+static_assert(offsetof(TraceBuffer, records) ==
+              offsetof(TraceBuffer, chunk) + sizeof(MallocTraceChunk),
+              "chunk header must be followed by records");
+
+// Protects the file and the variables below. Ordered after
+// TraceBuffer::lock.
+SpinLock trace_lock;
+int trace_fd = -1;
+// Forked children inherit our buffers and hooks, but mustn't write
+// into our file.
+pid_t trace_pid;
+uint64_t trace_start_ns;
+uint32_t next_thread;
+
+typedef ThreadBufferList<TraceBuffer> Buffers;
+
+uint64_t NowNanos() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+// Writes 'size' bytes to the trace file. On error the trace is
+// stopped. Requires trace_lock.
+void WriteLocked(const void* data, size_t size) {
+  const char* p = static_cast<const char*>(data);
+  while (size > 0 && trace_fd >= 0) {
+    ssize_t rv = write(trace_fd, p, size);
+    if (rv < 0 && errno == EINTR) {
+      continue;
+    }
+    if (rv <= 0) {
+      RAW_LOG(ERROR, "MallocTrace: write failed, stopping trace: %s",
+              SafeStrError(errno).c_str());
+      close(trace_fd);
+      trace_fd = -1;
+      return;
+    }
+    p += rv;
+    size -= rv;
+  }
+}
+
+// Writes out buffered records of 'buf'. Requires buf->lock.
+void FlushLocked(TraceBuffer* buf) {
+  if (buf->chunk.count == 0) {
+    return;
+  }
+  SpinLockHolder h(&trace_lock);
+  if (trace_pid == getpid()) {
+    WriteLocked(&buf->chunk, sizeof(MallocTraceChunk) +
+                buf->chunk.count * sizeof(MallocTraceRecord));
+  }
+  buf->chunk.count = 0;
+}
+
+void FlushExitingThreadBuffer(TraceBuffer* buf) {
+  SpinLockHolder h(&buf->lock);
+  FlushLocked(buf);
+}
+
+TraceBuffer* NewThreadBuffer() {
+  {
+    SpinLockHolder h(&trace_lock);
+    if (trace_fd < 0) {
+      return NULL;
+    }
+  }
+  TraceBuffer* buf = Buffers::NewForThread();
+  if (buf == NULL) {
+    return NULL;
+  }
+  SpinLockHolder h(&trace_lock);
+  buf->chunk.thread = next_thread++;
+  buf->chunk.count = 0;
+  return buf;
+}
+
+void Record(const void* ptr, uint64_t size, MallocTraceOp op) {
+  TraceBuffer* buf = Buffers::Current();
+  if (PREDICT_FALSE(buf == NULL)) {
+    buf = NewThreadBuffer();
+    if (buf == NULL) {
+      return;
+    }
+  }
+  const uint64_t now = NowNanos();
+  SpinLockHolder h(&buf->lock);
+  if (buf->chunk.count == kBufferRecords) {
+    FlushLocked(buf);
+  }
+  MallocTraceRecord* r = &buf->records[buf->chunk.count++];
+  r->timestamp = now - trace_start_ns;
+  r->ptr = reinterpret_cast<uintptr_t>(ptr);
+  r->size_and_op = size << 8 | op;
+}
+
+void NewHook(const void* ptr, size_t size) {
+  if (ptr != NULL) {
+    Record(ptr, size, kMallocTraceAlloc);
+  }
+}
+
+void DeleteHook(const void* ptr) {
+  if (ptr != NULL) {
+    Record(ptr, 0, kMallocTraceFree);
+  }
+}
+
+void MallocTraceStart(const char* fname) {
+  int fd = open(fname, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+  if (fd < 0) {
+    RAW_LOG(ERROR, "MallocTrace: can't open %s: %s",
+            fname, SafeStrError(errno).c_str());
+    return;
+  }
+  Buffers::Init(FlushExitingThreadBuffer);
+
+  MallocTraceHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, kMallocTraceMagic, sizeof(header.magic));
+  header.version = kMallocTraceVersion;
+  header.record_size = sizeof(MallocTraceRecord);
+  header.start_time = time(NULL);
+  {
+    SpinLockHolder h(&trace_lock);
+    trace_fd = fd;
+    trace_pid = getpid();
+    trace_start_ns = NowNanos();
+    WriteLocked(&header, sizeof(header));
+  }
+
+  RAW_CHECK(MallocHook::AddNewHook(&NewHook), "");
+  RAW_CHECK(MallocHook::AddDeleteHook(&DeleteHook), "");
+}
+
+void MallocTraceStop() {
+  {
+    SpinLockHolder h(&trace_lock);
+    if (trace_fd < 0) {
+      return;
+    }
+  }
+  RAW_CHECK(MallocHook::RemoveNewHook(&NewHook), "");
+  RAW_CHECK(MallocHook::RemoveDeleteHook(&DeleteHook), "");
+
+  for (TraceBuffer* buf = Buffers::All(); buf != NULL; buf = buf->next) {
+    SpinLockHolder h(&buf->lock);
+    FlushLocked(buf);
+  }
+
+  SpinLockHolder h(&trace_lock);
+  if (trace_fd >= 0 && trace_pid == getpid()) {
+    close(trace_fd);
+  }
+  trace_fd = -1;
+}
+
+void MallocTraceInit() {
+  char fname[PATH_MAX];
+  if (!GetUniquePathFromEnv("MALLOCTRACE", fname)) {
+    return;
+  }
+  // We do a uid check so we don't write out files in a setuid executable.
+#ifdef HAVE_GETEUID
+  if (getuid() != geteuid()) {
+    RAW_LOG(WARNING, "MallocTrace: ignoring MALLOCTRACE because "
+            "program seems to be setuid");
+    return;
+  }
+#endif
+  MallocTraceStart(fname);
+}
+
+// Writes out the rest of the trace at program exit.
+struct MallocTraceEndWriter {
+  ~MallocTraceEndWriter() {
+    MallocTraceStop();
+  }
+};
+
+}  // namespace
+}  // namespace tcmalloc
+
+// We want to make sure tcmalloc is up and running before starting the trace
+static const TCMallocGuard tcmalloc_initializer;
+REGISTER_MODULE_INITIALIZER(malloc_trace, tcmalloc::MallocTraceInit());
+static tcmalloc::MallocTraceEndWriter malloc_trace_end_writer;
+
+#endif  // !_WIN32
@@ -0,0 +1,84 @@
+// -*- Mode: C++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+// Copyright (c) 2024, gperftools Contributors
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+//     * Neither the name of Google Inc. nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// Binary malloc trace. When MALLOCTRACE is set to a file name, every
+// allocation and deallocation is recorded there through malloc hooks
+// (see malloc_trace.cc). benchmark/malloc_trace_replay.cc replays
+// such traces.
+//
+// The file starts with a MallocTraceHeader, followed by chunks. Each
+// chunk is a MallocTraceChunk and then 'count' MallocTraceRecords,
+// all made by the same thread. Threads buffer their records and write
+// them out a chunk at a time, so chunks of different threads are
+// interleaved and only timestamps give the order of events across
+// threads. Everything is in host byte order.
+//
+// This header is also used by the replay tool, so it must not depend
+// on anything else from gperftools.
+
+#ifndef TCMALLOC_MALLOC_TRACE_H_
+#define TCMALLOC_MALLOC_TRACE_H_
+
+#include <stdint.h>
+
+namespace tcmalloc {
+
+static const char kMallocTraceMagic[8] = {'g', 'p', 't', 'r', 'a', 'c', 'e', '\0'};
+static const uint32_t kMallocTraceVersion = 1;
+
+struct MallocTraceHeader {
+  char magic[8];                // kMallocTraceMagic
+  uint32_t version;             // kMallocTraceVersion
+  uint32_t record_size;         // sizeof(MallocTraceRecord)
+  uint64_t start_time;          // seconds since the epoch
+};
+
+struct MallocTraceChunk {
+  uint32_t thread;              // small id, assigned in order of first event
+  uint32_t count;               // number of records that follow
+};
+
+enum MallocTraceOp {
+  kMallocTraceAlloc = 0,
+  kMallocTraceFree = 1,
+};
+
+struct MallocTraceRecord {
+  uint64_t timestamp;           // nanoseconds since the trace started
+  uint64_t ptr;                 // object address; unique among live objects
+  uint64_t size_and_op;         // size << 8 | MallocTraceOp; size is 0 for frees
+
+  uint64_t size() const { return size_and_op >> 8; }
+  MallocTraceOp op() const { return static_cast<MallocTraceOp>(size_and_op & 0xff); }
+};
+
+}  // namespace tcmalloc
+
+#endif  // TCMALLOC_MALLOC_TRACE_H_
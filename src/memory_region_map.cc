@@ -94,6 +94,15 @@
 // allocations we are doing LowLevelAlloc reuses one mmap call and parcels out
 // the memory it created to satisfy several of our allocation requests.
 //
+// Lookups (FindRegion, FindAndMarkStackRegion) don't need to serialize with
+// the mmap hooks and with each other: they binary search a sorted array copy
+// of the RegionSet that is published RCU-style. Hooks only bump a version
+// number, which makes readers fall back to the locked RegionSet lookup, and
+// the array is rebuilt once a few locked lookups have happened without
+// changes in between. That way a burst of mmap-s costs one rebuild at most,
+// and a program that mostly mmap-s doesn't rebuild at all. Replaced arrays
+// are freed once no reader is in the middle of a lookup.
+//
 
 // ========================================================================= //
 
@@ -120,6 +129,7 @@
 #include "base/low_level_alloc.h"
 #include "base/threading.h"
 #include "mmap_hook.h"
+#include "stack_intern_table.h"
 
 #include <gperftools/stacktrace.h>
 #include <gperftools/malloc_hook.h> // For MallocHook::GetCallerStackTrace
@@ -142,9 +152,12 @@ HeapProfileBucket** MemoryRegionMap::bucket_table_ = nullptr;  // GUARDED_BY(loc
 int MemoryRegionMap::num_buckets_ = 0;  // GUARDED_BY(lock_)
 int MemoryRegionMap::saved_buckets_count_ = 0;  // GUARDED_BY(lock_)
 HeapProfileBucket MemoryRegionMap::saved_buckets_[20];  // GUARDED_BY(lock_)
-// GUARDED_BY(lock_)
-const void* MemoryRegionMap::saved_buckets_keys_[20][kMaxStackDepth];
 tcmalloc::MappingHookSpace MemoryRegionMap::mapping_hook_space_;
+std::atomic<MemoryRegionMap::RegionSnapshot*> MemoryRegionMap::snapshot_;
+std::atomic<uint64_t> MemoryRegionMap::regions_version_;
+MemoryRegionMap::RegionSnapshot* MemoryRegionMap::retired_snapshots_ = nullptr;  // GUARDED_BY(lock_)
+int MemoryRegionMap::retired_count_ = 0;  // GUARDED_BY(lock_)
+int MemoryRegionMap::locked_lookups_ = 0;  // GUARDED_BY(lock_)
 
 // ========================================================================= //
 
@@ -177,6 +190,44 @@ static MemoryRegionMap::RegionSetRep regions_rep;
 
 // ========================================================================= //
 
+struct MemoryRegionMap::RegionSnapshot {
+  uint64_t version;  // regions_version_ this is a copy of
+  RegionSnapshot* next_retired;
+  size_t count;
+  // Both arrays have count elements and are sorted like the RegionSet.
+  // end_addrs is what we binary search, as Region-s are rather big.
+  Region* regions;
+  uintptr_t end_addrs[1];
+
+  static RegionSnapshot* New(size_t capacity) {
+    const size_t header = sizeof(RegionSnapshot) +
+                          (capacity - 1) * sizeof(uintptr_t);
+    char* mem = static_cast<char*>(
+        MyAllocator::Allocate(header + capacity * sizeof(Region)));
+    RegionSnapshot* snapshot = reinterpret_cast<RegionSnapshot*>(mem);
+    snapshot->regions = reinterpret_cast<Region*>(mem + header);
+    return snapshot;
+  }
+};
+
+// Number of locked lookups without changes in between after which we
+// publish a new snapshot.
+static const int kLookupsToPublish = 4;
+
+// Most replaced snapshots kept waiting for readers to go away.
+static const int kMaxRetiredSnapshots = 4;
+
+// Number of threads looking at snapshot_, striped by thread so that
+// lookups from different threads don't share a cache line.
+// Replaced snapshots are only freed when all stripes are 0.
+static const int kReaderStripes = 16;
+struct CACHELINE_ALIGNED ReaderStripe {
+  std::atomic<int> count;
+};
+static ReaderStripe reader_stripes[kReaderStripes];
+
+// ========================================================================= //
+
 // Has InsertRegionLocked been called recursively
 // (or rather should we *not* use regions_ to record a hooked mmap).
 static bool recursive_insert = false;
@@ -243,7 +294,6 @@ bool MemoryRegionMap::Shutdown() NO_THREAD_SAFETY_ANALYSIS {
       for (HeapProfileBucket* curr = bucket_table_[i]; curr != 0; /**/) {
         HeapProfileBucket* bucket = curr;
         curr = curr->next;
-        MyAllocator::Free(bucket->stack, 0);
         MyAllocator::Free(bucket, 0);
       }
     }
@@ -256,6 +306,14 @@ bool MemoryRegionMap::Shutdown() NO_THREAD_SAFETY_ANALYSIS {
 
   if (regions_) regions_->~RegionSet();
   regions_ = NULL;
+  RegionsChangedLocked();
+  RegionSnapshot* snapshot = snapshot_.exchange(nullptr);
+  if (snapshot != nullptr) {
+    snapshot->next_retired = retired_snapshots_;
+    retired_snapshots_ = snapshot;
+    retired_count_++;
+  }
+  FreeRetiredSnapshotsLocked();
   bool deleted_arena = LowLevelAlloc::DeleteArena(arena_);
   if (deleted_arena) {
     arena_ = 0;
@@ -327,10 +385,12 @@ MemoryRegionMap::DoFindRegionLocked(uintptr_t addr) {
   if (regions_ != NULL) {
     Region sample;
     sample.SetRegionSetKey(addr);
-    RegionSet::iterator region = regions_->lower_bound(sample);
+    // The first region that ends after addr. Note that a region ending
+    // exactly at addr may be followed by one starting there.
+    RegionSet::iterator region = regions_->upper_bound(sample);
     if (region != regions_->end()) {
-      RAW_CHECK(addr <= region->end_addr, "");
-      if (region->start_addr <= addr  &&  addr < region->end_addr) {
+      RAW_CHECK(addr < region->end_addr, "");
+      if (region->start_addr <= addr) {
         return &(*region);
       }
     }
@@ -338,16 +398,115 @@ MemoryRegionMap::DoFindRegionLocked(uintptr_t addr) {
   return NULL;
 }
 
+bool MemoryRegionMap::FindRegionInSnapshot(uintptr_t addr, Region* result,
+                                           bool* found) {
+  // Registering as a reader before loading snapshot_ (both seq_cst)
+  // makes sure FreeRetiredSnapshotsLocked either sees us or we see
+  // the snapshot that replaced anything it frees.
+  std::atomic<int>* readers =
+    &reader_stripes[tcmalloc::ThreadStripeIndex() % kReaderStripes].count;
+  readers->fetch_add(1);
+  const RegionSnapshot* snapshot = snapshot_.load();
+  bool fresh = (snapshot != NULL &&
+                snapshot->version ==
+                  regions_version_.load(std::memory_order_acquire));
+  if (fresh) {
+    // The first region that ends after addr, like in DoFindRegionLocked.
+    const uintptr_t* end = snapshot->end_addrs + snapshot->count;
+    size_t i = std::upper_bound(snapshot->end_addrs, end, addr) -
+               snapshot->end_addrs;
+    *found = (i < snapshot->count && snapshot->regions[i].start_addr <= addr);
+    if (*found) *result = snapshot->regions[i];  // an independent copy
+  }
+  readers->fetch_sub(1, std::memory_order_release);
+  return fresh;
+}
+
+void MemoryRegionMap::RegionsChangedLocked() {
+  regions_version_.fetch_add(1, std::memory_order_release);
+  locked_lookups_ = 0;
+}
+
+void MemoryRegionMap::MaybePublishSnapshotLocked() {
+  RAW_CHECK(LockIsHeld(), "should be held (by this thread)");
+  if (regions_ == NULL || recursive_insert ||
+      ++locked_lookups_ < kLookupsToPublish) {
+    return;
+  }
+  // Freeing and allocating may munmap and mmap, so we do it before
+  // taking the version. Allocating may also get regions inserted,
+  // hence some slack.
+  FreeRetiredSnapshotsLocked();
+  if (retired_count_ >= kMaxRetiredSnapshots) {
+    return;  // lookups stay locked until readers let us free some
+  }
+  const size_t capacity = regions_->size() + 16;
+  recursive_insert = true;
+  RegionSnapshot* snapshot = RegionSnapshot::New(capacity);
+  HandleSavedRegionsLocked(&DoInsertRegionLocked);
+  recursive_insert = false;
+  if (regions_->size() > capacity) {
+    MyAllocator::Free(snapshot, 0);  // try again on the next lookup
+    return;
+  }
+  snapshot->version = regions_version_.load(std::memory_order_relaxed);
+  snapshot->next_retired = NULL;
+  snapshot->count = 0;
+  for (RegionSet::const_iterator r = regions_->begin();
+       r != regions_->end(); ++r) {
+    snapshot->end_addrs[snapshot->count] = r->end_addr;
+    snapshot->regions[snapshot->count++] = *r;
+  }
+  RegionSnapshot* old = snapshot_.exchange(snapshot);
+  if (old != NULL) {
+    // Freed next time, since freeing now could make snapshot stale.
+    old->next_retired = retired_snapshots_;
+    retired_snapshots_ = old;
+    retired_count_++;
+  }
+  RAW_VLOG(12, "Published snapshot of %zu regions", snapshot->count);
+}
+
+void MemoryRegionMap::FreeRetiredSnapshotsLocked() {
+  RAW_CHECK(LockIsHeld(), "should be held (by this thread)");
+  if (retired_snapshots_ == NULL) {
+    return;
+  }
+  // Readers that come after these loads will see the current snapshot_
+  // (see FindRegionInSnapshot).
+  for (int i = 0; i < kReaderStripes; i++) {
+    if (reader_stripes[i].count.load() != 0) {
+      return;  // next time then
+    }
+  }
+  while (retired_snapshots_ != NULL) {
+    RegionSnapshot* snapshot = retired_snapshots_;
+    retired_snapshots_ = snapshot->next_retired;
+    MyAllocator::Free(snapshot, 0);
+  }
+  retired_count_ = 0;
+}
+
 bool MemoryRegionMap::FindRegion(uintptr_t addr, Region* result) {
+  bool found;
+  if (FindRegionInSnapshot(addr, result, &found)) {
+    return found;
+  }
   Lock();
   const Region* region = DoFindRegionLocked(addr);
   if (region != NULL) *result = *region;  // create it as an independent copy
+  MaybePublishSnapshotLocked();
   Unlock();
   return region != NULL;
 }
 
 bool MemoryRegionMap::FindAndMarkStackRegion(uintptr_t stack_top,
                                              Region* result) {
+  bool found;
+  if (FindRegionInSnapshot(stack_top, result, &found) &&
+      (!found || result->is_stack)) {
+    return found;
+  }
   Lock();
   const Region* region = DoFindRegionLocked(stack_top);
   if (region != NULL) {
@@ -355,10 +514,14 @@ bool MemoryRegionMap::FindAndMarkStackRegion(uintptr_t stack_top,
                 reinterpret_cast<void*>(stack_top),
                 reinterpret_cast<void*>(region->start_addr),
                 reinterpret_cast<void*>(region->end_addr));
-    const_cast<Region*>(region)->set_is_stack();  // now we know
-      // cast is safe (set_is_stack does not change the set ordering key)
+    if (!region->is_stack) {
+      const_cast<Region*>(region)->set_is_stack();  // now we know
+        // cast is safe (set_is_stack does not change the set ordering key)
+      RegionsChangedLocked();
+    }
     *result = *region;  // create *result as an independent copy
   }
+  MaybePublishSnapshotLocked();
   Unlock();
   return region != NULL;
 }
@@ -366,54 +529,40 @@ bool MemoryRegionMap::FindAndMarkStackRegion(uintptr_t stack_top,
 HeapProfileBucket* MemoryRegionMap::GetBucket(int depth,
                                               const void* const key[]) {
   RAW_CHECK(LockIsHeld(), "should be held (by this thread)");
-  // Make hash-value
-  uintptr_t hash = 0;
-  for (int i = 0; i < depth; i++) {
-    hash += reinterpret_cast<uintptr_t>(key[i]);
-    hash += hash << 10;
-    hash ^= hash >> 6;
-  }
-  hash += hash << 3;
-  hash ^= hash >> 11;
+  // Interning doesn't invoke mmap hooks, so it is fine even when
+  // recursive_insert is set.
+  uintptr_t hash = tcmalloc::StackInternTable::Hash(key, depth);
+  uint32_t id = tcmalloc::StackInternTable::Intern(key, depth, hash);
 
   // Lookup stack trace in table
   unsigned int hash_index = (static_cast<unsigned int>(hash)) % kHashTableSize;
   for (HeapProfileBucket* bucket = bucket_table_[hash_index];
        bucket != 0;
        bucket = bucket->next) {
-    if ((bucket->hash == hash) && (bucket->depth == depth) &&
-        std::equal(key, key + depth, bucket->stack)) {
+    if (bucket->stack_id == id) {
       return bucket;
     }
   }
 
   // Create new bucket
-  const size_t key_size = sizeof(key[0]) * depth;
   HeapProfileBucket* bucket;
   if (recursive_insert) {  // recursion: save in saved_buckets_
-    const void** key_copy = saved_buckets_keys_[saved_buckets_count_];
-    std::copy(key, key + depth, key_copy);
+    RAW_CHECK(saved_buckets_count_ < arraysize(saved_buckets_), "");
     bucket = &saved_buckets_[saved_buckets_count_];
     memset(bucket, 0, sizeof(*bucket));
     ++saved_buckets_count_;
-    bucket->stack = key_copy;
     bucket->next  = NULL;
   } else {
-    recursive_insert = true;
-    const void** key_copy = static_cast<const void**>(
-        MyAllocator::Allocate(key_size));
-    recursive_insert = false;
-    std::copy(key, key + depth, key_copy);
     recursive_insert = true;
     bucket = static_cast<HeapProfileBucket*>(
         MyAllocator::Allocate(sizeof(HeapProfileBucket)));
     recursive_insert = false;
     memset(bucket, 0, sizeof(*bucket));
-    bucket->stack = key_copy;
     bucket->next  = bucket_table_[hash_index];
   }
   bucket->hash = hash;
-  bucket->depth = depth;
+  bucket->stack_id = id;
+  bucket->stack = tcmalloc::StackInternTable::Get(id, &bucket->depth);
   bucket_table_[hash_index] = bucket;
   ++num_buckets_;
   return bucket;
@@ -456,6 +605,7 @@ inline void MemoryRegionMap::DoInsertRegionLocked(const Region& region) {
   // This inserts and allocates permanent storage for region
   // and its call stack data: it's safe to do it now:
   regions_->insert(region);
+  RegionsChangedLocked();
   RAW_VLOG(12, "Inserted region %p..%p :",
               reinterpret_cast<void*>(region.start_addr),
               reinterpret_cast<void*>(region.end_addr));
@@ -497,8 +647,7 @@ void MemoryRegionMap::RestoreSavedBucketsLocked() {
     for (HeapProfileBucket* curr = bucket_table_[hash_index];
          curr != 0;
          curr = curr->next) {
-      if ((curr->hash == bucket.hash) && (curr->depth == bucket.depth) &&
-          std::equal(bucket.stack, bucket.stack + bucket.depth, curr->stack)) {
+      if (curr->stack_id == bucket.stack_id) {
         curr->allocs += bucket.allocs;
         curr->alloc_size += bucket.alloc_size;
         curr->frees += bucket.frees;
@@ -509,16 +658,13 @@ void MemoryRegionMap::RestoreSavedBucketsLocked() {
     }
     if (is_found) continue;
 
-    const size_t key_size = sizeof(bucket.stack[0]) * bucket.depth;
-    const void** key_copy = static_cast<const void**>(
-        MyAllocator::Allocate(key_size));
-    std::copy(bucket.stack, bucket.stack + bucket.depth, key_copy);
     HeapProfileBucket* new_bucket = static_cast<HeapProfileBucket*>(
         MyAllocator::Allocate(sizeof(HeapProfileBucket)));
     memset(new_bucket, 0, sizeof(*new_bucket));
     new_bucket->hash = bucket.hash;
+    new_bucket->stack_id = bucket.stack_id;
     new_bucket->depth = bucket.depth;
-    new_bucket->stack = key_copy;
+    new_bucket->stack = bucket.stack;
     new_bucket->next = bucket_table_[hash_index];
     bucket_table_[hash_index] = new_bucket;
     ++num_buckets_;
@@ -704,9 +850,10 @@ void MemoryRegionMap::RecordRegionRemoval(const void* start, size_t size) {
       // just modify region->end_addr as it's the sorting key.
       Region r = *region;
       r.set_end_addr(start_addr);
-      InsertRegionLocked(r);
-      // cut *region from start:
+      // cut *region from start first, or else r would look like
+      // a subset of *region and not get inserted:
       const_cast<Region&>(*region).set_start_addr(end_addr);
+      InsertRegionLocked(r);
     } else if (end_addr > region->start_addr  &&
                start_addr <= region->start_addr) {  // cut from start
       RAW_VLOG(12, "Start-chopping region %p..%p",
@@ -735,6 +882,7 @@ void MemoryRegionMap::RecordRegionRemoval(const void* start, size_t size) {
     }
     ++region;
   }
+  RegionsChangedLocked();
   RAW_VLOG(12, "Removed region %p..%p; have %zu regions",
               reinterpret_cast<void*>(start_addr),
               reinterpret_cast<void*>(end_addr),
@@ -38,6 +38,9 @@
 #include <config.h>
 
 #include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
 #include <set>
 #include "base/stl_allocator.h"
 #include "base/spinlock.h"
@@ -47,11 +50,6 @@
 #include "heap-profile-stats.h"
 #include "mmap_hook.h"
 
-// TODO(maxim): add a unittest:
-//  execute a bunch of mmaps and compare memory map what strace logs
-//  execute a bunch of mmap/munmup and compare memory map with
-//  own accounting of what those mmaps generated
-
 // Thread-safe class to collect and query the map of all memory regions
 // in a process that have been created with mmap, munmap, mremap, sbrk.
 // For each memory region, we keep track of (and provide to users)
@@ -213,14 +211,16 @@ class MemoryRegionMap {
   // Find the region that covers addr and write its data into *result if found,
   // in which case *result gets filled so that it stays fully functional
   // even when the underlying region gets removed from MemoryRegionMap.
-  // Returns success. Uses Lock/Unlock inside.
+  // Returns success. Takes no lock when the regions haven't changed since
+  // the last few lookups (see snapshot_ below), uses Lock/Unlock otherwise.
   static bool FindRegion(uintptr_t addr, Region* result);
 
   // Find the region that contains stack_top, mark that region as
   // a stack region, and write its data into *result if found,
   // in which case *result gets filled so that it stays fully functional
   // even when the underlying region gets removed from MemoryRegionMap.
-  // Returns success. Uses Lock/Unlock inside.
+  // Returns success. Locks like FindRegion, and also when the region
+  // isn't marked yet.
   static bool FindAndMarkStackRegion(uintptr_t stack_top, Region* result);
 
   // Iterate over the buckets which store mmap and munmap counts per stack
@@ -280,6 +280,9 @@ class MemoryRegionMap {
   // public to let us declare global objects:
   union RegionSetRep;
 
+  // Sorted array copy of regions_ for lookups without locking.
+  struct RegionSnapshot;
+
  private:
   // representation ===========================================================
 
@@ -300,6 +303,23 @@ class MemoryRegionMap {
   // simply by acquiring our recursive Lock() before that.
   static RegionSet* regions_;
 
+  // Copy of regions_ as of regions_version_ == snapshot_->version.
+  // Readers use it only while the versions match, and fall back to
+  // regions_ under Lock() otherwise. Changes to regions_ only bump the
+  // version; a new snapshot is published by a locked lookup once
+  // kLookupsToPublish of them happened since the last change. So
+  // regions_ changes are paid for in batches and only when there are
+  // lookups to be had.
+  static std::atomic<RegionSnapshot*> snapshot_;
+  static std::atomic<uint64_t> regions_version_;
+  // Replaced snapshots, freed once no thread is looking at snapshot_
+  // (see reader_stripes in the .cc). While there are
+  // kMaxRetiredSnapshots of them no new snapshot is published.
+  static RegionSnapshot* retired_snapshots_ GUARDED_BY(lock_);
+  static int retired_count_ GUARDED_BY(lock_);
+  // Locked lookups since regions_ last changed.
+  static int locked_lookups_ GUARDED_BY(lock_);
+
   // Lock to protect regions_ and buckets_ variables and the data behind.
   static SpinLock lock_;
   // Lock to protect the recursive lock itself.
@@ -337,8 +357,6 @@ class MemoryRegionMap {
   // with the any-time use of the static memory behind saved_buckets.
   static HeapProfileBucket saved_buckets_[20] GUARDED_BY(lock_);
 
-  static const void* saved_buckets_keys_[20][kMaxStackDepth] GUARDED_BY(lock_);
-
   static tcmalloc::MappingHookSpace mapping_hook_space_;
 
   // helpers ==================================================================
@@ -347,6 +365,22 @@ class MemoryRegionMap {
   // returns the region covering 'addr' or NULL; assumes our lock_ is held.
   static const Region* DoFindRegionLocked(uintptr_t addr);
 
+  // Lock-free helper for FindRegion and FindAndMarkStackRegion:
+  // returns false if snapshot_ is missing or stale, otherwise sets *found
+  // and, when found, *result.
+  static bool FindRegionInSnapshot(uintptr_t addr, Region* result,
+                                   bool* found);
+
+  // To be called after every change to regions_ or to a Region in it.
+  static void RegionsChangedLocked() EXCLUSIVE_LOCKS_REQUIRED(lock_);
+
+  // Counts a locked lookup, and publishes a new snapshot_ when enough
+  // of them happened without changes in between.
+  static void MaybePublishSnapshotLocked() EXCLUSIVE_LOCKS_REQUIRED(lock_);
+
+  // Frees replaced snapshots unless somebody may still be reading them.
+  static void FreeRetiredSnapshotsLocked() EXCLUSIVE_LOCKS_REQUIRED(lock_);
+
   // Verifying wrapper around regions_->insert(region)
   // To be called to do InsertRegionLocked's work only!
   inline static void DoInsertRegionLocked(const Region& region);
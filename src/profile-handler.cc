@@ -41,9 +41,13 @@
 
 #include <stdio.h>
 #include <errno.h>
+#include <string.h>
 #include <sys/time.h>
+#include <sys/types.h>
 
+#include <atomic>
 #include <list>
+#include <set>
 #include <string>
 
 #if HAVE_LINUX_SIGEV_THREAD_ID
@@ -54,6 +58,18 @@
 #include <signal.h>
 // for SYS_gettid
 #include <sys/syscall.h>
+
+struct timer_id_holder;
+#endif
+
+#if HAVE_LINUX_SIGEV_THREAD_ID && defined(HAVE_LINUX_PERF_EVENT_H)
+#define PROFILE_HANDLER_PERF_EVENTS 1
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#include <linux/perf_event.h>
+
+struct PerfEventSpec;
 #endif
 
 #include "base/dynamic_annotations.h"
@@ -135,6 +151,46 @@ class ProfileHandler {
   // Gets the current state of profile handler.
   void GetState(ProfileHandlerState* state);
 
+  // Sets the tag of the calling thread.
+  void SetThreadTag(int tag);
+
+  // Adds or removes a thread or a tag from the thread selection, see
+  // ProfileHandlerSelectThread.
+  void SelectThread(pid_t tid, bool selected);
+  void SelectThreadTag(int tag, bool selected);
+
+  // Drops the thread selection, so that all threads are sampled again.
+  void SelectAllThreads();
+
+#if HAVE_LINUX_SIGEV_THREAD_ID
+  // Unlinks the sampling source of an exiting thread.
+  void ForgetThreadTimer(timer_id_holder* holder);
+#endif
+
+  // Returns the kind of the tick being delivered. Only valid from within
+  // callbacks, which run after the singleton has been initialized, so it
+  // does not go through the (non async-signal-safe) Instance().
+  static ProfileHandlerTickKind CurrentTickKind() NO_THREAD_SAFETY_ANALYSIS {
+    return instance_->tick_kind_;
+  }
+
+  // Returns the number of base intervals the tick being delivered
+  // accounts for. Same restrictions as CurrentTickKind().
+  static int32_t CurrentTickWeight() NO_THREAD_SAFETY_ANALYSIS {
+    return instance_->tick_weight_;
+  }
+
+  // Asks for the timers to fire every 'multiplier' base intervals. Only
+  // stores the request, so it is async-signal-safe; the timers are
+  // re-armed from the signal handler.
+  static void SetIntervalMultiplier(int32_t multiplier) {
+    ProfileHandler* instance = instance_;
+    if (instance != NULL) {
+      instance->requested_multiplier_.store(multiplier,
+                                            std::memory_order_relaxed);
+    }
+  }
+
   // Initializes and returns the ProfileHandler singleton.
   static ProfileHandler* Instance();
 
@@ -162,6 +218,14 @@ class ProfileHandler {
   // Profiling signal interrupt frequency, read-only after construction.
   int32_t frequency_;
 
+  // The timers fire every this many base (1/frequency_) intervals, as
+  // asked by callbacks through ProfileHandlerSetIntervalMultiplier.
+  std::atomic<int32_t> requested_multiplier_;
+
+  // Multiplier the process-wide interval timer is armed with. Per-thread
+  // timers track theirs in their timer_id_holder.
+  std::atomic<int32_t> timer_multiplier_;
+
   // ITIMER_PROF (which uses SIGPROF), or ITIMER_REAL (which uses SIGALRM).
   // Translated into an equivalent choice of clock if per_thread_timer_enabled_
   // is true.
@@ -179,12 +243,41 @@ class ProfileHandler {
   // Must be false if HAVE_LINUX_SIGEV_THREAD_ID is not defined.
   bool per_thread_timer_enabled_;
 
+  // Are threads sampled on real time and their ticks classified as
+  // on-CPU or off-CPU? Implies per_thread_timer_enabled_.
+  bool wallclock_enabled_;
+
+#if PROFILE_HANDLER_PERF_EVENTS
+  // Event whose overflows drive the per-thread sampling, or NULL when
+  // per-thread POSIX timers are used. Implies per_thread_timer_enabled_.
+  const struct PerfEventSpec* perf_event_;
+#endif
+
+  // Kind of the tick being delivered, valid while holding signal_lock_
+  // in the signal handler.
+  ProfileHandlerTickKind tick_kind_ GUARDED_BY(signal_lock_);
+
+  // Weight of the tick being delivered, i.e. the interval multiplier its
+  // timer was armed with. Valid while holding signal_lock_ in the signal
+  // handler.
+  int32_t tick_weight_ GUARDED_BY(signal_lock_);
+
 #if HAVE_LINUX_SIGEV_THREAD_ID
   // this is used to destroy per-thread profiling timers on thread
   // termination
   tcmalloc::TlsKey thread_timer_key;
+
+  // Sampling sources of all registered threads.
+  timer_id_holder* thread_timers_ GUARDED_BY(control_lock_);
 #endif
 
+  // Is only a selection of the threads sampled? Then the per-thread
+  // sources of the other threads are kept disarmed. Threads are selected
+  // by tid or by tag; we expect both sets to be small.
+  bool selection_active_ GUARDED_BY(control_lock_);
+  std::set<pid_t> selected_tids_ GUARDED_BY(control_lock_);
+  std::set<int> selected_tags_ GUARDED_BY(control_lock_);
+
   // This lock serializes the registration of threads and protects the
   // callbacks_ list below.
   // Locking order:
@@ -218,6 +311,27 @@ class ProfileHandler {
   // per_thread_timer_enabled_ is true.
   void UpdateTimer(bool enable) EXCLUSIVE_LOCKS_REQUIRED(control_lock_);
 
+#if HAVE_LINUX_SIGEV_THREAD_ID
+  // Arms the source of a registered thread iff the thread is selected.
+  void UpdateThreadTimer(timer_id_holder* holder)
+      EXCLUSIVE_LOCKS_REQUIRED(control_lock_);
+
+  // Calls UpdateThreadTimer on all registered threads.
+  void UpdateThreadTimers() EXCLUSIVE_LOCKS_REQUIRED(control_lock_);
+
+  // pthread_atfork handlers. The sampling sources belong to the threads
+  // of the parent (its POSIX timers are not even inherited), so the
+  // child drops them all. Threads of the child can register again.
+  static void BeforeFork() NO_THREAD_SAFETY_ANALYSIS;
+  static void AfterForkInParent() NO_THREAD_SAFETY_ANALYSIS;
+  static void AfterForkInChild() NO_THREAD_SAFETY_ANALYSIS;
+#endif
+
+  // Re-arms the timer delivering the current tick if its interval
+  // multiplier differs from the requested one. Called from the signal
+  // handler.
+  void ApplyIntervalMultiplier() EXCLUSIVE_LOCKS_REQUIRED(signal_lock_);
+
   // Returns true if the handler is not being used by something else.
   // This checks the kernel's signal handler table.
   bool IsSignalHandlerAvailable();
@@ -249,18 +363,57 @@ int timer_settime(timer_t timerid, int flags, const struct itimerspec* value,
 
 #if HAVE_LINUX_SIGEV_THREAD_ID
 
+// Per-thread sampling source: either a POSIX timer or, with
+// CPUPROFILE_PERF_EVENT, a perf event fd. The holders of all live
+// threads are linked into ProfileHandler's thread_timers_ list, so that
+// thread selection can arm and disarm the sources of other threads.
 struct timer_id_holder {
   timer_t timerid;
-  timer_id_holder(timer_t _timerid) : timerid(_timerid) {}
+  int perf_fd;
+  // Is the perf event sampled in frequency rather than period mode?
+  bool perf_freq_mode;
+  // Owning thread and its tag (see ProfileHandlerSetThreadTag).
+  pid_t tid;
+  int tag;
+  // Is the source armed? Changed under both control_lock_ and
+  // signal_lock_, so the signal handler never re-arms a disarmed source.
+  bool armed;
+  // Interval multiplier the source is armed with.
+  int32_t multiplier;
+  // Next holder in ProfileHandler::thread_timers_ (control_lock_).
+  timer_id_holder* next;
+  timer_id_holder(timer_t _timerid)
+      : timerid(_timerid), perf_fd(-1), perf_freq_mode(false),
+        tid(0), tag(0), armed(false), multiplier(1), next(NULL) {}
+  timer_id_holder(int _perf_fd, bool _perf_freq_mode)
+      : timerid(), perf_fd(_perf_fd), perf_freq_mode(_perf_freq_mode),
+        tid(0), tag(0), armed(false), multiplier(1), next(NULL) {}
 };
 
+// The calling thread's sampling source (also owned by its TLS key
+// slot). This is a plain __thread variable so that the signal handler
+// can re-arm the source.
+static __thread timer_id_holder* thread_timer ATTR_INITIAL_EXEC;
+
+// Tag of the calling thread, kept here as well so that it can be set
+// before the thread registers.
+static __thread int thread_tag ATTR_INITIAL_EXEC;
+
+static void ForgetExitingThreadTimer(timer_id_holder* holder);
+
 extern "C" {
   static void ThreadTimerDestructor(void *arg) {
     if (!arg) {
       return;
     }
     timer_id_holder *holder = static_cast<timer_id_holder *>(arg);
-    timer_delete(holder->timerid);
+    ForgetExitingThreadTimer(holder);
+    thread_timer = NULL;
+    if (holder->perf_fd >= 0) {
+      close(holder->perf_fd);
+    } else {
+      timer_delete(holder->timerid);
+    }
     delete holder;
   }
 }
@@ -272,12 +425,13 @@ static void CreateThreadTimerKey(tcmalloc::TlsKey *pkey) {
   }
 }
 
-static void StartLinuxThreadTimer(int timer_type, int signal_number,
-                                  int32_t frequency, tcmalloc::TlsKey timer_key) {
+// Creates a disarmed timer delivering 'signal_number' to the calling
+// thread.
+static timer_id_holder* CreateLinuxThreadTimer(int timer_type,
+                                               int signal_number) {
   int rv;
   struct sigevent sevp;
   timer_t timerid;
-  struct itimerspec its;
   memset(&sevp, 0, sizeof(sevp));
   sevp.sigev_notify = SIGEV_THREAD_ID;
   sevp.sigev_notify_thread_id = syscall(SYS_gettid);
@@ -290,21 +444,217 @@ static void StartLinuxThreadTimer(int timer_type, int signal_number,
   if (rv) {
     RAW_LOG(FATAL, "aborting due to timer_create error: %s", strerror(errno));
   }
+  return new timer_id_holder(timerid);
+}
 
-  timer_id_holder *holder = new timer_id_holder(timerid);
-  rv = tcmalloc::SetTlsValue(timer_key, holder);
-  if (rv) {
-    RAW_LOG(FATAL, "aborting due to tcmalloc::SetTlsValue error: %s", strerror(rv));
+// Makes 'holder' fire every 'holder->multiplier' base intervals. Uses
+// only syscalls, so it is async-signal-safe, and works on the sources of
+// other threads too. Returns false on error, with errno set.
+static bool SetThreadTimerInterval(timer_id_holder* holder,
+                                   int32_t frequency) {
+  const int64_t kBillion = 1000000000;
+  int32_t multiplier = holder->multiplier;
+  int64_t interval_ns = (kBillion / frequency) * multiplier;
+#if PROFILE_HANDLER_PERF_EVENTS
+  if (holder->perf_fd >= 0) {
+    uint64_t arg = interval_ns;
+    if (holder->perf_freq_mode) {
+      arg = (frequency > multiplier) ? frequency / multiplier : 1;
+    }
+    return ioctl(holder->perf_fd, PERF_EVENT_IOC_PERIOD, &arg) == 0;
   }
-
-  its.it_interval.tv_sec = 0;
-  its.it_interval.tv_nsec = 1000000000 / frequency;
+#endif
+  struct itimerspec its;
+  its.it_interval.tv_sec = interval_ns / kBillion;
+  its.it_interval.tv_nsec = interval_ns % kBillion;
   its.it_value = its.it_interval;
-  rv = timer_settime(timerid, 0, &its, 0);
-  if (rv) {
+  return timer_settime(holder->timerid, 0, &its, 0) == 0;
+}
+
+// Starts or stops delivering ticks from 'holder'.
+static void ArmThreadTimer(timer_id_holder* holder, int32_t frequency,
+                           bool arm) {
+#if PROFILE_HANDLER_PERF_EVENTS
+  if (holder->perf_fd >= 0) {
+    if (arm && !SetThreadTimerInterval(holder, frequency)) {
+      RAW_LOG(FATAL, "aborting due to perf event period error: %s",
+              strerror(errno));
+    }
+    if (ioctl(holder->perf_fd,
+              arm ? PERF_EVENT_IOC_ENABLE : PERF_EVENT_IOC_DISABLE, 0) != 0) {
+      RAW_LOG(FATAL, "aborting due to perf event enable error: %s",
+              strerror(errno));
+    }
+    return;
+  }
+#endif
+  bool ok;
+  if (arm) {
+    ok = SetThreadTimerInterval(holder, frequency);
+  } else {
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    ok = timer_settime(holder->timerid, 0, &its, 0) == 0;
+  }
+  if (!ok) {
     RAW_LOG(FATAL, "aborting due to timer_settime error: %s", strerror(errno));
   }
 }
+
+#if PROFILE_HANDLER_PERF_EVENTS
+
+#ifndef PERF_FLAG_FD_CLOEXEC
+#define PERF_FLAG_FD_CLOEXEC (1UL << 3)
+#endif
+
+// Sampling events selectable with CPUPROFILE_PERF_EVENT.
+struct PerfEventSpec {
+  const char* name;
+  uint32_t type;
+  uint64_t config;
+  // Clock events count nanoseconds, so the sampling period is exactly
+  // the profiling interval. Other events are sampled in frequency mode,
+  // where the kernel adjusts the period to approximate the frequency.
+  bool is_clock;
+};
+
+static const PerfEventSpec kPerfEvents[] = {
+  { "cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, false },
+  { "instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, false },
+  { "cpu-clock", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_CLOCK, true },
+  { "task-clock", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK, true },
+  { "page-faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS, false },
+  { "context-switches", PERF_TYPE_SOFTWARE,
+    PERF_COUNT_SW_CONTEXT_SWITCHES, false },
+};
+
+// Hardware events are unavailable in many VMs; we then sample on this.
+static const PerfEventSpec* const kFallbackPerfEvent = &kPerfEvents[2];
+
+// Returns the event named 'name', or NULL if unknown.
+static const PerfEventSpec* FindPerfEvent(const char* name) {
+  for (const PerfEventSpec& spec : kPerfEvents) {
+    if (strcmp(spec.name, name) == 0) {
+      return &spec;
+    }
+  }
+  return NULL;
+}
+
+// Opens 'spec' counting on the calling thread only and arranges for
+// every counter overflow to deliver 'signal_number' to this thread. The
+// event is left disabled. Returns the event fd, or -1 with errno set.
+static int OpenThreadPerfEvent(const PerfEventSpec* spec, int signal_number,
+                               int32_t frequency) {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = spec->type;
+  attr.config = spec->config;
+  if (spec->is_clock) {
+    attr.sample_period = 1000000000 / frequency;
+  } else {
+    attr.freq = 1;
+    attr.sample_freq = frequency;
+  }
+  attr.wakeup_events = 1;
+  attr.disabled = 1;
+
+  int fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1,
+                   PERF_FLAG_FD_CLOEXEC);
+  if (fd < 0 && (errno == EACCES || errno == EPERM)) {
+    // perf_event_paranoid >= 2 only allows unprivileged users to count
+    // user-space execution.
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1,
+                 PERF_FLAG_FD_CLOEXEC);
+  }
+  if (fd < 0) {
+    return -1;
+  }
+
+  struct f_owner_ex owner;
+  owner.type = F_OWNER_TID;
+  owner.pid = syscall(SYS_gettid);
+  if (fcntl(fd, F_SETOWN_EX, &owner) != 0 ||
+      fcntl(fd, F_SETSIG, signal_number) != 0 ||
+      fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_ASYNC) != 0) {
+    int saved_errno = errno;
+    close(fd);
+    errno = saved_errno;
+    return -1;
+  }
+  return fd;
+}
+
+// Picks the event to sample on, probing it on the calling thread.
+// Returns NULL if 'name' is not a known event or perf events cannot be
+// used at all (e.g. in restricted containers), in which case we stay
+// with the timers.
+static const PerfEventSpec* ProbePerfEvent(const char* name,
+                                           int signal_number,
+                                           int32_t frequency) {
+  const PerfEventSpec* spec = FindPerfEvent(name);
+  if (spec == NULL) {
+    RAW_LOG(WARNING, "Unknown CPUPROFILE_PERF_EVENT '%s' (expected cycles,"
+            " instructions, cpu-clock, task-clock, page-faults or"
+            " context-switches), not using perf events", name);
+    return NULL;
+  }
+  int fd = OpenThreadPerfEvent(spec, signal_number, frequency);
+  if (fd < 0 && spec->type == PERF_TYPE_HARDWARE) {
+    RAW_LOG(INFO, "perf event %s is not available (%s), using %s",
+            spec->name, strerror(errno), kFallbackPerfEvent->name);
+    spec = kFallbackPerfEvent;
+    fd = OpenThreadPerfEvent(spec, signal_number, frequency);
+  }
+  if (fd < 0) {
+    RAW_LOG(INFO, "perf events are not available (%s), using timers",
+            strerror(errno));
+    return NULL;
+  }
+  close(fd);
+  return spec;
+}
+
+// Opens a disabled perf event delivering 'signal_number' to the calling
+// thread.
+static timer_id_holder* CreateLinuxThreadPerfEvent(const PerfEventSpec* spec,
+                                                   int signal_number,
+                                                   int32_t frequency) {
+  int fd = OpenThreadPerfEvent(spec, signal_number, frequency);
+  if (fd < 0) {
+    RAW_LOG(FATAL, "aborting due to perf_event_open error: %s",
+            strerror(errno));
+  }
+  return new timer_id_holder(fd, !spec->is_clock);
+}
+
+#endif  // PROFILE_HANDLER_PERF_EVENTS
+
+// CPU time consumed by the calling thread, as of its previous
+// wall-clock tick.
+static __thread int64_t last_tick_cpu_ns ATTR_INITIAL_EXEC;
+
+static int64_t ThreadCpuTimeNs() {
+  struct timespec ts;
+  if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0) {
+    return 0;
+  }
+  return static_cast<int64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+// Classifies a wall-clock tick of the calling thread by how much CPU
+// time it consumed since its previous tick, 'interval_ns' ago. This is
+// async-signal-safe: clock_gettime does not take locks.
+static ProfileHandlerTickKind ClassifyWallclockTick(int64_t interval_ns) {
+  int64_t now = ThreadCpuTimeNs();
+  int64_t delta = now - last_tick_cpu_ns;
+  last_tick_cpu_ns = now;
+  return (2 * delta >= interval_ns) ? PROFILE_TICK_ON_CPU
+                                    : PROFILE_TICK_OFF_CPU;
+}
 #endif
 
 void ProfileHandler::Init() {
@@ -325,9 +675,21 @@ ProfileHandler* ProfileHandler::Instance() {
 ProfileHandler::ProfileHandler()
     : timer_running_(false),
       interrupts_(0),
+      requested_multiplier_(1),
+      timer_multiplier_(1),
       callback_count_(0),
       allowed_(true),
-      per_thread_timer_enabled_(false) {
+      per_thread_timer_enabled_(false),
+      wallclock_enabled_(false),
+#if PROFILE_HANDLER_PERF_EVENTS
+      perf_event_(NULL),
+#endif
+      tick_kind_(PROFILE_TICK_CPU_TIME),
+      tick_weight_(1),
+#if HAVE_LINUX_SIGEV_THREAD_ID
+      thread_timers_(NULL),
+#endif
+      selection_active_(false) {
   SpinLockHolder cl(&control_lock_);
 
   timer_type_ = (getenv("CPUPROFILE_REALTIME") ? ITIMER_REAL : ITIMER_PROF);
@@ -353,8 +715,9 @@ ProfileHandler::ProfileHandler()
 
   const char *per_thread = getenv("CPUPROFILE_PER_THREAD_TIMERS");
   const char *signal_number = getenv("CPUPROFILE_TIMER_SIGNAL");
+  const char *wallclock = getenv("CPUPROFILE_WALLCLOCK");
 
-  if (per_thread || signal_number) {
+  if (per_thread || signal_number || wallclock) {
     if (timer_create) {
       CreateThreadTimerKey(&thread_timer_key);
       per_thread_timer_enabled_ = true;
@@ -362,13 +725,40 @@ ProfileHandler::ProfileHandler()
       if (signal_number) {
         signal_number_ = strtol(signal_number, NULL, 0);
       }
+      // Wall-clock profiling reuses the per-thread timers, but on
+      // CLOCK_MONOTONIC so that blocked threads are sampled too.
+      if (wallclock) {
+        wallclock_enabled_ = true;
+        timer_type_ = ITIMER_REAL;
+      }
     } else {
       RAW_LOG(INFO,
-              "Ignoring CPUPROFILE_PER_THREAD_TIMERS and\n"
-              " CPUPROFILE_TIMER_SIGNAL due to lack of timer_create().\n"
-              " Preload or link to librt.so for this to work");
+              "Ignoring CPUPROFILE_PER_THREAD_TIMERS,\n"
+              " CPUPROFILE_TIMER_SIGNAL and CPUPROFILE_WALLCLOCK due to\n"
+              " lack of timer_create(). Preload or link to librt.so for\n"
+              " this to work");
+    }
+  }
+
+#if PROFILE_HANDLER_PERF_EVENTS
+  const char *perf_event = getenv("CPUPROFILE_PERF_EVENT");
+
+  if (perf_event && wallclock_enabled_) {
+    RAW_LOG(INFO, "Ignoring CPUPROFILE_PERF_EVENT in wall-clock mode");
+  } else if (perf_event) {
+    // Perf events are per-thread sources too, but do not depend on
+    // timer_create() being available.
+    perf_event_ = ProbePerfEvent(perf_event, signal_number_, frequency_);
+    if (perf_event_ && !per_thread_timer_enabled_) {
+      CreateThreadTimerKey(&thread_timer_key);
+      per_thread_timer_enabled_ = true;
     }
   }
+#endif  // PROFILE_HANDLER_PERF_EVENTS
+
+  if (per_thread_timer_enabled_) {
+    pthread_atfork(BeforeFork, AfterForkInParent, AfterForkInChild);
+  }
 #endif
 
   // If something else is using the signal handler,
@@ -407,8 +797,27 @@ void ProfileHandler::RegisterThread() {
   // Record the thread identifier and start the timer if profiling is on.
 #if HAVE_LINUX_SIGEV_THREAD_ID
   if (per_thread_timer_enabled_) {
-    StartLinuxThreadTimer(timer_type_, signal_number_, frequency_,
-                          thread_timer_key);
+    if (wallclock_enabled_) {
+      last_tick_cpu_ns = ThreadCpuTimeNs();
+    }
+    timer_id_holder* holder;
+#if PROFILE_HANDLER_PERF_EVENTS
+    if (perf_event_) {
+      holder = CreateLinuxThreadPerfEvent(perf_event_, signal_number_,
+                                          frequency_);
+    } else
+#endif
+    holder = CreateLinuxThreadTimer(timer_type_, signal_number_);
+    holder->tid = syscall(SYS_gettid);
+    holder->tag = thread_tag;
+    int rv = tcmalloc::SetTlsValue(thread_timer_key, holder);
+    if (rv) {
+      RAW_LOG(FATAL, "aborting due to tcmalloc::SetTlsValue error: %s", strerror(rv));
+    }
+    thread_timer = holder;
+    holder->next = thread_timers_;
+    thread_timers_ = holder;
+    UpdateThreadTimer(holder);
     return;
   }
 #endif
@@ -485,6 +894,8 @@ void ProfileHandler::Reset() {
   }
   callback_count_ = 0;
   UpdateTimer(false);
+  requested_multiplier_ = 1;
+  timer_multiplier_ = 1;
   // copy gets deleted here
 }
 
@@ -498,8 +909,164 @@ void ProfileHandler::GetState(ProfileHandlerState* state) {
   state->frequency = frequency_;
   state->callback_count = callback_count_;
   state->allowed = allowed_;
+  state->wallclock = wallclock_enabled_;
+  state->interval_multiplier = requested_multiplier_;
+}
+
+void ProfileHandler::SetThreadTag(int tag) {
+  SpinLockHolder cl(&control_lock_);
+#if HAVE_LINUX_SIGEV_THREAD_ID
+  thread_tag = tag;
+  timer_id_holder* holder = thread_timer;
+  if (holder != NULL) {
+    holder->tag = tag;
+    UpdateThreadTimer(holder);
+  }
+#endif
+}
+
+void ProfileHandler::SelectThread(pid_t tid, bool selected) {
+  SpinLockHolder cl(&control_lock_);
+  if (!per_thread_timer_enabled_) {
+    RAW_LOG(INFO, "Thread selection needs per-thread timers, ignoring it");
+    return;
+  }
+  selection_active_ = true;
+  if (selected) {
+    selected_tids_.insert(tid);
+  } else {
+    selected_tids_.erase(tid);
+  }
+#if HAVE_LINUX_SIGEV_THREAD_ID
+  UpdateThreadTimers();
+#endif
+}
+
+void ProfileHandler::SelectThreadTag(int tag, bool selected) {
+  SpinLockHolder cl(&control_lock_);
+  if (!per_thread_timer_enabled_) {
+    RAW_LOG(INFO, "Thread selection needs per-thread timers, ignoring it");
+    return;
+  }
+  selection_active_ = true;
+  if (selected) {
+    selected_tags_.insert(tag);
+  } else {
+    selected_tags_.erase(tag);
+  }
+#if HAVE_LINUX_SIGEV_THREAD_ID
+  UpdateThreadTimers();
+#endif
+}
+
+void ProfileHandler::SelectAllThreads() {
+  SpinLockHolder cl(&control_lock_);
+  selection_active_ = false;
+  selected_tids_.clear();
+  selected_tags_.clear();
+#if HAVE_LINUX_SIGEV_THREAD_ID
+  UpdateThreadTimers();
+#endif
+}
+
+#if HAVE_LINUX_SIGEV_THREAD_ID
+void ProfileHandler::ForgetThreadTimer(timer_id_holder* holder) {
+  SpinLockHolder cl(&control_lock_);
+  for (timer_id_holder** p = &thread_timers_; *p != NULL; p = &(*p)->next) {
+    if (*p == holder) {
+      *p = holder->next;
+      break;
+    }
+  }
+}
+
+void ProfileHandler::UpdateThreadTimer(timer_id_holder* holder) {
+  bool selected = !selection_active_ ||
+                  selected_tids_.count(holder->tid) != 0 ||
+                  selected_tags_.count(holder->tag) != 0;
+  if (selected == holder->armed) {
+    return;
+  }
+  // Serialize with the signal handler of the owning thread, which
+  // re-arms its source when the interval multiplier changes.
+  ScopedSignalBlocker block(signal_number_);
+  SpinLockHolder sl(&signal_lock_);
+  holder->armed = selected;
+  if (selected) {
+    holder->multiplier = requested_multiplier_;
+  }
+  ArmThreadTimer(holder, frequency_, selected);
+}
+
+void ProfileHandler::UpdateThreadTimers() {
+  for (timer_id_holder* holder = thread_timers_; holder != NULL;
+       holder = holder->next) {
+    UpdateThreadTimer(holder);
+  }
+}
+
+// Takes both locks, so that the child does not inherit them locked by
+// another thread (e.g. signal_lock_ from a signal handler).
+void ProfileHandler::BeforeFork() {
+  ProfileHandler* instance = instance_;
+  if (instance == NULL) {
+    return;
+  }
+  instance->control_lock_.Lock();
+  sigset_t sig_set;
+  sigemptyset(&sig_set);
+  sigaddset(&sig_set, instance->signal_number_);
+  RAW_CHECK(sigprocmask(SIG_BLOCK, &sig_set, NULL) == 0,
+            "sigprocmask (block)");
+  instance->signal_lock_.Lock();
+}
+
+// Releases the locks taken by BeforeFork.
+static void UnlockAfterFork(SpinLock* control_lock, SpinLock* signal_lock,
+                            int signal_number) NO_THREAD_SAFETY_ANALYSIS {
+  signal_lock->Unlock();
+  sigset_t sig_set;
+  sigemptyset(&sig_set);
+  sigaddset(&sig_set, signal_number);
+  RAW_CHECK(sigprocmask(SIG_UNBLOCK, &sig_set, NULL) == 0,
+            "sigprocmask (unblock)");
+  control_lock->Unlock();
+}
+
+void ProfileHandler::AfterForkInParent() {
+  ProfileHandler* instance = instance_;
+  if (instance != NULL) {
+    UnlockAfterFork(&instance->control_lock_, &instance->signal_lock_,
+                    instance->signal_number_);
+  }
+}
+
+void ProfileHandler::AfterForkInChild() {
+  ProfileHandler* instance = instance_;
+  if (instance == NULL) {
+    return;
+  }
+  timer_id_holder* holder = instance->thread_timers_;
+  instance->thread_timers_ = NULL;
+  while (holder != NULL) {
+    timer_id_holder* next = holder->next;
+    if (holder->perf_fd >= 0) {
+      close(holder->perf_fd);
+    }
+    delete holder;
+    holder = next;
+  }
+  thread_timer = NULL;
+  tcmalloc::SetTlsValue(instance->thread_timer_key, NULL);
+  UnlockAfterFork(&instance->control_lock_, &instance->signal_lock_,
+                  instance->signal_number_);
 }
 
+static void ForgetExitingThreadTimer(timer_id_holder* holder) {
+  ProfileHandler::Instance()->ForgetThreadTimer(holder);
+}
+#endif
+
 void ProfileHandler::UpdateTimer(bool enable) {
   if (per_thread_timer_enabled_) {
     // Ignore any attempts to disable it because that's not supported, and it's
@@ -514,7 +1081,7 @@ void ProfileHandler::UpdateTimer(bool enable) {
 
   struct itimerval timer;
   static const int kMillion = 1000000;
-  int interval_usec = enable ? kMillion / frequency_ : 0;
+  int interval_usec = enable ? (kMillion / frequency_) * timer_multiplier_ : 0;
   timer.it_interval.tv_sec = interval_usec / kMillion;
   timer.it_interval.tv_usec = interval_usec % kMillion;
   timer.it_value = timer.it_interval;
@@ -535,6 +1102,30 @@ bool ProfileHandler::IsSignalHandlerAvailable() {
   return sa.sa_handler == SIG_IGN || sa.sa_handler == SIG_DFL;
 }
 
+void ProfileHandler::ApplyIntervalMultiplier() {
+  int32_t multiplier = requested_multiplier_.load(std::memory_order_relaxed);
+#if HAVE_LINUX_SIGEV_THREAD_ID
+  if (per_thread_timer_enabled_) {
+    timer_id_holder* holder = thread_timer;
+    if (holder != NULL && holder->armed && holder->multiplier != multiplier) {
+      holder->multiplier = multiplier;
+      SetThreadTimerInterval(holder, frequency_);
+    }
+    return;
+  }
+#endif
+  if (timer_multiplier_ != multiplier) {
+    timer_multiplier_ = multiplier;
+    struct itimerval timer;
+    static const int kMillion = 1000000;
+    int interval_usec = (kMillion / frequency_) * multiplier;
+    timer.it_interval.tv_sec = interval_usec / kMillion;
+    timer.it_interval.tv_usec = interval_usec % kMillion;
+    timer.it_value = timer.it_interval;
+    setitimer(timer_type_, &timer, 0);
+  }
+}
+
 void ProfileHandler::SignalHandler(int sig, siginfo_t* sinfo, void* ucontext) {
   int saved_errno = errno;
   // At this moment, instance_ must be initialized because the handler is
@@ -542,14 +1133,30 @@ void ProfileHandler::SignalHandler(int sig, siginfo_t* sinfo, void* ucontext) {
   // ProfileHandler::Instance runs.
   ProfileHandler* instance = instance_;
   RAW_CHECK(instance != NULL, "ProfileHandler is not initialized");
+  ProfileHandlerTickKind kind = PROFILE_TICK_CPU_TIME;
+  int32_t weight = instance->timer_multiplier_;
+#if HAVE_LINUX_SIGEV_THREAD_ID
+  if (instance->per_thread_timer_enabled_) {
+    weight = (thread_timer != NULL) ? thread_timer->multiplier : 1;
+  }
+  if (instance->wallclock_enabled_) {
+    kind = ClassifyWallclockTick((1000000000 / instance->frequency_) * weight);
+  }
+#endif
   {
     SpinLockHolder sl(&instance->signal_lock_);
     ++instance->interrupts_;
+    instance->tick_kind_ = kind;
+    instance->tick_weight_ = weight;
     for (CallbackIterator it = instance->callbacks_.begin();
          it != instance->callbacks_.end();
          ++it) {
       (*it)->callback(sig, sinfo, ucontext, (*it)->callback_arg);
     }
+    // Don't re-arm a timer that is being stopped.
+    if (!instance->callbacks_.empty()) {
+      instance->ApplyIntervalMultiplier();
+    }
   }
   errno = saved_errno;
 }
@@ -579,6 +1186,37 @@ void ProfileHandlerGetState(ProfileHandlerState* state) {
   ProfileHandler::Instance()->GetState(state);
 }
 
+ProfileHandlerTickKind ProfileHandlerGetTickKind() {
+  return ProfileHandler::CurrentTickKind();
+}
+
+int32_t ProfileHandlerGetTickWeight() {
+  return ProfileHandler::CurrentTickWeight();
+}
+
+void ProfileHandlerSetIntervalMultiplier(int32_t multiplier) {
+  if (multiplier < 1) {
+    multiplier = 1;
+  }
+  ProfileHandler::SetIntervalMultiplier(multiplier);
+}
+
+void ProfileHandlerSetThreadTag(int tag) {
+  ProfileHandler::Instance()->SetThreadTag(tag);
+}
+
+void ProfileHandlerSelectThread(pid_t tid, bool selected) {
+  ProfileHandler::Instance()->SelectThread(tid, selected);
+}
+
+void ProfileHandlerSelectThreadTag(int tag, bool selected) {
+  ProfileHandler::Instance()->SelectThreadTag(tag, selected);
+}
+
+void ProfileHandlerSelectAllThreads() {
+  ProfileHandler::Instance()->SelectAllThreads();
+}
+
 #else  // OS_CYGWIN
 
 // ITIMER_PROF doesn't work under cygwin.  ITIMER_REAL is available, but doesn't
@@ -602,4 +1240,27 @@ void ProfileHandlerReset() {
 void ProfileHandlerGetState(ProfileHandlerState* state) {
 }
 
+ProfileHandlerTickKind ProfileHandlerGetTickKind() {
+  return PROFILE_TICK_CPU_TIME;
+}
+
+int32_t ProfileHandlerGetTickWeight() {
+  return 1;
+}
+
+void ProfileHandlerSetIntervalMultiplier(int32_t multiplier) {
+}
+
+void ProfileHandlerSetThreadTag(int tag) {
+}
+
+void ProfileHandlerSelectThread(pid_t tid, bool selected) {
+}
+
+void ProfileHandlerSelectThreadTag(int tag, bool selected) {
+}
+
+void ProfileHandlerSelectAllThreads() {
+}
+
 #endif  // OS_CYGWIN
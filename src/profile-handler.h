@@ -43,6 +43,19 @@
  * with CPUPROFILE_PER_THREAD_TIMERS. The signal defaults to SIGPROF/SIGALRM to
  * match the choice of timer and can be set to an arbitrary value using
  * CPUPROFILE_TIMER_SIGNAL with CPUPROFILE_PER_THREAD_TIMERS.
+ *
+ * CPUPROFILE_WALLCLOCK selects wall-clock profiling: every registered thread
+ * gets its own CLOCK_MONOTONIC POSIX timer, so threads are sampled whether
+ * they are running or blocked (on locks, I/O, etc). Each such tick is
+ * classified as on-CPU or off-CPU, see ProfileHandlerGetTickKind.
+ *
+ * CPUPROFILE_PERF_EVENT replaces the timers with per-thread perf events
+ * (Linux only), whose counter overflows deliver the signal. If perf events
+ * are unavailable, or the event name is unknown, the timers are used as
+ * usual.
+ *
+ * With per-thread timers, sampling can be restricted to selected threads,
+ * see ProfileHandlerSelectThread.
  */
 
 #ifndef BASE_PROFILE_HANDLER_H_
@@ -50,6 +63,7 @@
 
 #include "config.h"
 #include <signal.h>
+#include <sys/types.h>
 #include "base/basictypes.h"
 
 /* Forward declaration. */
@@ -133,7 +147,67 @@ struct ProfileHandlerState {
   int32_t callback_count;  /* Number of callbacks registered */
   int64_t interrupts;  /* Number of interrupts received */
   bool allowed; /* Profiling is allowed */
+  bool wallclock; /* Threads are sampled on real time */
+  int32_t interval_multiplier; /* Requested interval, in 1/frequency units */
 };
 void ProfileHandlerGetState(struct ProfileHandlerState* state);
 
+/*
+ * Kind of the profiling tick currently being delivered. Ticks of the
+ * default CPU-time timers are always PROFILE_TICK_CPU_TIME. Under
+ * wall-clock profiling, a tick is PROFILE_TICK_ON_CPU if the thread
+ * consumed CPU time for at least half of the preceding sampling interval,
+ * and PROFILE_TICK_OFF_CPU otherwise.
+ */
+enum ProfileHandlerTickKind {
+  PROFILE_TICK_CPU_TIME,
+  PROFILE_TICK_ON_CPU,
+  PROFILE_TICK_OFF_CPU
+};
+
+/*
+ * Returns the kind of the tick being delivered. Unlike the rest of this
+ * interface, it is async-signal-safe and is meant to be called only from
+ * within registered callbacks.
+ */
+ProfileHandlerTickKind ProfileHandlerGetTickKind();
+
+/*
+ * Asks for the profiling timers to fire every 'multiplier' base intervals
+ * (1/frequency) instead of every interval, e.g. to bound the profiling
+ * overhead. The timers are re-armed at their next tick, so it takes a
+ * while for all threads to follow. This function is async-signal-safe
+ * and may be called from callbacks.
+ */
+void ProfileHandlerSetIntervalMultiplier(int32_t multiplier);
+
+/*
+ * Returns the number of base intervals the tick being delivered accounts
+ * for, i.e. the interval multiplier its timer was armed with. Like
+ * ProfileHandlerGetTickKind, it is async-signal-safe and only meant to be
+ * called from within registered callbacks.
+ */
+int32_t ProfileHandlerGetTickWeight();
+
+/*
+ * Thread selection. By default all registered threads are sampled. Once a
+ * thread (by kernel thread id) or a tag is selected, only the threads
+ * selected by id or carrying a selected tag are; the sampling sources of
+ * the others are disarmed, so they receive no signals at all. Requires
+ * per-thread timers (CPUPROFILE_PER_THREAD_TIMERS, CPUPROFILE_WALLCLOCK or
+ * CPUPROFILE_PERF_EVENT) and is ignored otherwise. These functions are
+ * not async-signal-safe.
+ */
+void ProfileHandlerSelectThread(pid_t tid, bool selected);
+void ProfileHandlerSelectThreadTag(int tag, bool selected);
+
+/* Drops the thread selection, so that all threads are sampled again. */
+void ProfileHandlerSelectAllThreads();
+
+/*
+ * Sets the tag of the calling thread, e.g. to group a thread pool. Threads
+ * start with tag 0. May be called before the thread is registered.
+ */
+void ProfileHandlerSetThreadTag(int tag);
+
 #endif  /* BASE_PROFILE_HANDLER_H_ */
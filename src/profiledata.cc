@@ -54,9 +54,12 @@
 
 // All of these are initialized in profiledata.h.
 const int ProfileData::kMaxStackDepth;
+const int ProfileData::kMaxLabels;
 const int ProfileData::kAssociativity;
 const int ProfileData::kBuckets;
 const int ProfileData::kBufferLength;
+const int ProfileData::kLabeledVersion;
+const int ProfileData::kLabelRecordMarker;
 
 ProfileData::Options::Options()
     : frequency_(1) {
@@ -66,12 +69,39 @@ ProfileData::Options::Options()
 // re-entrant).  However, that's not part of its public interface.
 void ProfileData::Evict(const Entry& entry) {
   const int d = entry.depth;
-  const int nslots = d + 2;     // Number of slots needed in eviction buffer
+  int num_labels = 0;
+  for (int k = 0; k < kMaxLabels; k++) {
+    num_labels += (entry.labels[k] != 0);
+  }
+  if (num_labels > 0 && !labeled_ && !drop_labels_) {
+    labeled_ = SetLabeledVersion();
+    drop_labels_ = !labeled_;
+  }
+  if (drop_labels_) {
+    num_labels = 0;
+  }
+  // Number of slots needed in eviction buffer
+  const int label_slots = (num_labels > 0) ? 3 + 2 * num_labels : 0;
+  const int nslots = d + 2 + label_slots;
   if (num_evicted_ + nslots > kBufferLength) {
     FlushEvicted();
     assert(num_evicted_ == 0);
     assert(nslots <= kBufferLength);
   }
+  if (num_labels > 0) {
+    // The label record holds (key, value) pairs and applies to the
+    // sample record that follows it.  Its count of 0 makes readers that
+    // don't know about labels ignore it.
+    evict_[num_evicted_++] = 0;
+    evict_[num_evicted_++] = 1 + 2 * num_labels;
+    evict_[num_evicted_++] = kLabelRecordMarker;
+    for (int k = 0; k < kMaxLabels; k++) {
+      if (entry.labels[k] != 0) {
+        evict_[num_evicted_++] = k;
+        evict_[num_evicted_++] = entry.labels[k];
+      }
+    }
+  }
   evict_[num_evicted_++] = entry.count;
   evict_[num_evicted_++] = d;
   memcpy(&evict_[num_evicted_], entry.stack, d * sizeof(Slot));
@@ -87,7 +117,9 @@ ProfileData::ProfileData()
       evictions_(0),
       total_bytes_(0),
       fname_(0),
-      start_time_(0) {
+      start_time_(0),
+      labeled_(false),
+      drop_labels_(false) {
 }
 
 bool ProfileData::Start(const char* fname,
@@ -111,6 +143,8 @@ bool ProfileData::Start(const char* fname,
   count_       = 0;
   evictions_   = 0;
   total_bytes_ = 0;
+  labeled_     = false;
+  drop_labels_ = false;
 
   hash_ = new Bucket[kBuckets];
   evict_ = new Slot[kBufferLength];
@@ -147,6 +181,20 @@ static void FDWrite(int fd, const char* buf, size_t len) {
   }
 }
 
+bool ProfileData::SetLabeledVersion() {
+  static const int kVersionSlot = 2;
+  if (total_bytes_ == 0) {
+    // The header is still at the start of the eviction buffer.
+    evict_[kVersionSlot] = kLabeledVersion;
+    return true;
+  }
+  const Slot version = kLabeledVersion;
+  ssize_t r;
+  NO_INTR(r = pwrite(out_, &version, sizeof(version),
+                     kVersionSlot * sizeof(Slot)));
+  return r == sizeof(version);
+}
+
 void ProfileData::Stop() {
   if (!enabled()) {
     return;
@@ -243,7 +291,8 @@ void ProfileData::FlushTable() {
   FlushEvicted();
 }
 
-void ProfileData::Add(int depth, const void* const* stack) {
+void ProfileData::Add(int depth, const void* const* stack,
+                      const uintptr_t* labels, int count) {
   if (!enabled()) {
     return;
   }
@@ -251,6 +300,11 @@ void ProfileData::Add(int depth, const void* const* stack) {
   if (depth > kMaxStackDepth) depth = kMaxStackDepth;
   RAW_CHECK(depth > 0, "ProfileData::Add depth <= 0");
 
+  static const Slot kNoLabels[kMaxLabels] = {};
+  if (labels == NULL) {
+    labels = kNoLabels;
+  }
+
   // Make hash-value
   Slot h = 0;
   for (int i = 0; i < depth; i++) {
@@ -258,6 +312,10 @@ void ProfileData::Add(int depth, const void* const* stack) {
     h = (h << 8) | (h >> (8*(sizeof(h)-1)));
     h += (slot * 31) + (slot * 7) + (slot * 3);
   }
+  for (int k = 0; k < kMaxLabels; k++) {
+    h = (h << 8) | (h >> (8*(sizeof(h)-1)));
+    h += labels[k] * 31;
+  }
 
   count_++;
 
@@ -266,7 +324,8 @@ void ProfileData::Add(int depth, const void* const* stack) {
   Bucket* bucket = &hash_[h % kBuckets];
   for (int a = 0; a < kAssociativity; a++) {
     Entry* e = &bucket->entry[a];
-    if (e->depth == depth) {
+    if (e->depth == depth &&
+        memcmp(e->labels, labels, sizeof(e->labels)) == 0) {
       bool match = true;
       for (int i = 0; i < depth; i++) {
         if (e->stack[i] != reinterpret_cast<Slot>(stack[i])) {
@@ -275,7 +334,7 @@ void ProfileData::Add(int depth, const void* const* stack) {
         }
       }
       if (match) {
-        e->count++;
+        e->count += count;
         done = true;
         break;
       }
@@ -297,7 +356,8 @@ void ProfileData::Add(int depth, const void* const* stack) {
 
     // Use the newly evicted entry
     e->depth = depth;
-    e->count = 1;
+    e->count = count;
+    memcpy(e->labels, labels, sizeof(e->labels));
     for (int i = 0; i < depth; i++) {
       e->stack[i] = reinterpret_cast<Slot>(stack[i]);
     }
@@ -48,9 +48,9 @@
 
 // A class that accumulates profile samples and writes them to a file.
 //
-// Each sample contains a stack trace and a count.  Memory usage is
-// reduced by combining profile samples that have the same stack trace
-// by adding up the associated counts.
+// Each sample contains a stack trace, an optional set of labels and a
+// count.  Memory usage is reduced by combining profile samples that have
+// the same stack trace and labels by adding up the associated counts.
 //
 // Profile data is accumulated in a bounded amount of memory, and will
 // flushed to a file as necessary to stay within the memory limit.
@@ -102,6 +102,7 @@ class ProfileData {
   };
 
   static const int kMaxStackDepth = 254;  // Max stack depth stored in profile
+  static const int kMaxLabels = 4;        // Max labels per sample
 
   ProfileData();
   ~ProfileData();
@@ -126,11 +127,15 @@ class ProfileData {
   // If data collection is enabled, record a sample with 'depth'
   // entries from 'stack'.  (depth must be > 0.)  At most
   // kMaxStackDepth stack entries will be recorded, starting with
-  // stack[0].
+  // stack[0].  If 'labels' is not NULL, it holds the values of the
+  // kMaxLabels labels of the sample, indexed by label key; a value of
+  // 0 means the label is not set.  The sample is counted 'count' times,
+  // e.g. when it stands for several sampling periods.
   //
   // This function is safe to call from asynchronous signals (but is
   // not re-entrant).
-  void Add(int depth, const void* const* stack);
+  void Add(int depth, const void* const* stack,
+           const uintptr_t* labels = NULL, int count = 1);
 
   // If data collection is enabled, write the data to disk (and leave
   // the collector enabled).
@@ -147,6 +152,14 @@ class ProfileData {
   static const int kBuckets = 1 << 10;          // For hashtable
   static const int kBufferLength = 1 << 18;     // For eviction buffer
 
+  // Profiles containing labeled samples are written with format
+  // version kLabeledVersion, and each labeled sample is preceded by a
+  // label record starting with kLabelRecordMarker, see
+  // docs/cpuprofile-fileformat.html.  Profiles without labels keep
+  // version 0 and are unchanged.
+  static const int kLabeledVersion = 1;
+  static const int kLabelRecordMarker = 1;
+
   // Type of slots: each slot can be either a count, or a PC value
   typedef uintptr_t Slot;
 
@@ -154,6 +167,7 @@ class ProfileData {
   struct Entry {
     Slot count;                  // Number of hits
     Slot depth;                  // Stack depth
+    Slot labels[kMaxLabels];     // Label values by key (0 if not set)
     Slot stack[kMaxStackDepth];  // Stack contents
   };
 
@@ -171,6 +185,8 @@ class ProfileData {
   size_t        total_bytes_;   // How much output
   char*         fname_;         // Profile file name
   time_t        start_time_;    // Start time, or 0
+  bool          labeled_;       // Header says version kLabeledVersion?
+  bool          drop_labels_;   // Header could not be updated
 
   // Move 'entry' to the eviction buffer.
   void Evict(const Entry& entry);
@@ -178,6 +194,11 @@ class ProfileData {
   // Write contents of eviction buffer to disk.
   void FlushEvicted();
 
+  // Switch the header to format version kLabeledVersion, in the
+  // eviction buffer if the header was not written yet, else in the
+  // file.  Returns false if the file cannot be updated (e.g. a pipe).
+  bool SetLabeledVersion();
+
   DISALLOW_COPY_AND_ASSIGN(ProfileData);
 };
 
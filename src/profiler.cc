@@ -55,6 +55,7 @@ typedef ucontext ucontext_t;
 typedef int ucontext_t;   // just to quiet the compiler, mostly
 #endif
 #include <sys/time.h>
+#include <time.h>          // for clock_gettime()
 #include <string>
 #include <gperftools/profiler.h>
 #include <gperftools/stacktrace.h>
@@ -65,6 +66,8 @@ typedef int ucontext_t;   // just to quiet the compiler, mostly
 #include "base/sysinfo.h"             /* for GetUniquePathFromEnv, etc */
 #include "profiledata.h"
 #include "profile-handler.h"
+#include "stack_fold.h"
+#include "stacktrace_internal.h"
 
 using std::string;
 
@@ -126,6 +129,29 @@ class CpuProfiler {
   // ProfileHandlerUnregisterCallback.
   ProfileHandlerToken* prof_handler_token_;
 
+  // Adaptive sampling state. Set at start, and then only touched in the
+  // context of SIGPROF interrupt.
+  //
+  // With CPUPROFILE_OVERHEAD_BUDGET, prof_handler measures its own cost
+  // and stretches the sampling interval to a multiple of the base
+  // interval so that the cost stays within the budget. Samples are then
+  // weighted by the multiplier their tick was taken with, so the profile
+  // keeps the base sampling period.
+  int64_t       overhead_budget_ppm_;  // Budget in parts per million of CPU
+                                       // time, or 0 if disabled.
+  int64_t       base_interval_ns_;     // Sampling period at full frequency
+  int64_t       handler_cost_ns_;      // Moving average of handler cost
+  int32_t       interval_multiplier_;  // Multiplier we asked for
+
+  // With CPUPROFILE_FOLD_RECURSION, repeated frames of recursive calls
+  // are folded (see stack_fold.h) before samples are recorded. Set at
+  // start, read in the context of SIGPROF interrupt.
+  bool          fold_recursion_;
+
+  // Folds 'cost_ns', the cost of the latest prof_handler run, into
+  // handler_cost_ns_ and adjusts the sampling interval.
+  void AdaptInterval(int64_t cost_ns);
+
   // Sets up a callback to receive SIGPROF interrupt.
   void EnableHandler();
 
@@ -137,6 +163,31 @@ class CpuProfiler {
                            void* cpu_profiler);
 };
 
+// Under wall-clock profiling (CPUPROFILE_WALLCLOCK) every sample gets
+// one of these functions appended as its outermost frame, so that one
+// profile carries both views: e.g. "pprof --focus=ProfilerWallclockOffCPU"
+// shows only the time threads spent blocked. They are never called.
+extern "C" ATTRIBUTE_NOINLINE void ProfilerWallclockOnCPU() {
+  __asm__ __volatile__("" ::: "memory");
+}
+extern "C" ATTRIBUTE_NOINLINE void ProfilerWallclockOffCPU() {
+  __asm__ __volatile__("" ::: "memory");
+}
+
+// Returns the pseudo return address identifying 'marker' in the
+// profile. pprof subtracts one from all but the leaf address of each
+// stack, so we add it back to land inside the marker function.
+static void* WallclockMarkerPC(void (*marker)()) {
+  return reinterpret_cast<void*>(reinterpret_cast<uintptr_t>(marker) + 1);
+}
+
+static_assert(PROFILER_MAX_LABELS == ProfileData::kMaxLabels,
+              "ProfileData must be able to record all thread labels");
+
+// Labels of the current thread, as set by ProfilerSetLabel. Read by
+// prof_handler, which runs on the interrupted thread.
+static __thread uintptr_t thread_labels[PROFILER_MAX_LABELS] ATTR_INITIAL_EXEC;
+
 // Signal handler that is registered when a user selectable signal
 // number is defined in the environment variable CPUPROFILESIGNAL.
 static void CpuProfilerSwitch(int signal_number)
@@ -173,9 +224,23 @@ static void CpuProfilerSwitch(int signal_number)
 // out to disk.
 CpuProfiler CpuProfiler::instance_;
 
+// Largest multiple of the base sampling interval adaptive sampling uses.
+static const int32_t kMaxIntervalMultiplier = 100;
+
+static int64_t MonotonicNowNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<int64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
 // Initialize profiling: activated if getenv("CPUPROFILE") exists.
 CpuProfiler::CpuProfiler()
-    : prof_handler_token_(NULL) {
+    : prof_handler_token_(NULL),
+      overhead_budget_ppm_(0),
+      base_interval_ns_(0),
+      handler_cost_ns_(0),
+      interval_multiplier_(1),
+      fold_recursion_(false) {
   // TODO(cgd) Move this code *out* of the CpuProfile constructor into a
   // separate object responsible for initialization. With ProfileHandler there
   // is no need to limit the number of profilers.
@@ -247,6 +312,28 @@ bool CpuProfiler::Start(const char* fname, const ProfilerOptions* options) {
     filter_arg_ = options->filter_in_thread_arg;
   }
 
+  // Overhead budget for adaptive sampling, in percent of CPU time.
+  overhead_budget_ppm_ = 0;
+  const char* budget = getenv("CPUPROFILE_OVERHEAD_BUDGET");
+  if (budget != NULL) {
+    double percent = strtod(budget, NULL);
+    if (percent > 0 && percent < 100) {
+      overhead_budget_ppm_ = static_cast<int64_t>(percent * 10000);
+    }
+  }
+  base_interval_ns_ = 1000000000 / prof_handler_state.frequency;
+  fold_recursion_ = EnvToBool("CPUPROFILE_FOLD_RECURSION", false);
+  handler_cost_ns_ = 0;
+  interval_multiplier_ = 1;
+  ProfileHandlerSetIntervalMultiplier(1);
+
+  // Take one backtrace outside of signal handler, so that stacktrace
+  // implementations that set up things lazily (e.g. eh_frame's unwind
+  // tables) are ready by the first SIGPROF.
+  void* warmup[1];
+  GetStackTrace(warmup, arraysize(warmup), 0);
+  tcmalloc::RefreshStackTraceTables();
+
   // Setup handler for SIGPROF interrupts
   EnableHandler();
 
@@ -272,6 +359,12 @@ void CpuProfiler::Stop() {
   // DisableHandler waits for the currently running callback to complete and
   // guarantees no future invocations. It is safe to stop the collector.
   collector_.Stop();
+
+  if (overhead_budget_ppm_ != 0) {
+    fprintf(stderr, "PROFILE: sampling interval multiplier/handler ns = "
+            "%d/%lld\n", interval_multiplier_,
+            static_cast<long long>(handler_cost_ns_));
+  }
 }
 
 void CpuProfiler::FlushTable() {
@@ -289,6 +382,9 @@ void CpuProfiler::FlushTable() {
   // guarantees no future invocations. It is safe to flush the profile data.
   collector_.FlushTable();
 
+  // Let backtraces from now on go through objects loaded meanwhile.
+  tcmalloc::RefreshStackTraceTables();
+
   EnableHandler();
 }
 
@@ -336,6 +432,11 @@ void CpuProfiler::prof_handler(int sig, siginfo_t*, void* signal_ucontext,
 
   if (instance->filter_ == NULL ||
       (*instance->filter_)(instance->filter_arg_)) {
+    int64_t start_ns = 0;
+    if (instance->overhead_budget_ppm_ != 0) {
+      start_ns = MonotonicNowNs();
+    }
+
     void* stack[ProfileData::kMaxStackDepth];
 
     // Under frame-pointer-based unwinding at least on x86, the
@@ -363,13 +464,75 @@ void CpuProfiler::prof_handler(int sig, siginfo_t*, void* signal_ucontext,
       depth++;  // To account for pc value in stack[0];
     }
 
-    instance->collector_.Add(depth, used_stack);
+    if (instance->fold_recursion_) {
+      depth = tcmalloc::FoldRecursion(used_stack, depth);
+    }
+
+    ProfileHandlerTickKind kind = ProfileHandlerGetTickKind();
+    if (kind != PROFILE_TICK_CPU_TIME) {
+      // Tag the sample with its on/off-CPU marker frame, dropping the
+      // outermost real frame if the stack is full.
+      int marker_index = used_stack + depth - stack;
+      if (marker_index >= static_cast<int>(arraysize(stack))) {
+        marker_index = arraysize(stack) - 1;
+        depth--;
+      }
+      stack[marker_index] = WallclockMarkerPC(kind == PROFILE_TICK_ON_CPU
+                                              ? ProfilerWallclockOnCPU
+                                              : ProfilerWallclockOffCPU);
+      depth++;
+    }
+
+    instance->collector_.Add(depth, used_stack, thread_labels,
+                             ProfileHandlerGetTickWeight());
+
+    if (instance->overhead_budget_ppm_ != 0) {
+      instance->AdaptInterval(MonotonicNowNs() - start_ns);
+    }
+  }
+}
+
+// Called from prof_handler only, so there is no concurrent access to the
+// adaptive sampling state.
+void CpuProfiler::AdaptInterval(int64_t cost_ns) {
+  // Exponential moving average, giving new samples a weight of 1/16. It
+  // starts from 0 rather than from the first (cold cache) sample, which
+  // tends to be an outlier.
+  handler_cost_ns_ += (cost_ns - handler_cost_ns_) / 16;
+
+  // Handler cost we can afford per base interval.
+  int64_t budget_ns = base_interval_ns_ * overhead_budget_ppm_ / 1000000;
+  if (budget_ns < 1) {
+    budget_ns = 1;
+  }
+
+  // Stretch the interval as soon as we are over budget, but only shrink
+  // it back once there is some headroom, so that we don't flip-flop
+  // (and re-arm timers) on every tick.
+  int64_t needed = (handler_cost_ns_ + budget_ns - 1) / budget_ns;
+  int64_t relaxed = (handler_cost_ns_ * 5 / 4 + budget_ns - 1) / budget_ns;
+  int64_t multiplier = interval_multiplier_;
+  if (needed > multiplier) {
+    multiplier = needed;
+  } else if (relaxed < multiplier) {
+    multiplier = relaxed;
+  }
+  if (multiplier < 1) {
+    multiplier = 1;
+  } else if (multiplier > kMaxIntervalMultiplier) {
+    multiplier = kMaxIntervalMultiplier;
+  }
+
+  if (multiplier != interval_multiplier_) {
+    interval_multiplier_ = multiplier;
+    ProfileHandlerSetIntervalMultiplier(multiplier);
   }
 }
 
 #if !(defined(__CYGWIN__) || defined(__CYGWIN32__))
 
 extern "C" PERFTOOLS_DLL_DECL void ProfilerRegisterThread() {
+  tcmalloc::RefreshStackTraceTables();
   ProfileHandlerRegisterThread();
 }
 
@@ -404,6 +567,37 @@ extern "C" PERFTOOLS_DLL_DECL int ProfilerGetStackTrace(
   return GetStackTraceWithContext(result, max_depth, skip_count, uc);
 }
 
+extern "C" PERFTOOLS_DLL_DECL void ProfilerSetLabel(int key, uintptr_t value) {
+  if (static_cast<unsigned>(key) < PROFILER_MAX_LABELS) {
+    thread_labels[key] = value;
+  }
+}
+
+extern "C" PERFTOOLS_DLL_DECL uintptr_t ProfilerGetLabel(int key) {
+  if (static_cast<unsigned>(key) < PROFILER_MAX_LABELS) {
+    return thread_labels[key];
+  }
+  return 0;
+}
+
+extern "C" PERFTOOLS_DLL_DECL void ProfilerSetThreadTag(int tag) {
+  ProfileHandlerSetThreadTag(tag);
+}
+
+extern "C" PERFTOOLS_DLL_DECL void ProfilerSelectThread(long tid,
+                                                        int selected) {
+  ProfileHandlerSelectThread(tid, selected != 0);
+}
+
+extern "C" PERFTOOLS_DLL_DECL void ProfilerSelectThreadTag(int tag,
+                                                           int selected) {
+  ProfileHandlerSelectThreadTag(tag, selected != 0);
+}
+
+extern "C" PERFTOOLS_DLL_DECL void ProfilerSelectAllThreads() {
+  ProfileHandlerSelectAllThreads();
+}
+
 #else  // OS_CYGWIN
 
 // ITIMER_PROF doesn't work under cygwin.  ITIMER_REAL is available, but doesn't
@@ -426,6 +620,12 @@ extern "C" int ProfilerGetStackTrace(
     void** result, int max_depth, int skip_count, const void *uc) {
   return 0;
 }
+extern "C" void ProfilerSetLabel(int key, uintptr_t value) { }
+extern "C" uintptr_t ProfilerGetLabel(int key) { return 0; }
+extern "C" void ProfilerSetThreadTag(int tag) { }
+extern "C" void ProfilerSelectThread(long tid, int selected) { }
+extern "C" void ProfilerSelectThreadTag(int tag, int selected) { }
+extern "C" void ProfilerSelectAllThreads() { }
 
 #endif  // OS_CYGWIN
 
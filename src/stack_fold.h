@@ -0,0 +1,121 @@
+/* -*- Mode: C++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+ * Copyright (c) 2024, gperftools Contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *     * Neither the name of Google Inc. nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// Recursion folding for recorded stacks. Deep recursion fills stacks
+// with the same few frames over and over. FoldRecursion replaces every
+// run of a repeated cycle of up to kMaxFoldPeriod frames with a single
+// copy of the cycle followed by a marker pseudo-pc that encodes cycle
+// length and repeat count. pprof recognizes markers and expands them
+// back, so profiles read the same as without folding.
+//
+// Markers live in [kFoldMarkerBase, kFoldMarkerLimit), which is never
+// mapped, so they can't be confused with real code addresses.
+//
+// Everything here is async-signal-safe and doesn't allocate, so it can
+// be used from cpu profiler's signal handler and from malloc hooks.
+#ifndef STACK_FOLD_H_
+#define STACK_FOLD_H_
+
+#include "config.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace tcmalloc {
+
+constexpr uintptr_t kFoldMarkerBase = 0x1000;
+constexpr uintptr_t kFoldMarkerLimit = 0x10000;
+constexpr int kMaxFoldPeriod = 4;
+constexpr int kMaxFoldCount =
+  (kFoldMarkerLimit - kFoldMarkerBase) / kMaxFoldPeriod - 1;
+
+inline void* FoldMarker(int period, int count) {
+  return reinterpret_cast<void*>(
+    kFoldMarkerBase + uintptr_t(count) * kMaxFoldPeriod + (period - 1));
+}
+
+inline bool IsFoldMarker(const void* pc, int* period, int* count) {
+  uintptr_t v = reinterpret_cast<uintptr_t>(pc);
+  if (v < kFoldMarkerBase || v >= kFoldMarkerLimit) {
+    return false;
+  }
+  v -= kFoldMarkerBase;
+  *period = v % kMaxFoldPeriod + 1;
+  *count = v / kMaxFoldPeriod;
+  return true;
+}
+
+// Folds repeated cycles of 'stack' in place and returns new depth.
+// Folding is only done where it makes stack shorter.
+inline int FoldRecursion(void** stack, int depth) {
+  int out = 0;
+  int i = 0;
+  while (i < depth) {
+    int best_period = 0;
+    int best_count = 1;
+    for (int period = 1; period <= kMaxFoldPeriod && i + 2 * period <= depth; period++) {
+      int count = 1;
+      while (count < kMaxFoldCount && i + (count + 1) * period <= depth) {
+        void** a = stack + i;
+        void** b = stack + i + count * period;
+        int k = 0;
+        while (k < period && a[k] == b[k]) {
+          k++;
+        }
+        if (k < period) {
+          break;
+        }
+        count++;
+      }
+      if (count * period > best_count * best_period) {
+        best_period = period;
+        best_count = count;
+      }
+    }
+
+    // Cycle plus marker must be shorter than what it replaces.
+    if (best_count * best_period > best_period + 1) {
+      for (int k = 0; k < best_period; k++) {
+        stack[out + k] = stack[i + k];
+      }
+      out += best_period;
+      stack[out++] = FoldMarker(best_period, best_count);
+      i += best_count * best_period;
+    } else {
+      stack[out++] = stack[i++];
+    }
+  }
+  return out;
+}
+
+}  // namespace tcmalloc
+
+#endif  // STACK_FOLD_H_
@@ -0,0 +1,193 @@
+/* -*- Mode: C++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+ * Copyright (c) 2024, gperftools Contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *     * Neither the name of Google Inc. nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+
+#include "stack_intern_table.h"
+
+#include <algorithm>
+#include <atomic>
+
+#include "base/logging.h"
+#include "base/spinlock.h"
+#include "mmap_hook.h"
+
+namespace tcmalloc {
+
+namespace {
+
+// Entries are immutable once published. Frames follow the entry
+// itself.
+struct Entry {
+  Entry* next;  // next entry in hash chain
+  uintptr_t hash;
+  uint32_t id;
+  int depth;
+
+  const void** stack() { return reinterpret_cast<const void**>(this + 1); }
+};
+
+constexpr unsigned int kTableSize = 179999;
+
+// id -> Entry* mapping is 2-level array of kChunkSize-sized chunks.
+constexpr int kChunkBits = 12;
+constexpr uint32_t kChunkSize = uint32_t{1} << kChunkBits;
+constexpr uint32_t kMaxChunks = 4096;
+
+// Entries are bump-allocated out of arenas of this size.
+constexpr size_t kArenaSize = 1 << 20;
+
+SpinLock lock;
+
+std::atomic<std::atomic<Entry*>*> table;
+std::atomic<Entry**> chunks[kMaxChunks];
+
+// All below are GUARDED_BY(lock)
+uint32_t next_id = 1;
+char* arena_pos;
+char* arena_end;
+
+std::atomic<uint32_t> count;
+std::atomic<size_t> bytes_used;
+
+void* AllocLocked(size_t size) {
+  size = (size + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+  if (arena_end - arena_pos < static_cast<ptrdiff_t>(size)) {
+    if (size > kArenaSize / 4) {
+      // Not worth wasting rest of current arena.
+      DirectAnonMMapResult res = DirectAnonMMap(false, size);
+      RAW_CHECK(res.success, "failed to allocate memory for stack table");
+      bytes_used.fetch_add(size, std::memory_order_relaxed);
+      return res.addr;
+    }
+    DirectAnonMMapResult res = DirectAnonMMap(false, kArenaSize);
+    RAW_CHECK(res.success, "failed to allocate memory for stack table");
+    arena_pos = static_cast<char*>(res.addr);
+    arena_end = arena_pos + kArenaSize;
+  }
+  void* rv = arena_pos;
+  arena_pos += size;
+  bytes_used.fetch_add(size, std::memory_order_relaxed);
+  return rv;
+}
+
+Entry* FindInChain(Entry* e, const void* const stack[], int depth, uintptr_t hash) {
+  for (; e != nullptr; e = e->next) {
+    if (e->hash == hash && e->depth == depth
+        && std::equal(stack, stack + depth, e->stack())) {
+      return e;
+    }
+  }
+  return nullptr;
+}
+
+Entry* GetEntry(uint32_t id) {
+  RAW_DCHECK(id != StackInternTable::kNoId, "");
+  Entry** chunk = chunks[id >> kChunkBits].load(std::memory_order_acquire);
+  RAW_DCHECK(chunk != nullptr, "");
+  return chunk[id & (kChunkSize - 1)];
+}
+
+}  // namespace
+
+uint32_t StackInternTable::Intern(const void* const stack[], int depth, uintptr_t hash) {
+  unsigned int index = static_cast<unsigned int>(hash) % kTableSize;
+
+  // Common case: the stack is already known.
+  std::atomic<Entry*>* t = table.load(std::memory_order_acquire);
+  if (t != nullptr) {
+    Entry* e = FindInChain(t[index].load(std::memory_order_acquire), stack, depth, hash);
+    if (e != nullptr) {
+      return e->id;
+    }
+  }
+
+  SpinLockHolder h(&lock);
+
+  t = table.load(std::memory_order_relaxed);
+  if (t == nullptr) {
+    // Fresh mmap-ed memory is all zeros, i.e. null heads.
+    t = static_cast<std::atomic<Entry*>*>(AllocLocked(sizeof(*t) * kTableSize));
+    table.store(t, std::memory_order_release);
+  }
+
+  // Somebody could have added it while we didn't hold the lock.
+  Entry* head = t[index].load(std::memory_order_relaxed);
+  Entry* e = FindInChain(head, stack, depth, hash);
+  if (e != nullptr) {
+    return e->id;
+  }
+
+  uint32_t id = next_id;
+  RAW_CHECK(id < kMaxChunks * kChunkSize, "too many unique stacks");
+  std::atomic<Entry**>* chunk = &chunks[id >> kChunkBits];
+  if (chunk->load(std::memory_order_relaxed) == nullptr) {
+    chunk->store(static_cast<Entry**>(AllocLocked(sizeof(Entry*) * kChunkSize)),
+                 std::memory_order_release);
+  }
+
+  e = static_cast<Entry*>(AllocLocked(sizeof(Entry) + sizeof(stack[0]) * depth));
+  e->next = head;
+  e->hash = hash;
+  e->id = id;
+  e->depth = depth;
+  std::copy(stack, stack + depth, e->stack());
+
+  chunk->load(std::memory_order_relaxed)[id & (kChunkSize - 1)] = e;
+  next_id = id + 1;
+  count.store(id, std::memory_order_relaxed);
+
+  // Publish it to lock-free readers above.
+  t[index].store(e, std::memory_order_release);
+  return id;
+}
+
+const void* const* StackInternTable::Get(uint32_t id, int* depth) {
+  Entry* e = GetEntry(id);
+  if (depth != nullptr) {
+    *depth = e->depth;
+  }
+  return e->stack();
+}
+
+uintptr_t StackInternTable::GetHash(uint32_t id) {
+  return GetEntry(id)->hash;
+}
+
+uint32_t StackInternTable::Count() {
+  return count.load(std::memory_order_relaxed);
+}
+
+size_t StackInternTable::BytesUsed() {
+  return bytes_used.load(std::memory_order_relaxed);
+}
+
+}  // namespace tcmalloc
@@ -0,0 +1,112 @@
+/* -*- Mode: C++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+ * Copyright (c) 2024, gperftools Contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *     * Neither the name of Google Inc. nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// StackInternTable is a process-wide set of unique call stacks. Every
+// distinct stack is stored exactly once and is referred to by a
+// 32-bit id. Heap profiler, heap checker and MemoryRegionMap buckets
+// all refer to their stacks through it, so a stack seen by several of
+// them is stored once and bucket lookups compare ids rather than
+// arrays of program counters.
+//
+// Stacks are never removed. Lookups are lock-free. Inserts take a
+// spinlock which is never held while calling anything but mmap
+// (bypassing mmap hooks), so it is safe to intern stacks while
+// holding heap profiler's or MemoryRegionMap's locks and from inside
+// malloc and mmap hooks.
+#ifndef STACK_INTERN_TABLE_H_
+#define STACK_INTERN_TABLE_H_
+
+#include "config.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace tcmalloc {
+
+class StackInternTable {
+ public:
+  // Ids are never 0, so 0 can be used as "no stack" by clients.
+  static constexpr uint32_t kNoId = 0;
+
+  // Hash of a stack trace, computed one frame at a time. This is the
+  // same hash heap profiler used for its buckets, and it can be fed
+  // frames as they are produced.
+  class Hasher {
+   public:
+    void Add(const void* pc) {
+      h_ += reinterpret_cast<uintptr_t>(pc);
+      h_ += h_ << 10;
+      h_ ^= h_ >> 6;
+    }
+
+    uintptr_t Finish() const {
+      uintptr_t h = h_;
+      h += h << 3;
+      h ^= h >> 11;
+      return h;
+    }
+
+   private:
+    uintptr_t h_ = 0;
+  };
+
+  static uintptr_t Hash(const void* const stack[], int depth) {
+    Hasher hasher;
+    for (int i = 0; i < depth; i++) {
+      hasher.Add(stack[i]);
+    }
+    return hasher.Finish();
+  }
+
+  // Returns id of given stack, adding it to the table if it isn't
+  // there yet. 'hash' must be Hash(stack, depth).
+  static uint32_t Intern(const void* const stack[], int depth, uintptr_t hash);
+
+  static uint32_t Intern(const void* const stack[], int depth) {
+    return Intern(stack, depth, Hash(stack, depth));
+  }
+
+  // Returns stack with given id. Returned memory stays valid (and
+  // unchanged) forever.
+  static const void* const* Get(uint32_t id, int* depth);
+
+  // Returns hash of stack with given id.
+  static uintptr_t GetHash(uint32_t id);
+
+  // Returns number of unique stacks interned so far and memory used
+  // to store them.
+  static uint32_t Count();
+  static size_t BytesUsed();
+};
+
+}  // namespace tcmalloc
+
+#endif  // STACK_INTERN_TABLE_H_
@@ -62,18 +62,30 @@
 //
 // 5) On windows we use RtlCaptureStackBackTrace.
 //
+// 6) Our own eh_frame unwinder (x86-64 Linux only). It turns unwind
+//    info of all loaded objects into lookup tables once, so that
+//    unwinding itself takes no locks and doesn't call malloc.
+//
+// 7) libgcc_cached and libunwind_cached (x86-64 Linux only) put a
+//    cache of unwind steps keyed by pc in front of 2) or 3), so that
+//    repeated backtraces through already seen code don't involve
+//    DWARF interpretation.
+//
 // Note: if you add a new implementation here, make sure it works
 // correctly when GetStackTrace() is called with max_depth == 0.
 // Some code may do that.
 
 #include <config.h>
+#include <stdint.h>
 #include <stdlib.h> // for getenv
 #include <string.h> // for strcmp
 #include <stdio.h> // for fprintf
 #include "gperftools/stacktrace.h"
 #include "base/commandlineflags.h"
 #include "base/googleinit.h"
+#include "base/elf_mem_image.h"  // for HAVE_ELF_MEM_IMAGE
 #include "getenv_safe.h"
+#include "stacktrace_internal.h"
 
 
 // we're using plain struct and not class to avoid any possible issues
@@ -111,6 +123,17 @@ struct GetStackImplementation {
 #undef GST_SUFFIX
 #undef STACKTRACE_INL_HEADER
 #define HAVE_GST_libgcc
+
+#ifdef HAVE_STACKTRACE_STEP_CACHE
+#define TCMALLOC_CACHED_UNWIND_STEPS 1
+#define STACKTRACE_INL_HEADER "stacktrace_libgcc-inl.h"
+#define GST_SUFFIX libgcc_cached
+#include "stacktrace_impl_setup-inl.h"
+#undef GST_SUFFIX
+#undef STACKTRACE_INL_HEADER
+#undef TCMALLOC_CACHED_UNWIND_STEPS
+#define HAVE_GST_libgcc_cached
+#endif
 #endif
 
 // libunwind uses __thread so we check for both libunwind.h and
@@ -122,6 +145,17 @@ struct GetStackImplementation {
 #undef GST_SUFFIX
 #undef STACKTRACE_INL_HEADER
 #define HAVE_GST_libunwind
+
+#ifdef HAVE_STACKTRACE_STEP_CACHE
+#define TCMALLOC_CACHED_UNWIND_STEPS 1
+#define STACKTRACE_INL_HEADER "stacktrace_libunwind-inl.h"
+#define GST_SUFFIX libunwind_cached
+#include "stacktrace_impl_setup-inl.h"
+#undef GST_SUFFIX
+#undef STACKTRACE_INL_HEADER
+#undef TCMALLOC_CACHED_UNWIND_STEPS
+#define HAVE_GST_libunwind_cached
+#endif
 #endif // USE_LIBUNWIND
 
 #if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__) || defined(__aarch64__) || defined(__riscv) || defined(__arm__))
@@ -144,6 +178,15 @@ struct GetStackImplementation {
 #define HAVE_GST_generic_fp_unsafe
 #endif
 
+#if defined(HAVE_ELF_MEM_IMAGE) && defined(__linux__) && defined(__x86_64__) && defined(_LP64)
+#define STACKTRACE_INL_HEADER "stacktrace_eh_frame-inl.h"
+#define GST_SUFFIX eh_frame
+#include "stacktrace_impl_setup-inl.h"
+#undef GST_SUFFIX
+#undef STACKTRACE_INL_HEADER
+#define HAVE_GST_eh_frame
+#endif
+
 #if defined(__ppc__) || defined(__PPC__)
 #if defined(__linux__)
 #define STACKTRACE_INL_HEADER "stacktrace_powerpc-linux-inl.h"
@@ -261,6 +304,15 @@ static GetStackImplementation *all_impls[] = {
 #ifdef HAVE_GST_generic
   &impl__generic,
 #endif
+#ifdef HAVE_GST_eh_frame
+  &impl__eh_frame,
+#endif
+#ifdef HAVE_GST_libunwind_cached
+  &impl__libunwind_cached,
+#endif
+#ifdef HAVE_GST_libgcc_cached
+  &impl__libgcc_cached,
+#endif
 #if defined(HAVE_GST_generic_fp) && !PREFER_FP_UNWINDER
   &impl__generic_fp,
   &impl__generic_fp_unsafe,
@@ -274,12 +326,37 @@ static GetStackImplementation *all_impls[] = {
 static bool get_stack_impl_inited;
 static GetStackImplementation *get_stack_impl;
 
+#ifdef HAVE_STACKTRACE_STACK_BOUNDS
+// Tells if 'impl' checks memory it reads against our stack bounds.
+static bool UsesStackBounds(GetStackImplementation* impl) {
+#ifdef HAVE_GST_generic_fp
+  if (impl == &impl__generic_fp) {
+    return true;
+  }
+#endif
+#ifdef HAVE_GST_libgcc_cached
+  if (impl == &impl__libgcc_cached) {
+    return true;
+  }
+#endif
+#ifdef HAVE_GST_libunwind_cached
+  if (impl == &impl__libunwind_cached) {
+    return true;
+  }
+#endif
+  return false;
+}
+#endif
+
 #if 0
 // This is for the benefit of code analysis tools that may have
 // trouble with the computed #include above.
 # include "stacktrace_libunwind-inl.h"
 # include "stacktrace_generic-inl.h"
 # include "stacktrace_generic_fp-inl.h"
+# include "stacktrace_eh_frame-inl.h"
+# include "stacktrace_step_cache-inl.h"
+# include "stacktrace_stack_bounds-inl.h"
 # include "stacktrace_powerpc-linux-inl.h"
 # include "stacktrace_win32-inl.h"
 # include "stacktrace_arm-inl.h"
@@ -304,12 +381,25 @@ struct CaptureScope {
   }
 };
 
+// Sets up stack bounds of the calling thread on its first capture
+// that has no ucontext. Those are by contract not done from signal
+// handlers, so it is fine to call pthread_getattr_np there. Malloc
+// it does is no different from malloc done by unwinders themselves.
+inline void InitThreadStackBounds() {
+#ifdef HAVE_STACKTRACE_STACK_BOUNDS
+  if (UsesStackBounds(get_stack_impl)) {
+    stacktrace_stack_bounds::MaybeInitStackBounds();
+  }
+#endif
+}
+
 }  // namespace
 
 ATTRIBUTE_NOINLINE
 PERFTOOLS_DLL_DECL int GetStackFrames(void** result, int* sizes, int max_depth,
                                       int skip_count) {
   CaptureScope scope(result);;
+  InitThreadStackBounds();
 
   return get_stack_impl->GetStackFramesPtr(result, sizes,
                                            max_depth, skip_count);
@@ -328,6 +418,7 @@ ATTRIBUTE_NOINLINE
 PERFTOOLS_DLL_DECL int GetStackTrace(void** result, int max_depth,
                                      int skip_count) {
   CaptureScope scope(result);
+  InitThreadStackBounds();
 
   return get_stack_impl->GetStackTracePtr(result, max_depth, skip_count);
 }
@@ -341,6 +432,15 @@ PERFTOOLS_DLL_DECL int GetStackTraceWithContext(void** result, int max_depth,
                                                      skip_count, uc);
 }
 
+void tcmalloc::RefreshStackTraceTables() {
+  init_default_stack_impl_inner();
+#ifdef HAVE_GST_eh_frame
+  if (get_stack_impl == &impl__eh_frame) {
+    stacktrace_eh_frame::RefreshTableIfStale();
+  }
+#endif
+}
+
 #if STACKTRACE_IS_TESTED
 static void init_default_stack_impl_inner() {
 }
@@ -375,8 +475,30 @@ const char* TEST_bump_stacktrace_implementation(const char* suggestion) {
     break;
   } while (true);
 
+#ifdef HAVE_GST_eh_frame
+  if (get_stack_impl == &impl__eh_frame) {
+    stacktrace_eh_frame::GetTable(true);
+  }
+#endif
+#ifdef HAVE_STACKTRACE_STACK_BOUNDS
+  if (UsesStackBounds(get_stack_impl)) {
+    stacktrace_stack_bounds::InitStackBounds();
+  }
+#endif
+
   return get_stack_impl->name;
 }
+
+// Returns false if there is no unwind step cache.
+bool TEST_stacktrace_step_cache_stats(uint64_t* hits, uint64_t* misses) {
+#ifdef HAVE_STACKTRACE_STEP_CACHE
+  *hits = stacktrace_step_cache::stats.hits.load(std::memory_order_relaxed);
+  *misses = stacktrace_step_cache::stats.misses.load(std::memory_order_relaxed);
+  return true;
+#else
+  return false;
+#endif
+}
 }
 
 #else  // !STACKTRACE_IS_TESTED
@@ -429,6 +551,21 @@ static void init_default_stack_impl_inner(void) {
 ATTRIBUTE_NOINLINE
 static void init_default_stack_impl(void) {
   init_default_stack_impl_inner();
+#ifdef HAVE_GST_eh_frame
+  if (get_stack_impl == &impl__eh_frame) {
+    // Build unwind tables now rather than in the first signal handler
+    // that needs them.
+    stacktrace_eh_frame::GetTable(true);
+  }
+#endif
+#ifdef HAVE_STACKTRACE_STACK_BOUNDS
+  if (UsesStackBounds(get_stack_impl)) {
+    // We're most likely in main thread. Finding its stack bounds
+    // involves reading /proc/self/maps, so lets do it now rather than
+    // in the middle of some malloc.
+    stacktrace_stack_bounds::InitStackBounds();
+  }
+#endif
   if (EnvToBool("TCMALLOC_STACKTRACE_METHOD_VERBOSE", false)) {
     fprintf(stderr, "Chosen stacktrace method is %s\nSupported methods:\n", get_stack_impl->name);
     for (int i = 0; i < sizeof(all_impls) / sizeof(all_impls[0]); i++) {
@@ -0,0 +1,1290 @@
+// -*- Mode: C++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+// Copyright (c) 2024, gperftools Contributors
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+//     * Neither the name of Google Inc. nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// This file implements backtrace capturing from eh_frame unwind info
+// without interpreting DWARF CFI at unwind time. Instead, the
+// .eh_frame_hdr search tables of all loaded objects are walked once
+// (via dl_iterate_phdr) and every FDE's CFA program is run ahead of
+// time into a compact table: one row per PC range, telling how to
+// compute the CFA and where the return address and frame pointer are
+// saved. Unwinding a frame is then two binary searches and a couple
+// of memory reads, with no locks and no malloc, so it is usable from
+// signal handlers.
+//
+// Only x86-64 Linux is supported. Rows we can't express (e.g. CFA
+// computed by DWARF expression) stop the backtrace, except for the
+// signal trampoline, whose caller's registers are picked from the
+// ucontext it points at.
+//
+// Tables are built ahead of time, outside of signal handlers: when
+// this implementation is selected at startup, by the first non-signal
+// backtrace, and by ProfilerStart before it enables SIGPROF. They are
+// rebuilt when a non-signal backtrace meets a PC that isn't covered
+// and objects were loaded or unloaded since. Backtraces taken with
+// ucontext (i.e. from signal handlers) never build or rebuild tables,
+// since dl_iterate_phdr takes loader's lock. Replaced tables are freed
+// by a later non-signal backtrace, once no backtrace is in progress.
+
+#ifndef BASE_STACKTRACE_EH_FRAME_INL_H_
+#define BASE_STACKTRACE_EH_FRAME_INL_H_
+// Note: this file is included into stacktrace.cc more than once.
+// Anything that should only be defined once should be here:
+
+#include <link.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/ucontext.h>
+#include <unistd.h>
+
+#include <atomic>
+
+#include "base/spinlock.h"
+#include "base/threading.h"
+
+// check_address-inl.h can't have include guard (its test includes it
+// twice), and stacktrace_generic_fp-inl.h may have included it.
+#ifndef BASE_STACKTRACE_GENERIC_FP_INL_H_
+#include "check_address-inl.h"
+#endif
+
+namespace {
+namespace stacktrace_eh_frame {
+
+// DWARF register numbers of x86-64.
+constexpr uint64_t kRegFP = 6;
+constexpr uint64_t kRegSP = 7;
+
+// DW_EH_PE_* pointer encodings.
+constexpr uint8_t kPEOmit = 0xff;
+constexpr uint8_t kPEAbsPtr = 0x00;
+constexpr uint8_t kPEULEB128 = 0x01;
+constexpr uint8_t kPEUData2 = 0x02;
+constexpr uint8_t kPEUData4 = 0x03;
+constexpr uint8_t kPEUData8 = 0x04;
+constexpr uint8_t kPESLEB128 = 0x09;
+constexpr uint8_t kPESData2 = 0x0a;
+constexpr uint8_t kPESData4 = 0x0b;
+constexpr uint8_t kPESData8 = 0x0c;
+constexpr uint8_t kPEPCRel = 0x10;
+constexpr uint8_t kPEDataRel = 0x30;
+constexpr uint8_t kPEIndirect = 0x80;
+
+// How the CFA of a row is computed.
+enum RowKind : uint8_t {
+  kRowNoInfo,        // PC is not covered by any FDE
+  kRowSP,            // CFA = sp + cfa_offset
+  kRowFP,            // CFA = fp + cfa_offset
+  kRowEndOfStack,    // Return address is undefined: outermost frame
+  kRowSignalFrame,   // Signal trampoline: sp points at a ucontext_t
+  kRowUnsupported,   // Anything else
+};
+
+// How the caller's frame pointer is found.
+enum FPRule : uint8_t {
+  kFPSame,     // Unchanged
+  kFPSaved,    // Saved at CFA + fp_offset
+  kFPUnknown,  // Not recoverable; frames needing it stop the trace
+};
+
+// Unwind rules valid from 'pc' (relative to the object's start) up to
+// the next row's pc.
+struct Row {
+  uint32_t pc;
+  int32_t cfa_offset;
+  int16_t ra_offset;
+  int16_t fp_offset;
+  RowKind kind;
+  FPRule fp_rule;
+};
+
+// Rows of one loaded object, sorted by pc.
+struct Object {
+  uintptr_t start;
+  uintptr_t end;
+  const Row* rows;
+  uint32_t num_rows;
+};
+
+// Published tables are immutable. They are only replaced when objects
+// get loaded or unloaded, which is rare, and the old ones are freed
+// once no capture can be walking them any more (see TableReader).
+struct Table {
+  const Object* objects;
+  int num_objects;
+  // dl_phdr_info's load and unload counters at the time of the build.
+  unsigned long long adds;
+  unsigned long long subs;
+  // Memory of the table itself and of its rows.
+  size_t bytes;
+  void* rows_memory;
+  size_t rows_bytes;
+  // Next table waiting to be freed (table_lock).
+  Table* next_retired;
+};
+
+std::atomic<Table*> table;
+SpinLock table_lock;
+
+// Replaced tables, waiting for the captures that may still walk them.
+Table* retired_tables;
+std::atomic<bool> have_retired_tables;
+
+// Numbers of captures in progress. Every capture touches one of these,
+// so they are spread over cache lines, by thread.
+constexpr int kReaderStripes = 16;
+struct alignas(64) ReaderStripe {
+  std::atomic<int> count;
+};
+ReaderStripe reader_stripes[kReaderStripes];
+
+// Counts the calling capture in progress while in scope. Tables must
+// only be loaded within its scope: a table replaced (with a seq_cst
+// store) is freed only after all stripes were seen at zero, so any
+// capture not counted then loads the new table.
+class TableReader {
+ public:
+  TableReader() {
+    stripe_ = &reader_stripes[tcmalloc::ThreadStripeIndex() % kReaderStripes];
+    stripe_->count.fetch_add(1, std::memory_order_seq_cst);
+  }
+  ~TableReader() {
+    stripe_->count.fetch_sub(1, std::memory_order_release);
+  }
+
+ private:
+  ReaderStripe* stripe_;
+};
+
+// Memory for tables comes straight from the kernel: we may be called
+// from within malloc, and mmap hooks may capture backtraces
+// themselves.
+void* RawMMap(size_t size) {
+  void* rv = reinterpret_cast<void*>(
+    syscall(SYS_mmap, nullptr, size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+  return (rv == MAP_FAILED) ? nullptr : rv;
+}
+
+void RawMUnMap(void* ptr, size_t size) {
+  syscall(SYS_munmap, ptr, size);
+}
+
+// Minimal growable array on top of RawMMap.
+template <typename T>
+class RawVector {
+ public:
+  T* data() const { return data_; }
+  size_t size() const { return size_; }
+  T& back() { return data_[size_ - 1]; }
+  void truncate(size_t size) { size_ = size; }
+
+  bool push_back(const T& value) {
+    if (size_ == capacity_ && !Grow()) {
+      return false;
+    }
+    data_[size_++] = value;
+    return true;
+  }
+
+  void Free() {
+    if (data_ != nullptr) {
+      RawMUnMap(data_, capacity_ * sizeof(T));
+    }
+    data_ = nullptr;
+    size_ = capacity_ = 0;
+  }
+
+  // Hands the memory over to the caller, who must RawMUnMap data() of
+  // the returned size.
+  size_t Release() {
+    size_t bytes = capacity_ * sizeof(T);
+    data_ = nullptr;
+    size_ = capacity_ = 0;
+    return bytes;
+  }
+
+ private:
+  bool Grow() {
+    size_t capacity = capacity_ ? capacity_ * 2 : (64 << 10) / sizeof(T);
+    T* fresh = static_cast<T*>(RawMMap(capacity * sizeof(T)));
+    if (fresh == nullptr) {
+      return false;
+    }
+    if (size_ > 0) {
+      memcpy(fresh, data_, size_ * sizeof(T));
+    }
+    size_t size = size_;
+    Free();
+    data_ = fresh;
+    size_ = size;
+    capacity_ = capacity;
+    return true;
+  }
+
+  T* data_ = nullptr;
+  size_t size_ = 0;
+  size_t capacity_ = 0;
+};
+
+// Bounds-checked reader of eh_frame data.
+struct Reader {
+  const uint8_t* p;
+  const uint8_t* end;
+  bool ok;
+
+  Reader(const uint8_t* p, const uint8_t* end) : p(p), end(end), ok(true) {}
+
+  template <typename T>
+  T Read() {
+    T value{};
+    if (end - p < static_cast<ptrdiff_t>(sizeof(T))) {
+      ok = false;
+      return value;
+    }
+    memcpy(&value, p, sizeof(T));
+    p += sizeof(T);
+    return value;
+  }
+
+  uint8_t U8() { return Read<uint8_t>(); }
+
+  uint64_t ULEB128() {
+    uint64_t result = 0;
+    int shift = 0;
+    uint8_t byte;
+    do {
+      if (p >= end) {
+        ok = false;
+        return 0;
+      }
+      byte = *p++;
+      if (shift < 64) {
+        result |= static_cast<uint64_t>(byte & 0x7f) << shift;
+      }
+      shift += 7;
+    } while (byte & 0x80);
+    return result;
+  }
+
+  int64_t SLEB128() {
+    uint64_t result = 0;
+    int shift = 0;
+    uint8_t byte;
+    do {
+      if (p >= end) {
+        ok = false;
+        return 0;
+      }
+      byte = *p++;
+      if (shift < 64) {
+        result |= static_cast<uint64_t>(byte & 0x7f) << shift;
+      }
+      shift += 7;
+    } while (byte & 0x80);
+    if (shift < 64 && (byte & 0x40)) {
+      result |= ~uint64_t{0} << shift;
+    }
+    return static_cast<int64_t>(result);
+  }
+
+  void Skip(uint64_t count) {
+    if (static_cast<uint64_t>(end - p) < count) {
+      ok = false;
+      p = end;
+      return;
+    }
+    p += count;
+  }
+
+  // Reads a pointer encoded with DW_EH_PE_* 'encoding'. 'datarel' is
+  // the base of DW_EH_PE_datarel pointers (the start of
+  // .eh_frame_hdr).
+  uintptr_t Encoded(uint8_t encoding, const uint8_t* datarel) {
+    if (encoding == kPEOmit) {
+      return 0;
+    }
+    uintptr_t field = reinterpret_cast<uintptr_t>(p);
+    uintptr_t value;
+    switch (encoding & 0x0f) {
+    case kPEAbsPtr: value = Read<uintptr_t>(); break;
+    case kPEULEB128: value = ULEB128(); break;
+    case kPEUData2: value = Read<uint16_t>(); break;
+    case kPEUData4: value = Read<uint32_t>(); break;
+    case kPEUData8: value = Read<uint64_t>(); break;
+    case kPESLEB128: value = SLEB128(); break;
+    case kPESData2: value = Read<int16_t>(); break;
+    case kPESData4: value = Read<int32_t>(); break;
+    case kPESData8: value = Read<int64_t>(); break;
+    default:
+      ok = false;
+      return 0;
+    }
+    switch (encoding & 0x70) {
+    case 0: break;
+    case kPEPCRel: value += field; break;
+    case kPEDataRel: value += reinterpret_cast<uintptr_t>(datarel); break;
+    default:
+      ok = false;
+      return 0;
+    }
+    if (ok && (encoding & kPEIndirect)) {
+      value = *reinterpret_cast<const uintptr_t*>(value);
+    }
+    return value;
+  }
+};
+
+// Rule for the registers we track: the frame pointer and the return
+// address.
+enum RuleKind : uint8_t {
+  kRuleSame,
+  kRuleUndefined,
+  kRuleOffset,    // Saved at CFA + offset
+  kRuleOther,     // Any rule we don't interpret
+};
+
+struct RegRule {
+  RuleKind kind;
+  int64_t offset;
+};
+
+// Interpreter state of a CFA program.
+struct CFAState {
+  uint64_t cfa_reg;
+  int64_t cfa_offset;
+  bool cfa_expression;
+  RegRule fp;
+  RegRule ra;
+};
+
+struct CIE {
+  const uint8_t* instructions;
+  const uint8_t* end;
+  uint64_t code_align;
+  int64_t data_align;
+  uint64_t ra_reg;
+  uint8_t fde_encoding;
+  bool has_augmentation_data;
+  bool signal_frame;
+  // State after running the CIE's initial instructions.
+  CFAState initial;
+};
+
+struct PendingObject {
+  uintptr_t start;
+  uintptr_t end;
+  size_t first_row;
+};
+
+struct Builder {
+  RawVector<Row> rows;
+  RawVector<PendingObject> objects;
+  const uint8_t* cie_ptr;
+  CIE cie;
+  bool seen_first;
+  unsigned long long adds;
+  unsigned long long subs;
+  bool failed;
+};
+
+// Translates an interpreter state into a table row.
+Row Encode(const CFAState& state, bool signal_frame) {
+  Row row;
+  memset(&row, 0, sizeof(row));
+  if (signal_frame) {
+    row.kind = kRowSignalFrame;
+    return row;
+  }
+  if (state.ra.kind == kRuleUndefined) {
+    row.kind = kRowEndOfStack;
+    return row;
+  }
+  if (state.cfa_expression || state.ra.kind != kRuleOffset
+      || (state.cfa_reg != kRegSP && state.cfa_reg != kRegFP)
+      || state.cfa_offset != static_cast<int32_t>(state.cfa_offset)
+      || state.ra.offset != static_cast<int16_t>(state.ra.offset)) {
+    row.kind = kRowUnsupported;
+    return row;
+  }
+  row.kind = (state.cfa_reg == kRegSP) ? kRowSP : kRowFP;
+  row.cfa_offset = state.cfa_offset;
+  row.ra_offset = state.ra.offset;
+  switch (state.fp.kind) {
+  case kRuleSame:
+    row.fp_rule = kFPSame;
+    break;
+  case kRuleOffset:
+    if (state.fp.offset == static_cast<int16_t>(state.fp.offset)) {
+      row.fp_rule = kFPSaved;
+      row.fp_offset = state.fp.offset;
+      break;
+    }
+    row.fp_rule = kFPUnknown;
+    break;
+  default:
+    row.fp_rule = kFPUnknown;
+    break;
+  }
+  return row;
+}
+
+bool SameRules(const Row& a, const Row& b) {
+  return a.kind == b.kind && a.cfa_offset == b.cfa_offset
+    && a.ra_offset == b.ra_offset && a.fp_offset == b.fp_offset
+    && a.fp_rule == b.fp_rule;
+}
+
+// Appends rows of one FDE to the current object.
+struct Emitter {
+  Builder* b;
+  const PendingObject* object;
+  uintptr_t pc_end;
+  bool signal_frame;
+
+  void Emit(uintptr_t pc, Row row) {
+    if (pc >= pc_end && row.kind != kRowNoInfo) {
+      return;
+    }
+    row.pc = pc - object->start;
+    if (b->rows.size() > object->first_row) {
+      Row& last = b->rows.back();
+      if (last.pc == row.pc) {
+        last = row;
+        return;
+      }
+      if (last.pc > row.pc || SameRules(last, row)) {
+        // Overlapping FDE or nothing new.
+        return;
+      }
+    }
+    if (!b->rows.push_back(row)) {
+      b->failed = true;
+    }
+  }
+
+  void EmitState(uintptr_t pc, const CFAState& state) {
+    Emit(pc, Encode(state, signal_frame));
+  }
+};
+
+RegRule* TrackedRule(CFAState* state, const CIE& cie, uint64_t reg) {
+  if (reg == kRegFP) {
+    return &state->fp;
+  }
+  if (reg == cie.ra_reg) {
+    return &state->ra;
+  }
+  return nullptr;
+}
+
+void SetRule(CFAState* state, const CIE& cie, uint64_t reg,
+             RuleKind kind, int64_t offset) {
+  RegRule* rule = TrackedRule(state, cie, reg);
+  if (rule != nullptr) {
+    rule->kind = kind;
+    rule->offset = offset;
+  }
+}
+
+// Runs the CFA program in 'r' starting at '*loc'. If 'emitter' is
+// given, emits a row every time the location advances. Returns false
+// if the program is malformed or uses unknown instructions.
+bool RunCFA(Reader r, const CIE& cie, const CFAState& initial,
+            CFAState* state, uintptr_t* loc, Emitter* emitter) {
+  constexpr int kMaxRememberDepth = 8;
+  CFAState remembered[kMaxRememberDepth];
+  int depth = 0;
+
+  auto advance_to = [&] (uintptr_t new_loc) {
+    if (emitter != nullptr) {
+      emitter->EmitState(*loc, *state);
+    }
+    *loc = new_loc;
+  };
+
+  while (r.ok && r.p < r.end) {
+    uint8_t op = r.U8();
+    uint8_t operand = op & 0x3f;
+    switch (op & 0xc0) {
+    case 0x40:  // DW_CFA_advance_loc
+      advance_to(*loc + operand * cie.code_align);
+      continue;
+    case 0x80:  // DW_CFA_offset
+      SetRule(state, cie, operand, kRuleOffset,
+              r.ULEB128() * cie.data_align);
+      continue;
+    case 0xc0:  // DW_CFA_restore
+      if (RegRule* rule = TrackedRule(state, cie, operand)) {
+        *rule = *TrackedRule(const_cast<CFAState*>(&initial), cie, operand);
+      }
+      continue;
+    }
+
+    uint64_t reg;
+    switch (op) {
+    case 0x00:  // DW_CFA_nop
+      break;
+    case 0x01:  // DW_CFA_set_loc
+      advance_to(r.Encoded(cie.fde_encoding, nullptr));
+      break;
+    case 0x02:  // DW_CFA_advance_loc1
+      advance_to(*loc + r.U8() * cie.code_align);
+      break;
+    case 0x03:  // DW_CFA_advance_loc2
+      advance_to(*loc + r.Read<uint16_t>() * cie.code_align);
+      break;
+    case 0x04:  // DW_CFA_advance_loc4
+      advance_to(*loc + r.Read<uint32_t>() * cie.code_align);
+      break;
+    case 0x05:  // DW_CFA_offset_extended
+      reg = r.ULEB128();
+      SetRule(state, cie, reg, kRuleOffset, r.ULEB128() * cie.data_align);
+      break;
+    case 0x06:  // DW_CFA_restore_extended
+      reg = r.ULEB128();
+      if (RegRule* rule = TrackedRule(state, cie, reg)) {
+        *rule = *TrackedRule(const_cast<CFAState*>(&initial), cie, reg);
+      }
+      break;
+    case 0x07:  // DW_CFA_undefined
+      SetRule(state, cie, r.ULEB128(), kRuleUndefined, 0);
+      break;
+    case 0x08:  // DW_CFA_same_value
+      SetRule(state, cie, r.ULEB128(), kRuleSame, 0);
+      break;
+    case 0x09:  // DW_CFA_register
+      reg = r.ULEB128();
+      r.ULEB128();
+      SetRule(state, cie, reg, kRuleOther, 0);
+      break;
+    case 0x0a:  // DW_CFA_remember_state
+      if (depth == kMaxRememberDepth) {
+        return false;
+      }
+      remembered[depth++] = *state;
+      break;
+    case 0x0b:  // DW_CFA_restore_state
+      if (depth == 0) {
+        return false;
+      }
+      *state = remembered[--depth];
+      break;
+    case 0x0c:  // DW_CFA_def_cfa
+      state->cfa_reg = r.ULEB128();
+      state->cfa_offset = r.ULEB128();
+      state->cfa_expression = false;
+      break;
+    case 0x0d:  // DW_CFA_def_cfa_register
+      state->cfa_reg = r.ULEB128();
+      state->cfa_expression = false;
+      break;
+    case 0x0e:  // DW_CFA_def_cfa_offset
+      state->cfa_offset = r.ULEB128();
+      break;
+    case 0x0f:  // DW_CFA_def_cfa_expression
+      r.Skip(r.ULEB128());
+      state->cfa_expression = true;
+      break;
+    case 0x10:  // DW_CFA_expression
+    case 0x16:  // DW_CFA_val_expression
+      reg = r.ULEB128();
+      r.Skip(r.ULEB128());
+      SetRule(state, cie, reg, kRuleOther, 0);
+      break;
+    case 0x11:  // DW_CFA_offset_extended_sf
+      reg = r.ULEB128();
+      SetRule(state, cie, reg, kRuleOffset, r.SLEB128() * cie.data_align);
+      break;
+    case 0x12:  // DW_CFA_def_cfa_sf
+      state->cfa_reg = r.ULEB128();
+      state->cfa_offset = r.SLEB128() * cie.data_align;
+      state->cfa_expression = false;
+      break;
+    case 0x13:  // DW_CFA_def_cfa_offset_sf
+      state->cfa_offset = r.SLEB128() * cie.data_align;
+      break;
+    case 0x14:  // DW_CFA_val_offset
+      reg = r.ULEB128();
+      r.ULEB128();
+      SetRule(state, cie, reg, kRuleOther, 0);
+      break;
+    case 0x15:  // DW_CFA_val_offset_sf
+      reg = r.ULEB128();
+      r.SLEB128();
+      SetRule(state, cie, reg, kRuleOther, 0);
+      break;
+    case 0x2e:  // DW_CFA_GNU_args_size
+      r.ULEB128();
+      break;
+    case 0x2f:  // DW_CFA_GNU_negative_offset_extended
+      reg = r.ULEB128();
+      SetRule(state, cie, reg, kRuleOffset,
+              -static_cast<int64_t>(r.ULEB128()) * cie.data_align);
+      break;
+    default:
+      return false;
+    }
+  }
+  return r.ok;
+}
+
+bool ParseCIE(const uint8_t* ptr, CIE* cie) {
+  Reader r(ptr, ptr + sizeof(uint32_t));
+  uint32_t length = r.Read<uint32_t>();
+  if (length == 0 || length == 0xffffffff) {
+    // Terminator, or 64-bit DWARF which is not used for eh_frame.
+    return false;
+  }
+  r.end = r.p + length;
+  if (r.Read<uint32_t>() != 0) {
+    return false;
+  }
+  uint8_t version = r.U8();
+  if (version != 1 && version != 3 && version != 4) {
+    return false;
+  }
+  const char* augmentation = reinterpret_cast<const char*>(r.p);
+  size_t augmentation_len = strnlen(augmentation, r.end - r.p);
+  r.Skip(augmentation_len + 1);
+  if (version == 4) {
+    r.U8();  // address_size
+    r.U8();  // segment_size
+  }
+  cie->code_align = r.ULEB128();
+  cie->data_align = r.SLEB128();
+  cie->ra_reg = (version == 1) ? r.U8() : r.ULEB128();
+  cie->fde_encoding = kPEAbsPtr;
+  cie->has_augmentation_data = false;
+  cie->signal_frame = false;
+
+  if (augmentation[0] == 'z') {
+    cie->has_augmentation_data = true;
+    uint64_t data_len = r.ULEB128();
+    const uint8_t* data_end = r.p + data_len;
+    for (size_t i = 1; i < augmentation_len && r.ok; i++) {
+      switch (augmentation[i]) {
+      case 'L':
+        r.U8();
+        break;
+      case 'P':
+        // Don't chase the personality pointer.
+        r.Encoded(r.U8() & ~kPEIndirect, nullptr);
+        break;
+      case 'R':
+        cie->fde_encoding = r.U8();
+        break;
+      case 'S':
+        cie->signal_frame = true;
+        break;
+      default:
+        // 'B', 'G' and unknown letters carry no data we need, and 'z'
+        // lets us skip whatever there is.
+        break;
+      }
+    }
+    if (!r.ok || data_end > r.end) {
+      return false;
+    }
+    r.p = data_end;
+  } else if (augmentation_len != 0) {
+    return false;
+  }
+  if (!r.ok) {
+    return false;
+  }
+  cie->instructions = r.p;
+  cie->end = r.end;
+
+  CFAState zero;
+  memset(&zero, 0, sizeof(zero));
+  zero.cfa_reg = kRegSP;
+  zero.fp.kind = kRuleSame;
+  zero.ra.kind = kRuleSame;
+  cie->initial = zero;
+  uintptr_t loc = 0;
+  return RunCFA(Reader(cie->instructions, cie->end), *cie, zero,
+                &cie->initial, &loc, nullptr);
+}
+
+void AddFDE(Builder* b, const PendingObject* object, const uint8_t* fde) {
+  Reader r(fde, fde + sizeof(uint32_t));
+  uint32_t length = r.Read<uint32_t>();
+  if (length == 0 || length == 0xffffffff) {
+    return;
+  }
+  r.end = r.p + length;
+  const uint8_t* cie_field = r.p;
+  uint32_t cie_offset = r.Read<uint32_t>();
+  const uint8_t* cie_ptr = cie_field - cie_offset;
+  if (cie_offset == 0) {
+    return;
+  }
+  if (cie_ptr != b->cie_ptr) {
+    b->cie_ptr = nullptr;
+    if (!ParseCIE(cie_ptr, &b->cie)) {
+      return;
+    }
+    b->cie_ptr = cie_ptr;
+  }
+  const CIE& cie = b->cie;
+
+  uintptr_t pc_begin = r.Encoded(cie.fde_encoding, nullptr);
+  uintptr_t pc_range = r.Encoded(cie.fde_encoding & 0x0f, nullptr);
+  if (cie.has_augmentation_data) {
+    r.Skip(r.ULEB128());
+  }
+  if (!r.ok || pc_range == 0 || pc_begin < object->start
+      || pc_begin + pc_range - object->start > UINT32_MAX) {
+    return;
+  }
+
+  size_t saved_size = b->rows.size();
+  Row saved_last;
+  if (saved_size > object->first_row) {
+    saved_last = b->rows.back();
+  }
+
+  Emitter emitter{b, object, pc_begin + pc_range, cie.signal_frame};
+  CFAState state = cie.initial;
+  uintptr_t loc = pc_begin;
+  if (!RunCFA(r, cie, cie.initial, &state, &loc, &emitter) || b->failed) {
+    b->rows.truncate(saved_size);
+    if (saved_size > object->first_row) {
+      b->rows.back() = saved_last;
+    }
+    return;
+  }
+  emitter.EmitState(loc, state);
+  Row end;
+  memset(&end, 0, sizeof(end));
+  end.kind = kRowNoInfo;
+  emitter.Emit(pc_begin + pc_range, end);
+}
+
+// dl_iterate_phdr callback adding rows of one object from its
+// .eh_frame_hdr binary search table.
+int AddObject(struct dl_phdr_info* info, size_t size, void* arg) {
+  Builder* b = static_cast<Builder*>(arg);
+  if (!b->seen_first) {
+    b->seen_first = true;
+    b->adds = info->dlpi_adds;
+    b->subs = info->dlpi_subs;
+  }
+  if (b->failed) {
+    return 1;
+  }
+
+  const ElfW(Phdr)* hdr_phdr = nullptr;
+  for (int i = 0; i < info->dlpi_phnum; i++) {
+    if (info->dlpi_phdr[i].p_type == PT_GNU_EH_FRAME) {
+      hdr_phdr = &info->dlpi_phdr[i];
+      break;
+    }
+  }
+  if (hdr_phdr == nullptr) {
+    return 0;
+  }
+
+  const uint8_t* hdr = reinterpret_cast<const uint8_t*>(
+    info->dlpi_addr + hdr_phdr->p_vaddr);
+  Reader r(hdr, hdr + hdr_phdr->p_memsz);
+  uint8_t version = r.U8();
+  uint8_t eh_frame_ptr_encoding = r.U8();
+  uint8_t fde_count_encoding = r.U8();
+  uint8_t table_encoding = r.U8();
+  r.Encoded(eh_frame_ptr_encoding, hdr);
+  if (!r.ok || version != 1 || fde_count_encoding == kPEOmit
+      || table_encoding != (kPEDataRel | kPESData4)) {
+    return 0;
+  }
+  uintptr_t fde_count = r.Encoded(fde_count_encoding, hdr);
+  if (!r.ok || fde_count == 0
+      || fde_count > static_cast<uintptr_t>(r.end - r.p) / 8) {
+    return 0;
+  }
+
+  // The search table is sorted by initial location, so the rows come
+  // out sorted too.
+  const uint8_t* entries = r.p;
+  int32_t first_loc;
+  memcpy(&first_loc, entries, sizeof(first_loc));
+
+  PendingObject object;
+  object.start = reinterpret_cast<uintptr_t>(hdr) + first_loc;
+  object.end = object.start;
+  object.first_row = b->rows.size();
+
+  for (uintptr_t i = 0; i < fde_count && !b->failed; i++) {
+    int32_t fde_offset;
+    memcpy(&fde_offset, entries + i * 8 + 4, sizeof(fde_offset));
+    AddFDE(b, &object, hdr + fde_offset);
+  }
+  if (b->failed) {
+    return 1;
+  }
+  if (b->rows.size() == object.first_row) {
+    return 0;
+  }
+  object.end = object.start + b->rows.back().pc;
+  if (!b->objects.push_back(object)) {
+    b->failed = true;
+    return 1;
+  }
+  return 0;
+}
+
+// Builds the tables of all loaded objects. Returns nullptr if we ran
+// out of memory.
+Table* BuildTable() {
+  Builder b = Builder();
+  dl_iterate_phdr(AddObject, &b);
+
+  size_t num_objects = b.objects.size();
+  size_t bytes = sizeof(Table) + num_objects * sizeof(Object);
+  void* memory = b.failed ? nullptr : RawMMap(bytes);
+  if (memory == nullptr) {
+    b.rows.Free();
+    b.objects.Free();
+    return nullptr;
+  }
+
+  Table* t = static_cast<Table*>(memory);
+  Object* objects = reinterpret_cast<Object*>(t + 1);
+  for (size_t i = 0; i < num_objects; i++) {
+    const PendingObject& pending = b.objects.data()[i];
+    size_t end_row = (i + 1 < num_objects)
+      ? b.objects.data()[i + 1].first_row : b.rows.size();
+    Object object;
+    object.start = pending.start;
+    object.end = pending.end;
+    object.rows = b.rows.data() + pending.first_row;
+    object.num_rows = end_row - pending.first_row;
+    // Insertion sort by start address; there are only few objects.
+    size_t j = i;
+    while (j > 0 && objects[j - 1].start > object.start) {
+      objects[j] = objects[j - 1];
+      j--;
+    }
+    objects[j] = object;
+  }
+  t->objects = objects;
+  t->num_objects = num_objects;
+  t->adds = b.adds;
+  t->subs = b.subs;
+  t->bytes = bytes;
+  t->rows_memory = b.rows.data();
+  t->rows_bytes = b.rows.Release();
+  t->next_retired = nullptr;
+  b.objects.Free();
+  return t;
+}
+
+void FreeTable(Table* t) {
+  if (t->rows_memory != nullptr) {
+    RawMUnMap(t->rows_memory, t->rows_bytes);
+  }
+  RawMUnMap(t, t->bytes);
+}
+
+// Frees the replaced tables if no capture is in progress.
+void FreeRetiredTablesLocked() {
+  if (retired_tables == nullptr) {
+    return;
+  }
+  for (int i = 0; i < kReaderStripes; i++) {
+    if (reader_stripes[i].count.load(std::memory_order_seq_cst) != 0) {
+      return;
+    }
+  }
+  while (retired_tables != nullptr) {
+    Table* t = retired_tables;
+    retired_tables = t->next_retired;
+    FreeTable(t);
+  }
+  have_retired_tables.store(false, std::memory_order_relaxed);
+}
+
+// Called by captures that are no longer TableReaders and may block.
+void MaybeFreeRetiredTables() {
+  if (!have_retired_tables.load(std::memory_order_relaxed)
+      || !table_lock.TryLock()) {
+    return;
+  }
+  FreeRetiredTablesLocked();
+  table_lock.Unlock();
+}
+
+// Returns the tables. If 'may_block', builds them if needed. Otherwise
+// (in signal handlers) returns nullptr if they aren't built yet, as we
+// can neither take loader's lock nor wait for another thread building
+// them, since we may have interrupted it.
+const Table* GetTable(bool may_block) {
+  Table* t = table.load(std::memory_order_seq_cst);
+  if (t != nullptr || !may_block) {
+    return t;
+  }
+  table_lock.Lock();
+  t = table.load(std::memory_order_relaxed);
+  if (t == nullptr) {
+    t = BuildTable();
+    table.store(t, std::memory_order_seq_cst);
+  }
+  table_lock.Unlock();
+  return t;
+}
+
+int ReadGeneration(struct dl_phdr_info* info, size_t size, void* arg) {
+  unsigned long long* generation = static_cast<unsigned long long*>(arg);
+  generation[0] = info->dlpi_adds;
+  generation[1] = info->dlpi_subs;
+  return 1;
+}
+
+// Called when 'seen' has no rows for a PC. Rebuilds the tables if
+// objects were loaded or unloaded since they were built. Returns the
+// new tables, or nullptr if nothing changed. The old tables are
+// retired, to be freed by MaybeFreeRetiredTables.
+const Table* RefreshTable(const Table* seen) {
+  SpinLockHolder h(&table_lock);
+  Table* t = table.load(std::memory_order_relaxed);
+  if (t != seen) {
+    return t;
+  }
+  unsigned long long generation[2] = {0, 0};
+  dl_iterate_phdr(ReadGeneration, generation);
+  if (generation[0] == t->adds && generation[1] == t->subs) {
+    return nullptr;
+  }
+  Table* fresh = BuildTable();
+  if (fresh != nullptr) {
+    table.store(fresh, std::memory_order_seq_cst);
+    t->next_retired = retired_tables;
+    retired_tables = t;
+    have_retired_tables.store(true, std::memory_order_relaxed);
+  }
+  return fresh;
+}
+
+// Rebuilds the tables, if they were built, when objects were loaded or
+// unloaded since. Not for signal handlers.
+void RefreshTableIfStale() {
+  // RefreshTable looks into t only if it is still the current table.
+  const Table* t = table.load(std::memory_order_seq_cst);
+  if (t != nullptr) {
+    RefreshTable(t);
+  }
+  MaybeFreeRetiredTables();
+}
+
+const Row* FindRow(const Table* t, uintptr_t pc) {
+  // Last object starting at or below pc.
+  int lo = 0, hi = t->num_objects;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (t->objects[mid].start <= pc) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  if (lo == 0) {
+    return nullptr;
+  }
+  const Object& object = t->objects[lo - 1];
+  if (pc >= object.end) {
+    return nullptr;
+  }
+
+  uint32_t offset = pc - object.start;
+  uint32_t rlo = 0, rhi = object.num_rows;
+  while (rlo < rhi) {
+    uint32_t mid = (rlo + rhi) / 2;
+    if (object.rows[mid].pc <= offset) {
+      rlo = mid + 1;
+    } else {
+      rhi = mid;
+    }
+  }
+  if (rlo == 0 || object.rows[rlo - 1].kind == kRowNoInfo) {
+    return nullptr;
+  }
+  return &object.rows[rlo - 1];
+}
+
+// Reads stack words, checking that their pages are readable. Stacks
+// are contiguous, so we only probe when crossing into another page.
+class MemoryReader {
+ public:
+  MemoryReader() : last_page_(0) {
+    static uintptr_t pagesize;
+    if (pagesize == 0) {
+      pagesize = getpagesize();
+    }
+    pagesize_ = pagesize;
+  }
+
+  bool Read(uintptr_t addr, uintptr_t* value) {
+    if ((addr & (sizeof(uintptr_t) - 1)) != 0) {
+      return false;
+    }
+    uintptr_t page = addr & ~(pagesize_ - 1);
+    if (page != last_page_) {
+      if (!CheckAddress(page, pagesize_)) {
+        return false;
+      }
+      last_page_ = page;
+    }
+    *value = *reinterpret_cast<const uintptr_t*>(addr);
+    return true;
+  }
+
+ private:
+  uintptr_t pagesize_;
+  uintptr_t last_page_;
+};
+
+struct Regs {
+  uintptr_t pc;
+  uintptr_t sp;
+  uintptr_t fp;
+  bool fp_valid;
+  // Is pc the interrupted instruction rather than a return address?
+  bool exact_pc;
+};
+
+enum StepResult {
+  kStepOk,
+  kStepStop,
+  kStepUnknownPC,
+};
+
+// Unwinds one frame, replacing 'regs' with the caller's registers.
+StepResult Step(const Table* t, Regs* regs, MemoryReader* mem,
+                uintptr_t* frame_size) {
+  // Return addresses point past the call, which may be the first
+  // instruction of the next function.
+  const Row* row = FindRow(t, regs->exact_pc ? regs->pc : regs->pc - 1);
+  if (row == nullptr) {
+    return kStepUnknownPC;
+  }
+
+  uintptr_t base;
+  switch (row->kind) {
+  case kRowSignalFrame: {
+    // The handler returned into the trampoline with sp pointing at
+    // the ucontext_t of the interrupted code.
+    const ucontext_t* uc = reinterpret_cast<const ucontext_t*>(regs->sp);
+    const greg_t* gregs = uc->uc_mcontext.gregs;
+    uintptr_t pc, sp, fp;
+    if (!mem->Read(reinterpret_cast<uintptr_t>(&gregs[REG_RIP]), &pc)
+        || !mem->Read(reinterpret_cast<uintptr_t>(&gregs[REG_RSP]), &sp)
+        || !mem->Read(reinterpret_cast<uintptr_t>(&gregs[REG_RBP]), &fp)) {
+      return kStepStop;
+    }
+    *frame_size = 0;
+    regs->pc = pc;
+    regs->sp = sp;
+    regs->fp = fp;
+    regs->fp_valid = true;
+    regs->exact_pc = true;
+    return (pc != 0) ? kStepOk : kStepStop;
+  }
+  case kRowSP:
+    base = regs->sp;
+    break;
+  case kRowFP:
+    if (!regs->fp_valid) {
+      return kStepStop;
+    }
+    base = regs->fp;
+    break;
+  default:
+    return kStepStop;
+  }
+
+  uintptr_t cfa = base + row->cfa_offset;
+  // Stack grows towards smaller addresses.
+  if (cfa <= regs->sp) {
+    return kStepStop;
+  }
+  uintptr_t ra;
+  if (!mem->Read(cfa + row->ra_offset, &ra)) {
+    return kStepStop;
+  }
+  if (row->fp_rule == kFPSaved) {
+    if (!mem->Read(cfa + row->fp_offset, &regs->fp)) {
+      return kStepStop;
+    }
+    regs->fp_valid = true;
+  } else if (row->fp_rule == kFPUnknown) {
+    regs->fp_valid = false;
+  }
+  *frame_size = cfa - regs->sp;
+  regs->sp = cfa;
+  regs->pc = ra;
+  regs->exact_pc = false;
+  return (ra != 0) ? kStepOk : kStepStop;
+}
+
+// Walks the stack starting with 'regs'. If 'record_first', regs->pc
+// is the first frame (i.e. it came from a ucontext). Unless
+// 'from_signal', tables may be rebuilt to cover newly loaded objects.
+// Captures from signal handlers (i.e. CPU profiles) stop at the first
+// frame in an object loaded since tables were last built, until a
+// non-signal capture or RefreshTableIfStale rebuilds them. The CPU
+// profiler calls the latter when it starts, on ProfilerFlush and on
+// ProfilerRegisterThread.
+template <bool WithSizes>
+int CaptureFrames(void** result, int* sizes, int max_depth, int skip_count,
+                  Regs regs, bool record_first, bool from_signal) {
+  int n = 0;
+  if (record_first) {
+    result[n++] = reinterpret_cast<void*>(regs.pc);
+  }
+
+  TableReader reader;
+  const Table* t = GetTable(!from_signal);
+  if (t == nullptr) {
+    return n;
+  }
+  bool may_refresh = !from_signal;
+
+  MemoryReader mem;
+  while (n < max_depth) {
+    uintptr_t frame_size;
+    StepResult rv = Step(t, &regs, &mem, &frame_size);
+    if (rv == kStepUnknownPC && may_refresh) {
+      may_refresh = false;
+      const Table* fresh = RefreshTable(t);
+      if (fresh != nullptr) {
+        t = fresh;
+        continue;
+      }
+    }
+    if (rv != kStepOk) {
+      break;
+    }
+    if (skip_count > 0) {
+      skip_count--;
+      continue;
+    }
+    if (WithSizes) {
+      sizes[n] = frame_size;
+    }
+    result[n++] = reinterpret_cast<void*>(regs.pc);
+  }
+  return n;
+}
+
+template <bool WithSizes>
+int Capture(void** result, int* sizes, int max_depth, int skip_count,
+            Regs regs, bool record_first, bool from_signal) {
+  int n = CaptureFrames<WithSizes>(result, sizes, max_depth, skip_count,
+                                   regs, record_first, from_signal);
+  if (!from_signal) {
+    MaybeFreeRetiredTables();
+  }
+  return n;
+}
+
+}  // namespace stacktrace_eh_frame
+}  // namespace
+
+#endif  // BASE_STACKTRACE_EH_FRAME_INL_H_
+
+// Note: this part of the file is included several times.
+// Do not put globals below.
+
+// The following 4 functions are generated from the code below:
+//   GetStack{Trace,Frames}()
+//   GetStack{Trace,Frames}WithContext()
+//
+// These functions take the following args:
+//   void** result: the stack-trace, as an array
+//   int* sizes: the size of each stack frame, as an array
+//               (GetStackFrames* only)
+//   int max_depth: the size of the result (and sizes) array(s)
+//   int skip_count: how many stack pointers to skip before storing in result
+//   void* ucp: a ucontext_t* (GetStack{Trace,Frames}WithContext only)
+static int GET_STACK_TRACE_OR_FRAMES {
+  if (max_depth == 0) {
+    return 0;
+  }
+
+#if IS_STACK_FRAMES
+  constexpr bool WithSizes = true;
+  memset(sizes, 0, sizeof(*sizes) * max_depth);
+#else
+  constexpr bool WithSizes = false;
+  int * const sizes = nullptr;
+#endif
+
+  stacktrace_eh_frame::Regs regs;
+  int n;
+
+#if IS_WITH_CONTEXT
+  if (ucp) {
+    // Like other implementations, we take the first pc from ucontext
+    // and ignore skip_count, assuming the caller only wanted the
+    // backtrace up to the signal handler frame.
+    const greg_t* gregs = static_cast<const ucontext_t*>(ucp)->uc_mcontext.gregs;
+    regs.pc = gregs[REG_RIP];
+    regs.sp = gregs[REG_RSP];
+    regs.fp = gregs[REG_RBP];
+    regs.fp_valid = true;
+    regs.exact_pc = true;
+    return stacktrace_eh_frame::Capture<WithSizes>(
+      result, sizes, max_depth, 0, regs, true, true);
+  }
+#endif
+
+  // Start unwinding from right here: this function has unwind info
+  // as any other, and the pc below is in the middle of it.
+  __asm__ __volatile__("leaq 0(%%rip), %0\n\t"
+                       "movq %%rsp, %1\n\t"
+                       "movq %%rbp, %2"
+                       : "=r"(regs.pc), "=r"(regs.sp), "=r"(regs.fp));
+  regs.fp_valid = true;
+  regs.exact_pc = true;
+
+  // one for this function
+  n = stacktrace_eh_frame::Capture<WithSizes>(
+    result, sizes, max_depth, skip_count + 1, regs, false, false);
+
+  if (n > 0) {
+    // make sure we don't tail-call Capture
+    (void)*(const_cast<void * volatile *>(result));
+  }
+
+  return n;
+}
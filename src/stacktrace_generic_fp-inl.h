@@ -44,6 +44,8 @@
 // This is only used on OS-es with mmap support.
 #include <sys/mman.h>
 
+#include <atomic>
+
 #if HAVE_SYS_UCONTEXT_H || HAVE_UCONTEXT_H
 
 #define DEFINE_TRIVIAL_GET
@@ -58,7 +60,7 @@
 
 #include <base/spinlock.h>
 
-#include "check_address-inl.h"
+#include "stacktrace_stack_bounds-inl.h"
 
 // our Autoconf setup enables -fno-omit-frame-pointer, but lets still
 // ask for it just in case.
@@ -79,6 +81,8 @@
 namespace {
 namespace stacktrace_generic_fp {
 
+using stacktrace_stack_bounds::ReadableChecker;
+
 #if __x86_64__ && !_LP64
 // x32 uses 64-bit stack entries but 32-bit addresses.
 #define PAD_FRAME
@@ -124,33 +128,154 @@ frame* adjust_fp(frame* f) {
 #endif
 }
 
-bool CheckPageIsReadable(void* ptr, void* checked_ptr) {
-  static uintptr_t pagesize;
-  if (pagesize == 0) {
-    pagesize = getpagesize();
-  }
+#if __linux__ && (__x86_64__ || __i386__ || __aarch64__) && !defined(PAD_FRAME) \
+  && (HAVE_SYS_UCONTEXT_H || HAVE_UCONTEXT_H)
+#define HAVE_LEAF_CALLER_RECOVERY 1
 
-  uintptr_t addr = reinterpret_cast<uintptr_t>(ptr);
-  uintptr_t parent_frame = reinterpret_cast<uintptr_t>(checked_ptr);
+// Registers of interrupted code we need to recover its caller when it
+// was interrupted before setting up its frame (or after tearing it
+// down).
+struct InterruptedRegs {
+  void* pc;
+  uintptr_t sp;
+  uintptr_t fp;
+  void* lr;  // link register, on architectures that have it
+};
 
-  parent_frame &= ~(pagesize - 1);
-  addr &= ~(pagesize - 1);
+void RegsFromUContext(const ucontext_t* uc, InterruptedRegs* regs) {
+#if __x86_64__
+  regs->pc = reinterpret_cast<void*>(uc->uc_mcontext.gregs[REG_RIP]);
+  regs->sp = uc->uc_mcontext.gregs[REG_RSP];
+  regs->fp = uc->uc_mcontext.gregs[REG_RBP];
+  regs->lr = nullptr;
+#elif __i386__
+  regs->pc = reinterpret_cast<void*>(uc->uc_mcontext.gregs[REG_EIP]);
+  regs->sp = uc->uc_mcontext.gregs[REG_ESP];
+  regs->fp = uc->uc_mcontext.gregs[REG_EBP];
+  regs->lr = nullptr;
+#elif __aarch64__
+  regs->pc = reinterpret_cast<void*>(uc->uc_mcontext.pc);
+  regs->sp = uc->uc_mcontext.sp;
+  regs->fp = uc->uc_mcontext.regs[29];
+  regs->lr = reinterpret_cast<void*>(uc->uc_mcontext.regs[30]);
+#endif
+}
 
-  if (parent_frame != 0 && addr == parent_frame) {
-    return true;
+// Frame pointer of code interrupted in its prologue (or epilogue)
+// still points to its caller's frame, so plain frame walking would
+// silently skip the caller. We recognize those few instructions at
+// interrupted pc and find caller's pc where it is at that point: at
+// top of the stack on x86 or in link register on aarch64.
+//
+// Note, we read code at pc without asking kernel. Interrupted pc was
+// being executed, and on those architectures executable memory is
+// readable.
+template <bool UnsafeAccesses>
+bool FindLeafCaller(const InterruptedRegs& regs, ReadableChecker* checker,
+                    void** caller) {
+#if __x86_64__ || __i386__
+  // Instructions are read one byte at a time, so that we never read
+  // past the end of the instruction we've recognized so far.
+  const uint8_t* p = static_cast<const uint8_t*>(regs.pc);
+  uintptr_t ra_addr;
+  if (p[0] == 0x55          // push %rbp
+      || p[0] == 0xc3) {    // ret
+    ra_addr = regs.sp;
+  } else if (p[0] == 0xf3 && p[1] == 0x0f && p[2] == 0x1e
+             && (p[3] == 0xfa || p[3] == 0xfb)) {  // endbr64/endbr32
+    ra_addr = regs.sp;
+#if __x86_64__
+  } else if (p[0] == 0x48 && ((p[1] == 0x89 && p[2] == 0xe5)
+                              || (p[1] == 0x8b && p[2] == 0xec))) {
+#else
+  } else if ((p[0] == 0x89 && p[1] == 0xe5) || (p[0] == 0x8b && p[1] == 0xec)) {
+#endif
+    // mov %rsp, %rbp: %rbp is pushed already
+    ra_addr = regs.sp + sizeof(void*);
+  } else {
+    return false;
+  }
+  // Return address slot has to be below caller's frame.
+  if (ra_addr >= regs.fp) {
+    return false;
+  }
+  void** slot = reinterpret_cast<void**>(ra_addr);
+  if (!UnsafeAccesses && !checker->IsReadable(slot)) {
+    return false;
+  }
+  *caller = *slot;
+  return *caller != nullptr;
+#elif __aarch64__
+  uint32_t insn = *static_cast<const uint32_t*>(regs.pc);
+  if (insn == 0xd503233f || insn == 0xd503237f     // paciasp, pacibsp
+      || insn == 0xd503245f || insn == 0xd50324df  // bti c, bti jc
+      || (insn & 0xffc07fff) == 0xa9807bfd         // stp x29, x30, [sp, #-N]!
+      || (insn & 0xffc07fff) == 0xa9007bfd         // stp x29, x30, [sp, #N]
+      || (insn & 0xffc003ff) == 0x910003fd         // mov/add x29, sp, #N
+      || insn == 0xd50323bf || insn == 0xd50323ff  // autiasp, autibsp
+      || insn == 0xd65f03c0                        // ret
+      || insn == 0xd65f0bff || insn == 0xd65f0fff) {  // retaa, retab
+    *caller = STRIP_PAC(regs.lr);
+    return *caller != nullptr;
   }
+  return false;
+#endif
+}
 
-  return CheckAddress(addr, pagesize);
+#if __x86_64__
+#define HAVE_SIGNAL_FRAME_UNWIND 1
+
+// Signal handler's frame links straight to frame of interrupted
+// function's caller, because kernel doesn't set up any frame for
+// interrupted function itself. Its return address is sigreturn
+// trampoline, and on x86-64 kernel's signal frame starts with that
+// return address immediately followed by ucontext. If frame 'f' is
+// such handler frame, fills registers of interrupted code and returns
+// true.
+template <bool UnsafeAccesses>
+bool GetSignalFrameRegs(frame* f, ReadableChecker* checker,
+                        InterruptedRegs* regs) {
+  // glibc's and musl's __restore_rt: mov $15, %rax; syscall
+  static const uint8_t kRestoreRT[] = {0x48, 0xc7, 0xc0, 0x0f, 0x00, 0x00, 0x00, 0x0f, 0x05};
+
+  const uint8_t* pc = static_cast<const uint8_t*>(f->pc);
+  if (!UnsafeAccesses
+      && (!checker->IsReadable(const_cast<uint8_t*>(pc))
+          || !checker->IsReadable(const_cast<uint8_t*>(pc + sizeof(kRestoreRT) - 1)))) {
+    return false;
+  }
+  for (int i = 0; i < sizeof(kRestoreRT); i++) {
+    if (pc[i] != kRestoreRT[i]) {
+      return false;
+    }
+  }
+
+  auto uc = reinterpret_cast<const ucontext_t*>(&f->pc + 1);
+  const greg_t* gregs = uc->uc_mcontext.gregs;
+  if (!UnsafeAccesses
+      && (!checker->IsReadable(const_cast<greg_t*>(gregs))
+          || !checker->IsReadable(const_cast<greg_t*>(gregs + NGREG - 1)))) {
+    return false;
+  }
+  RegsFromUContext(uc, regs);
+  return true;
 }
 
+#endif  // __x86_64__
+
+#endif  // HAVE_LEAF_CALLER_RECOVERY
+
 template <bool UnsafeAccesses, bool WithSizes>
 ATTRIBUTE_NOINLINE // forces architectures with link register to save it
 ENABLE_FP_ATTRIBUTE
 int capture(void **result, int max_depth, int skip_count,
             void* initial_frame, void* const * initial_pc,
-            int *sizes) {
+            const void* initial_regs, int *sizes) {
   int i = 0;
 
+  uintptr_t current_frame_addr = reinterpret_cast<uintptr_t>(__builtin_frame_address(0));
+  ReadableChecker checker(current_frame_addr);
+
   if (initial_pc != nullptr) {
     // This is 'with ucontext' case. We take first pc from ucontext
     // and then skip_count is ignored as we assume that caller only
@@ -162,6 +287,15 @@ int capture(void **result, int max_depth, int skip_count,
     result[0] = STRIP_PAC(*initial_pc);
 
     i++;
+
+#ifdef HAVE_LEAF_CALLER_RECOVERY
+    void* caller;
+    if (initial_regs != nullptr && i < max_depth
+        && FindLeafCaller<UnsafeAccesses>(
+          *static_cast<const InterruptedRegs*>(initial_regs), &checker, &caller)) {
+      result[i++] = caller;
+    }
+#endif
   }
 
   max_depth += skip_count;
@@ -185,7 +319,6 @@ int capture(void **result, int max_depth, int skip_count,
   constexpr uintptr_t kAlignment = 16;
 #endif
 
-  uintptr_t current_frame_addr = reinterpret_cast<uintptr_t>(__builtin_frame_address(0));
   uintptr_t initial_frame_addr = reinterpret_cast<uintptr_t>(initial_frame);
   if (((initial_frame_addr + sizeof(frame)) & (kAlignment - 1)) != 0) {
     return i;
@@ -203,9 +336,19 @@ int capture(void **result, int max_depth, int skip_count,
   frame* prev_f = reinterpret_cast<frame*>(current_frame_addr);
   frame *f = adjust_fp(reinterpret_cast<frame*>(initial_frame));
 
+  auto record = [&] (void* pc, uintptr_t size) {
+    if (i >= skip_count) {
+      if (WithSizes) {
+        sizes[i - skip_count] = size;
+      }
+      result[i - skip_count] = STRIP_PAC(pc);
+    }
+    i++;
+  };
+
   while (i < max_depth) {
     if (!UnsafeAccesses
-        && !CheckPageIsReadable(&f->parent, prev_f)) {
+        && !checker.IsReadable(&f->parent)) {
       break;
     }
 
@@ -214,18 +357,41 @@ int capture(void **result, int max_depth, int skip_count,
       break;
     }
 
-    if (i >= skip_count) {
-      if (WithSizes) {
-        sizes[i - skip_count] = reinterpret_cast<uintptr_t>(prev_f) - reinterpret_cast<uintptr_t>(f);
-      }
-      result[i - skip_count] = STRIP_PAC(pc);
-    }
-
-    i++;
+    record(pc, reinterpret_cast<uintptr_t>(prev_f) - reinterpret_cast<uintptr_t>(f));
 
     uintptr_t parent_frame_addr = f->parent;
     uintptr_t child_frame_addr = reinterpret_cast<uintptr_t>(f);
 
+#ifdef HAVE_SIGNAL_FRAME_UNWIND
+    // Handler's frame is followed by (at least) signal frame with
+    // ucontext in it, unless parent is on another (alternate signal)
+    // stack. So other frames don't pay for looking at their code.
+    InterruptedRegs regs;
+    if (parent_frame_addr - child_frame_addr >= sizeof(ucontext_t)
+        && GetSignalFrameRegs<UnsafeAccesses>(f, &checker, &regs)) {
+      // Interrupted function and maybe its caller don't have frames
+      // that we'd see.
+      void* caller;
+      if (i < max_depth) {
+        record(regs.pc, 0);
+      }
+      if (i < max_depth && FindLeafCaller<UnsafeAccesses>(regs, &checker, &caller)) {
+        record(caller, 0);
+      }
+
+      // Interrupted code may run on another stack, so we can't say
+      // much about its frame address.
+      parent_frame_addr = regs.fp;
+      if (parent_frame_addr < kTooSmallAddr
+          || ((parent_frame_addr + sizeof(frame)) & (kAlignment - 1)) != 0) {
+        break;
+      }
+      f = adjust_fp(reinterpret_cast<frame*>(parent_frame_addr));
+      prev_f = f;
+      continue;
+    }
+#endif
+
     if (parent_frame_addr < kTooSmallAddr) {
       break;
     }
@@ -298,6 +464,10 @@ static int GET_STACK_TRACE_OR_FRAMES {
 
   void* const * initial_pc = nullptr;
   void* initial_frame = __builtin_frame_address(0);
+  const void* initial_regs = nullptr;
+#if IS_WITH_CONTEXT && defined(HAVE_LEAF_CALLER_RECOVERY)
+  stacktrace_generic_fp::InterruptedRegs regs;
+#endif
   int n;
 
 #if IS_WITH_CONTEXT && (HAVE_SYS_UCONTEXT_H || HAVE_UCONTEXT_H)
@@ -312,6 +482,11 @@ static int GET_STACK_TRACE_OR_FRAMES {
       initial_frame = reinterpret_cast<void*>(frame_addr); \
     } while (false)
 
+#ifdef HAVE_LEAF_CALLER_RECOVERY
+    stacktrace_generic_fp::RegsFromUContext(uc, &regs);
+    initial_regs = &regs;
+#endif
+
 #if __linux__ && __riscv
     SETUP_FRAME(&uc->uc_mcontext.__gregs[REG_PC], uc->uc_mcontext.__gregs[REG_S0]);
 #elif __linux__ && __aarch64__
@@ -367,12 +542,12 @@ static int GET_STACK_TRACE_OR_FRAMES {
     // we're dealing with architecture that doesn't have proper ucontext integration
     n = stacktrace_generic_fp::capture<UnsafeAccesses, WithSizes>(
       result + 1, max_depth - 1, skip_count,
-      initial_frame, initial_pc, sizes);
+      initial_frame, initial_pc, initial_regs, sizes);
     n++;
   } else {
     n = stacktrace_generic_fp::capture<UnsafeAccesses, WithSizes>(
       result, max_depth, skip_count,
-      initial_frame, initial_pc, sizes);
+      initial_frame, initial_pc, initial_regs, sizes);
   }
 
   if (n > 0) {
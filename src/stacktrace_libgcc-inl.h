@@ -47,19 +47,42 @@ extern "C" {
 #include <unwind.h>
 
 #include "gperftools/stacktrace.h"
+#include "stacktrace_step_cache-inl.h"
+
+namespace {
 
 struct libgcc_backtrace_data {
   void **array;
   int skip;
   int pos;
   int limit;
+#ifdef HAVE_STACKTRACE_STEP_CACHE
+  // Non-null for libgcc_cached. Sees every frame we walk.
+  stacktrace_step_cache::Learner *learner;
+#endif
 };
 
+}  // namespace
+
 static _Unwind_Reason_Code libgcc_backtrace_helper(struct _Unwind_Context *ctx,
                                                    void *_data) {
   libgcc_backtrace_data *data =
     reinterpret_cast<libgcc_backtrace_data *>(_data);
 
+#ifdef HAVE_STACKTRACE_STEP_CACHE
+  if (data->learner) {
+    // Note, libgcc's "CFA" of a frame is CFA of its callee, that is
+    // frame's sp.
+    int ip_before_insn = 0;
+    stacktrace_step_cache::Frame frame;
+    frame.pc = _Unwind_GetIPInfo(ctx, &ip_before_insn);
+    frame.sp = _Unwind_GetCFA(ctx);
+    frame.fp = _Unwind_GetGR(ctx, 6 /* rbp */);
+    frame.interrupted = (ip_before_insn != 0);
+    data->learner->Add(frame);
+  }
+#endif
+
   if (data->skip > 0) {
     data->skip--;
     return _URC_NO_REASON;
@@ -96,8 +119,43 @@ static int GET_STACK_TRACE_OR_FRAMES {
   data.skip = skip_count + 2;
   data.pos = 0;
   data.limit = max_depth;
+#ifdef HAVE_STACKTRACE_STEP_CACHE
+  data.learner = nullptr;
+#endif
+
+#if TCMALLOC_CACHED_UNWIND_STEPS
+  // Note, like plain libgcc we ignore ucontext, so backtraces from
+  // signal handlers go through signal trampoline.
+  stacktrace_step_cache::Frame top;
+  STACKTRACE_STEP_CACHE_CAPTURE(top);
+  stacktrace_step_cache::ReadableChecker checker(top.sp);
+  int n = stacktrace_step_cache::Walk<false>(result, nullptr, max_depth,
+                                             data.skip, top, &checker);
+  if (n >= 0) {
+#if IS_STACK_FRAMES
+    memset(sizes, 0, sizeof(*sizes) * n);
+#endif
+    return n;
+  }
+  stacktrace_step_cache::Learner learner(top, &checker);
+  data.learner = &learner;
+#endif
 
-  _Unwind_Backtrace(libgcc_backtrace_helper, &data);
+  _Unwind_Reason_Code rc = _Unwind_Backtrace(libgcc_backtrace_helper, &data);
+  (void)rc;
+
+#if TCMALLOC_CACHED_UNWIND_STEPS
+  learner.Finish(rc == _URC_END_OF_STACK);
+  // Only captures with ucontext come from signal handlers, where we
+  // must not take loader's lock.
+  bool from_signal = false;
+#if IS_WITH_CONTEXT
+  from_signal = (ucp != nullptr);
+#endif
+  if (!from_signal) {
+    stacktrace_step_cache::CheckUnloads();
+  }
+#endif
 
   if (data.pos > 1 && data.array[data.pos - 1] == NULL)
     --data.pos;
@@ -50,6 +50,7 @@ extern "C" {
 
 #include "base/basictypes.h"
 #include "base/logging.h"
+#include "stacktrace_step_cache-inl.h"
 
 // Sometimes, we can try to get a stack trace from within a stack
 // trace, because libunwind can call mmap (maybe indirectly via an
@@ -64,6 +65,24 @@ static __thread int recursive ATTR_INITIAL_EXEC;
 #define BASE_STACKTRACE_UNW_CONTEXT_IS_UCONTEXT 1
 #endif
 
+#ifdef HAVE_STACKTRACE_STEP_CACHE
+// Passes current frame of 'cursor' to 'learner' (of libunwind_cached).
+static inline void libunwind_learn_frame(stacktrace_step_cache::Learner *learner,
+                                         unw_cursor_t *cursor, bool interrupted) {
+  if (!learner) {
+    return;
+  }
+  unw_word_t ip, sp, fp;
+  if (unw_get_reg(cursor, UNW_REG_IP, &ip) < 0
+      || unw_get_reg(cursor, UNW_REG_SP, &sp) < 0
+      || unw_get_reg(cursor, UNW_X86_64_RBP, &fp) < 0) {
+    return;
+  }
+  stacktrace_step_cache::Frame frame = {ip, sp, fp, interrupted};
+  learner->Add(frame);
+}
+#endif
+
 #endif  // BASE_STACKTRACE_LIBINWIND_INL_H_
 
 // Note: this part of the file is included several times.
@@ -94,6 +113,55 @@ static int GET_STACK_TRACE_OR_FRAMES {
   }
   ++recursive;
 
+#if TCMALLOC_CACHED_UNWIND_STEPS
+  stacktrace_step_cache::Learner *learner = nullptr;
+  // Set when the last unw_step went through signal trampoline
+  bool interrupted = false;
+  stacktrace_step_cache::Frame top;
+  STACKTRACE_STEP_CACHE_CAPTURE(top);
+  int walk_skip = skip_count + 2;
+  // Only captures with ucontext come from signal handlers, where we
+  // must not take loader's lock.
+  bool from_signal = false;
+#if (IS_WITH_CONTEXT && defined(BASE_STACKTRACE_UNW_CONTEXT_IS_UCONTEXT))
+  if (ucp) {
+    // Same as below: we start from ucontext and ignore skip_count.
+    const greg_t* gregs = static_cast<const ucontext_t*>(ucp)->uc_mcontext.gregs;
+    top.pc = gregs[REG_RIP];
+    top.sp = gregs[REG_RSP];
+    top.fp = gregs[REG_RBP];
+    top.interrupted = true;
+    interrupted = true;
+    walk_skip = 0;
+    from_signal = true;
+  }
+#endif
+  stacktrace_step_cache::ReadableChecker checker(top.sp);
+  {
+#if IS_STACK_FRAMES
+    int walked = stacktrace_step_cache::Walk<true>(result, sizes, max_depth,
+                                                   walk_skip, top, &checker);
+#else
+    int walked = stacktrace_step_cache::Walk<false>(result, nullptr, max_depth,
+                                                    walk_skip, top, &checker);
+#endif
+    if (walked >= 0) {
+      --recursive;
+      return walked;
+    }
+  }
+  stacktrace_step_cache::Learner cached_learner(top, &checker);
+  learner = &cached_learner;
+#define LEARN_FRAME() do {                                      \
+    libunwind_learn_frame(learner, &cursor, interrupted);       \
+    interrupted = (unw_is_signal_frame(&cursor) > 0);           \
+  } while (0)
+#define LEARN_FINISH(end_of_stack) learner->Finish(end_of_stack)
+#else
+#define LEARN_FRAME() do {} while (0)
+#define LEARN_FINISH(end_of_stack) do {} while (0)
+#endif
+
 #if (IS_WITH_CONTEXT && defined(BASE_STACKTRACE_UNW_CONTEXT_IS_UCONTEXT))
   if (ucp) {
     uc = *(static_cast<unw_context_t *>(const_cast<void *>(ucp)));
@@ -118,7 +186,9 @@ static int GET_STACK_TRACE_OR_FRAMES {
   assert(ret >= 0);
 
   while (skip_count--) {
-    if (unw_step(&cursor) <= 0) {
+    LEARN_FRAME();
+    if ((ret = unw_step(&cursor)) <= 0) {
+      LEARN_FINISH(ret == 0);
       goto out;
     }
 #if IS_STACK_FRAMES
@@ -136,7 +206,9 @@ static int GET_STACK_TRACE_OR_FRAMES {
     sizes[n] = 0;
 #endif
     result[n++] = ip;
-    if (unw_step(&cursor) <= 0) {
+    LEARN_FRAME();
+    if ((ret = unw_step(&cursor)) <= 0) {
+      LEARN_FINISH(ret == 0);
       break;
     }
 #if IS_STACK_FRAMES
@@ -148,6 +220,14 @@ static int GET_STACK_TRACE_OR_FRAMES {
 #endif
   }
 out:
+#if TCMALLOC_CACHED_UNWIND_STEPS
+  if (!from_signal) {
+    stacktrace_step_cache::CheckUnloads();
+  }
+#endif
   --recursive;
   return n;
 }
+
+#undef LEARN_FRAME
+#undef LEARN_FINISH
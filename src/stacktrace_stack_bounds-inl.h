@@ -0,0 +1,207 @@
+// -*- Mode: C++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+// Copyright (c) 2024, gperftools Contributors
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+//     * Neither the name of Google Inc. nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// This file has the bits that frame walking stacktrace
+// implementations need to tell if memory they're about to read is
+// readable: bounds of current thread's stack and a checker of
+// everything else.
+
+#ifndef BASE_STACKTRACE_STACK_BOUNDS_INL_H_
+#define BASE_STACKTRACE_STACK_BOUNDS_INL_H_
+
+#include <stdint.h>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <unistd.h>
+#define HAVE_STACKTRACE_STACK_BOUNDS 1
+#endif
+
+#include <atomic>
+
+#include "base/basictypes.h"
+#include "base/logging.h"
+#include "check_address-inl.h"
+
+namespace {
+namespace stacktrace_stack_bounds {
+
+#ifdef HAVE_STACKTRACE_STACK_BOUNDS
+
+// Stack of the current thread as reported by pthread_getattr_np. All
+// of [known_lo, hi) is known to be mapped. For threads created by
+// pthread_create this is entire stack. But main thread's stack is
+// reported up to rlimit, and only grows on demand. So for it we
+// start with the part above our own frame and extend it when
+// CheckAddress finds lower pages of [lo, hi) readable (kernel never
+// shrinks stack mapping).
+struct StackBounds {
+  uintptr_t lo;
+  uintptr_t known_lo;
+  uintptr_t hi;
+  bool inited;
+};
+
+static __thread StackBounds stack_bounds ATTR_INITIAL_EXEC;
+
+// Bounds are kept per thread and live as long as the thread does, so
+// all captures after the first one skip checks of stack pages.
+//
+// pthread_getattr_np allocates memory (and for main thread reads
+// /proc/self/maps). So we cannot call it from signal handlers. It is
+// called for main thread from stacktrace module initializer and for
+// every thread from its first capture without ucontext (see
+// MaybeInitStackBounds). Until then the thread checks every new page.
+ATTRIBUTE_NOINLINE
+void InitStackBounds() {
+  StackBounds* b = &stack_bounds;
+  if (b->inited) {
+    return;
+  }
+  // Set this first, so that malloc hooks that capture backtraces
+  // from inside pthread_getattr_np can't get here again.
+  b->inited = true;
+
+  pthread_attr_t attr;
+  if (pthread_getattr_np(pthread_self(), &attr) != 0) {
+    return;
+  }
+  void* addr;
+  size_t size;
+  if (pthread_attr_getstack(&attr, &addr, &size) == 0) {
+    uintptr_t lo = reinterpret_cast<uintptr_t>(addr);
+    uintptr_t hi = lo + size;
+    uintptr_t here = reinterpret_cast<uintptr_t>(__builtin_frame_address(0));
+    uintptr_t known_lo = lo;
+    if (getpid() == syscall(SYS_gettid)) {
+      known_lo = here & ~uintptr_t{static_cast<uintptr_t>(getpagesize()) - 1};
+    }
+    if (lo <= here && here < hi) {
+      b->lo = lo;
+      b->known_lo = known_lo;
+      // Signal handler on this thread may look at us at any
+      // time. Make sure it sees hi only after everything else.
+      std::atomic_signal_fence(std::memory_order_seq_cst);
+      b->hi = hi;
+    }
+  }
+  pthread_attr_destroy(&attr);
+}
+
+inline void MaybeInitStackBounds() {
+  if (!stack_bounds.inited) {
+    InitStackBounds();
+  }
+}
+
+#endif  // HAVE_STACKTRACE_STACK_BOUNDS
+
+// Tells if frames we walk during one capture are readable. Pages on
+// our thread's stack are known to be readable without asking the
+// kernel. Other pages are checked with CheckAddress (which costs a
+// syscall or two) and remembered, so each page is checked at most
+// once per capture. We deliberately don't keep pages across captures:
+// memory outside of our stack may be unmapped at any time.
+class ReadableChecker {
+public:
+  explicit ReadableChecker(uintptr_t known_readable) {
+    static uintptr_t pagesize;
+    if (pagesize == 0) {
+      pagesize = getpagesize();
+    }
+    page_mask_ = ~(pagesize - 1);
+    pages_[0] = known_readable & page_mask_;
+    count_ = 1;
+    next_ = 1;
+
+#ifdef HAVE_STACKTRACE_STACK_BOUNDS
+    hi_ = stack_bounds.hi;
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+    lo_ = stack_bounds.lo;
+    known_lo_ = stack_bounds.known_lo;
+#endif
+  }
+
+  bool IsReadable(void* ptr) {
+    uintptr_t addr = reinterpret_cast<uintptr_t>(ptr);
+
+#ifdef HAVE_STACKTRACE_STACK_BOUNDS
+    if (known_lo_ <= addr && addr < hi_) {
+      return true;
+    }
+#endif
+
+    uintptr_t page = addr & page_mask_;
+    for (int i = 0; i < count_; i++) {
+      if (pages_[i] == page) {
+        return true;
+      }
+    }
+
+    if (!CheckAddress(page, ~page_mask_ + 1)) {
+      return false;
+    }
+
+#ifdef HAVE_STACKTRACE_STACK_BOUNDS
+    if (lo_ <= page && page < known_lo_ && hi_ != 0) {
+      // Lower part of main thread's stack. Everything above this
+      // page is mapped too.
+      known_lo_ = page;
+      stack_bounds.known_lo = page;
+      return true;
+    }
+#endif
+
+    pages_[next_] = page;
+    next_ = (next_ + 1) % kPages;
+    if (count_ < kPages) {
+      count_++;
+    }
+    return true;
+  }
+
+private:
+  static constexpr int kPages = 8;
+
+  uintptr_t page_mask_;
+  uintptr_t pages_[kPages];
+  int count_;
+  int next_;
+#ifdef HAVE_STACKTRACE_STACK_BOUNDS
+  uintptr_t lo_;
+  uintptr_t known_lo_;
+  uintptr_t hi_;
+#endif
+};
+
+}  // namespace stacktrace_stack_bounds
+}  // namespace
+
+#endif  // BASE_STACKTRACE_STACK_BOUNDS_INL_H_
@@ -0,0 +1,478 @@
+// -*- Mode: C++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+// Copyright (c) 2024, gperftools Contributors
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+//     * Neither the name of Google Inc. nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// This file implements a PC-keyed cache of unwind steps that sits in
+// front of the libgcc and libunwind backtrace implementations (the
+// *_cached stacktrace methods).
+//
+// Neither unwinder lets us see the rules it got out of DWARF CFI. But
+// they tell us registers of every frame they walk, and on x86-64 it
+// takes just a few of them to tell how a frame was unwound: the
+// caller's sp is the CFA, the return address is right below it, and
+// the caller's rbp is either unchanged, or saved in the frame, or
+// (for frame pointer using code) rbp itself points 16 bytes below the
+// CFA. So every full backtrace we do with the real unwinder records
+// what it observed into the cache, keyed by pc. Once a step was
+// observed twice, the same way, backtraces that only meet cached pcs
+// are done by just following cached steps, without the unwinder and
+// without interpreting any DWARF. A pc that isn't cached makes us
+// redo the whole backtrace with the real unwinder (learning more
+// steps). Pcs that were seen unwinding in different ways are never
+// served from the cache.
+//
+// The cache is a fixed size direct mapped table. Entries are two
+// words: the step and the key xor-ed with the step, so readers detect
+// torn or racing updates without any locking. Every memory read done
+// by following cached steps is checked with ReadableChecker first, so
+// a bogus step (or a frame we don't understand) merely sends us back
+// to the real unwinder. It is safe to use from signal handlers to the
+// same extent the backing unwinder is.
+
+#ifndef BASE_STACKTRACE_STEP_CACHE_INL_H_
+#define BASE_STACKTRACE_STEP_CACHE_INL_H_
+
+#if defined(__linux__) && defined(__x86_64__) && defined(_LP64)
+
+#include <link.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/ucontext.h>
+
+#include <atomic>
+
+#include "stacktrace_stack_bounds-inl.h"
+
+#define HAVE_STACKTRACE_STEP_CACHE 1
+
+namespace {
+namespace stacktrace_step_cache {
+
+using stacktrace_stack_bounds::ReadableChecker;
+
+// A frame as seen by the unwinder. 'interrupted' is set for frames
+// interrupted by a signal, where pc isn't a return address.
+struct Frame {
+  uintptr_t pc;
+  uintptr_t sp;
+  uintptr_t fp;
+  bool interrupted;
+};
+
+enum StepKind : uint8_t {
+  kStepNone,         // Never stored
+  kStepSP,           // CFA = sp + cfa_offset
+  kStepFP,           // CFA = fp + 16, caller's fp saved at CFA - 16
+  kStepEndOfStack,   // Outermost frame
+  kStepSignalFrame,  // Signal trampoline: sp points at a ucontext_t
+  kStepConflict,     // Seen unwinding in different ways. Never used
+};
+
+// A step is packed into a single 64-bit word: kind in the lowest
+// byte, then 'confirmed' bit, then (for kStepSP) where the caller's
+// fp is saved relative to the CFA (0 means it is unchanged) and the
+// CFA offset.
+constexpr uint64_t kConfirmedBit = 1 << 8;
+
+// fp_offset of steps after which caller's fp is unknown. We get those
+// when several slots in the frame match it (e.g. when it is 0). It is
+// fine as long as no frame up the stack needs fp to unwind.
+constexpr int16_t kFPUnknown = 1;
+
+inline uint64_t PackStep(StepKind kind, int32_t cfa_offset, int16_t fp_offset) {
+  return static_cast<uint64_t>(kind)
+    | (static_cast<uint64_t>(static_cast<uint16_t>(fp_offset)) << 16)
+    | (static_cast<uint64_t>(static_cast<uint32_t>(cfa_offset)) << 32);
+}
+
+inline StepKind StepKindOf(uint64_t step) {
+  return static_cast<StepKind>(step & 0xff);
+}
+
+inline int16_t StepFPOffset(uint64_t step) {
+  return static_cast<int16_t>(step >> 16);
+}
+
+inline int32_t StepCFAOffset(uint64_t step) {
+  return static_cast<int32_t>(step >> 32);
+}
+
+// Few thousands return addresses is what typical programs unwind
+// through. Entries are 16 bytes, so this is 128k of (lazily touched)
+// bss.
+constexpr int kCacheBits = 13;
+constexpr int kCacheSize = 1 << kCacheBits;
+
+// How far below the CFA we look for the caller's saved fp.
+constexpr int kMaxFPSlot = 32;
+
+struct Entry {
+  std::atomic<uint64_t> check;  // key ^ step
+  std::atomic<uint64_t> step;
+};
+
+Entry cache[kCacheSize];
+
+struct Stats {
+  std::atomic<uint64_t> hits;      // frames unwound by cached steps
+  std::atomic<uint64_t> misses;    // backtraces redone by the unwinder
+};
+
+Stats stats;
+
+// dlpi_subs we saw last time. Used to drop steps of unloaded objects.
+std::atomic<unsigned long long> seen_subs;
+
+inline uint64_t KeyOf(uintptr_t pc, bool interrupted) {
+  // Same pc may be unwound differently when it is an exact pc of
+  // interrupted code and when it is a return address.
+  return (static_cast<uint64_t>(pc) << 1) | (interrupted ? 1 : 0);
+}
+
+inline Entry* EntryFor(uint64_t key) {
+  return &cache[(key * 0x9e3779b97f4a7c15ULL) >> (64 - kCacheBits)];
+}
+
+// Returns the step stored for 'key' or 0.
+inline uint64_t Lookup(uint64_t key) {
+  Entry* e = EntryFor(key);
+  uint64_t step = e->step.load(std::memory_order_relaxed);
+  uint64_t check = e->check.load(std::memory_order_relaxed);
+  if ((check ^ step) != key) {
+    return 0;
+  }
+  return step;
+}
+
+inline void Store(uint64_t key, uint64_t step) {
+  Entry* e = EntryFor(key);
+  e->step.store(step, std::memory_order_relaxed);
+  e->check.store(key ^ step, std::memory_order_relaxed);
+}
+
+inline void Flush() {
+  for (int i = 0; i < kCacheSize; i++) {
+    cache[i].step.store(0, std::memory_order_relaxed);
+    cache[i].check.store(0, std::memory_order_relaxed);
+  }
+}
+
+inline int ReadSubsCallback(struct dl_phdr_info* info, size_t size, void* data) {
+  if (size < offsetof(struct dl_phdr_info, dlpi_subs) + sizeof(info->dlpi_subs)) {
+    return 1;
+  }
+  *static_cast<unsigned long long*>(data) = info->dlpi_subs + 1;
+  return 1;
+}
+
+// Drops everything we've learned if some objects were unloaded since
+// the last check. dl_iterate_phdr takes loader's lock, so this is
+// never done while capturing. Instead the capture that had to fall
+// back to the real unwinder (which is when pcs of newly loaded code
+// are first seen) calls it after it is done, unless it runs in a
+// signal handler. Until then steps of unloaded code may be used for
+// unrelated code mapped in their place; which gives wrong backtraces,
+// but no crashes, as every read is checked.
+inline void CheckUnloads() {
+  unsigned long long subs = 0;
+  dl_iterate_phdr(ReadSubsCallback, &subs);
+  if (subs == 0) {
+    return;
+  }
+  unsigned long long prev = seen_subs.load(std::memory_order_relaxed);
+  if (prev == subs) {
+    return;
+  }
+  if (seen_subs.compare_exchange_strong(prev, subs) && prev != 0) {
+    Flush();
+  }
+}
+
+// Reads a word of stack at 'addr' into *value, if it is readable.
+inline bool Load(ReadableChecker* checker, uintptr_t addr, uintptr_t* value) {
+  if ((addr & (sizeof(void*) - 1)) != 0
+      || !checker->IsReadable(reinterpret_cast<void*>(addr))) {
+    return false;
+  }
+  *value = *reinterpret_cast<const uintptr_t*>(addr);
+  return true;
+}
+
+// Returns interrupted registers of the signal frame whose sp is
+// 'sp' or nullptr if they aren't readable.
+inline const greg_t* SignalFrameRegs(ReadableChecker* checker, uintptr_t sp) {
+  const greg_t* gregs =
+    reinterpret_cast<const ucontext_t*>(sp)->uc_mcontext.gregs;
+  if (!checker->IsReadable(const_cast<greg_t*>(gregs))
+      || !checker->IsReadable(const_cast<greg_t*>(gregs + NGREG - 1))) {
+    return nullptr;
+  }
+  return gregs;
+}
+
+// Figures out how 'frame' was unwound into 'caller'. Returns 0 if it
+// doesn't look like anything we can replay.
+inline uint64_t DeriveStep(ReadableChecker* checker,
+                           const Frame& frame, const Frame& caller) {
+  if (caller.pc == 0) {
+    // Unwinders report undefined return address (of the outermost
+    // frame) as 0.
+    return PackStep(kStepEndOfStack, 0, 0);
+  }
+  if (caller.interrupted) {
+    // The only way to get into interrupted frame is via signal
+    // trampoline, whose sp points at the interrupted registers.
+    const greg_t* gregs = SignalFrameRegs(checker, frame.sp);
+    if (gregs == nullptr
+        || static_cast<uintptr_t>(gregs[REG_RIP]) != caller.pc
+        || static_cast<uintptr_t>(gregs[REG_RSP]) != caller.sp
+        || static_cast<uintptr_t>(gregs[REG_RBP]) != caller.fp) {
+      return 0;
+    }
+    return PackStep(kStepSignalFrame, 0, 0);
+  }
+
+  uintptr_t cfa = caller.sp;
+  if (cfa < frame.sp + sizeof(void*) || (cfa & (sizeof(void*) - 1)) != 0
+      || cfa - frame.sp > INT32_MAX) {
+    return 0;
+  }
+  uintptr_t value;
+  if (!Load(checker, cfa - sizeof(void*), &value) || value != caller.pc) {
+    return 0;
+  }
+
+  if (frame.fp == cfa - 2 * sizeof(void*) && frame.fp >= frame.sp
+      && Load(checker, frame.fp, &value) && value == caller.fp) {
+    return PackStep(kStepFP, 0, 0);
+  }
+
+  int32_t cfa_offset = cfa - frame.sp;
+  if (caller.fp == frame.fp) {
+    return PackStep(kStepSP, cfa_offset, 0);
+  }
+
+  // Look for the (single) slot in this frame that has caller's fp.
+  int16_t fp_offset = 0;
+  for (int i = 2; i <= kMaxFPSlot; i++) {
+    uintptr_t slot = cfa - i * sizeof(void*);
+    if (slot < frame.sp) {
+      break;
+    }
+    if (!Load(checker, slot, &value) || value != caller.fp) {
+      continue;
+    }
+    if (fp_offset != 0) {
+      return PackStep(kStepSP, cfa_offset, kFPUnknown);
+    }
+    fp_offset = static_cast<int16_t>(-i * static_cast<int>(sizeof(void*)));
+  }
+  if (fp_offset == 0) {
+    return 0;
+  }
+  return PackStep(kStepSP, cfa_offset, fp_offset);
+}
+
+inline void Learn(const Frame& frame, uint64_t step) {
+  uint64_t key = KeyOf(frame.pc, frame.interrupted);
+  uint64_t old = Lookup(key);
+
+  if (old == 0) {
+    if (step != 0) {
+      Store(key, step);
+    }
+    return;
+  }
+  old &= ~kConfirmedBit;
+  if (old == step) {
+    Store(key, step | kConfirmedBit);
+    return;
+  }
+  if (step != 0 && StepKindOf(old) == kStepSP && StepKindOf(step) == kStepSP
+      && StepCFAOffset(old) == StepCFAOffset(step)
+      && (StepFPOffset(old) == kFPUnknown || StepFPOffset(step) == kFPUnknown)) {
+    // Same CFA, but caller's fp was ambiguous for one of them. The step
+    // with unknown fp is correct for both.
+    Store(key, PackStep(kStepSP, StepCFAOffset(step), kFPUnknown) | kConfirmedBit);
+    return;
+  }
+  if (StepKindOf(old) != kStepConflict) {
+    Store(key, PackStep(kStepConflict, 0, 0) | kConfirmedBit);
+  }
+}
+
+// Collects frames the real unwinder walks through and learns steps
+// between them. The first frame is replaced with 'top' (where the
+// cached walk starts), which is the same frame, but a pc that we'll
+// use as key next time.
+class Learner {
+public:
+  Learner(const Frame& top, ReadableChecker* checker)
+    : top_(top), checker_(checker), count_(0) {}
+
+  void Add(Frame frame) {
+    if (count_ == 0) {
+      frame = top_;
+    } else {
+      Learn(last_, DeriveStep(checker_, last_, frame));
+    }
+    last_ = frame;
+    count_++;
+  }
+
+  // Called after the unwinder is done. 'end_of_stack' tells if the
+  // last frame is the outermost one.
+  void Finish(bool end_of_stack) {
+    if (end_of_stack && count_ > 0) {
+      Learn(last_, PackStep(kStepEndOfStack, 0, 0));
+    }
+  }
+
+private:
+  Frame top_;
+  ReadableChecker* checker_;
+  Frame last_;
+  int count_;
+};
+
+// Walks the stack from 'frame' by cached steps only. Returns the
+// number of frames captured or -1 if it met a pc without confirmed
+// step or a step that would read unreadable memory, in which case the
+// caller should use the real unwinder.
+template <bool WithSizes>
+int Walk(void** result, int* sizes, int max_depth, int skip_count,
+         Frame frame, ReadableChecker* checker) {
+  int n = 0;
+  int hits = 0;
+  bool fp_valid = true;
+
+  while (n < max_depth) {
+    uint64_t step = Lookup(KeyOf(frame.pc, frame.interrupted));
+    if ((step & kConfirmedBit) == 0) {
+      goto miss;
+    }
+
+    Frame caller;
+    bool done = false;
+    switch (StepKindOf(step)) {
+    case kStepSP:
+    case kStepFP: {
+      if (StepKindOf(step) == kStepFP && !fp_valid) {
+        goto miss;
+      }
+      uintptr_t cfa = (StepKindOf(step) == kStepFP)
+        ? frame.fp + 2 * sizeof(void*)
+        : frame.sp + StepCFAOffset(step);
+      if (cfa <= frame.sp) {
+        goto miss;
+      }
+      caller.sp = cfa;
+      if (!Load(checker, cfa - sizeof(void*), &caller.pc)) {
+        goto miss;
+      }
+      if (StepKindOf(step) == kStepFP) {
+        if (!Load(checker, frame.fp, &caller.fp)) {
+          goto miss;
+        }
+      } else if (StepFPOffset(step) == kFPUnknown) {
+        caller.fp = 0;
+        fp_valid = false;
+      } else if (StepFPOffset(step) != 0) {
+        if (!Load(checker, cfa + StepFPOffset(step), &caller.fp)) {
+          goto miss;
+        }
+        fp_valid = true;
+      } else {
+        caller.fp = frame.fp;
+      }
+      caller.interrupted = false;
+      break;
+    }
+    case kStepSignalFrame: {
+      const greg_t* gregs = SignalFrameRegs(checker, frame.sp);
+      if (gregs == nullptr) {
+        goto miss;
+      }
+      caller.pc = gregs[REG_RIP];
+      caller.sp = gregs[REG_RSP];
+      caller.fp = gregs[REG_RBP];
+      caller.interrupted = true;
+      fp_valid = true;
+      break;
+    }
+    case kStepEndOfStack:
+      done = true;
+      break;
+    default:
+      goto miss;
+    }
+    hits++;
+
+    if (skip_count > 0) {
+      skip_count--;
+    } else {
+      if (WithSizes) {
+        sizes[n] = done ? 0 : caller.sp - frame.sp;
+      }
+      result[n++] = reinterpret_cast<void*>(frame.pc);
+    }
+    if (done || caller.pc == 0) {
+      break;
+    }
+    frame = caller;
+  }
+
+  stats.hits.fetch_add(hits, std::memory_order_relaxed);
+  return n;
+
+miss:
+  stats.hits.fetch_add(hits, std::memory_order_relaxed);
+  stats.misses.fetch_add(1, std::memory_order_relaxed);
+  return -1;
+}
+
+}  // namespace stacktrace_step_cache
+}  // namespace
+
+// Sets 'frame' to the current pc and registers. It must be expanded
+// in the function that then calls the unwinder (it is the first
+// frame unwinder reports).
+#define STACKTRACE_STEP_CACHE_CAPTURE(frame)                        \
+  do {                                                              \
+    __asm__ __volatile__("leaq 0(%%rip), %0\n\t"                    \
+                         "movq %%rsp, %1\n\t"                       \
+                         "movq %%rbp, %2"                           \
+                         : "=r"((frame).pc), "=r"((frame).sp),      \
+                           "=r"((frame).fp));                       \
+    (frame).interrupted = false;                                    \
+  } while (0)
+
+#endif  // __linux__ && __x86_64__ && _LP64
+
+#endif  // BASE_STACKTRACE_STEP_CACHE_INL_H_
@@ -31,8 +31,10 @@
 // ---
 // Author: Craig Silverstein
 //
-// This forks out to pprof to do the actual symbolizing.  We might
-// be better off writing our own in C++.
+// On ELF systems with dl_iterate_phdr we symbolize in-process by
+// reading symbol tables of loaded objects. Elsewhere (or when that
+// finds nothing) this forks out to pprof to do the actual
+// symbolizing.
 
 #include "config.h"
 #include "symbolize.h"
@@ -65,6 +67,24 @@
 #include <sys/sysctl.h>
 #endif
 
+#if defined(__ELF__) && defined(__linux__)
+#define HAVE_ELF_SYMBOLIZER 1
+#include <ctype.h>
+#include <cxxabi.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <link.h>
+#include <sys/auxv.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <atomic>
+
+#include "base/spinlock.h"
+#endif
+
 using std::string;
 
 // pprof may be used after destructors are
@@ -162,6 +182,658 @@ static void PrintError(const char* reason) {
           reason);
 }
 
+#ifdef HAVE_ELF_SYMBOLIZER
+
+namespace {
+
+// Same as pprof's ShortFunctionName: drops argument lists and
+// template arguments from demangled name. Works in place.
+void ShortenFunctionName(char* name) {
+  char* out = name;
+  int depth = 0;
+  for (const char* p = name; *p; p++) {
+    char c = *p;
+    if (c == '(' || c == '<') {
+      depth++;
+      continue;
+    }
+    if ((c == ')' || c == '>') && depth > 0) {
+      depth--;
+      if (depth == 0 && c == ')' && strncmp(p + 1, " const", 6) == 0) {
+        p += 6;
+      }
+      continue;
+    }
+    if (depth == 0) {
+      *out++ = c;
+    }
+  }
+  *out = 0;
+
+  // Drop return type of template functions, i.e. everything up to
+  // last space that is followed by "word::".
+  char* start = name;
+  for (char* p = name; *p; p++) {
+    if (*p != ' ') {
+      continue;
+    }
+    char* w = p + 1;
+    while (isalnum(*w) || *w == '_') {
+      w++;
+    }
+    if (w != p + 1 && w[0] == ':' && w[1] == ':') {
+      start = p + 1;
+    }
+  }
+  if (start != name) {
+    memmove(name, start, strlen(start) + 1);
+  }
+}
+
+// On-disk symbol cache. When PPROF_SYMBOL_CACHE names a directory,
+// function symbols of every object that has a build-id are saved
+// there in a file named by hex build-id. Both we and pprof consult it
+// before reading symbol tables (or running nm). The file is meant to
+// be mmap-ed and used as is: header, then records sorted by address
+// (relative to load bias), then NUL-terminated names (already
+// demangled and shortened). Everything is in host byte order.
+struct SymbolCacheHeader {
+  char magic[8];
+  uint32_t count;
+  uint32_t reserved;
+  uint64_t strings_offset;
+  uint64_t strings_size;
+};
+
+struct SymbolCacheRecord {
+  uint64_t addr;
+  uint32_t size;
+  uint32_t name;  // offset into strings
+};
+
+static_assert(sizeof(SymbolCacheHeader) == 32, "");
+static_assert(sizeof(SymbolCacheRecord) == 16, "");
+
+constexpr char kSymbolCacheMagic[8] = {'g', 'p', 's', 'y', 'm', 's', '1', '\n'};
+
+// Function symbols of one ELF object sorted by address. Object's file
+// (or in-memory image for vdso, or cache file) is mapped for as long
+// as we live and symbol names point into it. Once loaded, it may be
+// used by many threads at once without locking.
+class ElfSymbols {
+ public:
+  ElfSymbols() = default;
+  ElfSymbols(const ElfSymbols&) = delete;
+  ElfSymbols& operator=(const ElfSymbols&) = delete;
+
+  ~ElfSymbols() {
+    for (size_t i = 0; pretty_ != nullptr && i < count_; i++) {
+      const char* pretty = pretty_[i].load(std::memory_order_relaxed);
+      if (pretty != nullptr && pretty != entries_[i].name) {
+        free(const_cast<char*>(pretty));
+      }
+    }
+    delete[] pretty_;
+    delete[] entries_;
+    if (mapping_ != nullptr) {
+      munmap(const_cast<char*>(mapping_), mapping_size_);
+    }
+  }
+
+  // Makes us unmap 'image' of 'size' bytes when we're deleted.
+  void SetMapping(const char* image, size_t size) {
+    mapping_ = image;
+    mapping_size_ = size;
+  }
+
+  // Parses image of 'size' bytes. Returns false if it is not ELF
+  // file we understand or has no function symbols.
+  bool Init(const char* image, size_t size) {
+    if (size < sizeof(ElfW(Ehdr))) {
+      return false;
+    }
+    const ElfW(Ehdr)* ehdr = reinterpret_cast<const ElfW(Ehdr)*>(image);
+    if (memcmp(ehdr->e_ident, ELFMAG, SELFMAG) != 0
+        || ehdr->e_ident[EI_CLASS] != (sizeof(void*) == 8 ? ELFCLASS64 : ELFCLASS32)
+        || ehdr->e_shentsize != sizeof(ElfW(Shdr))
+        || ehdr->e_shoff == 0
+        || ehdr->e_shoff > size
+        || (size - ehdr->e_shoff) / sizeof(ElfW(Shdr)) < ehdr->e_shnum) {
+      return false;
+    }
+    const ElfW(Shdr)* shdrs = reinterpret_cast<const ElfW(Shdr)*>(image + ehdr->e_shoff);
+
+    // Prefer full symbol table, but stripped objects only have
+    // dynamic one.
+    const ElfW(Shdr)* symtab = nullptr;
+    for (int i = 0; i < ehdr->e_shnum; i++) {
+      if (shdrs[i].sh_type == SHT_SYMTAB) {
+        symtab = &shdrs[i];
+        break;
+      }
+      if (shdrs[i].sh_type == SHT_DYNSYM) {
+        symtab = &shdrs[i];
+      }
+    }
+    if (symtab == nullptr || symtab->sh_link >= ehdr->e_shnum) {
+      return false;
+    }
+    const ElfW(Shdr)* strtab = &shdrs[symtab->sh_link];
+    if (symtab->sh_offset > size || size - symtab->sh_offset < symtab->sh_size
+        || strtab->sh_offset > size || size - strtab->sh_offset < strtab->sh_size) {
+      return false;
+    }
+
+    const ElfW(Sym)* syms = reinterpret_cast<const ElfW(Sym)*>(image + symtab->sh_offset);
+    size_t nsyms = symtab->sh_size / sizeof(ElfW(Sym));
+    const char* strs = image + strtab->sh_offset;
+
+    entries_ = new Entry[nsyms];
+    count_ = 0;
+    for (size_t i = 0; i < nsyms; i++) {
+      int type = ELF64_ST_TYPE(syms[i].st_info);
+      if ((type != STT_FUNC && type != STT_GNU_IFUNC)
+          || syms[i].st_shndx == SHN_UNDEF
+          || syms[i].st_value == 0
+          || syms[i].st_name >= strtab->sh_size) {
+        continue;
+      }
+      Entry* e = &entries_[count_++];
+      e->addr = syms[i].st_value;
+      e->size = syms[i].st_size;
+      e->global = (ELF64_ST_BIND(syms[i].st_info) != STB_LOCAL);
+      e->name = strs + syms[i].st_name;
+    }
+    if (count_ == 0) {
+      delete[] entries_;
+      entries_ = nullptr;
+      return false;
+    }
+
+    // Aliases share address. Keep global one, since it is what nm
+    // and pprof would likely show.
+    std::sort(entries_, entries_ + count_, [] (const Entry& a, const Entry& b) {
+      if (a.addr != b.addr) {
+        return a.addr < b.addr;
+      }
+      return a.global > b.global;
+    });
+    count_ = std::unique(entries_, entries_ + count_, [] (const Entry& a, const Entry& b) {
+      return a.addr == b.addr;
+    }) - entries_;
+    pretty_ = new std::atomic<const char*>[count_]();
+    return true;
+  }
+
+  // Uses mmap-ed symbol cache file. Returns false if it looks broken.
+  bool InitFromCache(const char* image, size_t size) {
+    const SymbolCacheHeader* h = reinterpret_cast<const SymbolCacheHeader*>(image);
+    if (size < sizeof(*h)
+        || memcmp(h->magic, kSymbolCacheMagic, sizeof(h->magic)) != 0
+        || h->strings_offset < sizeof(*h) + uint64_t{h->count} * sizeof(SymbolCacheRecord)
+        || h->strings_offset > size
+        || h->strings_size == 0
+        || size - h->strings_offset < h->strings_size) {
+      return false;
+    }
+    cache_strings_ = image + h->strings_offset;
+    cache_strings_size_ = h->strings_size;
+    if (cache_strings_[cache_strings_size_ - 1] != 0) {
+      return false;
+    }
+    records_ = reinterpret_cast<const SymbolCacheRecord*>(h + 1);
+    count_ = h->count;
+    return true;
+  }
+
+  // Saves symbols loaded by Init into cache file at 'path'. Any
+  // failure simply leaves no cache behind.
+  void SaveCache(const char* path) {
+    string strings;
+    SymbolCacheRecord* records = new SymbolCacheRecord[count_];
+    for (size_t i = 0; i < count_; i++) {
+      records[i].addr = entries_[i].addr;
+      records[i].size = std::min<uintptr_t>(entries_[i].size, UINT32_MAX);
+      records[i].name = strings.size();
+      strings.append(Pretty(i));
+      strings.push_back('\0');
+    }
+
+    SymbolCacheHeader h;
+    memcpy(h.magic, kSymbolCacheMagic, sizeof(h.magic));
+    h.count = count_;
+    h.reserved = 0;
+    h.strings_offset = sizeof(h) + sizeof(records[0]) * count_;
+    h.strings_size = strings.size();
+
+    // Write it under unique temporary name, so that readers never
+    // see partial file, even if other threads or processes save the
+    // same object at the same time.
+    string tmp_path = string(path) + ".tmpXXXXXX";
+    int fd = mkostemp(&tmp_path[0], O_CLOEXEC);
+    if (fd >= 0) {
+      bool ok = fchmod(fd, 0644) == 0
+          && WriteFully(fd, &h, sizeof(h))
+          && WriteFully(fd, records, sizeof(records[0]) * count_)
+          && WriteFully(fd, strings.data(), strings.size());
+      ok = (close(fd) == 0) && ok;
+      if (!ok || rename(tmp_path.c_str(), path) != 0) {
+        unlink(tmp_path.c_str());
+      }
+    }
+    delete[] records;
+  }
+
+  // Returns name of function containing 'addr' (relative to object's
+  // load bias) or nullptr.
+  const char* Lookup(uintptr_t addr) {
+    if (records_ != nullptr) {
+      return LookupInCache(addr);
+    }
+
+    Entry* end = entries_ + count_;
+    Entry* e = std::upper_bound(entries_, end, addr, [] (uintptr_t a, const Entry& b) {
+      return a < b.addr;
+    });
+    if (e == entries_) {
+      return nullptr;
+    }
+    --e;
+    // Some hand-written functions have no size, so we trust them up
+    // to next symbol.
+    if (e->size != 0 && addr - e->addr >= e->size) {
+      return nullptr;
+    }
+    return Pretty(e - entries_);
+  }
+
+ private:
+  struct Entry {
+    uintptr_t addr;
+    uintptr_t size;
+    bool global;
+    const char* name;
+  };
+
+  // Returns demangled and shortened name of i-th entry. It is made on
+  // demand. Threads racing to make it agree on the first one made.
+  const char* Pretty(size_t i) {
+    const char* pretty = pretty_[i].load(std::memory_order_acquire);
+    if (pretty != nullptr) {
+      return pretty;
+    }
+    const char* name = entries_[i].name;
+    int status;
+    char* demangled = abi::__cxa_demangle(name, nullptr, nullptr, &status);
+    if (demangled != nullptr) {
+      ShortenFunctionName(demangled);
+      pretty = demangled;
+    } else {
+      pretty = name;
+    }
+    const char* expected = nullptr;
+    if (!pretty_[i].compare_exchange_strong(expected, pretty,
+                                            std::memory_order_acq_rel)) {
+      free(demangled);
+      return expected;
+    }
+    return pretty;
+  }
+
+  const char* LookupInCache(uintptr_t addr) {
+    const SymbolCacheRecord* end = records_ + count_;
+    const SymbolCacheRecord* r = std::upper_bound(
+      records_, end, addr, [] (uintptr_t a, const SymbolCacheRecord& b) {
+        return a < b.addr;
+      });
+    if (r == records_) {
+      return nullptr;
+    }
+    --r;
+    if ((r->size != 0 && addr - r->addr >= r->size)
+        || r->name >= cache_strings_size_) {
+      return nullptr;
+    }
+    return cache_strings_ + r->name;
+  }
+
+  static bool WriteFully(int fd, const void* buf, size_t size) {
+    const char* p = static_cast<const char*>(buf);
+    while (size > 0) {
+      ssize_t rv = write(fd, p, size);
+      if (rv < 0 && errno == EINTR) {
+        continue;
+      }
+      if (rv <= 0) {
+        return false;
+      }
+      p += rv;
+      size -= rv;
+    }
+    return true;
+  }
+
+  Entry* entries_ = nullptr;
+  std::atomic<const char*>* pretty_ = nullptr;
+  size_t count_ = 0;
+
+  const char* mapping_ = nullptr;
+  size_t mapping_size_ = 0;
+
+  // Set when we're backed by cache file.
+  const SymbolCacheRecord* records_ = nullptr;
+  const char* cache_strings_ = nullptr;
+  size_t cache_strings_size_ = 0;
+};
+
+// What tells loaded objects apart. Load bias and file name alone
+// don't: after dlclose another object (or new version of the same
+// file) may be loaded at the same address. So we also take object's
+// build-id or, if it has none, identity of its file.
+struct ObjectKey {
+  uintptr_t bias;
+  string name;
+  string build_id;
+  dev_t dev;
+  ino_t ino;
+  int64_t mtime_ns;
+
+  bool operator==(const ObjectKey& other) const {
+    return bias == other.bias && name == other.name
+        && build_id == other.build_id && dev == other.dev
+        && ino == other.ino && mtime_ns == other.mtime_ns;
+  }
+};
+
+// Loaded objects we've seen so far. We keep them across Symbolize
+// calls, so that repeated reports (e.g. from heap checker) don't
+// re-read symbol tables. Entries are never removed, since names we
+// handed out point into them. cache_lock only guards the list, symbols
+// are loaded without holding it.
+struct CachedObject {
+  CachedObject* next;
+  ObjectKey key;
+  ElfSymbols* symbols;  // nullptr if we couldn't read any
+};
+
+SpinLock cache_lock;
+CachedObject* cached_objects;
+
+// mmaps entire file read-only. Returns nullptr on failure.
+const char* MapFile(const char* path, size_t* size) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return nullptr;
+  }
+  struct stat st;
+  void* image = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && st.st_size > 0) {
+    image = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  close(fd);
+  if (image == MAP_FAILED) {
+    return nullptr;
+  }
+  *size = st.st_size;
+  return static_cast<const char*>(image);
+}
+
+const char* GetSymbolCacheDir() {
+  static const char* dir = ([] () -> const char* {
+      string dir = EnvToString("PPROF_SYMBOL_CACHE", "");
+      return dir.empty() ? nullptr : strdup(dir.c_str());
+    })();
+  return dir;
+}
+
+// Finds object's build-id in its loaded PT_NOTE segments and returns
+// it in hex. Returns false if the object has no build-id.
+bool GetBuildId(uintptr_t bias, const ElfW(Phdr)* phdrs, int phnum,
+                string* build_id) {
+  for (int i = 0; i < phnum; i++) {
+    if (phdrs[i].p_type != PT_NOTE) {
+      continue;
+    }
+    size_t align = (phdrs[i].p_align == 8) ? 8 : 4;
+    const char* p = reinterpret_cast<const char*>(bias + phdrs[i].p_vaddr);
+    const char* end = p + phdrs[i].p_memsz;
+    while (end - p >= static_cast<ptrdiff_t>(sizeof(ElfW(Nhdr)))) {
+      const ElfW(Nhdr)* note = reinterpret_cast<const ElfW(Nhdr)*>(p);
+      const char* name = p + sizeof(*note);
+      const char* desc = name + ((note->n_namesz + align - 1) & ~(align - 1));
+      const char* next = desc + ((note->n_descsz + align - 1) & ~(align - 1));
+      if (next > end) {
+        break;
+      }
+      if (note->n_type == NT_GNU_BUILD_ID && note->n_namesz == 4
+          && memcmp(name, "GNU", 4) == 0 && note->n_descsz > 0) {
+        build_id->clear();
+        for (size_t j = 0; j < note->n_descsz; j++) {
+          static const char kHex[] = "0123456789abcdef";
+          unsigned char c = desc[j];
+          build_id->push_back(kHex[c >> 4]);
+          build_id->push_back(kHex[c & 15]);
+        }
+        return true;
+      }
+      p = next;
+    }
+  }
+  return false;
+}
+
+// Forms path of cache file for the object from its hex 'build_id'.
+// Returns false if caching is off or object has no build-id.
+bool GetSymbolCachePath(const string& build_id, string* path) {
+  const char* dir = GetSymbolCacheDir();
+  if (dir == nullptr || build_id.empty()) {
+    return false;
+  }
+  *path = dir;
+  path->push_back('/');
+  path->append(build_id);
+  return true;
+}
+
+const char* ObjectPath(const char* name) {
+  return (name[0] == 0) ? "/proc/self/exe" : name;
+}
+
+void GetObjectKey(const char* name, uintptr_t bias, const ElfW(Phdr)* phdrs,
+                  int phnum, ObjectKey* key) {
+  key->bias = bias;
+  key->name = name;
+  key->dev = 0;
+  key->ino = 0;
+  key->mtime_ns = 0;
+  if (GetBuildId(bias, phdrs, phnum, &key->build_id)) {
+    return;
+  }
+  struct stat st;
+  if (stat(ObjectPath(name), &st) == 0) {
+    key->dev = st.st_dev;
+    key->ino = st.st_ino;
+    key->mtime_ns = int64_t{st.st_mtim.tv_sec} * 1000000000 + st.st_mtim.tv_nsec;
+  }
+}
+
+bool LoadObjectSymbols(ElfSymbols* symbols, const char* name, uintptr_t bias,
+                       const ElfW(Phdr)* phdrs, int phnum) {
+  size_t size;
+  const char* image = MapFile(ObjectPath(name), &size);
+  if (image != nullptr) {
+    if (symbols->Init(image, size)) {
+      symbols->SetMapping(image, size);
+      return true;
+    }
+    munmap(const_cast<char*>(image), size);
+  }
+
+  // vdso has no file, but it is mapped whole, section headers
+  // included.
+  uintptr_t vdso = getauxval(AT_SYSINFO_EHDR);
+  size_t image_size = 0;
+  uintptr_t image_start = 0;
+  for (int i = 0; i < phnum; i++) {
+    if (phdrs[i].p_type != PT_LOAD) {
+      continue;
+    }
+    if (phdrs[i].p_offset == 0) {
+      image_start = bias + phdrs[i].p_vaddr;
+    }
+    image_size = std::max<size_t>(image_size, phdrs[i].p_offset + phdrs[i].p_filesz);
+  }
+  return vdso != 0 && image_start == vdso
+      && symbols->Init(reinterpret_cast<const char*>(vdso), image_size);
+}
+
+ElfSymbols* LoadSymbols(const ObjectKey& key, const char* name,
+                        uintptr_t bias, const ElfW(Phdr)* phdrs, int phnum) {
+  ElfSymbols* symbols = new ElfSymbols;
+
+  string cache_path;
+  bool use_cache = GetSymbolCachePath(key.build_id, &cache_path);
+  if (use_cache) {
+    size_t size;
+    const char* image = MapFile(cache_path.c_str(), &size);
+    if (image != nullptr) {
+      if (symbols->InitFromCache(image, size)) {
+        symbols->SetMapping(image, size);
+        return symbols;
+      }
+      munmap(const_cast<char*>(image), size);
+    }
+  }
+
+  if (!LoadObjectSymbols(symbols, name, bias, phdrs, phnum)) {
+    delete symbols;
+    return nullptr;
+  }
+  if (use_cache) {
+    symbols->SaveCache(cache_path.c_str());
+  }
+  return symbols;
+}
+
+CachedObject* FindCachedObjectLocked(const ObjectKey& key) {
+  for (CachedObject* o = cached_objects; o != nullptr; o = o->next) {
+    if (o->key == key) {
+      return o;
+    }
+  }
+  return nullptr;
+}
+
+ElfSymbols* GetSymbols(const char* name, uintptr_t bias,
+                       const ElfW(Phdr)* phdrs, int phnum) {
+  ObjectKey key;
+  GetObjectKey(name, bias, phdrs, phnum, &key);
+  {
+    SpinLockHolder h(&cache_lock);
+    CachedObject* found = FindCachedObjectLocked(key);
+    if (found != nullptr) {
+      return found->symbols;
+    }
+  }
+
+  // Reading symbols involves file I/O, malloc and so on, so it is done
+  // without the lock. If some other thread got there first, we use
+  // its symbols.
+  CachedObject* o = new CachedObject;
+  o->key = key;
+  o->symbols = LoadSymbols(key, name, bias, phdrs, phnum);
+
+  CachedObject* found;
+  {
+    SpinLockHolder h(&cache_lock);
+    found = FindCachedObjectLocked(key);
+    if (found == nullptr) {
+      o->next = cached_objects;
+      cached_objects = o;
+      return o->symbols;
+    }
+  }
+  delete o->symbols;
+  delete o;
+  return found->symbols;
+}
+
+}  // namespace
+
+// Resolves addresses of symbolization_table_ against symbol tables
+// of loaded objects. Returns number of addresses resolved. Names
+// live in the object cache, so symbol_buffer_ isn't used.
+int SymbolTable::SymbolizeInProcess() {
+  // We don't want to allocate memory (or open files) while holding
+  // loader lock: other threads might be unwinding with malloc-related
+  // locks held. So we first take a copy of what dl_iterate_phdr
+  // tells us.
+  struct Object {
+    const char* name;
+    uintptr_t bias;
+    const ElfW(Phdr)* phdrs;
+    int phnum;
+  };
+  struct Objects {
+    Object* objects;
+    int capacity;
+    int count;
+  } objs = {nullptr, 0, 0};
+
+  auto fill = +[] (struct dl_phdr_info* info, size_t, void* data) -> int {
+    Objects* objs = static_cast<Objects*>(data);
+    if (objs->count < objs->capacity) {
+      objs->objects[objs->count] = Object{info->dlpi_name, info->dlpi_addr,
+                                          info->dlpi_phdr, info->dlpi_phnum};
+    }
+    objs->count++;
+    return 0;
+  };
+  dl_iterate_phdr(fill, &objs);
+  // Leave room for objects loaded meanwhile.
+  objs.capacity = objs.count + 16;
+  objs.objects = new Object[objs.capacity];
+  objs.count = 0;
+  dl_iterate_phdr(fill, &objs);
+  int count = std::min(objs.count, objs.capacity);
+
+  int found = 0;
+  for (int o = 0; o < count; o++) {
+    const Object& obj = objs.objects[o];
+    ElfSymbols* symbols = nullptr;
+    bool tried = false;
+    for (int i = 0; i < obj.phnum; i++) {
+      const ElfW(Phdr)& phdr = obj.phdrs[i];
+      if (phdr.p_type != PT_LOAD || !(phdr.p_flags & PF_X)) {
+        continue;
+      }
+      const void* lo = reinterpret_cast<const void*>(obj.bias + phdr.p_vaddr);
+      const void* hi = reinterpret_cast<const void*>(obj.bias + phdr.p_vaddr + phdr.p_memsz);
+      SymbolMap::iterator it = symbolization_table_.lower_bound(lo);
+      for (; it != symbolization_table_.end() && it->first < hi; ++it) {
+        if (!tried) {
+          symbols = GetSymbols(obj.name, obj.bias, obj.phdrs, obj.phnum);
+          tried = true;
+        }
+        if (symbols == nullptr) {
+          break;
+        }
+        const char* name = symbols->Lookup(
+          reinterpret_cast<uintptr_t>(it->first) - obj.bias);
+        if (name != nullptr) {
+          it->second = name;
+          found++;
+        }
+      }
+    }
+  }
+
+  delete[] objs.objects;
+  return found;
+}
+
+#endif  // HAVE_ELF_SYMBOLIZER
+
 void SymbolTable::Add(const void* addr) {
   symbolization_table_[addr] = "";
 }
@@ -170,6 +842,16 @@ const char* SymbolTable::GetSymbol(const void* addr) {
   return symbolization_table_[addr];
 }
 
+int SymbolTable::Symbolize() {
+#ifdef HAVE_ELF_SYMBOLIZER
+  int found = SymbolizeInProcess();
+  if (found > 0 || symbolization_table_.empty()) {
+    return found;
+  }
+#endif
+  return SymbolizeWithPprof();
+}
+
 // Updates symbolization_table with the pointers to symbol names corresponding
 // to its keys. The symbol names are stored in out, which is allocated and
 // freed by the caller of this routine.
@@ -178,7 +860,7 @@ const char* SymbolTable::GetSymbol(const void* addr) {
 // -- but be careful if you decide to use this routine for other purposes.
 // Returns number of symbols read on error.  If can't symbolize, returns 0
 // and emits an error message about why.
-int SymbolTable::Symbolize() {
+int SymbolTable::SymbolizeWithPprof() {
 #if !defined(HAVE_UNISTD_H)  || !defined(HAVE_SYS_SOCKET_H) || !defined(HAVE_SYS_WAIT_H)
   PrintError("Perftools does not know how to call a sub-process on this O/S");
   return 0;
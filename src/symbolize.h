@@ -69,6 +69,13 @@ class SymbolTable {
  private:
   typedef map<const void*, const char*> SymbolMap;
 
+  // Reads symbol tables of loaded objects directly. They are cached
+  // across calls (and SymbolTable instances).
+  int SymbolizeInProcess();
+
+  // Runs pprof --symbols.
+  int SymbolizeWithPprof();
+
   // An average size of memory allocated for a stack trace symbol.
   static const int kSymbolSize = 1024;
 
@@ -128,6 +128,7 @@
 #include "thread_cache.h"      // for ThreadCache
 #include "thread_cache_ptr.h"
 
+#include "guarded_allocation.h"
 #include "maybe_emergency_malloc.h"
 
 #if (defined(_WIN32) && !defined(__CYGWIN__) && !defined(__CYGWIN32__)) && !defined(WIN32_OVERRIDE_ALLOCATORS)
@@ -298,16 +299,32 @@ ATTRIBUTE_NOINLINE void InvalidFree(void* ptr) {
     tcmalloc::EmergencyFree(ptr);
     return;
   }
+#ifndef NO_TCMALLOC_SAMPLES
+  if (tcmalloc::IsGuardedPtr(ptr)) {
+    tcmalloc::GuardedFree(ptr);
+    return;
+  }
+#endif
   Log(kCrash, __FILE__, __LINE__, "Attempt to free invalid pointer", ptr);
 }
 
 size_t InvalidGetSizeForRealloc(const void* old_ptr) {
+#ifndef NO_TCMALLOC_SAMPLES
+  if (tcmalloc::IsGuardedPtr(old_ptr)) {
+    return tcmalloc::GuardedGetSize(old_ptr);
+  }
+#endif
   Log(kCrash, __FILE__, __LINE__,
       "Attempt to realloc invalid pointer", old_ptr);
   return 0;
 }
 
 size_t InvalidGetAllocatedSize(const void* ptr) {
+#ifndef NO_TCMALLOC_SAMPLES
+  if (tcmalloc::IsGuardedPtr(ptr)) {
+    return tcmalloc::GuardedGetSize(ptr);
+  }
+#endif
   Log(kCrash, __FILE__, __LINE__,
       "Attempt to get the size of an invalid pointer", ptr);
   return 0;
@@ -595,6 +612,12 @@ class TCMallocImplementation : public MallocExtension {
       for (Span* s = sampled->next; s != sampled; s = s->next) {
         table.AddTrace(*reinterpret_cast<StackTrace*>(s->objects));
       }
+#ifndef NO_TCMALLOC_SAMPLES
+      tcmalloc::GuardedIterateStackTraces(
+        [] (const StackTrace& t, void* arg) {
+          static_cast<tcmalloc::StackTraceTable*>(arg)->AddTrace(t);
+        }, &table);
+#endif
     }
     *sample_period = ThreadCachePtr::GetSlow()->GetSamplePeriod();
     return table.ReadStackTracesAndClear(); // grabs and releases pageheap_lock
@@ -889,6 +912,11 @@ class TCMallocImplementation : public MallocExtension {
       return kOwned;
     }
     const Span *span = Static::pageheap()->GetDescriptor(p);
+#ifndef NO_TCMALLOC_SAMPLES
+    if (!span && tcmalloc::IsGuardedPtr(ptr)) {
+      return kOwned;
+    }
+#endif
     return span ? kOwned : kNotOwned;
   }
 
@@ -1157,6 +1185,13 @@ static void* DoSampledAllocation(size_t size) {
   tmp.depth = tcmalloc::GrabBacktrace(tmp.stack, tcmalloc::kMaxStackDepth, 1);
   tmp.size = size;
 
+#ifndef TCMALLOC_USING_DEBUGALLOCATION  // it has page fences of its own
+  void* guarded = tcmalloc::GuardedAlloc(size, tmp);
+  if (guarded != NULL) {
+    return guarded;
+  }
+#endif
+
   // Allocate span
   auto pages = tcmalloc::pages(size == 0 ? 1 : size);
   Span *span = Static::pageheap()->New(pages);
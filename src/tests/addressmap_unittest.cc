@@ -37,6 +37,7 @@
 #include <random>
 #include <algorithm>
 #include <utility>
+#include "address_index-inl.h"
 #include "addressmap-inl.h"
 #include "base/logging.h"
 #include "base/commandlineflags.h"
@@ -163,6 +164,48 @@ int main(int argc, char** argv) {
       CHECK_EQ(result->first, i + 2*N);
     }
     CHECK_EQ(check_set.size(), 0);
+
+    // Index of the map must answer the same as the map itself
+    AddressIndex<ValueT> index(malloc, free);
+    index.Build(map, &SizeFunc);
+    for (int i = 0; i < N; ++i) {
+      char* p = ptrs_and_sizes[i].ptr;
+      CHECK_EQ(index.FindMutable(p), map.Find(p));
+      for (int offs = -8; offs <= kMaxRealSize + 8; ++offs) {
+        const void* index_p = NULL;
+        const void* map_p = NULL;
+        const ValueT* index_result =
+          index.FindInside(kMaxRealSize, p + offs, &index_p);
+        const ValueT* map_result =
+          map.FindInside(&SizeFunc, kMaxRealSize, p + offs, &map_p);
+        CHECK_EQ(index_result, map_result);
+        CHECK_EQ(index_p, map_p);
+      }
+    }
+    index.Clear();
+    CHECK(!index.built());
+    CHECK(!index.FindMutable(ptrs_and_sizes[0].ptr));
+  }
+
+  // Ranges spanning many pages, max_size limit and 0-sized ranges
+  {
+    AddressMap<ValueT> map(malloc, free);
+    char* big = reinterpret_cast<char*>(0x1000000);
+    char* empty = big + 3 * 4096;
+    map.Insert(big, make_pair(1, 3 * 4096));
+    map.Insert(empty, make_pair(2, 0));
+    AddressIndex<ValueT> index(malloc, free);
+    index.Build(map, &SizeFunc);
+    const void* res_p;
+    CHECK(index.FindInside(5000, big, &res_p));
+    CHECK(index.FindInside(5000, big + 5000, &res_p));
+    CHECK_EQ(res_p, big);
+    CHECK(!index.FindInside(4000, big + 4001, &res_p));
+    CHECK(!index.FindInside(5000, big + 5001, &res_p));
+    CHECK(!index.FindInside(5000, big - 1, &res_p));
+    CHECK(index.FindInside(5000, empty, &res_p));
+    CHECK_EQ(res_p, empty);
+    CHECK(!index.FindInside(5000, empty + 1, &res_p));
   }
 
   for (int i = 0; i < N; ++i) {
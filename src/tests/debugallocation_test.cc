@@ -33,9 +33,12 @@
 
 #include "config_for_unittests.h"
 
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h> // for memcmp
+#include <unistd.h>
+#include <thread>
 #include <vector>
 #include "gperftools/malloc_extension.h"
 #include "gperftools/tcmalloc.h"
@@ -80,6 +83,7 @@ static int test_counter = 0;    // incremented every time the macro is called
 
 // This flag won't be compiled in in opt mode.
 DECLARE_int32(max_free_queue_size);
+DECLARE_bool(malloc_page_fence);
 
 // Test match as well as mismatch rules.  But do not test on OS X; on
 // OS X the OS converts new/new[] to malloc before it gets to us, so
@@ -236,6 +240,31 @@ TEST(DebugAllocationTest, StackTraceWithDanglingWriteAtExitTest) {
   *x = old_x_value;  // restore x so that the test can exit successfully.
 }
 
+TEST(DebugAllocationTest, DanglingWriteFromOtherThreadsAtExitTest) {
+  // Blocks freed by other threads are queued separately from ours,
+  // but must still be checked at program termination.
+  int* x = NULL;
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 4; i++) {
+    threads.emplace_back([i, &x] () {
+      for (int j = 0; j < 1000; j++) {
+        delete noopt(new int);
+      }
+      if (i == 0) {
+        x = noopt(new int);
+        delete x;
+      }
+    });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+  int old_x_value = *x;
+  *x = 1;
+  IF_DEBUG_EXPECT_DEATH(exit(0), "Memory was written to after being freed.");
+  *x = old_x_value;  // restore x so that the test can exit successfully.
+}
+
 static size_t CurrentlyAllocatedBytes() {
   size_t value;
   CHECK(MallocExtension::instance()->GetNumericProperty(
@@ -338,6 +367,71 @@ TEST(DebugAllocationTest, ReallocAfterMemalign) {
   EXPECT_EQ(rv, 0);
 }
 
+static void ReportFault(int sig) {
+  static const char kMessage[] = "Caught page fence fault\n";
+  write(STDERR_FILENO, kMessage, sizeof(kMessage) - 1);
+  _exit(1);
+}
+
+// Writes to 'p', which is expected to fault.
+static void WriteExpectingFault(char* p) {
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = ReportFault;
+  sigaction(SIGSEGV, &sa, NULL);
+  sigaction(SIGBUS, &sa, NULL);
+  *noopt(p) = 1;
+  fprintf(stderr, "Write to %p did not fault\n", p);
+}
+
+TEST(DebugAllocationTest, PageFenceTest) {
+  FLAGS_malloc_page_fence = true;
+  const int pagesize = getpagesize();
+  // Blocks, including those too large to be pooled, end right before
+  // their guard page.
+  vector<char*> blocks;
+  for (size_t size = 1; size < 64 * pagesize; size = size * 3 + 1) {
+    char* p = noopt(new char[size]);
+    memset(p, 0x11, size);
+    uintptr_t end = reinterpret_cast<uintptr_t>(p + size);
+    EXPECT_LT((pagesize - end % pagesize) % pagesize, 16u);
+    blocks.push_back(p);
+  }
+  for (char* p : blocks) {
+    delete [] p;
+  }
+
+  // Writing one byte past the end hits the guard page, and writing to
+  // a freed block hits its quarantined slot.
+  char* y = noopt(new char[128]);
+  EXPECT_EQ(reinterpret_cast<uintptr_t>(y + 128) % pagesize, 0u);
+  IF_DEBUG_EXPECT_DEATH(WriteExpectingFault(y + 128),
+                        "Caught page fence fault");
+  delete [] y;
+  IF_DEBUG_EXPECT_DEATH(WriteExpectingFault(y), "Caught page fence fault");
+
+  // Recently freed slots are quarantined...
+  char* x = noopt(new char[100]);
+  char* old_x = x;
+  delete [] x;
+  x = noopt(new char[100]);
+  EXPECT_NE(x, old_x);
+  delete [] x;
+
+  // ...but they are reused.
+  int old_max_free_queue_size = FLAGS_max_free_queue_size;
+  FLAGS_max_free_queue_size = 0;
+  x = noopt(new char[100]);
+  old_x = x;
+  delete [] x;
+  x = noopt(new char[100]);
+  EXPECT_EQ(x, old_x);
+  delete [] x;
+
+  FLAGS_max_free_queue_size = old_max_free_queue_size;
+  FLAGS_malloc_page_fence = false;
+}
+
 int main(int argc, char** argv) {
   // If you run without args, we run the non-death parts of the test.
   // Otherwise, argv[1] should be a number saying which death-test
@@ -67,19 +67,30 @@ OneDeathTest() {
   }
 }
 
-death_test_num=0   # which death test to run
-while :; do        # same as 'while true', but more portable
-  echo -n "Running death test $death_test_num..."
-  output="`OneDeathTest $death_test_num`"
-  case $output in
-     # Empty string means grep didn't find anything.
-     "")      echo "FAILED"; num_failures=`expr $num_failures + 1`;;
-     "done"*) echo "done with death tests"; break;;
-     # Any other string means grep found something, like it ought to.
-     *)       echo "OK";;
-  esac
-  death_test_num=`expr $death_test_num + 1`
-done
+RunDeathTests() {
+  death_test_num=0   # which death test to run
+  while :; do        # same as 'while true', but more portable
+    echo -n "Running death test $death_test_num..."
+    output="`OneDeathTest $death_test_num`"
+    case $output in
+       # Empty string means grep didn't find anything.
+       "")      echo "FAILED"; num_failures=`expr $num_failures + 1`;;
+       "done"*) echo "done with death tests"; break;;
+       # Any other string means grep found something, like it ought to.
+       *)       echo "OK";;
+    esac
+    death_test_num=`expr $death_test_num + 1`
+  done
+}
+
+RunDeathTests
+
+# Page fences are made with MADV_GUARD_INSTALL where the kernel has it;
+# check that the mprotect fallback catches the same errors.
+echo "Running death tests with TCMALLOC_PAGE_FENCE_GUARD_MARKERS=0"
+TCMALLOC_PAGE_FENCE_GUARD_MARKERS=0
+export TCMALLOC_PAGE_FENCE_GUARD_MARKERS
+RunDeathTests
 
 # Test the non-death parts of the test too
 echo -n "Running non-death tests..."
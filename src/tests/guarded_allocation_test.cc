@@ -0,0 +1,191 @@
+// -*- Mode: C++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+// Copyright (c) 2024, gperftools Contributors
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+//     * Neither the name of Google Inc. nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// Checks guarded allocations. Expects to be run by
+// guarded_allocation_test.sh with sampling of every allocation and
+// guarded slots enabled.
+
+#include "config_for_unittests.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <thread>
+#include <vector>
+
+#include "gperftools/malloc_extension.h"
+#include "gperftools/nallocx.h"
+#include "gperftools/tcmalloc.h"
+#include "base/logging.h"
+#include "tests/testutil.h"
+
+static const size_t kObjectSize = 40;
+
+// The death tests are meant to be run from a shell-script driver,
+// which passes in an integer saying which death test to run. Same as
+// in debugallocation_test.
+static int test_to_run = -1;
+static int test_counter = 0;
+#define EXPECT_DEATH(statement, regex) do {             \
+  if (test_counter++ == test_to_run) {                  \
+    fprintf(stderr, "Expected regex:%s\n", regex);      \
+    statement;                                          \
+  }                                                     \
+} while (false)
+
+// Guarded allocations are told apart by their size, which is exact
+// instead of being rounded up to a size class.
+static bool IsGuarded(void* p, size_t size) {
+  return tc_malloc_size(p) == size;
+}
+
+// Returns a guarded allocation of 'size' bytes. Every allocation is
+// sampled, but some may not get a slot, so retry a bit.
+static char* GuardedMalloc(size_t size) {
+  std::vector<void*> others;
+  void* p = NULL;
+  for (int i = 0; i < 100; i++) {
+    p = noopt(malloc(size));
+    if (IsGuarded(p, size)) {
+      break;
+    }
+    others.push_back(p);
+    p = NULL;
+  }
+  for (void* q : others) {
+    free(q);
+  }
+  CHECK(p != NULL);
+  return static_cast<char*>(p);
+}
+
+static void TestBasic() {
+  char* p = GuardedMalloc(kObjectSize);
+  CHECK_EQ(reinterpret_cast<uintptr_t>(p) % getpagesize(), 0);
+  memset(p, 0x5a, kObjectSize);
+  CHECK_EQ(MallocExtension::instance()->GetAllocatedSize(p), kObjectSize);
+  CHECK_EQ(MallocExtension::instance()->GetOwnership(p),
+           MallocExtension::kOwned);
+  free(p);
+}
+
+static void TestRealloc() {
+  char* p = GuardedMalloc(kObjectSize);
+  for (size_t i = 0; i < kObjectSize; i++) {
+    p[i] = static_cast<char>(i);
+  }
+  char* q = static_cast<char*>(noopt(realloc(p, 3 * kObjectSize)));
+  for (size_t i = 0; i < kObjectSize; i++) {
+    CHECK_EQ(q[i], static_cast<char>(i));
+  }
+  free(q);
+}
+
+static void TestSizedFree() {
+  char* p = GuardedMalloc(kObjectSize);
+  tc_free_sized(p, kObjectSize);
+}
+
+// Many more allocations than slots, so that slots get reused.
+static void TestSlotReuse() {
+  for (int i = 0; i < 1000; i++) {
+    char* p = GuardedMalloc(kObjectSize + i % 64);
+    memset(p, 0, kObjectSize + i % 64);
+    free(p);
+  }
+}
+
+static void TestThreads() {
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; t++) {
+    threads.emplace_back([] () {
+      for (int i = 0; i < 1000; i++) {
+        void* p = noopt(malloc(kObjectSize));
+        memset(p, 0, kObjectSize);
+        free(p);
+      }
+    });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+}
+
+static void RunDeathTests() {
+  const int page_size = getpagesize();
+  {
+    char* p = GuardedMalloc(kObjectSize);
+    free(p);
+    EXPECT_DEATH(noopt(p)[0] = 1,
+                 "use-after-free at .* 0 bytes into 40-byte object");
+  }
+  {
+    char* p = GuardedMalloc(kObjectSize);
+    EXPECT_DEATH(noopt(p)[page_size] = 1,
+                 "buffer overflow at .* past the end of 40-byte object");
+    EXPECT_DEATH(noopt(p)[-1] = 1,
+                 "buffer underflow at .* 1 bytes before 40-byte object");
+    EXPECT_DEATH((noopt(p)[kObjectSize] = 1, free(p)),
+                 "buffer overflow of 40-byte object .*detected at free");
+    EXPECT_DEATH(free(noopt(p + 8)),
+                 "attempt to free invalid pointer");
+    free(p);
+    EXPECT_DEATH(free(noopt(p)), "double free of 40-byte object");
+  }
+}
+
+int main(int argc, char** argv) {
+  if (argc > 1) {
+    test_to_run = atoi(argv[1]);
+  }
+  CHECK_NE(nallocx(kObjectSize, 0), kObjectSize);
+
+  // Main thread's cache can be set up before TCMALLOC_SAMPLE_PARAMETER
+  // is read, and then it doesn't sample for the first 16 MiB.
+  for (int i = 0; i < 32; i++) {
+    free(noopt(malloc(1 << 20)));
+  }
+
+  RunDeathTests();
+  if (test_to_run >= 0) {
+    // Death test didn't die or there is no such test.
+    return 0;
+  }
+
+  TestBasic();
+  TestRealloc();
+  TestSizedFree();
+  TestSlotReuse();
+  TestThreads();
+  printf("PASS\n");
+  return 0;
+}
@@ -168,6 +168,39 @@ Test 60 1 "" "Starting tracking the heap" \
   HEAP_CHECKER_TEST_TEST_LEAK=1 HEAP_CHECKER_TEST_NO_THREADS=1 PERFTOOLS_VERBOSE=-10 \
   || exit 12
 
+# Test checks done by a forked child (--heap_check_fork), and that
+# when the child fails we check in this process instead:
+Test 120 0 "^PASS$" "" HEAP_CHECK_FORK=1 || exit 13
+Test 60 1 "MakeALeak" "" \
+  HEAP_CHECKER_TEST_TEST_LEAK=1 HEAP_CHECKER_TEST_NO_THREADS=1 \
+  HEAP_CHECK_FORK=1 || exit 14
+Test 120 0 "Forked leak check failed" "" \
+  HEAP_CHECK_FORK=1 HEAP_CHECK_FORK_TEST_FAILURE=1 || exit 15
+Test 60 1 "MakeALeak" "" \
+  HEAP_CHECKER_TEST_TEST_LEAK=1 HEAP_CHECKER_TEST_NO_THREADS=1 \
+  HEAP_CHECK_FORK=1 HEAP_CHECK_FORK_TEST_FAILURE=1 || exit 16
+
+# Test that marking with helper threads (--heap_check_threads) finds
+# the same leaks as marking in one thread.  heap-checker_unittest
+# checks its expected leak/no-leak results itself, so passing runs
+# are compared already:
+Test 120 0 "^PASS$" "" HEAP_CHECK_THREADS=4 || exit 17
+Test 120 0 "^PASS$" "" HEAP_CHECK_THREADS=4 HEAP_CHECK_FORK=1 || exit 18
+for leak in TEST_LEAK TEST_LOOP_LEAK; do
+  for threads in 1 4; do
+    Test 60 1 "Exiting .* because of .* leaks$" "" \
+      HEAP_CHECKER_TEST_$leak=1 HEAP_CHECKER_TEST_NO_THREADS=1 \
+      HEAP_CHECK_THREADS=$threads || exit 19
+    grep "detected leaks of" "$TMPDIR/output" > "$TMPDIR/leaks.$threads" \
+      || exit 20
+  done
+  if ! cmp -s "$TMPDIR/leaks.1" "$TMPDIR/leaks.4"; then
+    echo "Leaks found with HEAP_CHECK_THREADS=4 differ for $leak:"
+    diff "$TMPDIR/leaks.1" "$TMPDIR/leaks.4"
+    exit 21
+  fi
+done
+
 cd /    # so we're not in TMPDIR when we delete it
 rm -rf $TMPDIR
 
@@ -0,0 +1,176 @@
+// -*- Mode: C++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+// Copyright (c) 2024, gperftools Contributors
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+//     * Neither the name of Google Inc. nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// Checks that batch hooks see every allocation and deallocation.
+
+#include "config_for_unittests.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <mutex>
+#include <set>
+#include <thread>
+#include <vector>
+
+#include <gperftools/malloc_hook.h>
+#include "base/logging.h"
+#include "tests/testutil.h"
+
+// Unusual sizes, so that we can tell our objects. kSize objects are
+// tracked one by one, which only works if they are freed by the same
+// thread or after the allocating thread's events were delivered.
+// kThreadSize objects are allocated and freed by concurrent threads,
+// so we only count them.
+static const size_t kSize = 12345;
+static const size_t kThreadSize = 23456;
+static const int kObjects = 3000;
+static const int kThreads = 4;
+
+// Protects everything below.
+static std::mutex hook_mutex;
+static std::set<const void*> live;
+static int news, deletes, thread_news, batches;
+
+// Allocates on purpose, to check that batch hooks may do so.
+static void TestBatchHook(const MallocHook::Event* events, int count) {
+  CHECK_GT(count, 0);
+  std::lock_guard<std::mutex> l(hook_mutex);
+  batches++;
+  for (int i = 0; i < count; i++) {
+    const MallocHook::Event& e = events[i];
+    CHECK(e.ptr != NULL);
+    if (e.type == MallocHook_NewEvent) {
+      if (e.size == kSize) {
+        CHECK(live.insert(e.ptr).second);
+        news++;
+      } else if (e.size == kThreadSize) {
+        thread_news++;
+      }
+      continue;
+    }
+    CHECK_EQ(e.type, MallocHook_DeleteEvent);
+    CHECK_EQ(e.size, 0u);
+    if (live.erase(e.ptr) != 0) {
+      deletes++;
+    }
+  }
+}
+
+static int later_hook_events;
+
+static void LaterBatchHook(const MallocHook::Event* events, int count) {
+  std::lock_guard<std::mutex> l(hook_mutex);
+  later_hook_events += count;
+}
+
+static void AllocateAndFree(size_t size) {
+  std::vector<void*> objects;
+  for (int i = 0; i < kObjects; i++) {
+    objects.push_back(noopt(malloc(size)));
+  }
+  for (void* p : objects) {
+    free(p);
+  }
+}
+
+static void CheckCounts(int expected) {
+  std::lock_guard<std::mutex> l(hook_mutex);
+  CHECK_EQ(news, expected);
+  CHECK_EQ(deletes, expected);
+  CHECK(live.empty());
+}
+
+int main(int argc, char** argv) {
+  CHECK(!MallocHook::AddBatchHook(NULL));
+  CHECK(MallocHook::AddBatchHook(&TestBatchHook));
+
+  // Full buffers get delivered as we go.
+  AllocateAndFree(kSize);
+  CHECK_GT(batches, 0);
+  MallocHook::FlushBatchHooks();
+  CheckCounts(kObjects);
+
+  // Threads' buffers are flushed when they exit.
+  std::vector<std::thread> threads;
+  for (int t = 0; t < kThreads; t++) {
+    threads.emplace_back(AllocateAndFree, kThreadSize);
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+  {
+    std::lock_guard<std::mutex> l(hook_mutex);
+    CHECK_EQ(thread_news, kThreads * kObjects);
+  }
+
+  std::vector<void*> objects;
+  std::thread t([&objects] () {
+    for (int i = 0; i < kObjects; i++) {
+      objects.push_back(noopt(malloc(kSize)));
+    }
+  });
+  t.join();
+  for (void* p : objects) {
+    free(p);
+  }
+  MallocHook::FlushBatchHooks();
+  CheckCounts(2 * kObjects);
+
+  // Nothing is delivered after removal.
+  void* p = noopt(malloc(kSize));
+  CHECK(MallocHook::RemoveBatchHook(&TestBatchHook));
+  CHECK(!MallocHook::RemoveBatchHook(&TestBatchHook));
+  free(p);
+  MallocHook::FlushBatchHooks();
+  {
+    std::lock_guard<std::mutex> l(hook_mutex);
+    CHECK_EQ(news, 2 * kObjects + 1);
+    CHECK_EQ(live.size(), 1u);
+    live.clear();
+  }
+
+  // Hooks added later don't get events from before, such as those of
+  // TestBatchHook's own allocations while it gets the last events.
+  CHECK(MallocHook::AddBatchHook(&TestBatchHook));
+  p = noopt(malloc(kSize));
+  CHECK(MallocHook::RemoveBatchHook(&TestBatchHook));
+  CHECK(MallocHook::AddBatchHook(&LaterBatchHook));
+  MallocHook::FlushBatchHooks();
+  {
+    std::lock_guard<std::mutex> l(hook_mutex);
+    CHECK_EQ(later_hook_events, 0);
+  }
+  CHECK(MallocHook::RemoveBatchHook(&LaterBatchHook));
+  free(p);
+
+  printf("PASS\n");
+  return 0;
+}
@@ -0,0 +1,164 @@
+// -*- Mode: C++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+// Copyright (c) 2024, gperftools Contributors
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+//     * Neither the name of Google Inc. nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// Runs itself with MALLOCTRACE set and checks the resulting trace.
+
+#include "config_for_unittests.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <map>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "base/logging.h"
+#include "malloc_trace.h"
+#include "tests/testutil.h"
+
+using tcmalloc::MallocTraceChunk;
+using tcmalloc::MallocTraceHeader;
+using tcmalloc::MallocTraceRecord;
+
+// Unusual sizes, so that we can tell our objects in the trace.
+static const size_t kMainSize = 12345;
+static const size_t kThreadSize = 23456;
+static const int kObjects = 1000;
+
+// Allocates kObjects of kMainSize here and as many of kThreadSize in
+// another thread, and frees all of them here.
+static void RunWorkload() {
+  std::vector<void*> objects;
+  for (int i = 0; i < kObjects; i++) {
+    objects.push_back(noopt(malloc(kMainSize)));
+  }
+  std::thread t([&objects] () {
+    std::vector<void*> others;
+    for (int i = 0; i < kObjects; i++) {
+      others.push_back(noopt(malloc(kThreadSize)));
+    }
+    objects.insert(objects.end(), others.begin(), others.end());
+  });
+  t.join();
+  for (void* p : objects) {
+    free(p);
+  }
+}
+
+static void CheckTrace(const char* path) {
+  FILE* f = fopen(path, "rb");
+  CHECK(f != NULL);
+  MallocTraceHeader header;
+  CHECK_EQ(fread(&header, sizeof(header), 1, f), 1u);
+  CHECK_EQ(memcmp(header.magic, tcmalloc::kMallocTraceMagic,
+                  sizeof(header.magic)), 0);
+  CHECK_EQ(header.version, tcmalloc::kMallocTraceVersion);
+  CHECK_EQ(header.record_size, sizeof(MallocTraceRecord));
+
+  // Our objects and threads that allocated them.
+  std::map<uint64_t, uint32_t> live;
+  std::map<uint64_t, uint64_t> alloc_times;
+  std::set<uint32_t> main_threads, other_threads;
+  std::map<uint32_t, uint64_t> last_timestamp;
+  int frees = 0;
+
+  MallocTraceChunk chunk;
+  while (fread(&chunk, sizeof(chunk), 1, f) == 1) {
+    CHECK_GT(chunk.count, 0u);
+    std::vector<MallocTraceRecord> records(chunk.count);
+    CHECK_EQ(fread(records.data(), sizeof(MallocTraceRecord), chunk.count, f),
+             chunk.count);
+    for (const MallocTraceRecord& r : records) {
+      // Each thread's records are in order.
+      CHECK_GE(r.timestamp, last_timestamp[chunk.thread]);
+      last_timestamp[chunk.thread] = r.timestamp;
+
+      if (r.op() == tcmalloc::kMallocTraceAlloc) {
+        if (r.size() == kMainSize || r.size() == kThreadSize) {
+          CHECK(live.find(r.ptr) == live.end());
+          live[r.ptr] = chunk.thread;
+          alloc_times[r.ptr] = r.timestamp;
+          (r.size() == kMainSize ? main_threads : other_threads).insert(
+            chunk.thread);
+        }
+        continue;
+      }
+      CHECK_EQ(r.op(), tcmalloc::kMallocTraceFree);
+      CHECK_EQ(r.size(), 0u);
+      auto it = live.find(r.ptr);
+      if (it != live.end()) {
+        CHECK_GE(r.timestamp, alloc_times[r.ptr]);
+        live.erase(it);
+        frees++;
+      }
+    }
+  }
+  fclose(f);
+
+  CHECK_EQ(frees, 2 * kObjects);
+  CHECK(live.empty());
+  CHECK_EQ(main_threads.size(), 1u);
+  CHECK_EQ(other_threads.size(), 1u);
+  CHECK(*main_threads.begin() != *other_threads.begin());
+}
+
+int main(int argc, char** argv) {
+  if (argc > 1 && strcmp(argv[1], "record") == 0) {
+    RunWorkload();
+    return 0;
+  }
+
+  char path[] = "/tmp/malloc_trace_test.XXXXXX";
+  int fd = mkstemp(path);
+  CHECK(fd >= 0);
+  close(fd);
+
+  pid_t pid = fork();
+  CHECK(pid >= 0);
+  if (pid == 0) {
+    setenv("MALLOCTRACE", path, 1);
+    execl("/proc/self/exe", argv[0], "record", static_cast<char*>(NULL));
+    execl(argv[0], argv[0], "record", static_cast<char*>(NULL));
+    _exit(127);
+  }
+  int status;
+  CHECK_EQ(waitpid(pid, &status, 0), pid);
+  CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+  CheckTrace(path);
+  unlink(path);
+  printf("PASS\n");
+  return 0;
+}
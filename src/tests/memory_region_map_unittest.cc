@@ -0,0 +1,188 @@
+// -*- Mode: C++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+// Copyright (c) 2024, gperftools Contributors
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+//     * Neither the name of Google Inc. nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// Checks that MemoryRegionMap follows mmap and munmap, and that its
+// lookups work without taking its lock.
+
+#include "config_for_unittests.h"
+
+#include "memory_region_map.h"
+
+#include <stdio.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "base/logging.h"
+
+// mmap_hook.cc wants this from malloc_hook.cc, which we don't link.
+extern "C" int MallocHook_InitAtFirstAllocation_HeapLeakChecker() {
+  return 0;
+}
+
+static const size_t kPageSize = getpagesize();
+
+static char* Map(size_t pages, void* hint = NULL, int flags = 0) {
+  void* p = mmap(hint, pages * kPageSize, PROT_READ|PROT_WRITE,
+                 MAP_PRIVATE|MAP_ANONYMOUS|flags, -1, 0);
+  CHECK(p != MAP_FAILED);
+  return static_cast<char*>(p);
+}
+
+static void Unmap(char* p, size_t pages) {
+  CHECK_EQ(munmap(p, pages * kPageSize), 0);
+}
+
+// Checks that addr is in a region exactly covering [start, start+pages).
+static void ExpectRegion(const char* addr, const char* start, size_t pages) {
+  MemoryRegionMap::Region region;
+  CHECK(MemoryRegionMap::FindRegion(reinterpret_cast<uintptr_t>(addr),
+                                    &region));
+  CHECK_EQ(region.start_addr, reinterpret_cast<uintptr_t>(start));
+  CHECK_EQ(region.end_addr,
+           reinterpret_cast<uintptr_t>(start + pages * kPageSize));
+}
+
+static void ExpectNoRegion(const char* addr) {
+  MemoryRegionMap::Region region;
+  CHECK(!MemoryRegionMap::FindRegion(reinterpret_cast<uintptr_t>(addr),
+                                     &region));
+}
+
+static void TestMapUnmap() {
+  char* p = Map(4);
+  ExpectRegion(p, p, 4);
+  ExpectRegion(p + 4 * kPageSize - 1, p, 4);
+
+  // Punch a hole and check both sides, then fill the hole so that
+  // three regions are adjacent.
+  Unmap(p + kPageSize, 1);
+  ExpectRegion(p, p, 1);
+  ExpectNoRegion(p + kPageSize);
+  ExpectRegion(p + 2 * kPageSize, p + 2 * kPageSize, 2);
+  CHECK_EQ(Map(1, p + kPageSize, MAP_FIXED), p + kPageSize);
+  ExpectRegion(p + kPageSize - 1, p, 1);
+  ExpectRegion(p + kPageSize, p + kPageSize, 1);
+  ExpectRegion(p + 2 * kPageSize, p + 2 * kPageSize, 2);
+
+  Unmap(p, 4);
+  ExpectNoRegion(p);
+  ExpectNoRegion(p + 3 * kPageSize);
+}
+
+static void TestStackRegion() {
+  char* p = Map(2);
+  MemoryRegionMap::Region region;
+  CHECK(MemoryRegionMap::FindRegion(reinterpret_cast<uintptr_t>(p), &region));
+  CHECK(!region.is_stack);
+  CHECK(MemoryRegionMap::FindAndMarkStackRegion(
+          reinterpret_cast<uintptr_t>(p + kPageSize), &region));
+  CHECK(region.is_stack);
+  for (int i = 0; i < 10; i++) {
+    CHECK(MemoryRegionMap::FindRegion(reinterpret_cast<uintptr_t>(p),
+                                      &region));
+    CHECK(region.is_stack);
+  }
+  Unmap(p, 2);
+}
+
+// Once the map settles, lookups must not wait for the lock.
+static void TestLockFreeLookup() {
+  char* p = Map(1);
+  std::atomic<int> state{0};
+  std::thread holder([&state] () {
+    while (state.load() != 1) {}
+    MemoryRegionMap::LockHolder l;
+    state.store(2);
+    while (state.load() != 3) {}
+  });
+  for (int i = 0; i < 10; i++) {
+    ExpectRegion(p, p, 1);
+  }
+  state.store(1);
+  while (state.load() != 2) {}
+  ExpectRegion(p, p, 1);
+  ExpectNoRegion(p + kPageSize);
+  state.store(3);
+  holder.join();
+  Unmap(p, 1);
+}
+
+// Lookups of a fixed region keep working while other threads map and
+// unmap. Several readers overlap, so replaced snapshots have to wait
+// for them, and Shutdown checks that all got freed. Hooks run after
+// the fact, so one thread's munmap could be recorded after another
+// thread mapped the same address again; hence every thread maps and
+// unmaps only in its own range, which it reserved up front.
+static void TestConcurrentChanges() {
+  char* fixed = Map(3);
+  std::atomic<bool> done{false};
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 2; t++) {
+    char* base = Map(3);
+    threads.emplace_back([base] () {
+      Unmap(base, 3);
+      for (int i = 0; i < 2000; i++) {
+        char* p = Map(1 + i % 3, base, MAP_FIXED);
+        Unmap(p, 1 + i % 3);
+      }
+    });
+  }
+  std::vector<std::thread> readers;
+  for (int t = 0; t < 4; t++) {
+    readers.emplace_back([fixed, &done] () {
+      while (!done.load()) {
+        ExpectRegion(fixed + kPageSize, fixed, 3);
+      }
+    });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+  done.store(true);
+  for (auto& t : readers) {
+    t.join();
+  }
+  Unmap(fixed, 3);
+}
+
+int main(int argc, char** argv) {
+  MemoryRegionMap::Init(0, /* use_buckets */ false);
+  TestMapUnmap();
+  TestStackRegion();
+  TestLockFreeLookup();
+  TestConcurrentChanges();
+  CHECK(MemoryRegionMap::Shutdown());
+  printf("PASS\n");
+  return 0;
+}
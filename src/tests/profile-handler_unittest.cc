@@ -16,8 +16,10 @@
 #include <assert.h>
 #include <pthread.h>
 #include <sys/time.h>
+#include <sys/wait.h>
 #include <stdint.h>
 #include <time.h>
+#include <unistd.h>
 
 #include <atomic>
 #include <mutex>
@@ -117,6 +119,9 @@ int kSleepInterval = 200000000;
 // reset.
 int kTimerResetInterval = 5000000;
 
+// Most time in nano secs we wait for a tick that must come.
+int64_t kTickDeadline = 5000000000LL;
+
 static bool linux_per_thread_timers_mode_ = false;
 static int timer_type_ = ITIMER_PROF;
 
@@ -189,6 +194,13 @@ static void TickCounter(int sig, siginfo_t* sig_info, void *vuc,
   ++(*counter);
 }
 
+// Signal handler which records the weight of the latest profile tick.
+static void WeightRecorder(int sig, siginfo_t* sig_info, void *vuc,
+                           void* tick_weight) {
+  static_cast<std::atomic<int32_t>*>(tick_weight)->store(
+      ProfileHandlerGetTickWeight());
+}
+
 // This class tests the profile-handler.h interface.
 class ProfileHandlerTest {
  protected:
@@ -340,6 +352,9 @@ class ProfileHandlerTest {
   void MultipleCallbacks();
   void Reset();
   void RegisterCallbackBeforeThread();
+  void IntervalMultiplier();
+  void ThreadSelection();
+  void ForkedChild();
 
  public:
 #define RUN(test)  do {                         \
@@ -356,6 +371,9 @@ class ProfileHandlerTest {
     RUN(MultipleCallbacks);
     RUN(Reset);
     RUN(RegisterCallbackBeforeThread);
+    RUN(IntervalMultiplier);
+    RUN(ThreadSelection);
+    RUN(ForkedChild);
     printf("Done\n");
     return 0;
   }
@@ -447,6 +465,87 @@ TEST_F(ProfileHandlerTest, RegisterCallbackBeforeThread) {
   EXPECT_EQ(FLAGS_test_profiler_enabled, linux_per_thread_timers_mode_ || IsTimerEnabled());
 }
 
+// Verifies that the timers follow a requested interval multiplier and
+// that their ticks are weighted by it.
+TEST_F(ProfileHandlerTest, IntervalMultiplier) {
+  std::atomic<int32_t> tick_weight{0};
+  ProfileHandlerToken* token =
+      ProfileHandlerRegisterCallback(WeightRecorder, &tick_weight);
+  Delay(kTimerResetInterval);
+
+  ProfileHandlerSetIntervalMultiplier(3);
+  ProfileHandlerState state;
+  ProfileHandlerGetState(&state);
+  EXPECT_EQ(3, state.interval_multiplier);
+
+  if (FLAGS_test_profiler_enabled) {
+    // The first tick re-arms the timer, the following ones carry the
+    // new weight. They need the worker to get 3x the CPU time, which
+    // under heavy load may take a while.
+    for (int64_t waited = 0;
+         tick_weight.load() != 3 && waited < kTickDeadline;
+         waited += kTimerResetInterval) {
+      Delay(kTimerResetInterval);
+    }
+    EXPECT_EQ(3, tick_weight.load());
+    if (!linux_per_thread_timers_mode_) {
+      itimerval current_timer;
+      EXPECT_EQ(0, getitimer(timer_type_, &current_timer));
+      EXPECT_EQ(3 * (1000000 / state.frequency),
+                current_timer.it_interval.tv_usec);
+    }
+  }
+
+  UnregisterCallback(token);
+  ProfileHandlerSetIntervalMultiplier(1);
+}
+
+// Verifies that per-thread timers of unselected threads are disarmed.
+TEST_F(ProfileHandlerTest, ThreadSelection) {
+  int tick_count = 0;
+  ProfileHandlerToken* token = RegisterCallback(&tick_count);
+  VerifyRegistration(tick_count);
+
+  // No thread carries this tag, so no thread is sampled any more.
+  ProfileHandlerSelectThreadTag(42, true);
+  Delay(kTimerResetInterval);
+  if (linux_per_thread_timers_mode_) {
+    VerifyUnregistration(tick_count);
+  }
+
+  ProfileHandlerSelectAllThreads();
+  VerifyRegistration(tick_count);
+  UnregisterCallback(token);
+}
+
+// Verifies that a forked child, which does not inherit the sampling
+// sources of the parent's threads, can still change the selection.
+TEST_F(ProfileHandlerTest, ForkedChild) {
+  int tick_count = 0;
+  ProfileHandlerToken* token = RegisterCallback(&tick_count);
+  VerifyRegistration(tick_count);
+
+  // The child must not inherit allocate_lock held by the worker.
+  StopWorker();
+  pid_t pid = fork();
+  if (pid == 0) {
+    ProfileHandlerSelectThreadTag(42, true);
+    ProfileHandlerSetThreadTag(42);
+    ProfileHandlerSelectAllThreads();
+    ProfileHandlerRegisterThread();
+    _exit(0);
+  }
+  ASSERT_NE(-1, pid);
+  int status;
+  ASSERT_EQ(pid, waitpid(pid, &status, 0));
+  EXPECT_TRUE(WIFEXITED(status));
+  EXPECT_EQ(0, WEXITSTATUS(status));
+  StartWorker();
+
+  VerifyRegistration(tick_count);
+  UnregisterCallback(token);
+}
+
 }  // namespace
 
 int main(int argc, char** argv) {
@@ -206,8 +206,10 @@ string ProfileDataChecker::ValidateProfile() {
     return "error in header: non-zero count";
   if (reinterpret_cast<ProfileDataSlot*>(filedata.get())[1] != 3)
     return "error in header: num_slots != 3";
-  if (reinterpret_cast<ProfileDataSlot*>(filedata.get())[2] != 0)
-    return "error in header: non-zero format version";
+  ProfileDataSlot version =
+      reinterpret_cast<ProfileDataSlot*>(filedata.get())[2];
+  if (version != 0 && version != 1)
+    return "error in header: unknown format version";
   // Period (slot 3) can have any value.
   if (reinterpret_cast<ProfileDataSlot*>(filedata.get())[4] != 0)
     return "error in header: non-zero padding value";
@@ -228,6 +230,14 @@ string ProfileDataChecker::ValidateProfile() {
 
     if (sample[0] == 0 && sample[1] == 1 && sample[2] == 0) {
       seen_trailer = true;
+    } else if (sample[0] == 0 && version == 1 && sample[2] == 1) {
+      // Label record.
+      if (sample[1] % 2 != 1)
+        return "error in label record: odd number of label slots";
+      for (int i = 3; i < slots_this_sample; i += 2) {
+        if (sample[i] >= ProfileData::kMaxLabels)
+          return "error in label record: invalid label key";
+      }
     } else {
       if (sample[0] < 1)
         return "error in sample: sample count < 1";
@@ -344,6 +354,7 @@ class ProfileDataTest {
   void CollectOne();
   void CollectTwoMatching();
   void CollectTwoFlush();
+  void CollectLabeled();
   void StartResetRestart();
 
  public:
@@ -361,6 +372,7 @@ class ProfileDataTest {
     RUN(CollectOne);
     RUN(CollectTwoMatching);
     RUN(CollectTwoFlush);
+    RUN(CollectLabeled);
     RUN(StartResetRestart);
     RUN(StartStopNoOptionsEmpty);
     return 0;
@@ -566,6 +578,41 @@ TEST_F(ProfileDataTest, CollectTwoFlush) {
   EXPECT_EQ(kNoError, checker_.Check(slots, arraysize(slots)));
 }
 
+TEST_F(ProfileDataTest, CollectLabeled) {
+  const int frequency = 2;
+  ProfileDataSlot slots[] = {
+    0, 3, 1, 1000000 / frequency, 0,    // binary header, labeled version
+    1, 3, 100, 201, 302,                // sample without labels
+    0, 5, 1, 1, 7, 3, 9,                // labels 1=7 and 3=9 for...
+    2, 3, 100, 201, 302,                // ...the same stack, twice
+    0, 1, 0                             // binary trailer
+  };
+
+  ExpectStopped();
+  ProfileData::Options options;
+  options.set_frequency(frequency);
+  EXPECT_TRUE(collector_.Start(checker_.filename().c_str(), options));
+  ExpectRunningSamples(0);
+
+  const void *trace[] = { V(100), V(201), V(302) };
+  const uintptr_t labels[ProfileData::kMaxLabels] = { 0, 7, 0, 9 };
+
+  // The header is written with version 0 here, and only updated once
+  // the labeled sample is evicted.
+  collector_.Add(arraysize(trace), trace);
+  ExpectRunningSamples(1);
+  collector_.FlushTable();
+
+  collector_.Add(arraysize(trace), trace, labels);
+  collector_.Add(arraysize(trace), trace, labels);
+  ExpectRunningSamples(3);
+
+  collector_.Stop();
+  ExpectStopped();
+  EXPECT_EQ(kNoError, checker_.ValidateProfile());
+  EXPECT_EQ(kNoError, checker_.Check(slots, arraysize(slots)));
+}
+
 // Start then reset, verify that the result is *not* a valid profile.
 // Then start again and make sure the result is OK.
 TEST_F(ProfileDataTest, StartResetRestart) {
@@ -57,6 +57,8 @@ std::mutex mutex;
 static void test_other_thread() {
 #ifndef NO_THREADS
   ProfilerRegisterThread();
+  // Lets profiler_unittest.sh tell apart the other threads' samples.
+  ProfilerSetLabel(0, 1);
 
   int i, m;
   char b[128];
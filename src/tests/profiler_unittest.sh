@@ -211,11 +211,57 @@ VerifySimilar p9 "$PROFILER4_REALNAME" p10 "$PROFILER4_REALNAME" 2
 "$PROFILER4" 20 4 "$TMPDIR/p11" || RegisterFailure
 VerifyAcrossThreads p11 "$PROFILER4_REALNAME" 2
 
+# The other threads label their samples, so selecting that label must
+# leave only their time.
+labeled=`$PPROF $PPROF_FLAGS --text --label=0=1 "$PROFILER4_REALNAME" "$TMPDIR/p11" 2>/dev/null`
+if ! echo "$labeled" | grep -q test_other_thread || \
+   echo "$labeled" | grep -q test_main_thread; then
+  echo ">>> --label=0=1 did not select exactly the other threads' samples"
+  RegisterFailure
+fi
+
 # Test using ITIMER_REAL instead of ITIMER_PROF.
 env CPUPROFILE_REALTIME=1 "$PROFILER3" 30 2 "$TMPDIR/p16" || RegisterFailure
 env CPUPROFILE_REALTIME=1 "$PROFILER3" 60 2 "$TMPDIR/p17" || RegisterFailure
 VerifySimilar p16 "$PROFILER3_REALNAME" p17 "$PROFILER3_REALNAME" 2
 
+# Test sampling on perf events. This falls back to the timers where
+# perf events are not available, so it must work everywhere.
+env CPUPROFILE_PERF_EVENT=cpu-clock "$PROFILER3" 30 2 "$TMPDIR/p19" || RegisterFailure
+env CPUPROFILE_PERF_EVENT=cpu-clock "$PROFILER3" 60 2 "$TMPDIR/p20" || RegisterFailure
+VerifySimilar p19 "$PROFILER3_REALNAME" p20 "$PROFILER3_REALNAME" 2
+
+# Run the profile handler tests with per-thread timers too, where e.g.
+# forked children must drop the timers of the parent's threads.
+env CPUPROFILE_PER_THREAD_TIMERS=1 "$UNITTEST_DIR/profile_handler_unittest" \
+    >"$TMPDIR/profile_handler.out" 2>&1 || RegisterFailure
+
+# Test adaptive sampling with a budget low enough to make the profiler
+# stretch its sampling interval.
+env CPUPROFILE_OVERHEAD_BUDGET=0.1 "$PROFILER3" 30 2 "$TMPDIR/p21" || RegisterFailure
+env CPUPROFILE_OVERHEAD_BUDGET=0.1 "$PROFILER3" 60 2 "$TMPDIR/p22" || RegisterFailure
+VerifySimilar p21 "$PROFILER3_REALNAME" p22 "$PROFILER3_REALNAME" 2
+
+# Test wall-clock profiling. The threads serialize on a mutex, so
+# whoever waits for it must show up as off-CPU time.
+env CPUPROFILE_WALLCLOCK=1 "$PROFILER3" 30 2 "$TMPDIR/p18" || RegisterFailure
+for marker in ProfilerWallclockOnCPU ProfilerWallclockOffCPU; do
+  if ! "$PPROF" $PPROF_FLAGS --text "$PROFILER3_REALNAME" "$TMPDIR/p18" \
+       2>/dev/null | grep -q "$marker"; then
+    echo ">>> wall-clock profile has no $marker samples"
+    RegisterFailure
+  fi
+done
+
+# The eh_frame unwinder must have its tables ready by the first
+# SIGPROF (signal handlers never build them), so that samples reach
+# up to main. Elsewhere this just runs the default unwinder.
+env TCMALLOC_STACKTRACE_METHOD=eh_frame "$PROFILER1" 50 1 "$TMPDIR/p23" || RegisterFailure
+if ! "$PPROF" $PPROF_FLAGS --text "$PROFILER1_REALNAME" "$TMPDIR/p23" \
+     2>/dev/null | grep -q " main$"; then
+  echo ">>> eh_frame profile has no samples reaching main"
+  RegisterFailure
+fi
 
 # Make sure that when we have a process with a fork, the profiles don't
 # clobber each other
@@ -0,0 +1,139 @@
+/* -*- Mode: C++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+ * Copyright (c) 2024, gperftools Contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *     * Neither the name of Google Inc. nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config_for_unittests.h"
+
+#include "stack_fold.h"
+
+#include <stdio.h>
+
+#include <vector>
+
+#include "base/logging.h"
+
+using tcmalloc::FoldRecursion;
+using tcmalloc::FoldMarker;
+using tcmalloc::IsFoldMarker;
+
+static void* PC(uintptr_t n) {
+  return reinterpret_cast<void*>(0x400000 + n * 16);
+}
+
+// Expands markers back, like pprof does.
+static std::vector<void*> Unfold(const std::vector<void*>& folded) {
+  std::vector<void*> out;
+  for (void* pc : folded) {
+    int period, count;
+    if (IsFoldMarker(pc, &period, &count)) {
+      CHECK_LE(period, out.size());
+      std::vector<void*> cycle(out.end() - period, out.end());
+      for (int i = 1; i < count; i++) {
+        out.insert(out.end(), cycle.begin(), cycle.end());
+      }
+    } else {
+      out.push_back(pc);
+    }
+  }
+  return out;
+}
+
+static std::vector<void*> Fold(std::vector<void*> stack) {
+  int depth = FoldRecursion(stack.data(), stack.size());
+  CHECK_LE(depth, stack.size());
+  stack.resize(depth);
+  return stack;
+}
+
+static void CheckRoundTrip(const std::vector<void*>& stack) {
+  std::vector<void*> folded = Fold(stack);
+  CHECK(Unfold(folded) == stack);
+}
+
+static void TestMarkers() {
+  for (int period = 1; period <= tcmalloc::kMaxFoldPeriod; period++) {
+    for (int count : {2, 3, 1000, tcmalloc::kMaxFoldCount}) {
+      int p, c;
+      CHECK(IsFoldMarker(FoldMarker(period, count), &p, &c));
+      CHECK_EQ(p, period);
+      CHECK_EQ(c, count);
+    }
+  }
+  int p, c;
+  CHECK(!IsFoldMarker(PC(0), &p, &c));
+  CHECK(!IsFoldMarker(nullptr, &p, &c));
+  puts("markers test PASS");
+}
+
+static void TestFolding() {
+  // Nothing to fold.
+  std::vector<void*> plain = {PC(1), PC(2), PC(3), PC(1), PC(2)};
+  CHECK(Fold(plain) == plain);
+
+  // Two equal frames aren't worth a marker, three are.
+  std::vector<void*> two = {PC(1), PC(2), PC(2), PC(3)};
+  CHECK(Fold(two) == two);
+  std::vector<void*> three = {PC(1), PC(2), PC(2), PC(2), PC(3)};
+  CHECK((Fold(three) == std::vector<void*>{PC(1), PC(2), FoldMarker(1, 3), PC(3)}));
+
+  // Mutual recursion: leaf, then (a b c) 10 times, then main.
+  std::vector<void*> mutual = {PC(0)};
+  for (int i = 0; i < 10; i++) {
+    mutual.insert(mutual.end(), {PC(1), PC(2), PC(3)});
+  }
+  mutual.push_back(PC(4));
+  CHECK((Fold(mutual) == std::vector<void*>{PC(0), PC(1), PC(2), PC(3),
+                                            FoldMarker(3, 10), PC(4)}));
+  CheckRoundTrip(mutual);
+
+  // Several recursive regions, and cycles longer than we fold.
+  std::vector<void*> mixed;
+  for (int i = 0; i < 7; i++) mixed.push_back(PC(1));
+  for (int i = 0; i < 5; i++) mixed.insert(mixed.end(), {PC(2), PC(3)});
+  for (int i = 0; i < 3; i++) {
+    mixed.insert(mixed.end(), {PC(4), PC(5), PC(6), PC(7), PC(8)});
+  }
+  CheckRoundTrip(mixed);
+  CHECK_EQ(Fold(mixed).size(), 2 + 3 + 15);
+
+  // Repeat counts above kMaxFoldCount take several markers.
+  std::vector<void*> deep(tcmalloc::kMaxFoldCount + 100, PC(1));
+  CheckRoundTrip(deep);
+  CHECK_EQ(Fold(deep).size(), 4);
+
+  puts("folding test PASS");
+}
+
+int main() {
+  TestMarkers();
+  TestFolding();
+  puts("PASS");
+  return 0;
+}
@@ -0,0 +1,153 @@
+/* -*- Mode: C++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+ * Copyright (c) 2024, gperftools Contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *     * Neither the name of Google Inc. nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config_for_unittests.h"
+
+#include "stack_intern_table.h"
+
+#include <stdio.h>
+
+#include <thread>
+#include <vector>
+
+#include "base/logging.h"
+
+using tcmalloc::StackInternTable;
+
+// mmap_hook.cc wants this from malloc_hook.cc, which we don't link.
+extern "C" int MallocHook_InitAtFirstAllocation_HeapLeakChecker() {
+  return 0;
+}
+
+static void MakeStack(int seed, int depth, const void** stack) {
+  for (int i = 0; i < depth; i++) {
+    stack[i] = reinterpret_cast<const void*>(uintptr_t{0x1000} + seed * 64 + i);
+  }
+}
+
+static void CheckStack(uint32_t id, const void* const* stack, int depth) {
+  int got_depth;
+  const void* const* got = StackInternTable::Get(id, &got_depth);
+  CHECK_EQ(got_depth, depth);
+  for (int i = 0; i < depth; i++) {
+    CHECK_EQ(got[i], stack[i]);
+  }
+  CHECK_EQ(StackInternTable::GetHash(id), StackInternTable::Hash(stack, depth));
+}
+
+static void TestBasic() {
+  const void* a[8];
+  const void* b[8];
+  MakeStack(1, 8, a);
+  MakeStack(2, 8, b);
+
+  uint32_t id_a = StackInternTable::Intern(a, 8);
+  uint32_t id_b = StackInternTable::Intern(b, 8);
+  uint32_t id_a_short = StackInternTable::Intern(a, 4);
+  uint32_t id_empty = StackInternTable::Intern(a, 0);
+
+  CHECK_NE(id_a, StackInternTable::kNoId);
+  CHECK_NE(id_a, id_b);
+  CHECK_NE(id_a, id_a_short);
+  CHECK_NE(id_a, id_empty);
+  CHECK_EQ(StackInternTable::Intern(a, 8), id_a);
+  CHECK_EQ(StackInternTable::Intern(b, 8), id_b);
+  CHECK_EQ(StackInternTable::Intern(a, 0), id_empty);
+
+  // Interned copy must not depend on caller's array.
+  const void* a_copy[8];
+  MakeStack(1, 8, a_copy);
+  a[3] = nullptr;
+  CHECK_EQ(StackInternTable::Intern(a_copy, 8), id_a);
+  CheckStack(id_a, a_copy, 8);
+  CheckStack(id_b, b, 8);
+  CheckStack(id_a_short, a_copy, 4);
+  CheckStack(id_empty, a_copy, 0);
+
+  // Incremental hash is the same as one-shot hash.
+  StackInternTable::Hasher hasher;
+  for (int i = 0; i < 8; i++) {
+    hasher.Add(b[i]);
+  }
+  CHECK_EQ(hasher.Finish(), StackInternTable::Hash(b, 8));
+
+  CHECK_EQ(StackInternTable::Count(), 4);
+  puts("basic test PASS");
+}
+
+// Many threads interning overlapping sets of stacks must agree on
+// ids. Enough stacks are used to span several id chunks and arenas.
+static void TestThreads() {
+  constexpr int kThreads = 4;
+  constexpr int kStacks = 20000;
+  constexpr int kDepth = 16;
+
+  uint32_t before = StackInternTable::Count();
+
+  std::vector<std::vector<uint32_t>> ids(kThreads);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < kThreads; t++) {
+    threads.emplace_back([t, &ids] () {
+      const void* stack[kDepth];
+      for (int i = 0; i < kStacks; i++) {
+        // Every thread walks stacks in own order.
+        int s = (i * (2 * t + 1)) % kStacks;
+        MakeStack(1000 + s, kDepth, stack);
+        ids[t].push_back(StackInternTable::Intern(stack, kDepth));
+      }
+    });
+  }
+  for (auto& th : threads) {
+    th.join();
+  }
+
+  CHECK_EQ(StackInternTable::Count(), before + kStacks);
+
+  const void* stack[kDepth];
+  for (int t = 0; t < kThreads; t++) {
+    for (int i = 0; i < kStacks; i++) {
+      int s = (i * (2 * t + 1)) % kStacks;
+      MakeStack(1000 + s, kDepth, stack);
+      CHECK_EQ(ids[t][i], ids[0][s]);
+      CheckStack(ids[t][i], stack, kDepth);
+    }
+  }
+
+  CHECK_GE(StackInternTable::BytesUsed(), size_t{kStacks} * kDepth * sizeof(void*));
+  puts("threads test PASS");
+}
+
+int main() {
+  TestBasic();
+  TestThreads();
+  puts("PASS");
+  return 0;
+}
@@ -52,6 +52,7 @@
 #  endif
 #endif
 
+#include <thread>
 #include <vector>
 
 #include "base/commandlineflags.h"
@@ -371,6 +372,171 @@ void RunTest() {
 #endif  // TEST_UCONTEXT_BITS
 }
 
+// Threads other than main find their stack bounds on their first
+// capture, so see that captures work there too. Signals sent by
+// setitimer may land on any thread, so no ucontext captures here.
+void RunTestOnThread() {
+  std::thread([] () {
+    leaf_capture_fn = CaptureLeafPlain;
+    CheckStackTrace(0);
+    leaf_capture_fn = CaptureLeafWSkip;
+    CheckStackTrace(0);
+  }).join();
+  printf("PASS\n");
+}
+
+#if TEST_UCONTEXT_BITS && __x86_64__ && _LP64 && __GNUC__
+#define TEST_FP_SIGNAL_FRAMES 1
+
+// Frame pointer unwinder has to recover the caller of a function that
+// is interrupted in its prologue or epilogue, and to find interrupted
+// function behind signal handler's frame, even if the handler runs on
+// an alternate stack.
+
+extern "C" void FPLeafCode();
+asm(".pushsection .text\n"
+    ".type FPLeafCode, @function\n"
+    "FPLeafCode:\n"
+    "  push %rbp\n"        // +0
+    "  mov %rsp, %rbp\n"   // +1
+    "  pop %rbp\n"         // +4
+    "  ret\n"              // +5
+    ".size FPLeafCode, .-FPLeafCode\n"
+    ".popsection\n");
+
+void ATTRIBUTE_NOINLINE TestLeafCallerRecovery() {
+  printf("Testing caller recovery for interrupted prologue/epilogue\n");
+
+  const char* code = reinterpret_cast<const char*>(&FPLeafCode);
+  void* fake_ra = reinterpret_cast<void*>(&TestLeafCallerRecovery);
+  void* our_ra = __builtin_return_address(0);
+
+  struct {
+    int pc_offset;
+    int ra_slot;  // where return address is on stack, -1 if frame is set up
+  } cases[] = {{0, 0}, {1, 1}, {4, -1}, {5, 0}};
+
+  for (auto c : cases) {
+    void* fake_stack[2] = {nullptr, nullptr};
+    if (c.ra_slot >= 0) {
+      fake_stack[c.ra_slot] = fake_ra;
+    }
+
+    ucontext_t uc;
+    memset(&uc, 0, sizeof(uc));
+    uc.uc_mcontext.gregs[REG_RIP] = reinterpret_cast<greg_t>(code + c.pc_offset);
+    uc.uc_mcontext.gregs[REG_RSP] = reinterpret_cast<greg_t>(fake_stack);
+    uc.uc_mcontext.gregs[REG_RBP] = reinterpret_cast<greg_t>(__builtin_frame_address(0));
+
+    void* stack[8];
+    int n = GetStackTraceWithContext(stack, 8, 0, &uc);
+    printf("pc offset %d: %d frames: %p %p %p\n", c.pc_offset, n,
+           n > 0 ? stack[0] : nullptr, n > 1 ? stack[1] : nullptr,
+           n > 2 ? stack[2] : nullptr);
+    CHECK_GE(n, 2);
+    CHECK_EQ(stack[0], code + c.pc_offset);
+    if (c.ra_slot >= 0) {
+      CHECK_GE(n, 3);
+      CHECK_EQ(stack[1], fake_ra);
+      CHECK_EQ(stack[2], our_ra);
+    } else {
+      CHECK_EQ(stack[1], our_ra);
+    }
+  }
+  printf("PASS\n");
+}
+
+struct {
+  volatile bool ready;
+  volatile bool captured;
+  int size;
+  void* stack[32];
+} signal_frame_args;
+
+static void SignalFrameHandler(int, siginfo_t*, void*) {
+  if (!signal_frame_args.ready || signal_frame_args.captured) {
+    return;
+  }
+  signal_frame_args.size = GetStackTrace(signal_frame_args.stack,
+                                         arraysize(signal_frame_args.stack), 0);
+  signal_frame_args.captured = true;
+}
+
+void ATTRIBUTE_NOINLINE SpinUntilCaptured(AddressRange* range, void** ra) {
+  INIT_ADDRESS_RANGE(SpinUntilCaptured, start, end, range);
+  *ra = __builtin_return_address(0);
+  signal_frame_args.ready = true;
+  DECLARE_ADDRESS_LABEL(start);
+  while (!signal_frame_args.captured) {
+    // do nothing
+  }
+  DECLARE_ADDRESS_LABEL(end);
+}
+
+void TestSignalFrame(bool alt_stack) {
+  printf("Testing unwinding through signal frame%s\n",
+         alt_stack ? " on alternate stack" : "");
+
+  std::vector<char> alt_stack_mem(1 << 16);
+  stack_t ss, old_ss;
+  if (alt_stack) {
+    memset(&ss, 0, sizeof(ss));
+    ss.ss_sp = alt_stack_mem.data();
+    ss.ss_size = alt_stack_mem.size();
+    CHECK(sigaltstack(&ss, &old_ss) == 0);
+  }
+
+  struct sigaction sa, old_sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_sigaction = SignalFrameHandler;
+  sa.sa_flags = SA_SIGINFO | (alt_stack ? SA_ONSTACK : 0);
+  CHECK(sigaction(SIGPROF, &sa, &old_sa) == 0);
+
+  signal_frame_args.ready = false;
+  signal_frame_args.captured = false;
+
+  struct itimerval it;
+  it.it_interval.tv_sec = 0;
+  it.it_interval.tv_usec = 1000;
+  it.it_value = it.it_interval;
+  CHECK(setitimer(ITIMER_PROF, &it, nullptr) == 0);
+
+  AddressRange range;
+  void* ra;
+  SpinUntilCaptured(&range, &ra);
+
+  memset(&it, 0, sizeof(it));
+  CHECK(setitimer(ITIMER_PROF, &it, nullptr) == 0);
+  CHECK(sigaction(SIGPROF, &old_sa, nullptr) == 0);
+  if (alt_stack) {
+    CHECK(sigaltstack(&old_ss, nullptr) == 0);
+  }
+
+  // Interrupted function and its caller have to follow handler's
+  // frames.
+  int n = signal_frame_args.size;
+  int found = -1;
+  for (int i = 0; i + 1 < n; i++) {
+    printf("%p\n", signal_frame_args.stack[i]);
+    if (signal_frame_args.stack[i] >= range.start
+        && signal_frame_args.stack[i] <= range.end) {
+      found = i;
+      break;
+    }
+  }
+  CHECK_GE(found, 0);
+  CHECK_EQ(signal_frame_args.stack[found + 1], ra);
+  printf("PASS\n");
+}
+
+void TestGenericFPSignalFrames() {
+  TestLeafCallerRecovery();
+  TestSignalFrame(false);
+  TestSignalFrame(true);
+}
+
+#endif  // TEST_FP_SIGNAL_FRAMES
+
 extern "C" {
 const char* TEST_bump_stacktrace_implementation(const char*);
 }
@@ -396,6 +562,21 @@ int main(int argc, char** argv) {
     printf("\nSet max capture length to 3:\n");
     leaf_capture_len = 3;  // less than stack depth
     RunTest();
+
+    // Implementations that cache unwind info (e.g. libgcc_cached)
+    // should by now serve all of the above from their caches.
+    printf("\nRepeat with warm caches:\n");
+    leaf_capture_len = 20;
+    RunTest();
+
+    printf("\nRepeat on another thread:\n");
+    RunTestOnThread();
+
+#if TEST_FP_SIGNAL_FRAMES
+    if (strncmp(name, "generic_fp", strlen("generic_fp")) == 0 && !skipping_ucontext) {
+      TestGenericFPSignalFrames();
+    }
+#endif
   }
 
   return 0;
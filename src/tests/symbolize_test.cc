@@ -0,0 +1,195 @@
+// -*- Mode: C++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+/* Copyright (c) 2024, gperftools Contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *     * Neither the name of Google Inc. nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config_for_unittests.h"
+
+#include "symbolize.h"
+
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "base/basictypes.h"
+#include "base/logging.h"
+
+namespace symbolize_test {
+
+template <typename T>
+ATTRIBUTE_NOINLINE int Frobnicate(T* x, int y) {
+  x[0] = y;
+  return y * 2;
+}
+
+}  // namespace symbolize_test
+
+extern "C" ATTRIBUTE_NOINLINE void symbolize_test_c_function(volatile int* x) {
+  *x = 1;
+}
+
+#if defined(__ELF__) && defined(__linux__)
+
+static const char* SymbolizeCFunction() {
+  static SymbolTable table;
+  const char* c_pc = reinterpret_cast<const char*>(&symbolize_test_c_function) + 1;
+  table.Add(c_pc);
+  CHECK_EQ(table.Symbolize(), 1);
+  return table.GetSymbol(c_pc);
+}
+
+// Threads symbolizing at once load symbols of the same objects at
+// once. They must all get the same names.
+static void TestConcurrentSymbolize(const char* c_pc, const char* cxx_pc) {
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 8; i++) {
+    threads.emplace_back([c_pc, cxx_pc] () {
+      SymbolTable table;
+      table.Add(c_pc);
+      table.Add(cxx_pc);
+      CHECK_EQ(table.Symbolize(), 2);
+      CHECK_EQ(strcmp(table.GetSymbol(c_pc), "symbolize_test_c_function"), 0);
+      CHECK_EQ(strcmp(table.GetSymbol(cxx_pc), "symbolize_test::Frobnicate"), 0);
+    });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+}
+
+// Symbol cache files are named by build-id, so we look for the one
+// that has our function in it and patch that name. Child process we
+// then run must see patched name.
+static void TestDiskCache(const char* dir) {
+  DIR* d = opendir(dir);
+  CHECK(d != nullptr);
+  int patched = 0;
+  while (struct dirent* ent = readdir(d)) {
+    if (ent->d_name[0] == '.') {
+      continue;
+    }
+    std::string path = std::string(dir) + "/" + ent->d_name;
+    FILE* f = fopen(path.c_str(), "r+");
+    CHECK(f != nullptr);
+    std::string contents;
+    char buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+      contents.append(buf, n);
+    }
+    size_t pos = contents.find("symbolize_test_c_function");
+    if (pos != std::string::npos) {
+      fseek(f, pos, SEEK_SET);
+      fputs("symbolize_test_cached_fun", f);
+      patched++;
+    }
+    fclose(f);
+  }
+  closedir(d);
+  CHECK_EQ(patched, 1);
+
+  pid_t pid = fork();
+  CHECK_GE(pid, 0);
+  if (pid == 0) {
+    execl("/proc/self/exe", "symbolize_test", "--cached", nullptr);
+    _exit(1);
+  }
+  int status;
+  CHECK_EQ(waitpid(pid, &status, 0), pid);
+  CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+#endif
+
+int main(int argc, char** argv) {
+#if defined(__ELF__) && defined(__linux__)
+  if (argc > 1 && strcmp(argv[1], "--cached") == 0) {
+    const char* name = SymbolizeCFunction();
+    printf("from disk cache: %s\n", name);
+    CHECK_EQ(strcmp(name, "symbolize_test_cached_fun"), 0);
+    return 0;
+  }
+
+  char cache_dir[] = "/tmp/symbolize_test.XXXXXX";
+  CHECK(mkdtemp(cache_dir) != nullptr);
+  setenv("PPROF_SYMBOL_CACHE", cache_dir, 1);
+
+  volatile int x;
+  symbolize_test_c_function(&x);
+  int (*frob)(long*, int) = symbolize_test::Frobnicate<long>;
+  long y;
+  CHECK_EQ(frob(&y, 1), 2);
+
+  const char* c_pc = reinterpret_cast<const char*>(&symbolize_test_c_function) + 1;
+  const char* cxx_pc = reinterpret_cast<const char*>(frob) + 1;
+  const char* libc_pc = reinterpret_cast<const char*>(&qsort) + 1;
+
+  TestConcurrentSymbolize(c_pc, cxx_pc);
+
+  const char* first_name = nullptr;
+  for (int round = 0; round < 2; round++) {
+    SymbolTable table;
+    table.Add(c_pc);
+    table.Add(cxx_pc);
+    table.Add(libc_pc);
+    table.Add(reinterpret_cast<const void*>(uintptr_t{16}));
+    CHECK_EQ(table.Symbolize(), 3);
+
+    printf("%s\n%s\n%s\n", table.GetSymbol(c_pc), table.GetSymbol(cxx_pc),
+           table.GetSymbol(libc_pc));
+    CHECK_EQ(strcmp(table.GetSymbol(c_pc), "symbolize_test_c_function"), 0);
+    // Argument and template lists are dropped just like pprof does.
+    CHECK_EQ(strcmp(table.GetSymbol(cxx_pc), "symbolize_test::Frobnicate"), 0);
+    CHECK(strstr(table.GetSymbol(libc_pc), "qsort") != nullptr);
+    CHECK_EQ(strcmp(table.GetSymbol(reinterpret_cast<const void*>(uintptr_t{16})), ""), 0);
+
+    // Second round is served from cache.
+    if (round == 0) {
+      first_name = table.GetSymbol(cxx_pc);
+    } else {
+      CHECK_EQ(first_name, table.GetSymbol(cxx_pc));
+    }
+  }
+
+  CHECK_EQ(strcmp(SymbolizeCFunction(), "symbolize_test_c_function"), 0);
+  TestDiskCache(cache_dir);
+
+  std::string cmd = std::string("rm -rf ") + cache_dir;
+  CHECK_EQ(system(cmd.c_str()), 0);
+#endif
+  printf("PASS\n");
+  return 0;
+}
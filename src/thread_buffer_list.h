@@ -0,0 +1,140 @@
+// -*- Mode: C++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+// Copyright (c) 2024, gperftools Contributors
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+//     * Neither the name of Google Inc. nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// Per-thread buffers for malloc hooks that record events (see
+// malloc_trace.cc and malloc_hook_batch.cc). Every thread gets its
+// own buffer on first use. When it exits, the buffer is handed to an
+// 'on_exit' callback (to flush it) and is then kept for reuse by
+// threads created later.
+
+#ifndef TCMALLOC_THREAD_BUFFER_LIST_H_
+#define TCMALLOC_THREAD_BUFFER_LIST_H_
+
+#include "config.h"
+
+#include <new>
+
+#include "base/basictypes.h"
+#include "base/logging.h"
+#include "base/spinlock.h"
+#include "base/threading.h"
+#include "common.h"
+#include "safe_strerror.h"
+
+namespace tcmalloc {
+
+// Buffer must have 'Buffer* next' and 'Buffer* next_free' members,
+// which are ours.
+template <class Buffer>
+class ThreadBufferList {
+ public:
+  // Sets up the thread-local destructor that calls 'on_exit' with the
+  // buffer of an exiting thread. Only the first call does anything.
+  static void Init(void (*on_exit)(Buffer*)) {
+    if (key_created_) {
+      return;
+    }
+    on_exit_ = on_exit;
+    int rv = CreateTlsKey(&key_, Destructor);
+    if (rv) {
+      RAW_LOG(FATAL, "aborting due to tcmalloc::CreateTlsKey error: %s",
+              SafeStrError(rv).c_str());
+    }
+    key_created_ = true;
+  }
+
+  // Returns the calling thread's buffer, or NULL if it has none yet.
+  static Buffer* Current() {
+    return thread_buffer_;
+  }
+
+  // Gives the calling thread a buffer, either a new, value-initialized
+  // one or one left by an exited thread. Returns NULL if out of memory.
+  static Buffer* NewForThread() {
+    Buffer* buf;
+    {
+      SpinLockHolder h(&lock_);
+      buf = free_;
+      if (buf != NULL) {
+        free_ = buf->next_free;
+      } else {
+        void* mem = MetaDataAlloc(sizeof(Buffer));
+        if (mem == NULL) {
+          return NULL;
+        }
+        buf = new (mem) Buffer();
+        buf->next = all_;
+        all_ = buf;
+      }
+    }
+    // Set this first, since SetTlsValue may malloc, and then we get
+    // here again.
+    thread_buffer_ = buf;
+    SetTlsValue(key_, buf);
+    return buf;
+  }
+
+  // Returns the newest buffer; the others follow through 'next'.
+  // Buffers are never freed, so the list may be walked without
+  // locking.
+  static Buffer* All() {
+    SpinLockHolder h(&lock_);
+    return all_;
+  }
+
+ private:
+  static void Destructor(void* arg) {
+    Buffer* buf = static_cast<Buffer*>(arg);
+    on_exit_(buf);
+    // If this thread mallocs or frees anything after this point (i.e.
+    // in other thread-local destructors), it gets a new buffer and
+    // we're called again.
+    thread_buffer_ = NULL;
+    SpinLockHolder h(&lock_);
+    buf->next_free = free_;
+    free_ = buf;
+  }
+
+  // Protects the lists below.
+  static inline SpinLock lock_;
+  // Every buffer ever created.
+  static inline Buffer* all_;
+  // Buffers of exited threads, ready for reuse.
+  static inline Buffer* free_;
+
+  static inline bool key_created_;
+  static inline TlsKey key_;
+  static inline void (*on_exit_)(Buffer*);
+  static inline thread_local Buffer* thread_buffer_ ATTR_INITIAL_EXEC;
+};
+
+}  // namespace tcmalloc
+
+#endif  // TCMALLOC_THREAD_BUFFER_LIST_H_
@@ -110,6 +110,9 @@
 /* Define to 1 if you have the <linux/ptrace.h> header file. */
 /* #undef HAVE_LINUX_PTRACE_H */
 
+/* Define to 1 if you have the <linux/perf_event.h> header file. */
+/* #undef HAVE_LINUX_PERF_EVENT_H */
+
 /* Define if this is Linux that has SIGEV_THREAD_ID */
 /* #undef HAVE_LINUX_SIGEV_THREAD_ID */
 